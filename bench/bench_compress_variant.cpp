@@ -0,0 +1,77 @@
+#include "unique_haplotype.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+/**
+ * @brief Synthetic phased panel whose haplotypes are noisy copies of a set of founders.
+ *
+ * Every haplotype copies one founder and flips each allele with a small
+ * probability, which gives blocks with a realistic mix of shared and
+ * private columns.
+ */
+struct bench_panel
+{
+  std::vector<std::vector<std::int8_t>> variants;
+
+  bench_panel(std::size_t n_haps, std::size_t n_founders, std::size_t n_variants, double flip_rate, std::mt19937& rng)
+  {
+    std::uniform_int_distribution<std::size_t> founder(0, n_founders - 1);
+    std::bernoulli_distribution common(0.3), flip(flip_rate);
+
+    std::vector<std::size_t> hap_founder(n_haps);
+    for (std::size_t& f : hap_founder)
+      f = founder(rng);
+
+    std::vector<std::int8_t> founder_alleles(n_founders);
+    variants.resize(n_variants, std::vector<std::int8_t>(n_haps));
+    for (std::size_t v = 0; v < n_variants; ++v)
+    {
+      for (std::int8_t& a : founder_alleles)
+        a = common(rng);
+      for (std::size_t h = 0; h < n_haps; ++h)
+        variants[v][h] = founder_alleles[hap_founder[h]] ^ std::int8_t(flip(rng));
+    }
+  }
+};
+
+int main()
+{
+  const std::size_t block_size = 200;
+  const std::size_t n_variants = 2000;
+  const std::size_t panel_sizes[] = {1000, 10000, 50000, 100000, 200000};
+
+  std::mt19937 rng(1234);
+  std::printf("%10s %10s %14s %12s\n", "n_haps", "variants", "variants/sec", "mean_reps");
+
+  for (std::size_t n_haps : panel_sizes)
+  {
+    bench_panel panel(n_haps, n_haps / 20, n_variants, 0.001, rng);
+    reference_site_info site("1", 0, "", "A", "C", 0.f, 0.f, 0.);
+
+    std::size_t n_blocks = 0, reps_sum = 0;
+    unique_haplotype_block block;
+    auto start_time = std::chrono::steady_clock::now();
+    for (std::size_t v = 0; v < n_variants; ++v)
+    {
+      site.pos = v + 1;
+      if (!block.compress_variant(site, panel.variants[v]))
+        return std::fprintf(stderr, "Error: compress_variant failed\n"), 1;
+
+      if (block.variant_size() == block_size || v + 1 == n_variants)
+      {
+        reps_sum += block.unique_haplotype_size();
+        ++n_blocks;
+        block.clear();
+      }
+    }
+    double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    std::printf("%10zu %10zu %14.1f %12.1f\n", n_haps, n_variants, n_variants / elapsed_s, double(reps_sum) / n_blocks);
+  }
+
+  return 0;
+}
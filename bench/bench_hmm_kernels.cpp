@@ -0,0 +1,119 @@
+#include "hmm_kernels.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+/**
+ * @brief Synthetic reference block with the shape seen by `hidden_markov_model`.
+ */
+struct bench_block
+{
+  std::vector<std::vector<std::int8_t>> template_haps;
+  std::vector<std::size_t> cardinalities;
+  std::vector<std::int8_t> observed;
+  std::size_t n_expanded = 0;
+
+  bench_block(std::size_t n_unique, std::size_t n_rows, float alt_freq, std::mt19937& rng)
+  {
+    std::bernoulli_distribution alt(alt_freq);
+    std::uniform_int_distribution<std::size_t> card(1, 8);
+
+    cardinalities.resize(n_unique);
+    for (std::size_t& c : cardinalities)
+    {
+      c = card(rng);
+      n_expanded += c;
+    }
+
+    template_haps.resize(n_rows, std::vector<std::int8_t>(n_unique));
+    observed.resize(n_rows);
+    for (std::size_t i = 0; i < n_rows; ++i)
+    {
+      for (std::int8_t& a : template_haps[i])
+        a = alt(rng);
+      observed[i] = alt(rng);
+    }
+  }
+};
+
+/**
+ * @brief Runs one forward pass over the block (condition followed by transpose on every row).
+ * @return Final row, used to compare kernels against the scalar reference.
+ */
+static std::vector<float> forward_pass(const hmm_kernels::table& k, const bench_block& blk, std::vector<float>& probs, std::vector<float>& probs_norecom)
+{
+  const float err = 0.00999f, af = 0.2f, background_error = 1e-5f;
+  const double recom = 1e-5;
+  std::size_t n = blk.cardinalities.size();
+
+  for (std::size_t i = 0; i < n; ++i)
+    probs[i] = probs_norecom[i] = float(blk.cardinalities[i]) / blk.n_expanded;
+
+  for (std::size_t r = 0; r < blk.template_haps.size(); ++r)
+  {
+    std::int8_t observed = blk.observed[r];
+    float prandom = err * (observed ? af : 1.f - af) + background_error;
+    float pmatch = (1.f - err) + prandom;
+    double sum = k.condition(probs.data(), probs_norecom.data(), blk.template_haps[r].data(), n, observed, pmatch, prandom);
+
+    double complement = 1. - recom;
+    if (sum < 1e-10)
+    {
+      sum *= 1e15;
+      complement *= 1e15;
+    }
+    k.transpose(probs.data(), probs.data(), probs_norecom.data(), probs_norecom.data(), blk.cardinalities.data(), n, complement, sum * (recom / blk.n_expanded));
+  }
+
+  return probs;
+}
+
+int main()
+{
+  const std::size_t n_rows = 64;
+  const std::size_t shapes[] = {32, 128, 512, 2048, 8192};
+  const std::size_t target_elements = std::size_t(1) << 27;
+
+  std::mt19937 rng(1234);
+  std::vector<const hmm_kernels::table*> kernels = hmm_kernels::supported();
+
+  std::printf("active kernel: %s\n", hmm_kernels::active().name);
+  std::printf("%-8s %10s %12s %10s %14s\n", "kernel", "n_unique", "ns/element", "speedup", "max_rel_diff");
+
+  for (std::size_t n_unique : shapes)
+  {
+    bench_block blk(n_unique, n_rows, 0.2f, rng);
+    std::vector<float> probs(n_unique), probs_norecom(n_unique);
+    std::size_t n_iter = std::max<std::size_t>(1, target_elements / (n_unique * n_rows));
+
+    std::vector<float> reference = forward_pass(hmm_kernels::scalar(), blk, probs, probs_norecom);
+    double scalar_ns = 0.;
+
+    for (const hmm_kernels::table* k : kernels)
+    {
+      std::vector<float> result = forward_pass(*k, blk, probs, probs_norecom); // warm up
+
+      double max_rel_diff = 0.;
+      for (std::size_t i = 0; i < n_unique; ++i)
+        max_rel_diff = std::max(max_rel_diff, std::abs(double(result[i]) - reference[i]) / std::max(double(reference[i]), 1e-30));
+
+      auto start_time = std::chrono::steady_clock::now();
+      for (std::size_t it = 0; it < n_iter; ++it)
+        forward_pass(*k, blk, probs, probs_norecom);
+      double elapsed_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start_time).count();
+
+      double ns_per_element = elapsed_ns / (double(n_iter) * n_rows * n_unique);
+      if (k == kernels.front())
+        scalar_ns = ns_per_element;
+
+      std::printf("%-8s %10zu %12.4f %9.2fx %14.3g\n", k->name, n_unique, ns_per_element, scalar_ns / ns_per_element, max_rel_diff);
+    }
+  }
+
+  return 0;
+}
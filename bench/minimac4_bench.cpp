@@ -0,0 +1,348 @@
+#include "dosage_writer.hpp"
+#include "hidden_markov_model.hpp"
+#include "input_prep.hpp"
+#include "unique_haplotype.hpp"
+
+#include <savvy/writer.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Size and shape of the synthetic panel.
+ */
+struct bench_config
+{
+  std::size_t haplotypes = 2000;        ///< Reference haplotypes.
+  std::size_t targets = 100;            ///< Target haplotypes, drawn from the same founders.
+  std::size_t variants = 20000;         ///< Reference variants.
+  std::size_t variants_per_mb = 20000;  ///< Variant density.
+  std::size_t founders = 0;             ///< Founder haplotypes; fewer founders give fewer unique haplotypes per block (default: haplotypes / 20).
+  double flip_rate = 0.001;             ///< Probability that a haplotype differs from its founder at a site.
+  double typed_ratio = 0.05;            ///< Fraction of reference variants present in the target.
+  std::size_t max_templates = 32;       ///< Template cap compared against the unbounded thresholds (0 skips the comparison).
+  std::uint32_t seed = 1234;
+  std::string work_dir = "/tmp";        ///< Directory for the generated panel and output files.
+  std::string output = "/dev/stdout";   ///< JSON results path.
+};
+
+/**
+ * @brief Synthetic phased panel whose haplotypes are noisy copies of a set of founders.
+ *
+ * Reference and target haplotypes share the founders, so targets match long
+ * stretches of reference haplotypes as they would in a real cohort.
+ */
+struct bench_panel
+{
+  std::vector<std::uint32_t> positions;
+  std::vector<std::vector<std::int8_t>> ref_gts;
+  std::vector<std::vector<std::int8_t>> tar_gts;
+  std::vector<bool> typed;
+
+  bench_panel(const bench_config& cfg, std::mt19937& rng)
+  {
+    std::size_t n_founders = std::max<std::size_t>(1, cfg.founders ? cfg.founders : cfg.haplotypes / 20);
+    std::uniform_int_distribution<std::size_t> founder(0, n_founders - 1);
+    std::bernoulli_distribution common(0.3), flip(cfg.flip_rate), is_typed(cfg.typed_ratio);
+
+    std::vector<std::size_t> hap_founder(cfg.haplotypes + cfg.targets);
+    for (std::size_t& f : hap_founder)
+      f = founder(rng);
+
+    double spacing = 1e6 / double(std::max<std::size_t>(1, cfg.variants_per_mb));
+    std::vector<std::int8_t> founder_alleles(n_founders);
+    positions.resize(cfg.variants);
+    typed.resize(cfg.variants);
+    ref_gts.resize(cfg.variants, std::vector<std::int8_t>(cfg.haplotypes));
+    tar_gts.resize(cfg.variants, std::vector<std::int8_t>(cfg.targets));
+    for (std::size_t v = 0; v < cfg.variants; ++v)
+    {
+      positions[v] = std::uint32_t(1 + v * spacing);
+      typed[v] = is_typed(rng);
+      for (std::int8_t& a : founder_alleles)
+        a = common(rng);
+      for (std::size_t h = 0; h < hap_founder.size(); ++h)
+      {
+        std::int8_t a = founder_alleles[hap_founder[h]] ^ std::int8_t(flip(rng));
+        if (h < cfg.haplotypes)
+          ref_gts[v][h] = a;
+        else
+          tar_gts[v][h - cfg.haplotypes] = a;
+      }
+    }
+  }
+};
+
+/**
+ * @brief Timing of one benchmarked function.
+ */
+struct bench_result
+{
+  std::string name;
+  double seconds;
+  std::size_t items;
+  std::string unit;
+};
+
+/**
+ * @brief Dosage differences of a benchmarked mode against the default mode.
+ */
+struct bench_accuracy
+{
+  std::string name;
+  double max_dosage_difference;
+  double mean_dosage_difference;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static std::vector<std::string> sample_names(const std::string& prefix, std::size_t n)
+{
+  std::vector<std::string> ret(n);
+  for (std::size_t i = 0; i < n; ++i)
+    ret[i] = prefix + std::to_string(i + 1);
+  return ret;
+}
+
+/** @brief Writes the reference haplotypes as a diploid VCF-like SAV file to be compressed. */
+static bool write_panel(const bench_config& cfg, const bench_panel& panel, const std::string& path)
+{
+  std::vector<std::pair<std::string, std::string>> headers = {
+    {"fileformat", "VCFv4.2"},
+    {"phasing", "full"},
+    {"contig", "<ID=1>"},
+    {"FORMAT", "<ID=GT,Number=1,Type=String,Description=\"Genotype\">"}
+  };
+  savvy::writer output(path, savvy::file::format::sav, headers, sample_names("REF", cfg.haplotypes / 2), 3);
+  for (std::size_t v = 0; v < cfg.variants && output; ++v)
+  {
+    savvy::variant var("1", panel.positions[v], "A", {"C"}, "v" + std::to_string(v + 1));
+    var.set_format("GT", panel.ref_gts[v]);
+    output << var;
+  }
+  return output.good();
+}
+
+static bool parse_args(int argc, char** argv, bench_config& cfg)
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string opt = argv[i];
+    if (i + 1 >= argc)
+      return std::cerr << "Error: missing value for " << opt << "\n", false;
+
+    const char* val = argv[++i];
+    if (opt == "--haplotypes")
+      cfg.haplotypes = std::strtoull(val, nullptr, 10) / 2 * 2;
+    else if (opt == "--targets")
+      cfg.targets = std::strtoull(val, nullptr, 10) / 2 * 2;
+    else if (opt == "--variants")
+      cfg.variants = std::strtoull(val, nullptr, 10);
+    else if (opt == "--variants-per-mb")
+      cfg.variants_per_mb = std::strtoull(val, nullptr, 10);
+    else if (opt == "--founders")
+      cfg.founders = std::strtoull(val, nullptr, 10);
+    else if (opt == "--flip-rate")
+      cfg.flip_rate = std::atof(val);
+    else if (opt == "--typed-ratio")
+      cfg.typed_ratio = std::atof(val);
+    else if (opt == "--max-templates")
+      cfg.max_templates = std::strtoull(val, nullptr, 10);
+    else if (opt == "--seed")
+      cfg.seed = std::uint32_t(std::strtoul(val, nullptr, 10));
+    else if (opt == "--work-dir")
+      cfg.work_dir = val;
+    else if (opt == "--output")
+      cfg.output = val;
+    else
+      return std::cerr << "Error: unknown option " << opt << "\n", false;
+  }
+
+  if (cfg.haplotypes < 2 || cfg.targets < 2 || cfg.variants == 0)
+    return std::cerr << "Error: --haplotypes and --targets must be at least 2 and --variants at least 1\n", false;
+  return true;
+}
+
+static void write_json(std::ostream& os, const bench_config& cfg, const std::vector<bench_result>& results, const std::vector<bench_accuracy>& accuracy)
+{
+  os << "{\n  \"config\": {"
+    << "\"haplotypes\": " << cfg.haplotypes
+    << ", \"targets\": " << cfg.targets
+    << ", \"variants\": " << cfg.variants
+    << ", \"variants_per_mb\": " << cfg.variants_per_mb
+    << ", \"founders\": " << (cfg.founders ? cfg.founders : cfg.haplotypes / 20)
+    << ", \"flip_rate\": " << cfg.flip_rate
+    << ", \"typed_ratio\": " << cfg.typed_ratio
+    << ", \"max_templates\": " << cfg.max_templates
+    << ", \"seed\": " << cfg.seed << "},\n  \"results\": [";
+  for (std::size_t i = 0; i < results.size(); ++i)
+  {
+    const bench_result& r = results[i];
+    os << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\", \"seconds\": " << r.seconds
+      << ", \"" << r.unit << "\": " << r.items
+      << ", \"" << r.unit << "_per_second\": " << (r.seconds > 0. ? r.items / r.seconds : 0.) << "}";
+  }
+  os << "\n  ],\n  \"accuracy\": [";
+  for (std::size_t i = 0; i < accuracy.size(); ++i)
+  {
+    const bench_accuracy& a = accuracy[i];
+    os << (i ? "," : "") << "\n    {\"name\": \"" << a.name << "\", \"max_dosage_difference\": " << a.max_dosage_difference
+      << ", \"mean_dosage_difference\": " << a.mean_dosage_difference << "}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+/**
+ * Benchmarks the main stages of imputation on a synthetic panel and writes
+ * their timings as JSON:
+ * - `compress_variant`: unique haplotype compression of the reference variants.
+ * - `load_reference_haplotypes`: decoding and aligning the compressed panel with the typed sites.
+ * - `traverse_forward` and `traverse_backward`: HMM passes over every target haplotype.
+ * - `traverse_backward_max_templates`: the backward pass with S1 capped at
+ *   `--max-templates`, with its dosage differences to `traverse_backward`
+ *   written under `accuracy`.
+ * - `write_dosages`: building and writing the output records.
+ *
+ * Usage: minimac4_bench [--haplotypes N] [--targets N] [--variants N] [--variants-per-mb N]
+ *   [--founders N] [--flip-rate F] [--typed-ratio F] [--max-templates N] [--seed N] [--work-dir DIR] [--output PATH]
+ */
+int main(int argc, char** argv)
+{
+  bench_config cfg;
+  if (!parse_args(argc, argv, cfg))
+    return EXIT_FAILURE;
+
+  std::mt19937 rng(cfg.seed);
+  bench_panel panel(cfg, rng);
+  std::vector<bench_result> results;
+  std::vector<bench_accuracy> accuracy;
+  std::string prefix = cfg.work_dir + "/minimac4_bench_" + std::to_string(cfg.seed);
+  std::string vcf_path = prefix + "_panel.sav", ref_path = prefix + "_panel.msav", out_path = prefix + "_out.sav";
+
+  // compress_variant, with the block size limit used by --compress-reference
+  {
+    reference_site_info site("1", 0, "", "A", "C", 0.f, 0.f, 0.);
+    unique_haplotype_block block;
+    auto start = bench_clock::now();
+    for (std::size_t v = 0; v < cfg.variants; ++v)
+    {
+      site.pos = panel.positions[v];
+      if (!block.compress_variant(site, panel.ref_gts[v]))
+        return std::cerr << "Error: compress_variant failed\n", EXIT_FAILURE;
+      if (block.variant_size() == 0xFFFF)
+        block.clear();
+    }
+    results.push_back({"compress_variant", seconds_since(start), cfg.variants, "variants"});
+  }
+
+  if (!write_panel(cfg, panel, vcf_path) || !compress_reference_panel(vcf_path, ref_path, 10, 0xFFFF, 10, "", 1))
+    return std::cerr << "Error: failed writing synthetic panel\n", EXIT_FAILURE;
+
+  // load_reference_haplotypes
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  std::vector<target_variant> target_sites;
+  for (std::size_t v = 0; v < cfg.variants; ++v)
+  {
+    if (panel.typed[v])
+      target_sites.push_back({"1", panel.positions[v], "v" + std::to_string(v + 1), "A", "C", true, false, nan, nan, nan, packed_genotypes(panel.tar_gts[v])});
+  }
+  if (target_sites.empty())
+    return std::cerr << "Error: no typed sites (increase --typed-ratio)\n", EXIT_FAILURE;
+
+  savvy::genomic_region reg("1", 1, panel.positions.back());
+  reduced_haplotypes typed_only_reference_data(16, 512);
+  reduced_haplotypes full_reference_data;
+  {
+    reference_index ref_index;
+    ref_index.load(ref_path, "1");
+    auto start = bench_clock::now();
+    if (!load_reference_haplotypes(ref_path, reg, reg, {}, target_sites, typed_only_reference_data, full_reference_data, nullptr, &ref_index, nullptr, nullptr, 1e-5f, 0.01f))
+      return std::cerr << "Error: load_reference_haplotypes failed\n", EXIT_FAILURE;
+    typed_only_reference_data.build_reverse_maps();
+    full_reference_data.build_haplotype_bits();
+    results.push_back({"load_reference_haplotypes", seconds_since(start), cfg.variants, "variants"});
+  }
+
+  // traverse_forward and traverse_backward
+  full_dosages_results hmm_results;
+  hmm_results.resize(full_reference_data.variant_size(), target_sites.size(), cfg.targets);
+  {
+    hidden_markov_model hmm(0.01f, -1.f, 0.01f, 1e-5f, 0.f);
+    double forward_s = 0., backward_s = 0.;
+    for (std::size_t h = 0; h < cfg.targets; ++h)
+    {
+      auto start = bench_clock::now();
+      hmm.traverse_forward(typed_only_reference_data.blocks(), target_sites, h);
+      forward_s += seconds_since(start);
+      start = bench_clock::now();
+      hmm.traverse_backward(typed_only_reference_data.blocks(), target_sites, h, h, hmm_results, full_reference_data);
+      backward_s += seconds_since(start);
+    }
+    results.push_back({"traverse_forward", forward_s, cfg.targets, "haplotypes"});
+    results.push_back({"traverse_backward", backward_s, cfg.targets, "haplotypes"});
+  }
+
+  // traverse_backward with the S1 state capped
+  if (cfg.max_templates)
+  {
+    full_dosages_results capped_results;
+    capped_results.resize(full_reference_data.variant_size(), target_sites.size(), cfg.targets);
+    hidden_markov_model hmm(0.01f, -1.f, 0.01f, 1e-5f, 0.f, 0, hmm_precision::fp32, true, cfg.max_templates);
+    double backward_s = 0.;
+    for (std::size_t h = 0; h < cfg.targets; ++h)
+    {
+      hmm.traverse_forward(typed_only_reference_data.blocks(), target_sites, h);
+      auto start = bench_clock::now();
+      hmm.traverse_backward(typed_only_reference_data.blocks(), target_sites, h, h, capped_results, full_reference_data);
+      backward_s += seconds_since(start);
+    }
+    results.push_back({"traverse_backward_max_templates", backward_s, cfg.targets, "haplotypes"});
+
+    double max_diff = 0., sum_diff = 0.;
+    for (std::size_t i = 0; i < hmm_results.dimensions()[0]; ++i)
+    {
+      for (std::size_t j = 0; j < hmm_results.dimensions()[1]; ++j)
+      {
+        double diff = std::abs(double(hmm_results.dosage(i, j)) - double(capped_results.dosage(i, j)));
+        max_diff = std::max(max_diff, diff);
+        sum_diff += diff;
+      }
+    }
+    accuracy.push_back({"traverse_backward_max_templates", max_diff, sum_diff / double(std::max<std::size_t>(1, hmm_results.dimensions()[0] * hmm_results.dimensions()[1]))});
+  }
+
+  // write_dosages
+  {
+    dosage_writer output(out_path, "", "", savvy::file::format::sav, 3, sample_names("TAR", cfg.targets / 2), {"HDS"}, "1", -1.f, false);
+    auto start = bench_clock::now();
+    if (!output.write_dosages(hmm_results, target_sites, {}, {0, cfg.targets}, full_reference_data, reg))
+      return std::cerr << "Error: write_dosages failed\n", EXIT_FAILURE;
+    results.push_back({"write_dosages", seconds_since(start), full_reference_data.variant_size(), "variants"});
+  }
+
+  std::remove(vcf_path.c_str());
+  std::remove(ref_path.c_str());
+  std::remove(reference_index::default_path(ref_path).c_str());
+  std::remove(out_path.c_str());
+
+  std::ofstream ofs(cfg.output);
+  if (!ofs)
+    return std::cerr << "Error: could not open " << cfg.output << "\n", EXIT_FAILURE;
+  write_json(ofs, cfg, results, accuracy);
+  return ofs.good() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,181 @@
+#include "chunk_planner.hpp"
+#include "input_prep.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+bool chunk_planner::init(const prog_args& args, const std::string& chrom, std::uint64_t from, std::uint64_t to, std::size_t n_target_samples)
+{
+  reference_index index;
+  if (!index.load(args.ref_path(), chrom))
+  {
+    std::cerr << "Warning: no usable " << reference_index::default_path(args.ref_path()) << ", scanning reference blocks for --max-memory (run --index-reference to skip this)" << std::endl;
+    if (!index.build(args.ref_path()))
+      return false;
+  }
+
+  blocks_.clear();
+  max_block_length_ = 0;
+  for (auto it = index.blocks().begin(); it != index.blocks().end(); ++it)
+  {
+    if (it->chrom != chrom)
+      continue;
+    blocks_.push_back(*it);
+    max_block_length_ = std::max(max_block_length_, it->end - it->beg);
+  }
+
+  savvy::reader ref_input(args.ref_path());
+  if (!ref_input)
+    return std::cerr << "Error: could not open reference file\n", false;
+  n_ref_haplotypes_ = 2 * (args.sample_ids().empty() ? ref_input.samples().size() : args.sample_ids().size());
+
+  std::vector<target_variant> target_sites;
+  std::vector<std::string> target_ids;
+  std::uint64_t ext_from = from > std::uint64_t(args.overlap()) ? from - args.overlap() : 1;
+  if (!load_target_haplotypes(args.tar_path(), savvy::genomic_region(chrom, ext_from, to + args.overlap()), target_sites, target_ids, false))
+    return false;
+
+  typed_positions_.clear();
+  typed_positions_.reserve(target_sites.size());
+  for (auto it = target_sites.begin(); it != target_sites.end(); ++it)
+    typed_positions_.push_back(it->pos);
+  std::sort(typed_positions_.begin(), typed_positions_.end());
+
+  n_target_samples_ = n_target_samples;
+  chunk_size_ = std::max(std::int64_t(1), args.chunk_size());
+  overlap_ = args.overlap();
+  max_temp_buffer_ = std::max(std::size_t(1), args.temp_buffer());
+  stream_targets_ = args.stream_targets();
+  leave_one_out_ = args.leave_one_out();
+
+  std::size_t n_threads = std::max(1, int(args.threads()));
+  if (args.parallel_chunks() > 1)
+  {
+    running_chunks_ = loaded_chunks_ = args.parallel_chunks();
+    threads_per_chunk_ = std::max(std::size_t(1), n_threads / args.parallel_chunks());
+  }
+  else
+  {
+    running_chunks_ = 1;
+    loaded_chunks_ = args.prefetch_chunks() + 1;
+    threads_per_chunk_ = n_threads;
+  }
+
+  // Forward rows are kept at checkpoints only, and block-boundary checkpoints
+  // are assumed to store about one row per 64 typed sites.
+  forward_scale_ = 1.;
+  if (args.forward_checkpoints() == std::numeric_limits<std::size_t>::max())
+    forward_scale_ /= 64.;
+  else if (args.forward_checkpoints())
+    forward_scale_ /= double(args.forward_checkpoints());
+  if (args.forward_precision() != hmm_precision::fp32)
+    forward_scale_ /= 2.;
+
+  return true;
+}
+
+std::uint64_t chunk_planner::estimate(std::uint64_t from, std::uint64_t to, std::size_t temp_buffer) const
+{
+  std::uint64_t ext_from = from > std::uint64_t(overlap_) ? from - overlap_ : 1;
+  std::uint64_t ext_to = to + overlap_;
+
+  std::uint64_t full_variants = 0, full_blocks = 0, full_gt_bytes = 0, full_reps = 0, max_reps = 1;
+  std::uint64_t scan_from = ext_from > max_block_length_ ? ext_from - max_block_length_ : 0;
+  auto it = std::lower_bound(blocks_.begin(), blocks_.end(), scan_from, [](const reference_index::block_entry& e, std::uint64_t pos) { return e.beg < pos; });
+  for ( ; it != blocks_.end() && it->beg <= ext_to; ++it)
+  {
+    if (it->end < ext_from)
+      continue;
+
+    max_reps = std::max(max_reps, it->reps);
+    if (it->end >= from && it->beg <= to)
+    {
+      full_variants += it->variants;
+      full_gt_bytes += it->variants * it->reps;
+      full_reps += it->reps;
+      ++full_blocks;
+    }
+  }
+
+  std::uint64_t n_typed = std::upper_bound(typed_positions_.begin(), typed_positions_.end(), ext_to) - std::lower_bound(typed_positions_.begin(), typed_positions_.end(), ext_from);
+  std::uint64_t typed_reps = std::min(std::max(n_ref_haplotypes_, std::uint64_t(1)), max_reps);
+  std::uint64_t typed_blocks = (n_typed + 63) / 64;
+
+  // Reference blocks: variant records and rows (with allele bit rows for full blocks), plus the unique map (and reverse map for typed-only blocks) of each block.
+  std::uint64_t reference_bytes = full_variants * sizeof(reference_variant) + full_gt_bytes + full_gt_bytes / 8 + full_blocks * n_ref_haplotypes_ * sizeof(std::int64_t) + full_reps * sizeof(std::size_t)
+    + n_typed * (sizeof(reference_variant) + typed_reps) + typed_blocks * n_ref_haplotypes_ * (sizeof(std::int64_t) + sizeof(std::uint32_t));
+
+  std::uint64_t n_haplotypes = 2 * n_target_samples_;
+  std::uint64_t n_group_haplotypes = 2 * std::min(std::uint64_t(temp_buffer), n_target_samples_);
+  std::uint64_t target_bytes = n_typed * (sizeof(target_variant) + ((stream_targets_ ? n_group_haplotypes : n_haplotypes) + 3) / 4);
+
+  // Probability and no-recombination rows of each thread.
+  std::uint64_t forward_bytes = std::uint64_t(double(threads_per_chunk_ * n_typed * typed_reps * 2 * sizeof(float)) * forward_scale_);
+  std::uint64_t dosage_bytes = (full_variants + (leave_one_out_ ? n_typed : 0)) * n_group_haplotypes * sizeof(float);
+  if (n_group_haplotypes < n_haplotypes)
+    dosage_bytes *= 2; // The next group is imputed while the previous one is written to a temp file.
+
+  return (reference_bytes + target_bytes) * loaded_chunks_ + (forward_bytes + dosage_bytes) * running_chunks_;
+}
+
+bool chunk_planner::plan(const std::string& chrom, std::uint64_t from, std::uint64_t to, std::uint64_t max_bytes, std::vector<savvy::region>& impute_regions, std::vector<std::size_t>& temp_buffers) const
+{
+  impute_regions.clear();
+  temp_buffers.clear();
+
+  std::uint64_t min_length = std::min(std::uint64_t(chunk_size_), std::max(std::uint64_t(overlap_), std::uint64_t(chunk_size_) / 4));
+  std::vector<std::uint64_t> candidates;
+  for (std::uint64_t start = std::max(std::uint64_t(1), from); start <= to; )
+  {
+    std::uint64_t cap = std::min(to, start + chunk_size_ - 1);
+    std::uint64_t min_end = std::min(cap, start + min_length - 1);
+
+    // Chunks end at block ends so that growing a chunk adds whole blocks to the estimate.
+    candidates.clear();
+    std::uint64_t scan_from = start > max_block_length_ ? start - max_block_length_ : 0;
+    auto it = std::lower_bound(blocks_.begin(), blocks_.end(), scan_from, [](const reference_index::block_entry& e, std::uint64_t pos) { return e.beg < pos; });
+    for ( ; it != blocks_.end() && it->beg <= cap; ++it)
+    {
+      if (it->end >= start && it->end < cap)
+        candidates.push_back(it->end);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    candidates.push_back(cap);
+
+    // The estimate only grows with the chunk end, so the longest fitting chunk is found by bisection.
+    auto longest_fit = [&](std::size_t temp_buffer)
+    {
+      return std::partition_point(candidates.begin(), candidates.end(), [&](std::uint64_t end) { return estimate(start, end, temp_buffer) <= max_bytes; });
+    };
+    auto reaches_min_end = [&](std::vector<std::uint64_t>::const_iterator fit_end) { return fit_end != candidates.begin() && *(fit_end - 1) >= min_end; };
+
+    // Smaller sample groups only shrink the per-group structures, so groups are halved only while that lets
+    // the chunk grow. A chunk bound by its reference blocks keeps its groups.
+    std::size_t temp_buffer = max_temp_buffer_;
+    auto fit_end = longest_fit(temp_buffer);
+    if (temp_buffer > 1 && !reaches_min_end(fit_end))
+    {
+      auto smallest_groups_end = longest_fit(1);
+      while (temp_buffer > 1 && fit_end != smallest_groups_end && !reaches_min_end(fit_end))
+      {
+        temp_buffer = std::max(std::size_t(1), temp_buffer / 2);
+        fit_end = longest_fit(temp_buffer);
+      }
+    }
+
+    if (fit_end == candidates.begin())
+    {
+      std::cerr << "Error: chunk " << chrom << ":" << start << "-" << candidates.front() << " is estimated to need " << estimate(start, candidates.front(), 1) / (1024 * 1024) << " MiB with one sample per group, which exceeds --max-memory" << std::endl;
+      return false;
+    }
+
+    std::uint64_t chunk_end = *(fit_end - 1);
+    impute_regions.emplace_back(chrom, start, chunk_end);
+    temp_buffers.push_back(temp_buffer);
+    start = chunk_end + 1;
+  }
+
+  return true;
+}
@@ -0,0 +1,105 @@
+#ifndef MINIMAC4_CHUNK_PLANNER_HPP
+#define MINIMAC4_CHUNK_PLANNER_HPP
+
+#include "prog_args.hpp"
+#include "reference_index.hpp"
+
+#include <savvy/reader.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Chooses chunk boundaries and sample groups that fit a memory budget (`--max-memory`).
+ *
+ * Peak memory of a chunk depends on the reference variant density, the number
+ * of unique haplotypes per block and the number of target samples, so fixed
+ * `--chunk` and `--temp-buffer` values either waste memory in sparse regions
+ * or run out of it in dense ones. The planner estimates the footprint of a
+ * candidate chunk from the block index of the reference (variants and unique
+ * haplotypes per block) and from the positions of the target sites, without
+ * loading any haplotypes.
+ *
+ * The estimate covers the structures that grow with the chunk:
+ *  - the full reference blocks of the impute region and the typed-only blocks
+ *    of the extended region, including their unique maps;
+ *  - the packed target genotypes of the extended region (one sample group with
+ *    `--stream-targets`);
+ *  - the forward rows of each HMM thread, scaled by `--forward-checkpoints`
+ *    and `--hmm-precision`;
+ *  - the dosage matrices of one sample group (`full_dosages_results`), or of
+ *    two when groups are written to temp files, without the leave-one-out
+ *    rows of typed sites under `--no-er2`.
+ *
+ * Loaded inputs are counted once per chunk held in memory (`--prefetch-chunks`
+ * + 1, or `--parallel-chunks`) and HMM state once per chunk being imputed.
+ * Typed-only blocks are not in the index, so their number and size are
+ * approximated from the typed site count and the largest overlapping reference
+ * block. The estimate is a heuristic meant to keep peak RSS under the budget,
+ * not an exact accounting.
+ */
+class chunk_planner
+{
+private:
+  std::vector<reference_index::block_entry> blocks_;
+  std::vector<std::uint32_t> typed_positions_;
+  std::uint64_t max_block_length_ = 0;
+  std::uint64_t n_ref_haplotypes_ = 0;
+  std::uint64_t n_target_samples_ = 0;
+  std::int64_t chunk_size_ = 0;
+  std::int64_t overlap_ = 0;
+  std::size_t max_temp_buffer_ = 0;
+  std::size_t threads_per_chunk_ = 1;
+  std::size_t loaded_chunks_ = 1;
+  std::size_t running_chunks_ = 1;
+  double forward_scale_ = 1.;
+  bool stream_targets_ = false;
+  bool leave_one_out_ = true;
+public:
+  /**
+   * @brief Reads the block index and the target sites of a chromosome.
+   *
+   * If `<reference>.m4i` is missing or stale, the blocks are read by scanning
+   * the reference file instead.
+   *
+   * @param args             Program arguments.
+   * @param chrom            Chromosome to plan.
+   * @param from             First position to impute.
+   * @param to               Last position to impute.
+   * @param n_target_samples Number of target samples.
+   * @return False if the reference or target file could not be read.
+   */
+  bool init(const prog_args& args, const std::string& chrom, std::uint64_t from, std::uint64_t to, std::size_t n_target_samples);
+
+  /**
+   * @brief Estimates peak memory while imputing `[from, to]`.
+   * @param temp_buffer Number of samples per HMM group.
+   * @return Estimated bytes, including chunks loaded or imputed alongside this one.
+   */
+  std::uint64_t estimate(std::uint64_t from, std::uint64_t to, std::size_t temp_buffer) const;
+
+  /**
+   * @brief Splits `[from, to]` into chunks that fit the budget.
+   *
+   * Each chunk is grown block by block up to `--chunk` while the estimate
+   * stays under @p max_bytes. When the longest fitting chunk is shorter than
+   * a quarter of `--chunk` (or the overlap, if larger), the sample group of
+   * that chunk is halved and the chunk grown again, since smaller groups only
+   * add temp files whereas shorter chunks repeat the overlap more often.
+   * Groups are not shrunk when that would not let the chunk grow, i.e. when
+   * the chunk is bound by its reference blocks rather than by its samples.
+   *
+   * @param chrom          Chromosome.
+   * @param from           First position to impute.
+   * @param to             Last position to impute.
+   * @param max_bytes      Memory budget.
+   * @param impute_regions Set to the planned chunks.
+   * @param temp_buffers   Set to the number of samples per group of each chunk.
+   * @return False if the first block of some chunk does not fit under the
+   *         budget even with one sample per group.
+   */
+  bool plan(const std::string& chrom, std::uint64_t from, std::uint64_t to, std::uint64_t max_bytes, std::vector<savvy::region>& impute_regions, std::vector<std::size_t>& temp_buffers) const;
+};
+
+#endif // MINIMAC4_CHUNK_PLANNER_HPP
@@ -1,6 +1,9 @@
 #include "dosage_writer.hpp"
 
 #include <algorithm>
+#include <array>
+#include <future>
+#include <limits>
 
 dosage_writer::dosage_writer(const std::string& file_path, const std::string& emp_file_path, const std::string& sites_file_path,
   savvy::file::format file_format,
@@ -188,7 +191,103 @@ bool dosage_writer::sites_match(const target_variant& t, const reference_site_in
 //  return merge_temp_files(temp_files, temp_emp_files);
 //}
 
-bool dosage_writer::merge_temp_files(std::list<savvy::reader>& temp_files, std::list<savvy::reader>& temp_emp_files)
+namespace
+{
+  /** @return True if both records are the same allele of the same site. */
+  bool same_site(const savvy::site_info& a, const savvy::site_info& b)
+  {
+    return a.pos() == b.pos() && a.chrom() == b.chrom() && a.ref() == b.ref() && a.alts() == b.alts();
+  }
+
+  /**
+   * @brief Decodes temp file records in batches on background threads.
+   *
+   * The readers are split into up to `threads` groups and each group is read
+   * by its own task. While a batch is consumed, the next one is decoded into a
+   * second buffer, so decoding overlaps with pasting and encoding the output.
+   */
+  class temp_batch_reader
+  {
+  private:
+    std::vector<savvy::reader*> readers_;
+    std::array<std::vector<std::vector<savvy::variant>>, 2> records_;
+    std::array<std::vector<std::size_t>, 2> counts_;
+    std::size_t active_ = 0;
+    std::size_t batch_size_;
+    std::size_t threads_;
+    std::vector<std::future<void>> pending_;
+  public:
+    temp_batch_reader(std::list<savvy::reader>& readers, std::size_t batch_size, std::size_t threads) :
+      batch_size_(batch_size),
+      threads_(std::max<std::size_t>(1, std::min(threads, readers.size())))
+    {
+      for (auto it = readers.begin(); it != readers.end(); ++it)
+        readers_.push_back(&(*it));
+
+      for (std::size_t b = 0; b < 2; ++b)
+      {
+        records_[b].resize(readers_.size(), std::vector<savvy::variant>(batch_size_));
+        counts_[b].resize(readers_.size());
+      }
+
+      if (readers_.size())
+        fetch(1);
+    }
+
+    ~temp_batch_reader() { wait(); }
+
+    /**
+     * @brief Makes the next batch current and starts decoding the one after it.
+     * @param n_records Set to the number of records in the batch (0 at the end of the files).
+     * @return False if the temp files do not have the same number of records.
+     */
+    bool next_batch(std::size_t& n_records)
+    {
+      wait();
+      active_ ^= 1;
+      const std::vector<std::size_t>& counts = counts_[active_];
+      n_records = counts.empty() ? 0 : counts.front();
+      bool consistent = std::all_of(counts.begin(), counts.end(), [n_records](std::size_t c) { return c == n_records; });
+      if (consistent && n_records == batch_size_)
+        fetch(active_ ^ 1);
+      return consistent;
+    }
+
+    /** @return Record `i` of reader `reader_idx` in the current batch. */
+    savvy::variant& record(std::size_t reader_idx, std::size_t i) { return records_[active_][reader_idx][i]; }
+
+    /** @return Reader `reader_idx`. */
+    const savvy::reader& reader(std::size_t reader_idx) const { return *readers_[reader_idx]; }
+  private:
+    void fetch(std::size_t buf)
+    {
+      std::fill(counts_[buf].begin(), counts_[buf].end(), 0);
+      std::size_t group_size = (readers_.size() + threads_ - 1) / threads_;
+      for (std::size_t beg = 0; beg < readers_.size(); beg += group_size)
+      {
+        std::size_t end = std::min(readers_.size(), beg + group_size);
+        pending_.emplace_back(std::async(std::launch::async, [this, buf, beg, end]()
+        {
+          for (std::size_t r = beg; r < end; ++r)
+          {
+            std::size_t& cnt = counts_[buf][r];
+            while (cnt < batch_size_ && readers_[r]->read(records_[buf][r][cnt]).good())
+              ++cnt;
+          }
+        }));
+      }
+    }
+
+    void wait()
+    {
+      for (auto it = pending_.begin(); it != pending_.end(); ++it)
+        it->get();
+      pending_.clear();
+    }
+  };
+}
+
+bool dosage_writer::merge_temp_files(std::list<savvy::reader>& temp_files, std::list<savvy::reader>& temp_emp_files, std::size_t threads)
 {
   if (temp_files.empty())
     return false;
@@ -199,8 +298,12 @@ bool dosage_writer::merge_temp_files(std::list<savvy::reader>& temp_files, std::
   for (auto it = temp_emp_files.begin(); it != temp_emp_files.end(); ++it)
     it->reset_bounds(savvy::slice_bounds(0));
 
-  savvy::variant out_var;
-  savvy::variant out_var_emp;
+  // Two batches of every temp file are held in memory, so limit a batch to about 4M sample values.
+  const std::size_t batch_size = std::max<std::size_t>(1, std::min<std::size_t>(256, (std::size_t(1) << 22) / std::max<std::size_t>(1, n_samples_)));
+  temp_batch_reader hds_batches(temp_files, batch_size, threads);
+  temp_batch_reader emp_batches(temp_emp_files, batch_size, threads);
+  std::size_t n_hds_records = 0, n_emp_records = 0, emp_idx = 0;
+
   savvy::compressed_vector<float> pasted_hds;
   savvy::compressed_vector<float> partial_hds;
 
@@ -210,78 +313,119 @@ bool dosage_writer::merge_temp_files(std::list<savvy::reader>& temp_files, std::
   std::vector<std::int8_t> partial_gt;
   std::size_t max_ploidy = 0;
 
-  int good_count = temp_files.size();
-  while (good_count == temp_files.size())
+  while (true)
   {
-    float s_cs{}, s_x{}, s_xx{}, loo_s_x{}, loo_s_xx{}, loo_s_y{}, loo_s_yy{}, loo_s_xy{};
-    std::size_t n{};
-    bool is_typed = false;
+    if (!hds_batches.next_batch(n_hds_records))
+      return std::cerr << "Error: record mismatch in temp files" << std::endl, false;
+    if (n_hds_records == 0)
+      break;
 
-    pasted_hds.clear();
-
-    good_count = 0;
-    for (auto it = temp_files.begin(); it != temp_files.end(); ++it)
+    for (std::size_t v = 0; v < n_hds_records; ++v)
     {
-      bool read_succeeded = it->read(out_var).good();
-      good_count += (int)read_succeeded;
-      out_var.get_format("HDS", partial_hds);
-
-      // verify max ploidy is consistent across all temp files
-      if (max_ploidy == 0)
-        max_ploidy = partial_hds.size() / it->samples().size();
-      if (read_succeeded && max_ploidy != (partial_hds.size() / it->samples().size()))
-        return std::cerr << "Error: max ploidy is not consistent across temp files. This should never happen. Please report." << std::endl, false;
-
-      std::size_t old_size = pasted_hds.size();
-      pasted_hds.resize(old_size + partial_hds.size());
-      for (auto jt = partial_hds.begin(); jt != partial_hds.end(); ++jt)
-        pasted_hds[old_size + jt.offset()] = *jt;
-
-      float tmp;
-      if (out_var.get_info("S_X", tmp)) s_x += tmp;
-      if (out_var.get_info("S_XX", tmp)) s_xx += tmp;
-      if (out_var.get_info("S_CS", tmp)) s_cs += tmp;
-      if (out_var.get_info("LOO_S_X", tmp))
-      {
-        loo_s_x += tmp;
-        if (out_var.get_info("LOO_S_XX", tmp)) loo_s_xx += tmp;
-        if (out_var.get_info("LOO_S_Y", tmp)) loo_s_y += tmp;
-        // if (out_var.get_info("LOO_S_YY", tmp)) loo_s_yy += tmp;
-        if (out_var.get_info("LOO_S_XY", tmp)) loo_s_xy += tmp;
-        is_typed = true;
-      }
+      float s_cs{}, s_x{}, s_xx{}, loo_s_x{}, loo_s_xx{}, loo_s_y{}, loo_s_yy{}, loo_s_xy{};
+      std::size_t n{};
+      bool is_typed = false;
 
-      std::int64_t tmp_int;
-      if (out_var.get_info("AN", tmp_int)) n += tmp_int;
-    }
+      pasted_hds.clear();
 
-    loo_s_yy = loo_s_y;
+      for (std::size_t f = 0; f < temp_files.size(); ++f)
+      {
+        savvy::variant& file_var = hds_batches.record(f, v);
+        if (!same_site(file_var, hds_batches.record(0, v)))
+          return std::cerr << "Error: temp files disagree at record " << file_var.chrom() << ":" << file_var.pos() << ":" << file_var.ref() << " (" << hds_batches.record(0, v).chrom() << ":" << hds_batches.record(0, v).pos() << " in the first file)" << std::endl, false;
+        file_var.get_format("HDS", partial_hds);
+
+        // verify max ploidy is consistent across all temp files
+        if (max_ploidy == 0)
+          max_ploidy = partial_hds.size() / hds_batches.reader(f).samples().size();
+        if (max_ploidy != (partial_hds.size() / hds_batches.reader(f).samples().size()))
+          return std::cerr << "Error: max ploidy is not consistent across temp files. This should never happen. Please report." << std::endl, false;
+
+        std::size_t old_size = pasted_hds.size();
+        pasted_hds.resize(old_size + partial_hds.size());
+        for (auto jt = partial_hds.begin(); jt != partial_hds.end(); ++jt)
+          pasted_hds[old_size + jt.offset()] = *jt;
+
+        float tmp;
+        if (file_var.get_info("S_X", tmp)) s_x += tmp;
+        if (file_var.get_info("S_XX", tmp)) s_xx += tmp;
+        if (file_var.get_info("S_CS", tmp)) s_cs += tmp;
+        if (file_var.get_info("LOO_S_X", tmp))
+        {
+          loo_s_x += tmp;
+          if (file_var.get_info("LOO_S_XX", tmp)) loo_s_xx += tmp;
+          if (file_var.get_info("LOO_S_Y", tmp)) loo_s_y += tmp;
+          // if (file_var.get_info("LOO_S_YY", tmp)) loo_s_yy += tmp;
+          if (file_var.get_info("LOO_S_XY", tmp)) loo_s_xy += tmp;
+          is_typed = true;
+        }
 
-    if (good_count)
-    {
-      if (good_count < temp_files.size())
-        return std::cerr << "Error: record mismatch in temp files" << std::endl, false;
+        std::int64_t tmp_int;
+        if (file_var.get_info("AN", tmp_int)) n += tmp_int;
+      }
 
-      out_var.remove_info("S_X");
-      out_var.remove_info("S_XX");
-      out_var.remove_info("S_CS");
-      out_var.remove_info("AN");
+      loo_s_yy = loo_s_y;
 
-      //std::size_t n = pasted_hds.size() - std::count_if(pasted_hds.begin(), pasted_hds.end(), [](const float& v) { return std::isnan(v); });
+      if (!is_temp_file_)
+      {
+        // Haplotypes left missing by a sample group without observed genotypes are mean-imputed
+        // from the other groups, and counted in the statistics as a single-file run would.
+        std::size_t n_missing = 0;
+        for (auto jt = pasted_hds.begin(); jt != pasted_hds.end(); ++jt)
+          n_missing += savvy::typed_value::is_missing(*jt);
+        if (n_missing)
+        {
+          if (n == 0)
+            continue; // No sample is observed at this target-only site
+          float mean = s_x / n;
+          for (auto jt = pasted_hds.begin(); jt != pasted_hds.end(); ++jt)
+          {
+            if (savvy::typed_value::is_missing(*jt))
+              *jt = mean;
+          }
+          n += n_missing;
+          s_x += mean * n_missing;
+          s_xx += mean * mean * n_missing;
+          s_cs += (mean > 0.5f ? mean : 1.f - mean) * n_missing;
+        }
+      }
 
-//      float s_x = std::accumulate(pasted_hds.begin(), pasted_hds.end(), 0.f);
-//      float s_xx = std::inner_product(pasted_hds.begin(), pasted_hds.end(), pasted_hds.begin(), 0.f);
+      // The last temp file's record carries the site info of the merged record.
+      savvy::variant& out_var = hds_batches.record(temp_files.size() - 1, v);
+      if (is_temp_file_)
+      {
+        // Output of a sample shard keeps the summed statistics, so shards can be merged in turn.
+        out_var.set_info("AN", std::int64_t(n));
+        out_var.set_info("S_X", s_x);
+        out_var.set_info("S_XX", s_xx);
+        out_var.set_info("S_CS", s_cs);
+      }
+      else
+      {
+        out_var.remove_info("S_X");
+        out_var.remove_info("S_XX");
+        out_var.remove_info("S_CS");
+        out_var.remove_info("AN");
 
-      float af = s_x / n;
-      out_var.set_info("AF", af);
-      out_var.set_info("MAF", af > 0.5f ? 1.f - af : af);
-      out_var.set_info("AVG_CS", s_cs / n);
+        float af = s_x / n;
+        out_var.set_info("AF", af);
+        out_var.set_info("MAF", af > 0.5f ? 1.f - af : af);
+        out_var.set_info("AVG_CS", s_cs / n);
 
-      out_var.set_info("R2", calc_r2(s_x, s_xx, n));
+        out_var.set_info("R2", calc_r2(s_x, s_xx, n));
+      }
 
-      if (has_good_r2(out_var))
+      if (is_temp_file_ || has_good_r2(out_var))
       {
-        if (is_typed)
+        if (is_typed && is_temp_file_)
+        {
+          out_var.set_info("LOO_S_X", loo_s_x);
+          out_var.set_info("LOO_S_XX", loo_s_xx);
+          out_var.set_info("LOO_S_Y", loo_s_y);
+          out_var.set_info("LOO_S_YY", loo_s_yy);
+          out_var.set_info("LOO_S_XY", loo_s_xy);
+        }
+        else if (is_typed)
         {
           assert(std::find_if(out_var.info_fields().begin(), out_var.info_fields().end(), [](const std::pair<std::string, savvy::typed_value>& v)
                    { return v.first == "TYPED"; }) != out_var.info_fields().end());
@@ -294,47 +438,42 @@ bool dosage_writer::merge_temp_files(std::list<savvy::reader>& temp_files, std::
           float er2 = calc_er2(loo_s_x, loo_s_xx, loo_s_y, loo_s_yy, loo_s_xy, n);
           out_var.set_info("ER2", er2);
 
-          float gt_af = loo_s_y / n;
-          if (gt_af > 0.f && gt_af < 1.f)
-          {
-            int bin = std::max(0, static_cast<int>(-std::log10(gt_af > 0.5f ? 1.f - gt_af : gt_af)));
-            if (accuracy_stats_.size() <= bin)
-              accuracy_stats_.resize(bin + 1);
-            accuracy_stats_[bin].er2_sum += er2;
-            ++(accuracy_stats_[bin].n_var);
-          }
+          record_accuracy(er2, loo_s_y / n);
+        }
 
-          if (emp_out_file_)
+        if (is_typed && emp_out_file_)
+        {
+          if (emp_idx == n_emp_records)
           {
-            pasted_lds.clear();
-            pasted_gt.clear();
-            pasted_lds.reserve(n);
-            pasted_gt.reserve(n);
-
-            int good_count_emp = 0;
-            for (auto it = temp_emp_files.begin(); it != temp_emp_files.end(); ++it)
-            {
-              good_count_emp += (int)it->read(out_var_emp).good();
-
-              out_var_emp.get_format("LDS", partial_lds);
-              for (auto jt = partial_lds.begin(); jt != partial_lds.end(); ++jt)
-                pasted_lds.push_back(*jt);
-
-              out_var_emp.get_format("GT", partial_gt);
-              for (auto jt = partial_gt.begin(); jt != partial_gt.end(); ++jt)
-                pasted_gt.push_back(*jt);
-            }
-
-            if (good_count_emp < temp_emp_files.size())
+            emp_idx = 0;
+            if (!emp_batches.next_batch(n_emp_records) || n_emp_records == 0)
               return std::cerr << "Error: record mismatch in empirical temp files" << std::endl, false;
+          }
 
-            if (pasted_hds.size() != pasted_gt.size() || pasted_lds.size() != pasted_gt.size())
-              return std::cerr << "Error: Merged HDS, LDS, and GT are not consistent. This should never happen. Please report." << std::endl, false;
+          pasted_lds.clear();
+          pasted_gt.clear();
+          pasted_lds.reserve(n);
+          pasted_gt.reserve(n);
 
-            out_var_emp.set_format("GT", pasted_gt);
-            out_var_emp.set_format("LDS", pasted_lds);
-            emp_out_file_->write(out_var_emp);
+          for (std::size_t f = 0; f < temp_emp_files.size(); ++f)
+          {
+            savvy::variant& file_var = emp_batches.record(f, emp_idx);
+            if (!same_site(file_var, out_var))
+              return std::cerr << "Error: empirical temp files disagree with the dosages at " << out_var.chrom() << ":" << out_var.pos() << ":" << out_var.ref() << std::endl, false;
+            file_var.get_format("LDS", partial_lds);
+            pasted_lds.insert(pasted_lds.end(), partial_lds.begin(), partial_lds.end());
+
+            file_var.get_format("GT", partial_gt);
+            pasted_gt.insert(pasted_gt.end(), partial_gt.begin(), partial_gt.end());
           }
+
+          if (pasted_hds.size() != pasted_gt.size() || pasted_lds.size() != pasted_gt.size())
+            return std::cerr << "Error: Merged HDS, LDS, and GT are not consistent. This should never happen. Please report." << std::endl, false;
+
+          savvy::variant& out_var_emp = emp_batches.record(temp_emp_files.size() - 1, emp_idx++);
+          out_var_emp.set_format("GT", pasted_gt);
+          out_var_emp.set_format("LDS", pasted_lds);
+          emp_out_file_->write(out_var_emp);
         }
 
         if (sites_out_file_)
@@ -344,7 +483,7 @@ bool dosage_writer::merge_temp_files(std::list<savvy::reader>& temp_files, std::
           sites_out_file_->write(site_var);
         }
 
-        set_format_fields(out_var, pasted_hds);
+        set_format_fields(update_ctx_, out_var, pasted_hds);
         out_file_ << out_var;
       }
     }
@@ -410,26 +549,15 @@ bool dosage_writer::mean_impute(savvy::compressed_vector<float>& sparse_dosages)
   return false;
 }
 
-bool dosage_writer::write_dosages(const full_dosages_results& hmm_results, const std::vector<target_variant>& tar_variants, const std::vector<target_variant>& tar_only_variants, std::pair<std::size_t, std::size_t> observed_range, const reduced_haplotypes& full_reference_data, const savvy::region& impute_region)
+bool dosage_writer::write_dosages(const full_dosages_results& hmm_results, const std::vector<target_variant>& tar_variants, const std::vector<target_variant>& tar_only_variants, std::pair<std::size_t, std::size_t> observed_range, const reduced_haplotypes& full_reference_data, const savvy::region& impute_region, std::size_t threads)
 {
   assert(hmm_results.dimensions()[0] == full_reference_data.variant_size());
-
-  variant_update_ctx update_context;
-  savvy::variant out_var;
-  savvy::variant out_var_emp;
-
   assert(!tar_variants.empty());
-//  std::vector<float> dosages(tar_variants[0].gt.size());
-//  std::vector<float> loo_dosages(tar_variants[0].gt.size());
-  savvy::compressed_vector<float> sparse_dosages;
-  const std::vector<std::int8_t> empty_gt_vec;
-  const std::vector<float> empty_loo_vec;
-
-  assert(!is_temp_file_ || observed_range.first != 0 || observed_range.second != tar_variants[0].gt.size());
+  assert(observed_range.first < observed_range.second && observed_range.second <= tar_variants[0].gt.size());
 
   auto tar_it = tar_variants.begin();
   auto tar_only_it = tar_only_variants.begin();
-  std::size_t i = 0;
+  auto ref_it = full_reference_data.begin();
 
   while (tar_it != tar_variants.end() && tar_it->pos < impute_region.from())
     ++tar_it;
@@ -437,116 +565,188 @@ bool dosage_writer::write_dosages(const full_dosages_results& hmm_results, const
   while (tar_only_it != tar_only_variants.end() && tar_only_it->pos < impute_region.from())
     ++tar_only_it;
 
-  for (auto ref_it = full_reference_data.begin(); ref_it != full_reference_data.end(); ++ref_it,++i)
+  // Produces the output sites in file order: target-only sites at or before each reference site, then the
+  // reference site, then the remaining target-only sites of the impute region.
+  auto next_item = [&](output_item& item) -> bool
   {
-    assert(i == ref_it.global_idx());
-
-    while(tar_only_it != tar_only_variants.end() && tar_only_it->pos <= ref_it->pos)
+    item = output_item();
+    if (tar_only_it != tar_only_variants.end() && tar_only_it->pos <= (ref_it != full_reference_data.end() ? ref_it->pos : impute_region.to()))
     {
-      out_var = savvy::site_info(tar_only_it->chrom, tar_only_it->pos, tar_only_it->ref, {tar_only_it->alt}, tar_only_it->id);
-      std::vector<std::int8_t> observed(tar_only_it->gt.begin() + observed_range.first, tar_only_it->gt.begin() + observed_range.second);
-      sparse_dosages.assign(observed.begin(), observed.end(), savvy::typed_value::reserved_transformation_functor<float>());
+      item.tar_only = &(*tar_only_it++);
+      return true;
+    }
 
-      if (mean_impute(sparse_dosages))
-      {
-        set_info_fields(out_var, sparse_dosages, {}, observed);
-        if (has_good_r2(out_var))
-        {
-          if (sites_out_file_)
-          {
-            savvy::variant site_var;
-            dynamic_cast<savvy::site_info&>(site_var) = out_var;
-            sites_out_file_->write(site_var);
-          }
+    if (ref_it == full_reference_data.end())
+      return false;
 
-          set_format_fields(out_var, sparse_dosages);
-          out_file_ << out_var;
-        }
-      }
-      ++tar_only_it;
+    item.ref = &(*ref_it);
+    item.row = ref_it.global_idx();
+    if (tar_it != tar_variants.end() && sites_match(*tar_it, *ref_it))
+    {
+      item.tar = &(*tar_it);
+      item.tar_idx = tar_it - tar_variants.begin();
+      ++tar_it;
     }
+    ++ref_it;
+    return true;
+  };
 
-    bool ref_matches_tar = tar_it != tar_variants.end() && sites_match(*tar_it, *ref_it);
-    //      for (std::size_t j = 0; j < dosages.size(); ++j)
-    //        dosages[j] = float(std::int16_t(hmm_results.dosage(i, j) * bin_scalar_ + 0.5f)) / bin_scalar_;
-    //
-    //      if (ref_matches_tar)
-    //      {
-    //        for (std::size_t j = 0; j < loo_dosages.size(); ++j)
-    //          loo_dosages[j] = float(std::int16_t(hmm_results.loo_dosage(tar_idx, j) * bin_scalar_ + 0.5f)) / bin_scalar_;
-    //      }
-
-    out_var = savvy::site_info(ref_it->chrom, ref_it->pos, ref_it->ref, {ref_it->alt}, ref_it->id);
-    assert(!std::isnan(hmm_results.dosages_[i][0]));
-    sparse_dosages.assign(hmm_results.dosages_[i].begin(), hmm_results.dosages_[i].end());
-    if (ref_matches_tar)
+  const std::size_t n_columns = hmm_results.dimensions()[1];
+  const bool with_loo = hmm_results.dimensions_loo()[0] > 0;
+  auto build_record = [&](variant_update_ctx& ctx, const output_item& item, output_record& rec)
+  {
+    rec.write = false;
+    rec.write_emp = false;
+    ctx.er2 = ctx.gt_af = std::numeric_limits<float>::quiet_NaN();
+    savvy::compressed_vector<float>& sparse_dosages = ctx.sparse_dosages;
+
+    if (item.tar_only)
     {
-      assert(!std::isnan(hmm_results.loo_dosages_[tar_it - tar_variants.begin()][0]));
-      std::vector<std::int8_t> observed(tar_it->gt.begin() + observed_range.first, tar_it->gt.begin() + observed_range.second);
-      set_info_fields(out_var, sparse_dosages, hmm_results.loo_dosages_[tar_it - tar_variants.begin()], observed); // TODO: do not store loo_dosages outside impute region.
+      const target_variant& tar = *item.tar_only;
+      rec.var = savvy::site_info(tar.chrom, tar.pos, tar.ref, {tar.alt}, tar.id);
+      std::vector<std::int8_t> observed = tar.gt.unpack(observed_range.first, observed_range.second);
+      sparse_dosages.assign(observed.begin(), observed.end(), savvy::typed_value::reserved_transformation_functor<float>());
 
-      if (emp_out_file_ && has_good_r2(out_var))
+      // Temp files keep every site so that their records line up when merged. A sample group without
+      // any observed genotype keeps missing dosages, which merge_temp_files fills from the other groups.
+      if (mean_impute(sparse_dosages) || is_temp_file_)
       {
-        out_var_emp = savvy::site_info(ref_it->chrom, ref_it->pos, ref_it->ref, {ref_it->alt}, ref_it->id);
-        out_var_emp.set_info("TYPED", std::vector<std::int8_t>());
-        out_var_emp.set_info("IMPUTED", std::vector<std::int8_t>());
-        out_var_emp.set_format("GT", observed);
-        out_var_emp.set_format("LDS", hmm_results.loo_dosages_[tar_it - tar_variants.begin()]);
-        emp_out_file_->write(out_var_emp);
+        set_info_fields(ctx, rec.var, sparse_dosages, nullptr, observed);
+        rec.write = has_good_r2(rec.var);
       }
-      ++tar_it;
     }
     else
     {
-      set_info_fields(out_var, sparse_dosages, {}, {});
-      out_var_emp.set_info("IMPUTED", std::vector<std::int8_t>());
-    }
-
+      const reference_variant& ref = *item.ref;
+      rec.var = savvy::site_info(ref.chrom, ref.pos, ref.ref, {ref.alt}, ref.id);
+      const float* dosages = hmm_results.dosage_row(item.row, ctx.row_buf);
+      assert(!std::isnan(dosages[0]));
+      sparse_dosages.assign(dosages, dosages + n_columns);
+      if (item.tar)
+      {
+        // Results imputed with --no-er2 have no LOO rows, so the site gets no ER2 statistics.
+        const float* loo_dosages = nullptr;
+        if (with_loo)
+        {
+          loo_dosages = hmm_results.loo_dosage_row(item.tar_idx, ctx.loo_row_buf);
+          assert(!std::isnan(loo_dosages[0]));
+        }
+        std::vector<std::int8_t> observed = item.tar->gt.unpack(observed_range.first, observed_range.second);
+        assert(observed.size() == n_columns);
+        set_info_fields(ctx, rec.var, sparse_dosages, loo_dosages, observed); // TODO: do not store loo_dosages outside impute region.
+        if (!loo_dosages)
+          rec.var.set_info("IMPUTED", std::vector<std::int8_t>());
 
-    if (has_good_r2(out_var))
-    {
-      if (sites_out_file_)
+        if (loo_dosages && emp_out_file_ && has_good_r2(rec.var))
+        {
+          rec.emp_var = savvy::site_info(ref.chrom, ref.pos, ref.ref, {ref.alt}, ref.id);
+          rec.emp_var.set_info("TYPED", std::vector<std::int8_t>());
+          rec.emp_var.set_info("IMPUTED", std::vector<std::int8_t>());
+          rec.emp_var.set_format("GT", observed);
+          ctx.emp_lds.assign(loo_dosages, loo_dosages + n_columns);
+          rec.emp_var.set_format("LDS", ctx.emp_lds);
+          rec.write_emp = true;
+        }
+      }
+      else
       {
-        savvy::variant site_var;
-        dynamic_cast<savvy::site_info&>(site_var) = out_var;
-        sites_out_file_->write(site_var);
+        set_info_fields(ctx, rec.var, sparse_dosages, nullptr, {});
       }
-
-      set_format_fields(out_var, sparse_dosages);
-      out_file_ << out_var;
+      rec.write = has_good_r2(rec.var);
     }
-  }
 
-  assert(tar_it == tar_variants.end() || tar_it->pos > impute_region.to());
+    if (rec.write)
+      set_format_fields(ctx, rec.var, sparse_dosages);
+
+    rec.er2 = ctx.er2;
+    rec.gt_af = ctx.gt_af;
+  };
+
+  // Records are built in batches, split into contiguous ranges across the worker threads. While one
+  // batch is written in order, the next one is built in the background. A batch is limited to about
+  // 8M sample values since it holds the expanded FORMAT fields of every record.
+  threads = std::max<std::size_t>(1, threads);
+  if (worker_ctxs_.size() < threads)
+    worker_ctxs_.resize(threads);
+  const std::size_t batch_size = std::max(threads, std::min<std::size_t>(64 * threads, (std::size_t(1) << 23) / std::max<std::size_t>(1, n_samples_)));
+
+  std::array<std::vector<output_item>, 2> items;
+  std::array<std::vector<output_record>, 2> records;
+  std::vector<std::future<void>> pending;
+  auto start_batch = [&](std::size_t buf)
+  {
+    items[buf].resize(batch_size);
+    std::size_t n_items = 0;
+    while (n_items < batch_size && next_item(items[buf][n_items]))
+      ++n_items;
+    items[buf].resize(n_items);
+    if (records[buf].size() < n_items)
+      records[buf].resize(n_items);
+
+    std::size_t range_size = (n_items + threads - 1) / threads;
+    for (std::size_t w = 0, beg = 0; beg < n_items; ++w, beg += range_size)
+    {
+      std::size_t end = std::min(n_items, beg + range_size);
+      pending.emplace_back(std::async(std::launch::async, [&, buf, w, beg, end]()
+      {
+        for (std::size_t j = beg; j < end; ++j)
+          build_record(worker_ctxs_[w], items[buf][j], records[buf][j]);
+      }));
+    }
+  };
 
-  while(tar_only_it != tar_only_variants.end() && tar_only_it->pos <= impute_region.to())
+  std::size_t cur = 0;
+  start_batch(cur);
+  while (!pending.empty())
   {
-    out_var = savvy::site_info(tar_only_it->chrom, tar_only_it->pos, tar_only_it->ref, {tar_only_it->alt}, tar_only_it->id);
-    std::vector<std::int8_t> observed(tar_only_it->gt.begin() + observed_range.first, tar_only_it->gt.begin() + observed_range.second);
-    sparse_dosages.assign(observed.begin(), observed.end(), savvy::typed_value::reserved_transformation_functor<float>());
+    for (auto it = pending.begin(); it != pending.end(); ++it)
+      it->get();
+    pending.clear();
+
+    start_batch(cur ^ 1);
 
-    if (mean_impute(sparse_dosages))
+    for (std::size_t j = 0; j < items[cur].size(); ++j)
     {
-      set_info_fields(out_var, sparse_dosages, {}, observed);
-      if (has_good_r2(out_var))
+      output_record& rec = records[cur][j];
+      if (!std::isnan(rec.er2))
+        record_accuracy(rec.er2, rec.gt_af);
+
+      if (rec.write_emp)
+        emp_out_file_->write(rec.emp_var);
+
+      if (rec.write)
       {
         if (sites_out_file_)
         {
           savvy::variant site_var;
-          dynamic_cast<savvy::site_info&>(site_var) = out_var;
+          dynamic_cast<savvy::site_info&>(site_var) = rec.var;
           sites_out_file_->write(site_var);
         }
 
-        set_format_fields(out_var, sparse_dosages);
-        out_file_ << out_var;
+        out_file_ << rec.var;
       }
     }
-    ++tar_only_it;
+
+    cur ^= 1;
   }
 
+  assert(tar_it == tar_variants.end() || tar_it->pos > impute_region.to());
+
   return out_file_.good();
 }
 
+void dosage_writer::record_accuracy(float er2, float gt_af)
+{
+  if (gt_af > 0.f && gt_af < 1.f)
+  {
+    int bin = std::max(0, static_cast<int>(-std::log10(gt_af > 0.5f ? 1.f - gt_af : gt_af)));
+    if (accuracy_stats_.size() <= bin)
+      accuracy_stats_.resize(bin + 1);
+    accuracy_stats_[bin].er2_sum += er2;
+    ++(accuracy_stats_[bin].n_var);
+  }
+}
+
 float dosage_writer::calc_r2(double s_x, double s_xx, std::size_t n)
 {
   double af = s_x / n;
@@ -587,7 +787,7 @@ void dosage_writer::print_mean_er2(std::ostream& os) const
   os << std::endl;
 }
 
-void dosage_writer::set_info_fields(savvy::variant& out_var, const savvy::compressed_vector<float>& sparse_dosages, const std::vector<float>& loo_dosages, const std::vector<std::int8_t>& observed)
+void dosage_writer::set_info_fields(variant_update_ctx& ctx, savvy::variant& out_var, const savvy::compressed_vector<float>& sparse_dosages, const float* loo_dosages, const std::vector<std::int8_t>& observed)
 {
   std::size_t n = sparse_dosages.size();
   assert(n);
@@ -597,7 +797,7 @@ void dosage_writer::set_info_fields(savvy::variant& out_var, const savvy::compre
   float s_cs(sparse_dosages.size() - sparse_dosages.non_zero_size());
   for (auto it = sparse_dosages.begin(); it != sparse_dosages.end(); ++it)
   {
-    if (savvy::typed_value::is_end_of_vector(*it))
+    if (savvy::typed_value::is_special_value(*it))
       --n;
     else
       s_cs += *it > 0.5f ? *it : 1.f - *it;
@@ -620,18 +820,18 @@ void dosage_writer::set_info_fields(savvy::variant& out_var, const savvy::compre
     out_var.set_info("R2", calc_r2(s_x, s_xx, n));
   }
 
-  if (loo_dosages.size())
+  if (loo_dosages)
   {
-    assert(observed.size() == loo_dosages.size());
+    const float* loo_end = loo_dosages + observed.size();
     // sparse_loo_dosages.assign(loo_dosages.begin(), loo_dosages.end());
 
-    s_x = std::accumulate(loo_dosages.begin(), loo_dosages.end(), 0.f, plus_ignore_missing());
-    s_xx = std::inner_product(loo_dosages.begin(), loo_dosages.end(), loo_dosages.begin(), 0.f, plus_ignore_missing(), std::multiplies<float>());
+    s_x = std::accumulate(loo_dosages, loo_end, 0.f, plus_ignore_missing());
+    s_xx = std::inner_product(loo_dosages, loo_end, loo_dosages, 0.f, plus_ignore_missing(), std::multiplies<float>());
     float s_y = (float)std::accumulate(observed.begin(), observed.end(), std::int32_t(0), plus_ignore_missing());
     // since observed can only be 0 or 1, s_yy is the same as s_y
     float s_yy = s_y; // std::inner_product(sparse_gt.begin(), sparse_gt.end(), sparse_gt.begin(), 0.f); // TODO: allow for missing oberserved genotypes.
 
-    float s_xy = std::inner_product(loo_dosages.begin(), loo_dosages.end(), observed.begin(), 0.f, plus_ignore_missing(), std::multiplies<float>());
+    float s_xy = std::inner_product(loo_dosages, loo_end, observed.begin(), 0.f, plus_ignore_missing(), std::multiplies<float>());
     //    float s_xy = 0.f;
     //    for (auto it = ctx.sparse_gt.begin(); it != ctx.sparse_gt.end(); ++it)
     //      s_xy += *it * loo_dosages[it.offset()];
@@ -649,26 +849,19 @@ void dosage_writer::set_info_fields(savvy::variant& out_var, const savvy::compre
       float er2 = calc_er2(s_x, s_xx, s_y, s_yy, s_xy, n);
       out_var.set_info("ER2", er2);
 
-      float gt_af = s_y / n;
-      if (gt_af > 0.f && gt_af < 1.f)
-      {
-        int bin = std::max(0, static_cast<int>(-std::log10(gt_af > 0.5f ? 1.f - gt_af : gt_af)));
-        if (accuracy_stats_.size() <= bin)
-          accuracy_stats_.resize(bin + 1);
-        accuracy_stats_[bin].er2_sum += er2;
-        ++(accuracy_stats_[bin].n_var);
-      }
+      ctx.er2 = er2;
+      ctx.gt_af = s_y / n;
     }
   }
 
   if (observed.size())
     out_var.set_info("TYPED", std::vector<std::int8_t>());
 
-  if (loo_dosages.size() || observed.empty())
+  if (loo_dosages || observed.empty())
     out_var.set_info("IMPUTED", std::vector<std::int8_t>());
 }
 
-void dosage_writer::set_format_fields(savvy::variant& out_var, savvy::compressed_vector<float>& sparse_dosages)
+void dosage_writer::set_format_fields(variant_update_ctx& ctx, savvy::variant& out_var, savvy::compressed_vector<float>& sparse_dosages)
 {
   std::size_t stride = sparse_dosages.size() / n_samples_;
 
@@ -676,7 +869,7 @@ void dosage_writer::set_format_fields(savvy::variant& out_var, savvy::compressed
   {
     out_var.set_format("HDS", {});
 
-    sparse_gt_.assign(sparse_dosages.value_data(), sparse_dosages.value_data() + sparse_dosages.non_zero_size(), sparse_dosages.index_data(), sparse_dosages.size(), [](float v)
+    ctx.sparse_gt.assign(sparse_dosages.value_data(), sparse_dosages.value_data() + sparse_dosages.non_zero_size(), sparse_dosages.index_data(), sparse_dosages.size(), [](float v)
       {
         if (savvy::typed_value::is_end_of_vector(v))
           return savvy::typed_value::end_of_vector_value<std::int8_t>();
@@ -684,7 +877,7 @@ void dosage_writer::set_format_fields(savvy::variant& out_var, savvy::compressed
 //          return savvy::typed_value::missing_value<std::int8_t>();
         return std::int8_t(v < 0.5f ? 0 : 1);
       });
-    out_var.set_format("GT", sparse_gt_);
+    out_var.set_format("GT", ctx.sparse_gt);
   }
 
   if (fmt_field_set_.find("HDS") != fmt_field_set_.end())
@@ -699,28 +892,28 @@ void dosage_writer::set_format_fields(savvy::variant& out_var, savvy::compressed
   if (fmt_field_set_.find("GP") != fmt_field_set_.end() || fmt_field_set_.find("SD") != fmt_field_set_.end())
   {
     // set dense dosage vector
-    dense_zero_vec_.resize(sparse_dosages.size());
+    ctx.dense_zero_vec.resize(sparse_dosages.size());
     for (auto it = sparse_dosages.begin(); it != sparse_dosages.end(); ++it)
-      dense_zero_vec_[it.offset()] = *it;
+      ctx.dense_zero_vec[it.offset()] = *it;
 
-    std::vector<float>& dense_hds = dense_zero_vec_;
+    std::vector<float>& dense_hds = ctx.dense_zero_vec;
 
     if (fmt_field_set_.find("GP") != fmt_field_set_.end())
     {
       if (stride == 1)
       {
         // All samples are haploid
-        dense_float_vec_.resize(n_samples_ * 2);
+        ctx.dense_float_vec.resize(n_samples_ * 2);
         for (std::size_t i = 0; i < n_samples_; ++i)
         {
           std::size_t dest_idx = i * 2;
-          dense_float_vec_[dest_idx] = 1.f - dense_hds[i];
-          dense_float_vec_[dest_idx + 1] = dense_hds[i];
+          ctx.dense_float_vec[dest_idx] = 1.f - dense_hds[i];
+          ctx.dense_float_vec[dest_idx + 1] = dense_hds[i];
         }
       }
       else if (stride == 2)
       {
-        dense_float_vec_.resize(n_samples_ * 3);
+        ctx.dense_float_vec.resize(n_samples_ * 3);
         for (std::size_t i = 0; i < n_samples_; ++i)
         {
           std::size_t src_idx = i * 2;
@@ -730,35 +923,35 @@ void dosage_writer::set_format_fields(savvy::variant& out_var, savvy::compressed
           if (savvy::typed_value::is_end_of_vector(y))
           {
             // haploid
-            dense_float_vec_[dest_idx] = 1.f - x;
-            dense_float_vec_[dest_idx + 1] = x;
-            dense_float_vec_[dest_idx + 2] = y;
+            ctx.dense_float_vec[dest_idx] = 1.f - x;
+            ctx.dense_float_vec[dest_idx + 1] = x;
+            ctx.dense_float_vec[dest_idx + 2] = y;
           }
           else
           {
             // diploid
-            dense_float_vec_[dest_idx] = (1.f - x) * (1.f - y);
-            dense_float_vec_[dest_idx + 1] = x * (1.f - y) + y * (1.f - x);
-            dense_float_vec_[dest_idx + 2] = x * y;
+            ctx.dense_float_vec[dest_idx] = (1.f - x) * (1.f - y);
+            ctx.dense_float_vec[dest_idx + 1] = x * (1.f - y) + y * (1.f - x);
+            ctx.dense_float_vec[dest_idx + 2] = x * y;
           }
         }
       }
 
-      out_var.set_format("GP", dense_float_vec_);
+      out_var.set_format("GP", ctx.dense_float_vec);
     }
 
     if (fmt_field_set_.find("SD") != fmt_field_set_.end())
     {
-      dense_float_vec_.resize(n_samples_);
+      ctx.dense_float_vec.resize(n_samples_);
       if (stride == 1)
       {
         // All samples are haploid
         for (std::size_t i = 0; i < n_samples_; ++i)
         {
-          dense_float_vec_[i] = dense_hds[i] * (1.f - dense_hds[i]);
+          ctx.dense_float_vec[i] = dense_hds[i] * (1.f - dense_hds[i]);
         }
 
-        out_var.set_format("SD", dense_float_vec_);
+        out_var.set_format("SD", ctx.dense_float_vec);
       }
       else if (stride == 2)
       {
@@ -767,12 +960,12 @@ void dosage_writer::set_format_fields(savvy::variant& out_var, savvy::compressed
           float x = dense_hds[i];
           float y = dense_hds[i + 1];
           if (savvy::typed_value::is_end_of_vector(y)) // haploid
-            dense_float_vec_[i / 2] = x * (1.f - x);
+            ctx.dense_float_vec[i / 2] = x * (1.f - x);
           else // diploid
-            dense_float_vec_[i / 2] = x * (1.f - x) + y * (1.f - y);
+            ctx.dense_float_vec[i / 2] = x * (1.f - x) + y * (1.f - y);
         }
 
-        out_var.set_format("SD", dense_float_vec_);
+        out_var.set_format("SD", ctx.dense_float_vec);
       }
       else
       {
@@ -783,7 +976,7 @@ void dosage_writer::set_format_fields(savvy::variant& out_var, savvy::compressed
 
     // unset dense dosage vector
     for (auto it = sparse_dosages.begin(); it != sparse_dosages.end(); ++it)
-      dense_zero_vec_[it.offset()] = 0.f;
+      ctx.dense_zero_vec[it.offset()] = 0.f;
   }
 
   if (fmt_field_set_.find("DS") != fmt_field_set_.end())
@@ -792,3 +985,68 @@ void dosage_writer::set_format_fields(savvy::variant& out_var, savvy::compressed
     out_var.set_format("DS", sparse_dosages);
   }
 }
+
+namespace
+{
+  bool open_shards(const std::vector<std::string>& paths, std::list<savvy::reader>& readers, std::vector<std::string>& sample_ids, std::string& chrom)
+  {
+    for (auto it = paths.begin(); it != paths.end(); ++it)
+    {
+      readers.emplace_back(*it);
+      if (!readers.back())
+        return std::cerr << "Error: could not open shard " << *it << std::endl, false;
+
+      sample_ids.insert(sample_ids.end(), readers.back().samples().begin(), readers.back().samples().end());
+      for (auto jt = readers.back().headers().begin(); chrom.empty() && jt != readers.back().headers().end(); ++jt)
+      {
+        if (jt->first == "contig" && jt->second.compare(0, 4, "<ID=") == 0)
+          chrom = jt->second.substr(4, jt->second.find_first_of(",>") - 4);
+      }
+    }
+    return true;
+  }
+}
+
+bool merge_sample_shards(const std::vector<std::string>& shard_paths,
+  const std::vector<std::string>& emp_shard_paths,
+  const std::string& out_path,
+  const std::string& emp_out_path,
+  const std::string& sites_out_path,
+  savvy::file::format out_format,
+  std::uint8_t out_compression,
+  const std::vector<std::string>& fmt_fields,
+  float min_r2,
+  std::size_t threads)
+{
+  if (!emp_out_path.empty() && emp_shard_paths.size() != shard_paths.size())
+    return std::cerr << "Error: --empirical-output requires --empirical-shards with one file per shard\n", false;
+
+  std::list<savvy::reader> shards, emp_shards;
+  std::vector<std::string> sample_ids, emp_sample_ids;
+  std::string chrom;
+  if (!open_shards(shard_paths, shards, sample_ids, chrom))
+    return false;
+
+  for (auto it = shards.begin(); it != shards.end(); ++it)
+  {
+    if (std::find_if(it->headers().begin(), it->headers().end(), [](const std::pair<std::string, std::string>& h) { return h.first == "INFO" && h.second.compare(0, 8, "<ID=S_X,") == 0; }) == it->headers().end())
+      return std::cerr << "Error: " << shard_paths[std::distance(shards.begin(), it)] << " is not the output of a --sample-shard run\n", false;
+  }
+
+  if (!emp_out_path.empty())
+  {
+    std::string emp_chrom;
+    if (!open_shards(emp_shard_paths, emp_shards, emp_sample_ids, emp_chrom))
+      return false;
+    if (emp_sample_ids != sample_ids)
+      return std::cerr << "Error: samples of --empirical-shards do not match the shards\n", false;
+  }
+
+  std::cerr << "Merging " << shards.size() << " shards with " << sample_ids.size() << " samples ..." << std::endl;
+  dosage_writer output(out_path, emp_out_path, sites_out_path, out_format, out_compression, sample_ids, fmt_fields, chrom, min_r2, false);
+  if (!output.merge_temp_files(shards, emp_shards, threads))
+    return false;
+
+  output.print_mean_er2(std::cerr);
+  return true;
+}
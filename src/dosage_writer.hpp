@@ -43,21 +43,52 @@ private:
   float min_r2_ = -1.f;                           /**< Minimum acceptable R2 for output */
   bool is_temp_file_;                              /**< Whether this is a temporary output file */
 
-  // buffers
-  savvy::compressed_vector<std::int8_t> sparse_gt_; /**< Sparse genotype calls */
-  std::vector<float> dense_float_vec_;             /**< Dense floating-point buffer for GP/SD/DS */
-  std::vector<float> dense_zero_vec_;              /**< Helper buffer for resetting dense vectors */
-
   /**
    * @struct variant_update_ctx
-   * @brief Context structure used internally when updating variant FORMAT fields.
+   * @brief Scratch buffers of one thread building output records.
    */
   struct variant_update_ctx
   {
-    savvy::compressed_vector<std::int8_t> sparse_gt;
-    savvy::compressed_vector<float> sparse_dosages;
-    std::vector<float> gp_vec;
+    savvy::compressed_vector<std::int8_t> sparse_gt; /**< Sparse genotype calls */
+    savvy::compressed_vector<float> sparse_dosages;  /**< Dosages of the record being built */
+    std::vector<float> dense_float_vec;              /**< Dense floating-point buffer for GP/SD/DS */
+    std::vector<float> dense_zero_vec;               /**< Helper buffer for resetting dense vectors */
+    std::vector<float> row_buf;                      /**< Gathered dosage row (tiled layout) */
+    std::vector<float> loo_row_buf;                  /**< Gathered LOO dosage row (tiled layout) */
+    std::vector<float> emp_lds;                      /**< LDS values of the empirical record */
+    float er2 = 0.f;                                 /**< ER2 set by set_info_fields (NaN if not computed) */
+    float gt_af = 0.f;                               /**< Observed allele frequency matching `er2` */
+  };
+
+  /**
+   * @struct output_item
+   * @brief One output site of write_dosages: either a target-only site or a reference site.
+   */
+  struct output_item
+  {
+    const target_variant* tar_only = nullptr; /**< Target-only site, or null for a reference site */
+    const reference_variant* ref = nullptr;   /**< Reference site */
+    std::size_t row = 0;                      /**< Row of the reference site in the dosage matrix */
+    const target_variant* tar = nullptr;      /**< Typed target site matching `ref`, or null */
+    std::size_t tar_idx = 0;                  /**< Row of `tar` in the LOO dosage matrix */
   };
+
+  /**
+   * @struct output_record
+   * @brief Output records of one site, built by a worker thread and written in order.
+   */
+  struct output_record
+  {
+    savvy::variant var;
+    savvy::variant emp_var;
+    float er2 = 0.f;
+    float gt_af = 0.f;
+    bool write = false;
+    bool write_emp = false;
+  };
+
+  variant_update_ctx update_ctx_;                  /**< Buffers used by merge_temp_files */
+  std::vector<variant_update_ctx> worker_ctxs_;    /**< Buffers of the write_dosages worker threads */
 public:
   /**
    * @brief Construct a new dosage_writer.
@@ -95,11 +126,19 @@ public:
    * 
    * @param temp_files A list of readers for temporary dosage files (HDS, GT).
    * @param temp_emp_files A list of readers for temporary empirical dosage files (LDS, GT).
+   * @param threads Number of threads decoding the temp files. Records are decoded
+   *                in batches, and the next batch of each file is decoded in the
+   *                background while the current one is pasted and written.
    * @return true if merging succeeded and all files are consistent.
    * @return false if any I/O error occurs or record/ploidy mismatches are detected.
    * 
-   * @note The function assumes all temporary files have the same number of records
-   * and consistent ploidy per sample. Any mismatch will cause an error and abort.
+   * @note The function assumes all temporary files have the same number of records,
+   * in the same site order, and consistent ploidy per sample. Any mismatch, including
+   * a record whose chromosome, position or alleles differ between files, will cause
+   * an error and abort.
+   *
+   * @note Target-only dosages left missing by a sample group without observed
+   * genotypes are mean-imputed from the other groups in the final output.
    * 
    * @note The merged HDS vector is used to generate the final FORMAT fields,
    * including DS, HDS, GP, and SD. INFO fields are recalculated across all
@@ -107,13 +146,17 @@ public:
    * 
    * @note For ER2 calculation, missing LOO_S_YY values are currently approximated
    * by LOO_S_Y. This may need adjustment if missing values are available in temp files.
+   *
+   * @note If this writer was constructed with `is_temp` (a `--sample-shard` output),
+   * the summed AN, S_X, S_XX, S_CS and LOO_S_* fields are written instead of AF, R2
+   * and ER2, and every record is kept.
    * 
    * @warning Only haploid and diploid samples are fully supported for SD/GP calculations.
    * 
    * @warning Any inconsistencies in record counts across temp files or mismatch
    * between HDS, LDS, and GT vectors will abort the merge.
    */
-  bool merge_temp_files(std::list<savvy::reader>& temp_files, std::list<savvy::reader>& temp_emp_files);
+  bool merge_temp_files(std::list<savvy::reader>& temp_files, std::list<savvy::reader>& temp_emp_files, std::size_t threads = 1);
   bool merge_temp_files(std::list<std::string>& temp_file_paths, std::list<std::string>& temp_emp_file_paths);
 
   /**
@@ -135,7 +178,8 @@ public:
    *
    * @param hmm_results 
    *   Container with HMM imputation results, including dosages and 
-   *   leave-one-out (LOO) dosages for each reference variant.
+   *   leave-one-out (LOO) dosages for each reference variant. If it has no
+   *   LOO rows (`--no-er2`), typed sites are written without ER2 or LOO sums.
    *
    * @param tar_variants 
    *   List of target variants that overlap with the reference panel
@@ -156,6 +200,11 @@ public:
    * @param impute_region 
    *   Genomic region currently being imputed (chromosome, start, end).
    *
+   * @param threads
+   *   Number of threads building records. Sites are built in batches split
+   *   across the threads, and the next batch is built while the current one
+   *   is written in order by the calling thread.
+   *
    * @return true if the primary output file stream is still in a good state
    *         after writing all sites; false otherwise.
    *
@@ -209,7 +258,7 @@ public:
    * @enddot
    */
 
-  bool write_dosages(const full_dosages_results& hmm_results, const std::vector<target_variant>& tar_variants, const std::vector<target_variant>& tar_only_variants, std::pair<std::size_t, std::size_t> observed_range, const reduced_haplotypes& full_reference_data, const savvy::region& impute_region);
+  bool write_dosages(const full_dosages_results& hmm_results, const std::vector<target_variant>& tar_variants, const std::vector<target_variant>& tar_only_variants, std::pair<std::size_t, std::size_t> observed_range, const reduced_haplotypes& full_reference_data, const savvy::region& impute_region, std::size_t threads = 1);
   
   /**
    * @brief Print the mean empirical R² (ER2) values to an output stream.
@@ -717,13 +766,17 @@ private:
    *   - LOO_S_X, LOO_S_XX, LOO_S_Y, LOO_S_YY, LOO_S_XY: raw sums and cross-products (temp mode)
    *   - ER2: empirical squared correlation between observed genotypes 
    *          and leave-one-out dosages (final mode; see calc_er2)
-   *   - Per-MAF-bin accuracy tracking: accumulates ER² into 
-   *     `accuracy_stats_` for later summary.
+   *   - Per-MAF-bin accuracy tracking: ER² and the observed allele frequency
+   *     are stored in `ctx` and later passed to `record_accuracy` by the
+   *     writing thread.
    *
    * - **Flags**
    *   - TYPED: set if observed genotypes are available
    *   - IMPUTED: set if imputed dosages are present (or if no observed data)
    *
+   * @param[out] ctx
+   *   Scratch context of the calling thread. Receives ER² and the observed allele frequency.
+   *
    * @param[out] out_var 
    *   The variant record to annotate with INFO fields.
    *
@@ -731,7 +784,7 @@ private:
    *   Compressed vector of imputed dosages for all samples.
    *
    * @param[in] loo_dosages 
-   *   Leave-one-out dosages (same length as `observed`), or empty if not available.
+   *   Leave-one-out dosages (same length as `observed`), or null if not available.
    *
    * @param[in] observed 
    *   Observed hard genotype calls (0/1), used for empirical R² 
@@ -743,7 +796,7 @@ private:
    *   among reference vs. alternate allele assignments.
    * - Allele frequency (AF) is computed from non-missing dosages.
    */
-  void set_info_fields(savvy::variant& out_var, const savvy::compressed_vector<float>& sparse_dosages, const std::vector<float>& loo_dosages, const std::vector<std::int8_t>& observed);
+  void set_info_fields(variant_update_ctx& ctx, savvy::variant& out_var, const savvy::compressed_vector<float>& sparse_dosages, const float* loo_dosages, const std::vector<std::int8_t>& observed);
   
   /**
    * @brief Populate FORMAT fields for an imputed variant record.
@@ -769,7 +822,7 @@ private:
    *   - Expanded dense probabilities derived from dosages.  
    *   - Haploid: two probabilities [ref, alt].  
    *   - Diploid: three probabilities [P(0/0), P(0/1), P(1/1)].  
-   *   - Uses a dense vector (`dense_float_vec_`).  
+   *   - Uses a dense vector (`ctx.dense_float_vec`).  
    *
    * - **SD (Standard deviation of genotype)**  
    *   - Per-sample variance estimate derived from dosages.  
@@ -781,6 +834,9 @@ private:
    *   - Reduces haploid/diploid dosages into a single scalar dosage per sample.  
    *   - Implemented via `savvy::stride_reduce`.  
    *
+   * @param[in,out] ctx
+   *   Scratch buffers of the calling thread.
+   *
    * @param[out] out_var
    *   The variant record to annotate with FORMAT fields.
    *
@@ -791,11 +847,16 @@ private:
    *
    * @note
    * - This method temporarily expands sparse dosages into a dense vector
-   *   (`dense_zero_vec_`) for GP/SD calculation, and resets it afterward.
+   *   (`ctx.dense_zero_vec`) for GP/SD calculation, and resets it afterward.
    * - Currently only supports haploid (stride = 1) and diploid (stride = 2)
    *   samples. Higher ploidy triggers an error message for SD.
    */
-  void set_format_fields(savvy::variant& out_var, savvy::compressed_vector<float>& sparse_dosages);
+  void set_format_fields(variant_update_ctx& ctx, savvy::variant& out_var, savvy::compressed_vector<float>& sparse_dosages);
+
+  /**
+   * @brief Adds the ER² of a typed site to the accuracy statistics of its allele frequency bin.
+   */
+  void record_accuracy(float er2, float gt_af);
 
   /**
    * @brief Binary functor that performs addition while ignoring missing values.
@@ -845,4 +906,32 @@ private:
   };
 };
 
+/**
+ * @brief Pastes the outputs of `--sample-shard` runs into the final output.
+ *
+ * Each shard holds the HDS of a contiguous block of target samples and the
+ * per-site sums (AN, S_X, S_XX, S_CS and LOO_S_*) of those samples, in the
+ * same format as the temp files of a sample group. Since R2 and ER2 depend on
+ * the samples only through these sums, the merged output has the same
+ * statistics as imputing all samples in one run.
+ *
+ * @param shard_paths     Shard outputs (SAV), in shard order.
+ * @param emp_shard_paths Empirical shard outputs, in shard order. Required if
+ *                        @p emp_out_path is not empty.
+ * @param threads         Number of threads decoding the shards.
+ * @return False if a shard could not be read or the shards do not match.
+ *
+ * @see dosage_writer::merge_temp_files
+ */
+bool merge_sample_shards(const std::vector<std::string>& shard_paths,
+  const std::vector<std::string>& emp_shard_paths,
+  const std::string& out_path,
+  const std::string& emp_out_path,
+  const std::string& sites_out_path,
+  savvy::file::format out_format,
+  std::uint8_t out_compression,
+  const std::vector<std::string>& fmt_fields,
+  float min_r2,
+  std::size_t threads = 1);
+
 #endif // MINIMAC4_DOSAGE_WRITER_HPP
@@ -1,6 +1,7 @@
 #include "hidden_markov_model.hpp"
 #include "variant.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <numeric>
 #include <unordered_map>
@@ -8,10 +9,15 @@
 constexpr float hidden_markov_model::jump_fix;
 constexpr float hidden_markov_model::jump_threshold;
 
-hidden_markov_model::hidden_markov_model(float s3_prob_threshold, float s1_prob_threshold, float diff_threshold, float background_error, float decay) :
+hidden_markov_model::hidden_markov_model(float s3_prob_threshold, float s1_prob_threshold, float diff_threshold, float background_error, float decay, std::size_t checkpoint_interval, hmm_precision precision, bool leave_one_out, std::size_t max_templates) :
+  checkpoint_interval_(checkpoint_interval == 0 && precision != hmm_precision::fp32 ? 1 : checkpoint_interval),
+  precision_(precision),
+  leave_one_out_(leave_one_out),
+  kernels_(&hmm_kernels::active()),
   prob_threshold_(s3_prob_threshold),
   s1_prob_threshold_(s1_prob_threshold),
   diff_threshold_(diff_threshold),
+  max_templates_(max_templates),
   background_error_(background_error),
   decay_(decay)
 {
@@ -31,33 +37,126 @@ void hidden_markov_model::initialize_likelihoods(std::vector<float>& probs, std:
     proportions[i] = 1.f / ref_block.cardinalities()[ref_block.unique_map()[i]];
 }
 
+bool hidden_markov_model::transition_forward(const unique_haplotype_block& prev_ref_block,
+  const std::vector<float>& prev_last_row, const std::vector<float>& prev_last_row_norecom,
+  const std::vector<float>& prev_junction_proportions,
+  const unique_haplotype_block& ref_block, std::vector<float>& junction_proportions,
+  std::vector<float>& first_row, std::vector<float>& first_row_norecom, double recom)
+{
+  temp_row_.clear();
+  temp_row_.resize(ref_block.unique_haplotype_size(), 0.f);
+  for (std::size_t i = 0; i < ref_block.expanded_haplotype_size(); ++i)
+  {
+    std::size_t uniq_idx = ref_block.unique_map()[i];
+    std::size_t prev_uniq_idx = prev_ref_block.unique_map()[i];
+    float p = prev_last_row_norecom[prev_uniq_idx] * prev_junction_proportions[i] + (prev_last_row[prev_uniq_idx] - prev_last_row_norecom[prev_uniq_idx]) / prev_ref_block.cardinalities()[prev_uniq_idx];
+    junction_proportions[i] = p;
+    temp_row_[uniq_idx] += p;
+    assert((prev_last_row[prev_uniq_idx] - prev_last_row_norecom[prev_uniq_idx]) >= 0.f);
+  }
+
+  for (std::size_t i = 0; i < ref_block.expanded_haplotype_size(); ++i)
+  {
+    std::size_t uniq_idx = ref_block.unique_map()[i];
+    assert(temp_row_[uniq_idx] > 0.f);
+    junction_proportions[i] = junction_proportions[i] / temp_row_[uniq_idx];
+    assert(junction_proportions[i] >= 0.f);
+    assert(junction_proportions[i] <= 1.f);
+  }
+
+  first_row.resize(temp_row_.size());
+  first_row_norecom.resize(temp_row_.size());
+  return transpose(temp_row_, first_row, temp_row_, first_row_norecom, ref_block.cardinalities(), recom, ref_block.expanded_haplotype_size());
+}
+
 void hidden_markov_model::traverse_forward(const std::deque<unique_haplotype_block>& ref_haps,
   const std::vector<target_variant>& tar_variants,
   std::size_t hap_idx)
 {
   std::size_t n_expanded_haplotypes = ref_haps.front().expanded_haplotype_size();
 
+  // Per-block buffers are only grown so that rows of blocks beyond the current chunk keep their capacity.
   precision_jumps_.resize(tar_variants.size());
-  junction_prob_proportions_.resize(ref_haps.size(), std::vector<float>(n_expanded_haplotypes));
-  forward_probs_.resize(ref_haps.size());
-  forward_norecom_probs_.resize(ref_haps.size());
-  for (std::size_t b = 0; b < forward_probs_.size(); ++b)
+  if (junction_prob_proportions_.size() < ref_haps.size())
+    junction_prob_proportions_.resize(ref_haps.size());
+  if (forward_probs_.size() < ref_haps.size())
+  {
+    forward_probs_.resize(ref_haps.size());
+    forward_norecom_probs_.resize(ref_haps.size());
+  }
+  if (precision_ != hmm_precision::fp32 && packed_forward_probs_.size() < ref_haps.size())
+    packed_forward_probs_.resize(ref_haps.size());
+  for (std::size_t b = 0; b < ref_haps.size(); ++b)
   {
     auto& prob_block = forward_probs_[b];
     auto& norecom_prob_block = forward_norecom_probs_[b];
     const auto& ref_block = ref_haps[b];
+    junction_prob_proportions_[b].resize(n_expanded_haplotypes);
+
+    std::size_t n_stored_rows = ref_block.variant_size();
+    if (checkpoint_interval_ && n_stored_rows)
+      n_stored_rows = (n_stored_rows - 1) / checkpoint_interval_ + 1;
+
+    if (precision_ != hmm_precision::fp32)
+    {
+      packed_forward_probs_[b].resize(n_stored_rows);
+      continue;
+    }
 
-    prob_block.resize(ref_block.variant_size());
-    norecom_prob_block.resize(ref_block.variant_size());
-    for (std::size_t v = 0; v < ref_block.variant_size(); ++v)
+    prob_block.resize(n_stored_rows);
+    norecom_prob_block.resize(n_stored_rows);
+    for (std::size_t v = 0; v < n_stored_rows; ++v)
     {
       prob_block[v].resize(ref_block.unique_haplotype_size());
       norecom_prob_block[v].resize(ref_block.unique_haplotype_size());
     }
   }
 
+  if (checkpoint_interval_)
+  {
+    // Only checkpoint rows are kept. The working rows are rolled through cur_row_ and next_row_.
+    std::size_t global_idx = 0;
+    for (std::size_t block_idx = 0; block_idx < ref_haps.size(); ++block_idx)
+    {
+      const unique_haplotype_block& ref_block = ref_haps[block_idx];
+      if (block_idx == 0)
+      {
+        initialize_likelihoods(cur_row_, cur_row_norecom_, junction_prob_proportions_[block_idx], ref_block);
+      }
+      else
+      {
+        precision_jumps_[global_idx - 1] = transition_forward(ref_haps[block_idx - 1], cur_row_, cur_row_norecom_, junction_prob_proportions_[block_idx - 1],
+          ref_block, junction_prob_proportions_[block_idx], next_row_, next_row_norecom_, tar_variants[global_idx - 1].recom);
+        std::swap(cur_row_, next_row_);
+        std::swap(cur_row_norecom_, next_row_norecom_);
+      }
+
+      const auto& template_variants = ref_block.variants();
+      std::size_t n_rows = ref_block.variant_size();
+      for (std::size_t i = 0; i < n_rows; ++i,++global_idx)
+      {
+        if (i % checkpoint_interval_ == 0)
+        {
+          store_forward_row(block_idx, i / checkpoint_interval_, cur_row_, cur_row_norecom_);
+        }
+
+        std::int8_t observed = tar_variants[global_idx].gt[hap_idx];
+        double sum = condition(cur_row_, cur_row_norecom_, template_variants[i].gt, observed, tar_variants[global_idx].err, tar_variants[global_idx].af);
+
+        if (i + 1 < n_rows)
+        {
+          next_row_.resize(cur_row_.size());
+          next_row_norecom_.resize(cur_row_.size());
+          precision_jumps_[global_idx] = transpose(cur_row_, next_row_, cur_row_norecom_, next_row_norecom_, ref_block.cardinalities(), tar_variants[global_idx].recom, n_expanded_haplotypes, sum);
+          std::swap(cur_row_, next_row_);
+          std::swap(cur_row_norecom_, next_row_norecom_);
+        }
+      }
+    }
+    return;
+  }
+
   std::size_t global_idx = 0;
-  std::vector<float> temp_row;
   for (std::size_t block_idx = 0; block_idx < ref_haps.size(); ++block_idx,++global_idx)
   {
     const unique_haplotype_block& ref_block = ref_haps[block_idx];
@@ -69,35 +168,8 @@ void hidden_markov_model::traverse_forward(const std::deque<unique_haplotype_blo
     else
     {
       // Transition from previous block
-      const unique_haplotype_block& prev_ref_block = ref_haps[block_idx - 1];
-      std::vector<float>& prev_junction_proportions = junction_prob_proportions_[block_idx - 1];
-      std::vector<float>& prev_last_row = forward_probs_[block_idx - 1].back();
-      std::vector<float>& prev_last_row_norecom = forward_norecom_probs_[block_idx - 1].back();
-      std::vector<float>& junction_proportions = junction_prob_proportions_[block_idx];
-      std::vector<float>& first_row = forward_probs_[block_idx].front();
-      std::vector<float>& first_row_norecom = forward_norecom_probs_[block_idx].front();
-      temp_row.clear();
-      temp_row.resize(first_row.size(), 0.f);
-      for (std::size_t i = 0; i < ref_block.expanded_haplotype_size(); ++i)
-      {
-        std::size_t uniq_idx = ref_block.unique_map()[i];
-        std::size_t prev_uniq_idx = prev_ref_block.unique_map()[i];
-        float p = prev_last_row_norecom[prev_uniq_idx] * prev_junction_proportions[i] + (prev_last_row[prev_uniq_idx] - prev_last_row_norecom[prev_uniq_idx]) / prev_ref_block.cardinalities()[prev_uniq_idx];
-        junction_proportions[i] = p;
-        temp_row[uniq_idx] += p;
-        assert((prev_last_row[prev_uniq_idx] - prev_last_row_norecom[prev_uniq_idx]) >= 0.f);
-      }
-
-      for (std::size_t i = 0; i < ref_block.expanded_haplotype_size(); ++i)
-      {
-        std::size_t uniq_idx = ref_block.unique_map()[i];
-        assert(temp_row[uniq_idx] > 0.f);
-        junction_proportions[i] = junction_proportions[i] / temp_row[uniq_idx];
-        assert(junction_proportions[i] >= 0.f);
-        assert(junction_proportions[i] <= 1.f);
-      }
-
-      precision_jumps_[global_idx - 1] = transpose(temp_row, first_row, temp_row, first_row_norecom, ref_block.cardinalities(), tar_variants[global_idx - 1].recom, n_expanded_haplotypes);
+      precision_jumps_[global_idx - 1] = transition_forward(ref_haps[block_idx - 1], forward_probs_[block_idx - 1].back(), forward_norecom_probs_[block_idx - 1].back(), junction_prob_proportions_[block_idx - 1],
+        ref_block, junction_prob_proportions_[block_idx], forward_probs_[block_idx].front(), forward_norecom_probs_[block_idx].front(), tar_variants[global_idx - 1].recom);
     }
 
 
@@ -107,22 +179,82 @@ void hidden_markov_model::traverse_forward(const std::deque<unique_haplotype_blo
     for (std::size_t i = 0; i < last_row_idx; ++i,++global_idx)
     {
       std::int8_t observed = tar_variants[global_idx].gt[hap_idx];
-      if (observed >= 0)
-        condition(forward_probs_[block_idx][i], forward_norecom_probs_[block_idx][i], template_variants[i].gt, observed, tar_variants[global_idx].err, tar_variants[global_idx].af);
-      precision_jumps_[global_idx] = transpose(forward_probs_[block_idx][i], forward_probs_[block_idx][i + 1], forward_norecom_probs_[block_idx][i], forward_norecom_probs_[block_idx][i + 1], ref_block.cardinalities(), tar_variants[global_idx].recom, n_expanded_haplotypes);
+      double sum = condition(forward_probs_[block_idx][i], forward_norecom_probs_[block_idx][i], template_variants[i].gt, observed, tar_variants[global_idx].err, tar_variants[global_idx].af);
+      precision_jumps_[global_idx] = transpose(forward_probs_[block_idx][i], forward_probs_[block_idx][i + 1], forward_norecom_probs_[block_idx][i], forward_norecom_probs_[block_idx][i + 1], ref_block.cardinalities(), tar_variants[global_idx].recom, n_expanded_haplotypes, sum);
     }
 
     std::int8_t observed = tar_variants[global_idx].gt[hap_idx];
-    if (observed >= 0)
-      condition(forward_probs_[block_idx][last_row_idx], forward_norecom_probs_[block_idx][last_row_idx], template_variants[last_row_idx].gt, observed, tar_variants[global_idx].err, tar_variants[global_idx].af);
+    condition(forward_probs_[block_idx][last_row_idx], forward_norecom_probs_[block_idx][last_row_idx], template_variants[last_row_idx].gt, observed, tar_variants[global_idx].err, tar_variants[global_idx].af);
+  }
+}
+
+void hidden_markov_model::store_forward_row(std::size_t block_idx, std::size_t slot, const std::vector<float>& probs, const std::vector<float>& probs_norecom)
+{
+  if (precision_ == hmm_precision::fp32)
+  {
+    forward_probs_[block_idx][slot] = probs;
+    forward_norecom_probs_[block_idx][slot] = probs_norecom;
+  }
+  else
+  {
+    packed_forward_probs_[block_idx][slot].pack(probs, probs_norecom, precision_);
+  }
+}
+
+void hidden_markov_model::load_forward_row(std::size_t block_idx, std::size_t slot, std::vector<float>& probs, std::vector<float>& probs_norecom) const
+{
+  if (precision_ == hmm_precision::fp32)
+  {
+    probs = forward_probs_[block_idx][slot];
+    probs_norecom = forward_norecom_probs_[block_idx][slot];
   }
+  else
+  {
+    packed_forward_probs_[block_idx][slot].unpack(probs, probs_norecom, precision_);
+  }
+}
+
+void hidden_markov_model::recompute_forward_segment(const unique_haplotype_block& ref_block, std::size_t block_idx, std::size_t row, std::size_t block_global_idx,
+  const std::vector<target_variant>& tar_variants, std::size_t hap_idx)
+{
+  std::size_t seg_begin = row / checkpoint_interval_ * checkpoint_interval_;
+  std::size_t seg_end = ref_block.variant_size();
+  if (checkpoint_interval_ < seg_end - seg_begin)
+    seg_end = seg_begin + checkpoint_interval_;
+
+  if (segment_probs_.size() < seg_end - seg_begin)
+  {
+    segment_probs_.resize(seg_end - seg_begin);
+    segment_norecom_probs_.resize(seg_end - seg_begin);
+  }
+
+  load_forward_row(block_idx, seg_begin / checkpoint_interval_, segment_probs_[0], segment_norecom_probs_[0]);
+
+  const auto& template_variants = ref_block.variants();
+  for (std::size_t i = seg_begin; i < seg_end; ++i)
+  {
+    std::size_t k = i - seg_begin;
+    std::size_t global_idx = block_global_idx + i;
+    std::int8_t observed = tar_variants[global_idx].gt[hap_idx];
+    double sum = condition(segment_probs_[k], segment_norecom_probs_[k], template_variants[i].gt, observed, tar_variants[global_idx].err, tar_variants[global_idx].af);
+
+    if (i + 1 < seg_end)
+    {
+      segment_probs_[k + 1].resize(segment_probs_[k].size());
+      segment_norecom_probs_[k + 1].resize(segment_probs_[k].size());
+      // Jump flags were already recorded by traverse_forward.
+      transpose(segment_probs_[k], segment_probs_[k + 1], segment_norecom_probs_[k], segment_norecom_probs_[k + 1], ref_block.cardinalities(), tar_variants[global_idx].recom, ref_block.expanded_haplotype_size(), sum);
+    }
+  }
+
+  segment_block_idx_ = block_idx;
+  segment_begin_ = seg_begin;
 }
 
 void hidden_markov_model::traverse_backward(const std::deque<unique_haplotype_block>& ref_haps,
   const std::vector<target_variant>& tar_variants,
   std::size_t hap_idx,
   std::size_t out_idx,
-  const std::vector<std::vector<std::vector<std::size_t>>>& reverse_maps,
   full_dosages_results& output,
   const reduced_haplotypes& full_reference_data)
 {
@@ -131,15 +263,23 @@ void hidden_markov_model::traverse_backward(const std::deque<unique_haplotype_bl
   const auto full_ref_rend = --full_reference_data.begin();
 
   std::size_t global_idx = tar_variants.size() - 1;
-  std::vector<float> backward;
-  std::vector<float> backward_norecom;
-  std::vector<float> junction_proportions_backward;
-  std::vector<float> extra;
-  std::vector<float> constants;
-
-  double prob_sum = std::accumulate(forward_probs_.back().back().begin(), forward_probs_.back().back().end(), 0.);
+  std::vector<float>& backward = backward_;
+  std::vector<float>& backward_norecom = backward_norecom_;
+  std::vector<float>& junction_proportions_backward = junction_proportions_backward_;
+  std::vector<float>& extra = extra_;
+  std::vector<float>& constants = constants_;
 
   int last_block_idx = int(ref_haps.size()) - 1;
+  std::size_t last_row_idx = ref_haps.back().variant_size() - 1;
+  if (checkpoint_interval_)
+  {
+    segment_block_idx_ = std::size_t(-1);
+    recompute_forward_segment(ref_haps.back(), last_block_idx, last_row_idx, global_idx - last_row_idx, tar_variants, hap_idx);
+  }
+
+  const std::vector<float>& last_forward_row = forward_row(last_block_idx, last_row_idx);
+  double prob_sum = std::accumulate(last_forward_row.begin(), last_forward_row.end(), 0.);
+
   for (int block_idx = last_block_idx; block_idx >= 0; --block_idx)
   {
     const unique_haplotype_block& ref_block = ref_haps[block_idx];
@@ -181,12 +321,13 @@ void hidden_markov_model::traverse_backward(const std::deque<unique_haplotype_bl
     best_s3_haps_.clear();
     best_s3_probs_.clear();
 
+    const csr_reverse_map& reverse_map = ref_block.reverse_map();
     constants.clear();
-    constants.resize(reverse_maps[block_idx].size());
-    for (std::size_t i = 0; i < reverse_maps[block_idx].size(); ++i)
+    constants.resize(reverse_map.size());
+    for (std::size_t i = 0; i < reverse_map.size(); ++i)
     {
-      for (std::size_t j = 0; j < reverse_maps[block_idx][i].size(); ++j)
-        constants[i] += junction_prob_proportions_[block_idx][reverse_maps[block_idx][i][j]] * junction_proportions_backward[reverse_maps[block_idx][i][j]];
+      for (std::uint32_t expanded_idx : reverse_map[i])
+        constants[i] += junction_prob_proportions_[block_idx][expanded_idx] * junction_proportions_backward[expanded_idx];
     }
 
     std::size_t best_hap(-1);
@@ -194,49 +335,92 @@ void hidden_markov_model::traverse_backward(const std::deque<unique_haplotype_bl
     extra.resize(backward.size());
 
     const auto& template_variants = ref_block.variants();
-    std::size_t n_rows = forward_probs_[block_idx].size();
+    std::size_t n_rows = ref_block.variant_size();
+    std::size_t block_global_idx = global_idx + 1 - n_rows;
+    double backward_sum = kernels_->sum(backward.data(), backward.size());
     for (int i = int(n_rows) - 1; i >= 0; --i,--global_idx)
     {
-      bool right_jump = transpose(backward, backward, backward_norecom, backward_norecom, ref_block.cardinalities(), tar_variants[global_idx].recom, n_expanded_haplotypes);
+      if (checkpoint_interval_ && (segment_block_idx_ != std::size_t(block_idx) || std::size_t(i) < segment_begin_))
+        recompute_forward_segment(ref_block, block_idx, i, block_global_idx, tar_variants, hap_idx);
+
+      bool right_jump = transpose(backward, backward, backward_norecom, backward_norecom, ref_block.cardinalities(), tar_variants[global_idx].recom, n_expanded_haplotypes, backward_sum);
 
       if (global_idx > 0 && precision_jumps_[global_idx - 1])
         auto a = 0;
       if (precision_jumps_[global_idx])
+      {
         prob_sum /= jump_fix;
+        ++counters_.precision_jumps;
+      }
       if (right_jump)
+      {
         prob_sum *= jump_fix;
+        ++counters_.precision_jumps;
+      }
 
       std::int8_t observed = tar_variants[global_idx].gt[hap_idx];
       impute(prob_sum, best_hap,
-        forward_probs_[block_idx][i], backward,
-        forward_norecom_probs_[block_idx][i], backward_norecom,
+        forward_row(block_idx, i), backward,
+        forward_norecom_row(block_idx, i), backward_norecom,
         junction_prob_proportions_[block_idx], junction_proportions_backward,
-        constants, ref_block.unique_map(), reverse_maps[block_idx],
+        constants, ref_block.unique_map(), reverse_map,
         template_variants[i].gt,
         tar_variants,
         global_idx, hap_idx, out_idx,
         output,
         full_ref_ritr, full_ref_rend, prev_full_ref_block_idx);
 
-      if (observed >= 0)
-        condition(backward, backward_norecom, template_variants[i].gt, observed, tar_variants[global_idx].err, tar_variants[global_idx].af);
+      backward_sum = condition(backward, backward_norecom, template_variants[i].gt, observed, tar_variants[global_idx].err, tar_variants[global_idx].af);
     }
   }
   assert(global_idx == std::size_t(-1));
+
+  std::size_t capacity = workspace_capacity();
+  if (capacity > workspace_capacity_)
+  {
+    ++counters_.workspace_growths;
+    workspace_capacity_ = capacity;
+  }
+}
+
+std::size_t hidden_markov_model::workspace_capacity() const
+{
+  std::size_t ret = temp_row_.capacity() + cur_row_.capacity() + cur_row_norecom_.capacity() + next_row_.capacity() + next_row_norecom_.capacity()
+    + backward_.capacity() + backward_norecom_.capacity() + junction_proportions_backward_.capacity() + extra_.capacity() + constants_.capacity();
+  for (auto it = forward_probs_.begin(); it != forward_probs_.end(); ++it)
+  {
+    for (auto jt = it->begin(); jt != it->end(); ++jt)
+      ret += jt->capacity();
+  }
+  for (auto it = forward_norecom_probs_.begin(); it != forward_norecom_probs_.end(); ++it)
+  {
+    for (auto jt = it->begin(); jt != it->end(); ++jt)
+      ret += jt->capacity();
+  }
+  for (auto it = packed_forward_probs_.begin(); it != packed_forward_probs_.end(); ++it)
+  {
+    for (auto jt = it->begin(); jt != it->end(); ++jt)
+      ret += jt->capacity();
+  }
+  for (auto it = segment_probs_.begin(); it != segment_probs_.end(); ++it)
+    ret += it->capacity();
+  for (auto it = segment_norecom_probs_.begin(); it != segment_norecom_probs_.end(); ++it)
+    ret += it->capacity();
+  for (auto it = junction_prob_proportions_.begin(); it != junction_prob_proportions_.end(); ++it)
+    ret += it->capacity();
+  return ret;
 }
 
 bool hidden_markov_model::transpose(const std::vector<float>& from, std::vector<float>& to, const std::vector<float>& from_norecom, std::vector<float>& to_norecom, const std::vector<std::size_t>& uniq_cardinalities, double recom, std::size_t n_templates)
+{
+  return transpose(from, to, from_norecom, to_norecom, uniq_cardinalities, recom, n_templates, kernels_->sum(from.data(), from.size()));
+}
+
+bool hidden_markov_model::transpose(const std::vector<float>& from, std::vector<float>& to, const std::vector<float>& from_norecom, std::vector<float>& to_norecom, const std::vector<std::size_t>& uniq_cardinalities, double recom, std::size_t n_templates, double sum)
 {
   bool jumped = false;
   assert(from.size() == to.size());
 
-  double sum = 0.;
-
-  for (std::size_t i = 0; i < from.size(); ++i)
-  {
-    sum += from[i];
-  }
-
   double complement = 1. - recom;
 
   // prevent probs from getting too small
@@ -249,39 +433,24 @@ bool hidden_markov_model::transpose(const std::vector<float>& from, std::vector<
 
   sum *= (recom / n_templates);
 
-  for (int i = 0; i < to.size(); i++)
-  {
-    to[i] = from[i] * complement + (uniq_cardinalities[i] * sum);
-    to_norecom[i] = from_norecom[i] * complement;
-    assert(to[i] >= 0.0f);
-    assert(to_norecom[i] >= 0.0f);
-    assert(to[i] < 1e18);
-    assert(to_norecom[i] < 1e18);
-  }
+  kernels_->transpose(from.data(), to.data(), from_norecom.data(), to_norecom.data(), uniq_cardinalities.data(), to.size(), complement, sum);
+  assert(std::all_of(to.begin(), to.end(), [](float p) { return p >= 0.f && p < 1e18f; }));
+  assert(std::all_of(to_norecom.begin(), to_norecom.end(), [](float p) { return p >= 0.f && p < 1e18f; }));
 
   return jumped;
 }
 
-void hidden_markov_model::condition(std::vector<float>& probs, std::vector<float>& probs_norecom, const std::vector<std::int8_t>& template_haps, std::int8_t observed, float err, float af)
+double hidden_markov_model::condition(std::vector<float>& probs, std::vector<float>& probs_norecom, const std::vector<std::int8_t>& template_haps, std::int8_t observed, float err, float af)
 {
+  if (observed < 0)
+    return kernels_->sum(probs.data(), probs.size());
+
   float prandom = err * (observed ? af : 1.f - af) + background_error_;
   float pmatch = (1.f - err) + prandom;
 
-  for (std::size_t i = 0; i < probs.size(); ++i)
-  {
-    if(observed == template_haps[i])
-    {
-      probs[i] *= pmatch;
-      probs_norecom[i] *= pmatch;
-    }
-    else
-    {
-      probs[i] *= prandom;
-      probs_norecom[i] *= prandom;
-    }
-
-    assert(probs[i]>=0.0f);
-  }
+  double sum = kernels_->condition(probs.data(), probs_norecom.data(), template_haps.data(), probs.size(), observed, pmatch, prandom);
+  assert(std::all_of(probs.begin(), probs.end(), [](float p) { return p >= 0.f; }));
+  return sum;
 }
 
 void hidden_markov_model::impute_typed_site(double& prob_sum, std::size_t& prev_best_hap,
@@ -292,7 +461,7 @@ void hidden_markov_model::impute_typed_site(double& prob_sum, std::size_t& prev_
   const std::vector<float>& left_junction_proportions,
   const std::vector<float>& right_junction_proportions,
   const std::vector<float>& constants,
-  const std::vector<std::vector<std::size_t>>& reverse_map,
+  const csr_reverse_map& reverse_map,
   const std::vector<std::int8_t>& template_haps,
   std::int8_t observed, float err, float af,
   std::vector<std::uint32_t>& best_unique_haps, std::vector<float>& best_unique_probs, float& dose, float& loo_dose)
@@ -314,7 +483,10 @@ void hidden_markov_model::impute_typed_site(double& prob_sum, std::size_t& prev_
 //      if (template_haps[i])
 //        p_alt = std::min(1.f, std::max(0.f, prob)); // TODO: + (1. - p_alt) * AF_other to support larger thresholds
       dose = template_haps[i] ? 1.f : 0.f;
-      loo_dose = savvy::typed_value::is_missing(observed) ? savvy::typed_value::missing_value<float>() : dose;
+      if (!leave_one_out_ || savvy::typed_value::is_missing(observed))
+        loo_dose = savvy::typed_value::missing_value<float>();
+      else
+        loo_dose = dose, ++counters_.loo_sites;
       return;
     }
   }
@@ -345,7 +517,7 @@ void hidden_markov_model::impute_typed_site(double& prob_sum, std::size_t& prev_
   dose = std::min(1.f, std::max(0.f, float(p_alt / prob_sum)));
   dose = float(std::int16_t(dose * bin_scalar_ + 0.5f)) / bin_scalar_; // bin
 
-  if (savvy::typed_value::is_missing(observed))
+  if (!leave_one_out_ || savvy::typed_value::is_missing(observed))
   {
     loo_dose = savvy::typed_value::missing_value<float>();
   }
@@ -371,11 +543,24 @@ void hidden_markov_model::impute_typed_site(double& prob_sum, std::size_t& prev_
 
     loo_dose = float(loo_p_alt / (loo_p_alt + loo_p_ref));
     loo_dose = float(std::int16_t(loo_dose * bin_scalar_ + 0.5f)) / bin_scalar_; // bin
+    ++counters_.loo_sites;
   }
 
   prev_best_hap = best_unique_haps.size() == 1 ? best_unique_haps.front() : std::numeric_limits<std::size_t>::max();
 }
 
+inline std::size_t count_trailing_zeros(std::uint64_t word)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(word);
+#else
+  std::size_t n = 0;
+  for ( ; !(word & 1); word >>= 1)
+    ++n;
+  return n;
+#endif
+}
+
 inline bool sites_match(const target_variant& t, const reference_site_info& r)
 {
   return t.pos == r.pos && t.alt == r.alt && t.ref == r.ref;
@@ -385,7 +570,7 @@ void hidden_markov_model::s3_to_s1_probs(
   const std::vector<float>& left_probs, const std::vector<float>& right_probs,
   const std::vector<float>& left_probs_norecom, const std::vector<float>& right_probs_norecom,
   const std::vector<float>& left_junction_proportions, const std::vector<float>& right_junction_proportions,
-  const std::vector<std::vector<std::size_t>>& s3_reverse_map, double prob_sum)
+  const csr_reverse_map& s3_reverse_map, double prob_sum)
 {
   best_s1_haps_.clear();
   best_s1_probs_.clear();
@@ -423,6 +608,28 @@ void hidden_markov_model::s3_to_s1_probs(
       }
     }
   }
+
+  s1_capped_prob_ = 0.;
+  if (max_templates_ && best_s1_haps_.size() > max_templates_)
+  {
+    s1_order_.resize(best_s1_haps_.size());
+    std::iota(s1_order_.begin(), s1_order_.end(), 0u);
+    auto more_probable = [this](std::uint32_t l, std::uint32_t r) { return best_s1_probs_[l] > best_s1_probs_[r] || (best_s1_probs_[l] == best_s1_probs_[r] && l < r); };
+    std::nth_element(s1_order_.begin(), s1_order_.begin() + max_templates_, s1_order_.end(), more_probable);
+    for (auto it = s1_order_.begin() + max_templates_; it != s1_order_.end(); ++it)
+      s1_capped_prob_ += best_s1_probs_[*it];
+    s1_order_.resize(max_templates_);
+    std::sort(s1_order_.begin(), s1_order_.end());
+
+    for (std::size_t i = 0; i < s1_order_.size(); ++i)
+    {
+      best_s1_haps_[i] = best_s1_haps_[s1_order_[i]];
+      best_s1_probs_[i] = best_s1_probs_[s1_order_[i]];
+    }
+    counters_.s1_capped_states += best_s1_haps_.size() - max_templates_;
+    best_s1_haps_.resize(max_templates_);
+    best_s1_probs_.resize(max_templates_);
+  }
 }
 
 void hidden_markov_model::s1_to_s2_probs(std::vector<std::size_t>& cardinalities, const std::vector<std::int64_t>& unique_map, std::size_t s2_size)
@@ -447,6 +654,55 @@ void hidden_markov_model::s1_to_s2_probs(std::vector<std::size_t>& cardinalities
   }
 }
 
+std::size_t hidden_markov_model::interpolate_run(const unique_haplotype_block& block, std::size_t beg, std::size_t end)
+{
+  assert(beg < end && end <= block.variant_size());
+  run_p_alt_.assign(end - beg, 0.);
+  run_ac_.assign(end - beg, 0);
+
+  const haplotype_bit_matrix& bits = block.haplotype_bits();
+  std::size_t an = 0;
+  for (std::size_t i = 0; i < best_s2_haps_.size(); ++i)
+  {
+    std::size_t h = best_s2_haps_[i];
+    float prob = s2_probs_[h];
+    std::size_t card = s2_cardinalities_[h];
+    an += card;
+
+    if (bits.empty())
+    {
+      for (std::size_t v = beg; v < end; ++v)
+      {
+        if (block.variants()[v].gt[h])
+        {
+          run_p_alt_[v - beg] += prob;
+          run_ac_[v - beg] += card;
+        }
+      }
+      continue;
+    }
+
+    const std::uint64_t* words = bits.row(h);
+    for (std::size_t w = beg / 64; w * 64 < end; ++w)
+    {
+      std::uint64_t word = words[w];
+      if (w == beg / 64)
+        word &= ~std::uint64_t(0) << (beg % 64);
+      if ((w + 1) * 64 > end)
+        word &= ~(~std::uint64_t(0) << (end % 64));
+
+      for ( ; word; word &= word - 1)
+      {
+        std::size_t v = w * 64 + count_trailing_zeros(word) - beg;
+        run_p_alt_[v] += prob;
+        run_ac_[v] += card;
+      }
+    }
+  }
+
+  return an;
+}
+
 void hidden_markov_model::impute(double& prob_sum, std::size_t& prev_best_typed_hap,
   const std::vector<float>& left_probs,
   const std::vector<float>& right_probs,
@@ -456,7 +712,7 @@ void hidden_markov_model::impute(double& prob_sum, std::size_t& prev_best_typed_
   const std::vector<float>& right_junction_proportions,
   const std::vector<float>& constants,
   const std::vector<std::int64_t>& uniq_map,
-  const std::vector<std::vector<std::size_t>>& reverse_map,
+  const csr_reverse_map& reverse_map,
   const std::vector<std::int8_t>& template_haps,
   const std::vector<target_variant>& tar_variants,
   std::size_t row, std::size_t column, std::size_t out_column,
@@ -485,7 +741,8 @@ void hidden_markov_model::impute(double& prob_sum, std::size_t& prev_best_typed_
     template_haps,
     tar_variants[row].gt[column], tar_variants[row].err, tar_variants[row].af, best_typed_haps, best_typed_probs,
     typed_dose, typed_loo_dose);
-
+  ++counters_.typed_sites;
+  counters_.s3_states += best_typed_haps.size();
 
 
   //  if (full_ref_ritr == full_ref_rend || full_ref_ritr->pos <= mid_point) // TODO: stop traverse_backward at beginning of region.
@@ -506,19 +763,23 @@ void hidden_markov_model::impute(double& prob_sum, std::size_t& prev_best_typed_
       left_junction_proportions,
       right_junction_proportions,
       reverse_map, prob_sum);
+    ++counters_.s1_updates;
+    counters_.s1_states += best_s1_haps_.size();
 
     prev_block_idx = std::size_t(-1);
   }
 
   // vvvvvvvvvvvvvvvv TODO vvvvvvvvvvvvvvvv //
-  double best_sum = std::accumulate(best_typed_probs.begin(), best_typed_probs.end(), 0.);
+  double best_sum = std::accumulate(best_typed_probs.begin(), best_typed_probs.end(), 0.) - s1_capped_prob_;
   std::size_t n_templates = left_junction_proportions.size();
+  std::size_t run_left = 0, run_begin = 0, an = 0;
   for ( ; full_ref_ritr != full_ref_rend && full_ref_ritr->pos >= mid_point; --full_ref_ritr)
   {
     if (sites_match(tar_variants[row], *full_ref_ritr))
     {
       output.dosage(full_ref_ritr.global_idx(), out_column) = typed_dose;
-      output.loo_dosage(row, out_column) = typed_loo_dose;
+      if (leave_one_out_)
+        output.loo_dosage(row, out_column) = typed_loo_dose;
       if (tar_variants[row].pos == mid_point)
         ++mid_point; // equivalent to breaking and decrementing full_ref_ritr
     }
@@ -527,24 +788,30 @@ void hidden_markov_model::impute(double& prob_sum, std::size_t& prev_best_typed_
       if (full_ref_ritr.block_idx() != prev_block_idx)
       {
         s1_to_s2_probs(s2_cardinalities_, full_ref_ritr.unique_map(), full_ref_ritr.cardinalities().size());
+        ++counters_.s2_updates;
+        counters_.s2_states += best_s2_haps_.size();
         prev_block_idx = full_ref_ritr.block_idx();
+        run_left = 0;
       }
 
-      double p_alt = 0;
-      std::size_t ac = 0;
-      std::size_t an = 0;
-      for (std::size_t i = 0; i < best_s2_haps_.size(); ++i)
+      if (run_left == 0)
       {
-        std::size_t card = s2_cardinalities_[best_s2_haps_[i]];
-
-        if (full_ref_ritr->gt[best_s2_haps_[i]])
+        // The run ends at the next typed site, the mid-point or the start of the block.
+        std::size_t run_end = full_ref_ritr.block_local_idx() + 1;
+        auto run_itr = full_ref_ritr;
+        do
         {
-          p_alt += s2_probs_[best_s2_haps_[i]]; //best_s2_probs_[i];
-          ac += card;
-        }
-        an += card;
+          ++run_left;
+          --run_itr;
+        } while (run_itr != full_ref_rend && run_itr.block_idx() == prev_block_idx && run_itr->pos >= mid_point && !sites_match(tar_variants[row], *run_itr));
+        run_begin = run_end - run_left;
+        an = interpolate_run(full_ref_ritr.block(), run_begin, run_end);
       }
 
+      --run_left;
+      double p_alt = run_p_alt_[full_ref_ritr.block_local_idx() - run_begin];
+      std::size_t ac = run_ac_[full_ref_ritr.block_local_idx() - run_begin];
+
       assert(full_ref_ritr->ac >= ac);
       assert(n_templates >= an);
       if (n_templates - an > 0)
@@ -1,11 +1,14 @@
 #ifndef MINIMAC4_HIDDEN_MARKOV_MODEL_HPP
 #define MINIMAC4_HIDDEN_MARKOV_MODEL_HPP
 
+#include "hmm_kernels.hpp"
+#include "reduced_precision.hpp"
 #include "unique_haplotype.hpp"
 #include "variant.hpp"
 
 #include <array>
 #include <cassert>
+#include <cstdint>
 #include <numeric>
 
 /**
@@ -15,130 +18,211 @@
  * haplotypes in the dataset. It provides storage for both standard dosages
  * and leave-one-out dosages, which are used for model validation and
  * cross-checking accuracy.
+ *
+ * Each matrix is one contiguous buffer aligned to a 64-byte cache line, with
+ * rows padded to a multiple of `tile_width` columns. Resizing only allocates
+ * when a matrix grows beyond its capacity, so an object reused across chunks
+ * stops allocating once it has seen the largest chunk.
+ *
+ * In the `variant_major` layout, the haplotypes of a variant are contiguous
+ * and `dosage_row()` returns a pointer into the matrix. In the
+ * `haplotype_tiled` layout, each tile of `tile_width` haplotypes is stored
+ * variant by variant, so a thread imputing whole tiles never writes to a cache
+ * line shared with another thread. Rows are then gathered by `dosage_row()`.
  */
 class full_dosages_results
 {
 public:
-  /**
-   * @brief Matrix of imputed dosages.
-   *
-   * Each row corresponds to a variant, and each column corresponds to a
-   * target haplotype or sample. Values are floating-point dosages in [0,1].
-   */
-  std::vector<std::vector<float>> dosages_;
+  /** @brief Memory layout of the dosage matrices. */
+  enum class layout
+  {
+    variant_major,  ///< One padded row of haplotypes per variant.
+    haplotype_tiled ///< Tiles of `tile_width` haplotypes, each stored variant by variant.
+  };
 
+  /** Number of floats in a 64-byte cache line. */
+  static const std::size_t tile_width = 16;
+private:
+  std::vector<float> dosage_storage_;
+  std::vector<float> loo_dosage_storage_;
+  std::size_t dosage_offset_ = 0;
+  std::size_t loo_dosage_offset_ = 0;
+  std::size_t n_rows_ = 0;
+  std::size_t n_loo_rows_ = 0;
+  std::size_t n_columns_ = 0;
+  std::size_t stride_ = 0;
+  layout layout_ = layout::variant_major;
+public:
   /**
-   * @brief Matrix of leave-one-out (LOO) dosages.
-   *
-   * These dosages are computed excluding the current target haplotype from
-   * the reference panel, useful for cross-validation of imputation.
+   * @brief Sets the layout used from the next call to `resize()`.
    */
-  std::vector<std::vector<float>> loo_dosages_;
-public:
+  void set_layout(layout l) { layout_ = l; }
+
   /**
    * @brief Resizes the dosage matrices to the specified dimensions.
    *
-   * This function resizes two internal 2D vectors: `dosages_` and `loo_dosages_`.
-   * Each element is initialized to a sentinel value returned by
-   * `savvy::typed_value::end_of_vector_value<float>()`.
+   * Every element of both matrices is set to the sentinel value returned by
+   * `savvy::typed_value::end_of_vector_value<float>()`. Existing values are
+   * not preserved.
    *
-   * @param n_rows Number of rows for the main `dosages_` matrix.
-   * @param n_loo_rows Number of rows for the leave-one-out `loo_dosages_` matrix.
+   * @param n_rows Number of rows for the main dosages matrix.
+   * @param n_loo_rows Number of rows for the leave-one-out dosages matrix.
    * @param n_columns Number of columns for both matrices.
-   *
-   * @details
-   * After calling this function:
-   * - `dosages_` will have dimensions `n_rows x n_columns`.
-   * - `loo_dosages_` will have dimensions `n_loo_rows x n_columns`.
-   * - All elements in both matrices are initialized to a sentinel value
-   *   indicating the end of a vector, typically used for safe iteration or
-   *   checking uninitialized entries.
    */
   void resize(std::size_t n_rows, std::size_t n_loo_rows, std::size_t n_columns)
   {
-    dosages_.resize(n_rows, std::vector<float>(n_columns, savvy::typed_value::end_of_vector_value<float>()));
-    loo_dosages_.resize(n_loo_rows, std::vector<float>(n_columns, savvy::typed_value::end_of_vector_value<float>()));
+    n_rows_ = n_rows;
+    n_loo_rows_ = n_loo_rows;
+    n_columns_ = n_columns;
+    stride_ = (n_columns + tile_width - 1) / tile_width * tile_width;
+    dosage_offset_ = reserve(dosage_storage_, n_rows_ * stride_);
+    loo_dosage_offset_ = reserve(loo_dosage_storage_, n_loo_rows_ * stride_);
+    fill_eov();
   }
 
+  /**
+   * @brief Sets the dimensions to zero while keeping the allocated buffers.
+   */
+  void clear() { resize(0, 0, 0); }
+
   /**
    * @brief Fills all dosage matrices with the end-of-vector sentinel value.
    *
-   * This function sets every element in the `dosages_` and `loo_dosages_`
-   * 2D vectors to a sentinel value returned by
-   * `savvy::typed_value::end_of_vector_value<float>()`.
-   *
    * @details
    * This is useful for reinitializing matrices before recalculation or
    * ensuring that all entries are in a known "empty" state.
-   * 
-   * After calling this function:
-   * - All elements in `dosages_` are set to the sentinel value.
-   * - All elements in `loo_dosages_` are set to the sentinel value.
    */
   void fill_eov()
   {
-    for (auto& v : dosages_)
-      std::fill(v.begin(), v.end(),savvy::typed_value::end_of_vector_value<float>());
-
-    for (auto& v : loo_dosages_)
-      std::fill(v.begin(), v.end(),savvy::typed_value::end_of_vector_value<float>());
+    std::fill_n(dosage_storage_.begin() + dosage_offset_, n_rows_ * stride_, savvy::typed_value::end_of_vector_value<float>());
+    std::fill_n(loo_dosage_storage_.begin() + loo_dosage_offset_, n_loo_rows_ * stride_, savvy::typed_value::end_of_vector_value<float>());
   }
 
   /**
    * @brief Returns the dimensions of the main dosages matrix.
    *
    * @return A `std::array` of size 2:
-   *         - [0]: number of rows (`dosages_.size()`)
-   *         - [1]: number of columns (`dosages_[0].size()` if not empty, 0 otherwise)
+   *         - [0]: number of rows (variants)
+   *         - [1]: number of columns (haplotypes)
    */
-    std::array<std::size_t, 2> dimensions() const { return {dosages_.size(), dosages_.empty() ? 0 : dosages_[0].size()}; }
-
+  std::array<std::size_t, 2> dimensions() const { return {n_rows_, n_columns_}; }
 
   /**
    * @brief Returns the dimensions of the leave-one-out dosages matrix.
    *
    * @return A `std::array` of size 2:
-   *         - [0]: number of rows (`loo_dosages_.size()`)
-   *         - [1]: number of columns (`loo_dosages_[0].size()` if not empty, 0 otherwise)
+   *         - [0]: number of rows (typed variants)
+   *         - [1]: number of columns (haplotypes)
    */
-    std::array<std::size_t, 2> dimensions_loo() const { return {dosages_.size(), dosages_.empty() ? 0 : dosages_[0].size()}; }
-
+  std::array<std::size_t, 2> dimensions_loo() const { return {n_loo_rows_, n_columns_}; }
 
   /**
    * @brief Accesses an element of the main dosages matrix (modifiable).
    *
    * @param i Row index.
    * @param j Column index.
-   * @return Reference to the element at position (i, j) in `dosages_`.
+   * @return Reference to the element at position (i, j).
    */
-  float& dosage(std::size_t i, std::size_t j) { return dosages_[i][j]; }
+  float& dosage(std::size_t i, std::size_t j) { return dosage_storage_[dosage_offset_ + index(i, j, n_rows_)]; }
 
   /**
    * @brief Accesses an element of the main dosages matrix (const version).
-   *
-   * @param i Row index.
-   * @param j Column index.
-   * @return Const reference to the element at position (i, j) in `dosages_`.
    */
-  const float& dosage(std::size_t i, std::size_t j) const  { return dosages_[i][j]; }
+  const float& dosage(std::size_t i, std::size_t j) const  { return dosage_storage_[dosage_offset_ + index(i, j, n_rows_)]; }
 
   /**
    * @brief Accesses an element of the leave-one-out dosages matrix (modifiable).
    *
    * @param i Row index.
    * @param j Column index.
-   * @return Reference to the element at position (i, j) in `loo_dosages_`.
+   * @return Reference to the element at position (i, j).
    */
-  float& loo_dosage(std::size_t i, std::size_t j) { return loo_dosages_[i][j]; }
+  float& loo_dosage(std::size_t i, std::size_t j) { return loo_dosage_storage_[loo_dosage_offset_ + index(i, j, n_loo_rows_)]; }
 
   /**
    * @brief Accesses an element of the leave-one-out dosages matrix (const version).
+   */
+  const float& loo_dosage(std::size_t i, std::size_t j) const { return loo_dosage_storage_[loo_dosage_offset_ + index(i, j, n_loo_rows_)]; }
+
+  /**
+   * @brief Gets the `dimensions()[1]` dosages of row `i` as a contiguous array.
    *
    * @param i Row index.
-   * @param j Column index.
-   * @return Const reference to the element at position (i, j) in `loo_dosages_`.
+   * @param buf Buffer used to gather the row in the tiled layout.
+   * @return Pointer into the matrix (variant-major layout) or into `buf` (tiled layout).
    */
-  const float& loo_dosage(std::size_t i, std::size_t j) const { return loo_dosages_[i][j]; }
+  const float* dosage_row(std::size_t i, std::vector<float>& buf) const { return row(dosage_storage_, dosage_offset_, n_rows_, i, buf); }
+
+  /**
+   * @brief Gets the `dimensions_loo()[1]` leave-one-out dosages of row `i` as a contiguous array.
+   * @see dosage_row()
+   */
+  const float* loo_dosage_row(std::size_t i, std::vector<float>& buf) const { return row(loo_dosage_storage_, loo_dosage_offset_, n_loo_rows_, i, buf); }
+private:
+  std::size_t index(std::size_t i, std::size_t j, std::size_t n_rows) const
+  {
+    if (layout_ == layout::variant_major)
+      return i * stride_ + j;
+    return ((j / tile_width) * n_rows + i) * tile_width + j % tile_width;
+  }
+
+  const float* row(const std::vector<float>& storage, std::size_t offset, std::size_t n_rows, std::size_t i, std::vector<float>& buf) const
+  {
+    if (layout_ == layout::variant_major)
+      return storage.data() + offset + i * stride_;
+
+    buf.resize(n_columns_);
+    for (std::size_t j = 0; j < n_columns_; j += tile_width)
+    {
+      const float* tile_row = storage.data() + offset + index(i, j, n_rows);
+      std::copy_n(tile_row, std::min(std::size_t(tile_width), n_columns_ - j), buf.begin() + j);
+    }
+    return buf.data();
+  }
+
+  /** Grows `storage` to hold `size` floats from a cache line boundary and returns the offset of that boundary. */
+  static std::size_t reserve(std::vector<float>& storage, std::size_t size)
+  {
+    if (storage.size() < size + tile_width)
+      storage.resize(size + tile_width);
+    std::size_t misalignment = reinterpret_cast<std::uintptr_t>(storage.data()) % (tile_width * sizeof(float));
+    return misalignment ? (tile_width * sizeof(float) - misalignment) / sizeof(float) : 0;
+  }
+};
+
+/**
+ * @brief Work counters accumulated by `hidden_markov_model`.
+ *
+ * State counts are summed over every typed site (S3) or every state update
+ * (S1, S2), so dividing by the matching update count gives the mean state size.
+ */
+struct hmm_counters
+{
+  std::uint64_t precision_jumps = 0; ///< Rescaled rows in the forward and backward traversals.
+  std::uint64_t typed_sites = 0;     ///< Typed sites imputed within the impute region.
+  std::uint64_t loo_sites = 0;       ///< Typed sites for which a leave-one-out dosage was computed.
+  std::uint64_t s3_states = 0;       ///< Sum of S3 (typed-only template) state sizes.
+  std::uint64_t s1_updates = 0;      ///< Number of S3 to S1 expansions.
+  std::uint64_t s1_states = 0;       ///< Sum of S1 state sizes.
+  std::uint64_t s1_capped_states = 0; ///< Sum of S1 states dropped by the `--max-templates` cap.
+  std::uint64_t s2_updates = 0;      ///< Number of S1 to S2 projections onto full reference blocks.
+  std::uint64_t s2_states = 0;       ///< Sum of S2 state sizes.
+  std::uint64_t workspace_growths = 0; ///< Haplotypes whose traversal grew the reusable row buffers.
+
+  hmm_counters& operator+=(const hmm_counters& other)
+  {
+    precision_jumps += other.precision_jumps;
+    typed_sites += other.typed_sites;
+    loo_sites += other.loo_sites;
+    s3_states += other.s3_states;
+    s1_updates += other.s1_updates;
+    s1_states += other.s1_states;
+    s1_capped_states += other.s1_capped_states;
+    s2_updates += other.s2_updates;
+    s2_states += other.s2_states;
+    workspace_growths += other.workspace_growths;
+    return *this;
+  }
 };
 
 /**
@@ -159,12 +243,56 @@ public:
 class hidden_markov_model
 {
 private:
-  /** Forward probability matrices per haplotype block. */
+  /** Forward probability matrices per haplotype block (only checkpoint rows when checkpointing is enabled). */
   std::deque<std::vector<std::vector<float>>> forward_probs_;
 
   /** Forward probabilities ignoring recombination. */
   std::deque<std::vector<std::vector<float>>> forward_norecom_probs_;
 
+  /** Forward rows and no-recombination rows stored in 16 bits (used instead of the fp32 matrices when `precision_` is not fp32). */
+  std::deque<std::vector<packed_prob_row>> packed_forward_probs_;
+
+  /** Forward rows recomputed from a checkpoint for the segment currently being traversed backward. */
+  std::vector<std::vector<float>> segment_probs_;
+
+  /** Recomputed forward rows ignoring recombination. */
+  std::vector<std::vector<float>> segment_norecom_probs_;
+
+  /** Block index of the recomputed segment (-1 if none). */
+  std::size_t segment_block_idx_ = std::size_t(-1);
+
+  /** Row (within block) of the first recomputed forward row. */
+  std::size_t segment_begin_ = 0;
+
+  /** Number of rows between stored forward rows (0 stores every row). */
+  std::size_t checkpoint_interval_ = 0;
+
+  /** Storage precision of the forward rows. */
+  hmm_precision precision_ = hmm_precision::fp32;
+
+  /** Whether leave-one-out dosages of typed sites are computed and stored. */
+  bool leave_one_out_ = true;
+
+  /** SIMD kernels used by `condition` and `transpose`. */
+  const hmm_kernels::table* kernels_;
+
+  /** Scratch rows used while traversing forward. */
+  std::vector<float> temp_row_;
+  std::vector<float> cur_row_;
+  std::vector<float> cur_row_norecom_;
+  std::vector<float> next_row_;
+  std::vector<float> next_row_norecom_;
+
+  /** Backward state and scratch rows, kept between haplotypes so their capacity is reused. */
+  std::vector<float> backward_;
+  std::vector<float> backward_norecom_;
+  std::vector<float> junction_proportions_backward_;
+  std::vector<float> extra_;
+  std::vector<float> constants_;
+
+  /** Capacity of the row buffers after the last traversal, used to count `workspace_growths`. */
+  std::size_t workspace_capacity_ = 0;
+
   /** Junction probability proportions per haplotype block. */
   std::vector<std::vector<float>> junction_prob_proportions_;
 
@@ -180,6 +308,15 @@ private:
   /** Difference threshold for updating best haplotypes. */
   float diff_threshold_ = 0.01f;
 
+  /** Cap on the size of the S1 state (0 is unbounded). */
+  std::size_t max_templates_ = 0;
+
+  /** Summed probability of the S1 templates dropped by the cap, interpolated from allele counts instead. */
+  double s1_capped_prob_ = 0.;
+
+  /** Scratch positions into `best_s1_haps_` used to select the capped S1 state. */
+  std::vector<std::uint32_t> s1_order_;
+
   /** Background sequencing/genotyping error rate. */
   float background_error_ = 1e-5f;
 
@@ -219,6 +356,15 @@ private:
   /** Posterior probabilities corresponding to best S3 haplotypes. */
   std::vector<float> best_s3_probs_;
 
+  /** Summed S2 probabilities of the alternate allele at each site of the current run of untyped sites. */
+  std::vector<double> run_p_alt_;
+
+  /** Summed S2 cardinalities of the alternate allele at each site of the current run of untyped sites. */
+  std::vector<std::size_t> run_ac_;
+
+  /** Work counters since construction or the last `reset_counters()`. */
+  hmm_counters counters_;
+
 public:
   /**
    * @brief Constructs a Hidden Markov Model with specified parameters.
@@ -229,13 +375,32 @@ public:
    *                       make a confident state call.
    * @param background_error Expected background error rate.
    * @param decay Decay factor controlling the influence of previous states.
+   * @param checkpoint_interval Number of typed sites between stored forward rows.
+   *                            0 stores every row, SIZE_MAX stores only the first
+   *                            row of each reference block.
+   * @param precision Storage precision of the forward rows.
+   * @param leave_one_out Whether to compute leave-one-out dosages of typed sites.
+   *                      When false, `traverse_backward` writes no LOO dosages,
+   *                      so the output may be sized without LOO rows.
+   * @param max_templates Cap on the number of S1 templates kept after the
+   *                      thresholds (0 is unbounded).
    *
    * @details
    * This constructor initializes the internal HMM parameters. These thresholds
    * and the decay factor influence the model's sensitivity to differences in
    * observed probabilities and determine how the hidden states are inferred.
+   *
+   * When checkpointing is enabled, `traverse_forward` keeps only the forward
+   * rows at block boundaries and every `checkpoint_interval` rows within a block.
+   * `traverse_backward` recomputes the remaining rows from the closest checkpoint
+   * using the same operations, so dosages are identical to the default mode.
+   *
+   * With 16-bit precision, stored rows are rounded with a per-row scale and
+   * widened to fp32 only when the backward pass recomputes them. Since a stored
+   * row must be widened and conditioned again before use, a checkpoint interval
+   * of 0 is treated as 1 in this mode.
    */
-  hidden_markov_model(float s3_prob_threshold, float s1_prob_threshold, float diff_threshold, float background_error, float decay);
+  hidden_markov_model(float s3_prob_threshold, float s1_prob_threshold, float diff_threshold, float background_error, float decay, std::size_t checkpoint_interval = 0, hmm_precision precision = hmm_precision::fp32, bool leave_one_out = true, std::size_t max_templates = 0);
 
   /**
    * @brief Performs a forward traversal over reference haplotypes for a given target haplotype.
@@ -283,11 +448,11 @@ public:
    * recombination events, junction proportions, and leave-one-out considerations.
    *
    * @param ref_haps A deque of reference haplotype blocks (`unique_haplotype_block`).
-   *                 Each block contains multiple haplotypes and variant positions.
+   *                 Each block contains multiple haplotypes and variant positions,
+   *                 and must have its reverse map built (`build_reverse_map()`).
    * @param tar_variants A vector of target variants (`target_variant`) to traverse backward.
    * @param hap_idx Index of the target haplotype to traverse within `tar_variants`.
    * @param out_idx Output index used for storing results in `full_dosages_results`.
-   * @param reverse_maps Maps from expanded to unique haplotypes for each block.
    * @param output Reference to a `full_dosages_results` structure where computed
    *               posterior dosages are stored.
    * @param full_reference_data Reduced haplotype reference data needed for imputation.
@@ -315,9 +480,23 @@ public:
     const std::vector<target_variant>& tar_variant,
     std::size_t hap_idx,
     std::size_t out_idx,
-    const std::vector<std::vector<std::vector<std::size_t>>>& reverse_maps,
     full_dosages_results& output,
     const reduced_haplotypes& full_reference_data);
+
+  /** @return Work counters accumulated by the traversals of this model. */
+  const hmm_counters& counters() const { return counters_; }
+
+  /** @brief Zeroes the work counters. */
+  void reset_counters() { counters_ = hmm_counters(); }
+
+  /**
+   * @return Total capacity, in elements, of the forward, backward and scratch rows.
+   *
+   * Row buffers are only grown, never released, so once a model has traversed
+   * the largest block shape of a run it traverses further haplotypes and
+   * chunks without allocating them again.
+   */
+  std::size_t workspace_capacity() const;
 private:
   /**
    * @brief Updates forward or backward probabilities conditioned on an observed genotype.
@@ -333,19 +512,23 @@ private:
    * @param err Genotyping error probability.
    * @param af Allele frequency of the observed variant.
    *
+   * @return Sum of `probs` after conditioning (or the unchanged sum when `observed` is missing).
+   *
    * @details
    * - Computes a probability of random mismatch (`prandom`) based on error and allele frequency.
    * - Computes the match probability (`pmatch`) for haplotypes matching the observed genotype.
    * - Multiplies each probability by either `pmatch` or `prandom` depending on whether
    *   the template haplotype matches the observation.
    * - Ensures that all resulting probabilities are non-negative.
+   * - The sum is accumulated in the same pass so that the following `transpose`
+   *   does not need to read the row again.
    *
    * @note
    * - This function is typically called during the forward or backward traversal
    *   to condition probabilities on observed data.
    * - Assertions ensure probabilities remain non-negative after conditioning.
    */
-  void condition(std::vector<float>& probs, std::vector<float>& probs_norecom, const std::vector<std::int8_t>& template_haps, std::int8_t observed, float err, float freq);
+  double condition(std::vector<float>& probs, std::vector<float>& probs_norecom, const std::vector<std::int8_t>& template_haps, std::int8_t observed, float err, float freq);
   
   /**
    * @brief Transposes probability vectors to the next variant position, accounting for recombination.
@@ -379,6 +562,11 @@ private:
    */
   bool transpose(const std::vector<float>& from, std::vector<float>& to, const std::vector<float>& from_norecom, std::vector<float>& to_norecom, const std::vector<std::size_t>& uniq_cardinalities, double recom, std::size_t n_templates);
 
+  /**
+   * @brief Same as above, but with the sum of `from` already known (e.g., returned by `condition`).
+   */
+  bool transpose(const std::vector<float>& from, std::vector<float>& to, const std::vector<float>& from_norecom, std::vector<float>& to_norecom, const std::vector<std::size_t>& uniq_cardinalities, double recom, std::size_t n_templates, double sum);
+
   /**
    * @brief Computes posterior dosages and probabilities for a single typed variant site.
    *
@@ -405,7 +593,7 @@ private:
    * @param best_unique_haps Output vector of indices for haplotypes exceeding the probability threshold.
    * @param best_unique_probs Output vector of probabilities for the corresponding haplotypes.
    * @param dose Output posterior dosage (0-1) for the typed site.
-   * @param loo_dose Output leave-one-out dosage for the typed site.
+   * @param loo_dose Output leave-one-out dosage for the typed site (missing if `leave_one_out_` is false).
    *
    * @details
    * - Checks if the previously best haplotype exceeds the threshold and assigns the dosage directly.
@@ -428,7 +616,7 @@ private:
     const std::vector<float>& left_junction_proportions,
     const std::vector<float>& right_junction_proportions,
     const std::vector<float>& constants,
-    const std::vector<std::vector<std::size_t>>& reverse_map,
+    const csr_reverse_map& reverse_map,
     const std::vector<std::int8_t>& template_haps,
     std::int8_t observed, float err, float af,
     std::vector<std::uint32_t>& best_uniq_haps, std::vector<float>& best_uniq_probs, float& dose, float& loo_dose);
@@ -488,7 +676,7 @@ private:
     const std::vector<float>& right_junction_proportions,
     const std::vector<float>& constants,
     const std::vector<std::int64_t>& uniq_map,
-    const std::vector<std::vector<std::size_t>>& reverse_map,
+    const csr_reverse_map& reverse_map,
     const std::vector<std::int8_t>& template_haps,
     const std::vector<target_variant>& tar_variants,
     std::size_t row, std::size_t column, std::size_t out_column,
@@ -498,12 +686,83 @@ private:
 
   void initialize_likelihoods(std::vector<float>& probs, std::vector<float>& probs_norecom, std::vector<float>& proportions, const unique_haplotype_block& ref_block);
 
+  /**
+   * @brief Computes the first forward row of a block from the last row of the previous block.
+   *
+   * @param prev_ref_block Previous reference block.
+   * @param prev_last_row Conditioned last forward row of the previous block.
+   * @param prev_last_row_norecom Conditioned last no-recombination forward row of the previous block.
+   * @param prev_junction_proportions Junction proportions of the previous block.
+   * @param ref_block Current reference block.
+   * @param junction_proportions Output junction proportions of the current block.
+   * @param first_row Output first forward row of the current block.
+   * @param first_row_norecom Output first no-recombination forward row of the current block.
+   * @param recom Recombination probability between the two sites.
+   * @return `true` if a precision jump was applied.
+   */
+  bool transition_forward(const unique_haplotype_block& prev_ref_block,
+    const std::vector<float>& prev_last_row, const std::vector<float>& prev_last_row_norecom,
+    const std::vector<float>& prev_junction_proportions,
+    const unique_haplotype_block& ref_block, std::vector<float>& junction_proportions,
+    std::vector<float>& first_row, std::vector<float>& first_row_norecom, double recom);
+
+  /**
+   * @brief Recomputes the forward rows of the checkpoint segment containing `row`.
+   *
+   * The rows are rebuilt from the stored checkpoint with the same `condition` and
+   * `transpose` calls used by `traverse_forward` and stored in `segment_probs_`.
+   *
+   * @param ref_block Reference block that contains the segment.
+   * @param block_idx Index of `ref_block`.
+   * @param row Row within the block that must be available.
+   * @param block_global_idx Index in `tar_variants` of the first row of the block.
+   * @param tar_variants Target variants.
+   * @param hap_idx Index of the target haplotype.
+   */
+  void recompute_forward_segment(const unique_haplotype_block& ref_block, std::size_t block_idx, std::size_t row, std::size_t block_global_idx,
+    const std::vector<target_variant>& tar_variants, std::size_t hap_idx);
+
+  /** @brief Stores the working forward rows as checkpoint `slot` of block `block_idx`. */
+  void store_forward_row(std::size_t block_idx, std::size_t slot, const std::vector<float>& probs, const std::vector<float>& probs_norecom);
+
+  /** @brief Loads checkpoint `slot` of block `block_idx` into fp32 rows. */
+  void load_forward_row(std::size_t block_idx, std::size_t slot, std::vector<float>& probs, std::vector<float>& probs_norecom) const;
+
+  /** @return Forward row of block `block_idx` at `row`, either stored or recomputed. */
+  const std::vector<float>& forward_row(std::size_t block_idx, std::size_t row) const { return checkpoint_interval_ ? segment_probs_[row - segment_begin_] : forward_probs_[block_idx][row]; }
+
+  /** @return No-recombination forward row of block `block_idx` at `row`, either stored or recomputed. */
+  const std::vector<float>& forward_norecom_row(std::size_t block_idx, std::size_t row) const { return checkpoint_interval_ ? segment_norecom_probs_[row - segment_begin_] : forward_norecom_probs_[block_idx][row]; }
+
+  /**
+   * @brief Expands the S3 state into the S1 templates passing the probability thresholds.
+   *
+   * With `max_templates_` set, only the most probable `max_templates_`
+   * survivors are kept, found by partial selection and left in expansion
+   * order so the interpolated sums do not depend on the selection. Their
+   * dropped probability is kept in `s1_capped_prob_`. The selection is not
+   * reused incrementally: every call expands and scores all survivors.
+   */
   void s3_to_s1_probs(
     const std::vector<float>& left_probs, const std::vector<float>& right_probs,
     const std::vector<float>& left_probs_norecom, const std::vector<float>& right_probs_norecom,
     const std::vector<float>& left_junction_proportions, const std::vector<float>& right_junction_proportions,
-    const std::vector<std::vector<std::size_t>>& s3_reverse_map, double prob_sum);
+    const csr_reverse_map& s3_reverse_map, double prob_sum);
   void s1_to_s2_probs(std::vector<std::size_t>& cardinalities, const std::vector<std::int64_t>& uniq_map, std::size_t s2_size);
+
+  /**
+   * @brief Sums the S2 templates carrying the alternate allele at variants `[beg, end)` of a block.
+   *
+   * Every untyped site between two typed sites of one block is interpolated
+   * from the same S2 templates, so the sums of the whole run are filled into
+   * `run_p_alt_` and `run_ac_` at once. Templates are visited in the order of
+   * `best_s2_haps_`, which keeps each sum identical to a per-site loop, and
+   * the alternate alleles of a template are found from the set bits of its
+   * row in `haplotype_bits()`. Blocks without bit rows fall back to `gt`.
+   *
+   * @return Summed cardinalities of all S2 templates.
+   */
+  std::size_t interpolate_run(const unique_haplotype_block& block, std::size_t beg, std::size_t end);
 };
 
 #endif // MINIMAC4_HIDDEN_MARKOV_MODEL_HPP
\ No newline at end of file
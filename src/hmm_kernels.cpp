@@ -0,0 +1,324 @@
+#include "hmm_kernels.hpp"
+
+#include <cstdlib>
+#include <iostream>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MINIMAC4_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define MINIMAC4_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+  // ---- scalar reference ---- //
+  double scalar_condition(float* probs, float* probs_norecom, const std::int8_t* template_haps, std::size_t n, std::int8_t observed, float pmatch, float prandom)
+  {
+    double sum = 0.;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      float f = observed == template_haps[i] ? pmatch : prandom;
+      probs[i] *= f;
+      probs_norecom[i] *= f;
+      sum += probs[i];
+    }
+    return sum;
+  }
+
+  double scalar_sum(const float* probs, std::size_t n)
+  {
+    double sum = 0.;
+    for (std::size_t i = 0; i < n; ++i)
+      sum += probs[i];
+    return sum;
+  }
+
+  void scalar_transpose(const float* from, float* to, const float* from_norecom, float* to_norecom, const std::size_t* cardinalities, std::size_t n, double complement, double scaled_sum)
+  {
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      to[i] = from[i] * complement + (cardinalities[i] * scaled_sum);
+      to_norecom[i] = from_norecom[i] * complement;
+    }
+  }
+
+#ifdef MINIMAC4_X86_KERNELS
+  static_assert(sizeof(std::size_t) == 8, "x86 kernels expect 64-bit cardinalities");
+
+  // ---- AVX2 ---- //
+  __attribute__((target("avx2")))
+  inline __m256d avx2_widen_add(__m256d acc, __m128 v)
+  {
+    return _mm256_add_pd(acc, _mm256_cvtps_pd(v));
+  }
+
+  // Exact for integers below 2^52, which bounds any haplotype cardinality.
+  __attribute__((target("avx2")))
+  inline __m256d avx2_u64_to_pd(__m256i v)
+  {
+    const __m256d magic = _mm256_set1_pd(4503599627370496.); // 2^52
+    return _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(v, _mm256_castpd_si256(magic))), magic);
+  }
+
+  __attribute__((target("avx2")))
+  inline double avx2_hsum(__m256d v)
+  {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+  }
+
+  __attribute__((target("avx2")))
+  double avx2_condition(float* probs, float* probs_norecom, const std::int8_t* template_haps, std::size_t n, std::int8_t observed, float pmatch, float prandom)
+  {
+    const __m128i obs = _mm_set1_epi8(observed);
+    const __m256 match_v = _mm256_set1_ps(pmatch);
+    const __m256 random_v = _mm256_set1_ps(prandom);
+    __m256d acc_lo = _mm256_setzero_pd();
+    __m256d acc_hi = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for ( ; i + 8 <= n; i += 8)
+    {
+      __m128i alleles = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(template_haps + i));
+      __m256 mask = _mm256_castsi256_ps(_mm256_cvtepi8_epi32(_mm_cmpeq_epi8(alleles, obs)));
+      __m256 f = _mm256_blendv_ps(random_v, match_v, mask);
+      __m256 p = _mm256_mul_ps(_mm256_loadu_ps(probs + i), f);
+      _mm256_storeu_ps(probs + i, p);
+      _mm256_storeu_ps(probs_norecom + i, _mm256_mul_ps(_mm256_loadu_ps(probs_norecom + i), f));
+      acc_lo = avx2_widen_add(acc_lo, _mm256_castps256_ps128(p));
+      acc_hi = avx2_widen_add(acc_hi, _mm256_extractf128_ps(p, 1));
+    }
+
+    return avx2_hsum(_mm256_add_pd(acc_lo, acc_hi)) + scalar_condition(probs + i, probs_norecom + i, template_haps + i, n - i, observed, pmatch, prandom);
+  }
+
+  __attribute__((target("avx2")))
+  double avx2_sum(const float* probs, std::size_t n)
+  {
+    __m256d acc_lo = _mm256_setzero_pd();
+    __m256d acc_hi = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for ( ; i + 8 <= n; i += 8)
+    {
+      acc_lo = avx2_widen_add(acc_lo, _mm_loadu_ps(probs + i));
+      acc_hi = avx2_widen_add(acc_hi, _mm_loadu_ps(probs + i + 4));
+    }
+
+    return avx2_hsum(_mm256_add_pd(acc_lo, acc_hi)) + scalar_sum(probs + i, n - i);
+  }
+
+  __attribute__((target("avx2")))
+  void avx2_transpose(const float* from, float* to, const float* from_norecom, float* to_norecom, const std::size_t* cardinalities, std::size_t n, double complement, double scaled_sum)
+  {
+    const __m256d comp_v = _mm256_set1_pd(complement);
+    const __m256d sum_v = _mm256_set1_pd(scaled_sum);
+    std::size_t i = 0;
+    for ( ; i + 4 <= n; i += 4)
+    {
+      __m256d card = avx2_u64_to_pd(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(cardinalities + i)));
+      __m256d f = _mm256_cvtps_pd(_mm_loadu_ps(from + i));
+      __m256d f_norecom = _mm256_cvtps_pd(_mm_loadu_ps(from_norecom + i));
+      _mm_storeu_ps(to + i, _mm256_cvtpd_ps(_mm256_add_pd(_mm256_mul_pd(f, comp_v), _mm256_mul_pd(card, sum_v))));
+      _mm_storeu_ps(to_norecom + i, _mm256_cvtpd_ps(_mm256_mul_pd(f_norecom, comp_v)));
+    }
+
+    scalar_transpose(from + i, to + i, from_norecom + i, to_norecom + i, cardinalities + i, n - i, complement, scaled_sum);
+  }
+
+  // ---- AVX-512 (foundation instructions only) ---- //
+  __attribute__((target("avx512f")))
+  inline __m512d avx512_u64_to_pd(__m512i v)
+  {
+    const __m512d magic = _mm512_set1_pd(4503599627370496.); // 2^52
+    return _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(v, _mm512_castpd_si512(magic))), magic);
+  }
+
+  __attribute__((target("avx512f")))
+  inline __m256 avx512_upper_ps(__m512 v)
+  {
+    return _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+  }
+
+  __attribute__((target("avx512f")))
+  double avx512_condition(float* probs, float* probs_norecom, const std::int8_t* template_haps, std::size_t n, std::int8_t observed, float pmatch, float prandom)
+  {
+    const __m512i obs = _mm512_set1_epi32(observed);
+    const __m512 match_v = _mm512_set1_ps(pmatch);
+    const __m512 random_v = _mm512_set1_ps(prandom);
+    __m512d acc_lo = _mm512_setzero_pd();
+    __m512d acc_hi = _mm512_setzero_pd();
+    std::size_t i = 0;
+    for ( ; i + 16 <= n; i += 16)
+    {
+      __m512i alleles = _mm512_cvtepi8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(template_haps + i)));
+      __mmask16 mask = _mm512_cmpeq_epi32_mask(alleles, obs);
+      __m512 f = _mm512_mask_blend_ps(mask, random_v, match_v);
+      __m512 p = _mm512_mul_ps(_mm512_loadu_ps(probs + i), f);
+      _mm512_storeu_ps(probs + i, p);
+      _mm512_storeu_ps(probs_norecom + i, _mm512_mul_ps(_mm512_loadu_ps(probs_norecom + i), f));
+      acc_lo = _mm512_add_pd(acc_lo, _mm512_cvtps_pd(_mm512_castps512_ps256(p)));
+      acc_hi = _mm512_add_pd(acc_hi, _mm512_cvtps_pd(avx512_upper_ps(p)));
+    }
+
+    return _mm512_reduce_add_pd(_mm512_add_pd(acc_lo, acc_hi)) + scalar_condition(probs + i, probs_norecom + i, template_haps + i, n - i, observed, pmatch, prandom);
+  }
+
+  __attribute__((target("avx512f")))
+  double avx512_sum(const float* probs, std::size_t n)
+  {
+    __m512d acc_lo = _mm512_setzero_pd();
+    __m512d acc_hi = _mm512_setzero_pd();
+    std::size_t i = 0;
+    for ( ; i + 16 <= n; i += 16)
+    {
+      acc_lo = _mm512_add_pd(acc_lo, _mm512_cvtps_pd(_mm256_loadu_ps(probs + i)));
+      acc_hi = _mm512_add_pd(acc_hi, _mm512_cvtps_pd(_mm256_loadu_ps(probs + i + 8)));
+    }
+
+    return _mm512_reduce_add_pd(_mm512_add_pd(acc_lo, acc_hi)) + scalar_sum(probs + i, n - i);
+  }
+
+  __attribute__((target("avx512f")))
+  void avx512_transpose(const float* from, float* to, const float* from_norecom, float* to_norecom, const std::size_t* cardinalities, std::size_t n, double complement, double scaled_sum)
+  {
+    const __m512d comp_v = _mm512_set1_pd(complement);
+    const __m512d sum_v = _mm512_set1_pd(scaled_sum);
+    std::size_t i = 0;
+    for ( ; i + 8 <= n; i += 8)
+    {
+      __m512d card = avx512_u64_to_pd(_mm512_loadu_si512(cardinalities + i));
+      __m512d f = _mm512_cvtps_pd(_mm256_loadu_ps(from + i));
+      __m512d f_norecom = _mm512_cvtps_pd(_mm256_loadu_ps(from_norecom + i));
+      _mm256_storeu_ps(to + i, _mm512_cvtpd_ps(_mm512_add_pd(_mm512_mul_pd(f, comp_v), _mm512_mul_pd(card, sum_v))));
+      _mm256_storeu_ps(to_norecom + i, _mm512_cvtpd_ps(_mm512_mul_pd(f_norecom, comp_v)));
+    }
+
+    scalar_transpose(from + i, to + i, from_norecom + i, to_norecom + i, cardinalities + i, n - i, complement, scaled_sum);
+  }
+#endif // MINIMAC4_X86_KERNELS
+
+#ifdef MINIMAC4_NEON_KERNELS
+  static_assert(sizeof(std::size_t) == 8, "NEON kernels expect 64-bit cardinalities");
+
+  inline float64x2_t neon_widen_add(float64x2_t acc, float32x4_t v)
+  {
+    return vaddq_f64(vaddq_f64(acc, vcvt_f64_f32(vget_low_f32(v))), vcvt_high_f64_f32(v));
+  }
+
+  double neon_condition(float* probs, float* probs_norecom, const std::int8_t* template_haps, std::size_t n, std::int8_t observed, float pmatch, float prandom)
+  {
+    const int8x8_t obs = vdup_n_s8(observed);
+    const float32x4_t match_v = vdupq_n_f32(pmatch);
+    const float32x4_t random_v = vdupq_n_f32(prandom);
+    float64x2_t acc = vdupq_n_f64(0.);
+    std::size_t i = 0;
+    for ( ; i + 8 <= n; i += 8)
+    {
+      int16x8_t mask16 = vmovl_s8(vreinterpret_s8_u8(vceq_s8(vld1_s8(template_haps + i), obs)));
+      uint32x4_t mask_lo = vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(mask16)));
+      uint32x4_t mask_hi = vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(mask16)));
+      float32x4_t f_lo = vbslq_f32(mask_lo, match_v, random_v);
+      float32x4_t f_hi = vbslq_f32(mask_hi, match_v, random_v);
+      float32x4_t p_lo = vmulq_f32(vld1q_f32(probs + i), f_lo);
+      float32x4_t p_hi = vmulq_f32(vld1q_f32(probs + i + 4), f_hi);
+      vst1q_f32(probs + i, p_lo);
+      vst1q_f32(probs + i + 4, p_hi);
+      vst1q_f32(probs_norecom + i, vmulq_f32(vld1q_f32(probs_norecom + i), f_lo));
+      vst1q_f32(probs_norecom + i + 4, vmulq_f32(vld1q_f32(probs_norecom + i + 4), f_hi));
+      acc = neon_widen_add(neon_widen_add(acc, p_lo), p_hi);
+    }
+
+    return vaddvq_f64(acc) + scalar_condition(probs + i, probs_norecom + i, template_haps + i, n - i, observed, pmatch, prandom);
+  }
+
+  double neon_sum(const float* probs, std::size_t n)
+  {
+    float64x2_t acc = vdupq_n_f64(0.);
+    std::size_t i = 0;
+    for ( ; i + 4 <= n; i += 4)
+      acc = neon_widen_add(acc, vld1q_f32(probs + i));
+
+    return vaddvq_f64(acc) + scalar_sum(probs + i, n - i);
+  }
+
+  void neon_transpose(const float* from, float* to, const float* from_norecom, float* to_norecom, const std::size_t* cardinalities, std::size_t n, double complement, double scaled_sum)
+  {
+    const float64x2_t comp_v = vdupq_n_f64(complement);
+    const float64x2_t sum_v = vdupq_n_f64(scaled_sum);
+    std::size_t i = 0;
+    for ( ; i + 2 <= n; i += 2)
+    {
+      float64x2_t card = vcvtq_f64_u64(vld1q_u64(reinterpret_cast<const std::uint64_t*>(cardinalities + i)));
+      float64x2_t f = vcvt_f64_f32(vld1_f32(from + i));
+      float64x2_t f_norecom = vcvt_f64_f32(vld1_f32(from_norecom + i));
+      vst1_f32(to + i, vcvt_f32_f64(vaddq_f64(vmulq_f64(f, comp_v), vmulq_f64(card, sum_v))));
+      vst1_f32(to_norecom + i, vcvt_f32_f64(vmulq_f64(f_norecom, comp_v)));
+    }
+
+    scalar_transpose(from + i, to + i, from_norecom + i, to_norecom + i, cardinalities + i, n - i, complement, scaled_sum);
+  }
+#endif // MINIMAC4_NEON_KERNELS
+
+  const hmm_kernels::table scalar_table = {"scalar", scalar_condition, scalar_sum, scalar_transpose};
+#ifdef MINIMAC4_X86_KERNELS
+  const hmm_kernels::table avx2_table = {"avx2", avx2_condition, avx2_sum, avx2_transpose};
+  const hmm_kernels::table avx512_table = {"avx512", avx512_condition, avx512_sum, avx512_transpose};
+#endif
+#ifdef MINIMAC4_NEON_KERNELS
+  const hmm_kernels::table neon_table = {"neon", neon_condition, neon_sum, neon_transpose};
+#endif
+
+  const hmm_kernels::table& select_kernels()
+  {
+    std::vector<const hmm_kernels::table*> candidates = hmm_kernels::supported();
+    const char* forced = std::getenv("MINIMAC4_SIMD");
+    if (forced && *forced)
+    {
+      const hmm_kernels::table* t = hmm_kernels::find(forced);
+      if (t)
+        return *t;
+      std::cerr << "Warning: MINIMAC4_SIMD=" << forced << " is not supported on this CPU and will be ignored\n";
+    }
+    return *candidates.back();
+  }
+}
+
+const hmm_kernels::table& hmm_kernels::scalar()
+{
+  return scalar_table;
+}
+
+std::vector<const hmm_kernels::table*> hmm_kernels::supported()
+{
+  std::vector<const table*> ret = {&scalar_table};
+#ifdef MINIMAC4_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    ret.push_back(&avx2_table);
+  if (__builtin_cpu_supports("avx512f"))
+    ret.push_back(&avx512_table);
+#endif
+#ifdef MINIMAC4_NEON_KERNELS
+  ret.push_back(&neon_table);
+#endif
+  return ret;
+}
+
+const hmm_kernels::table* hmm_kernels::find(const std::string& name)
+{
+  for (const table* t : supported())
+  {
+    if (name == t->name)
+      return t;
+  }
+  return nullptr;
+}
+
+const hmm_kernels::table& hmm_kernels::active()
+{
+  static const table& selected = select_kernels();
+  return selected;
+}
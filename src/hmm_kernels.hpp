@@ -0,0 +1,68 @@
+#ifndef MINIMAC4_HMM_KERNELS_HPP
+#define MINIMAC4_HMM_KERNELS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Inner loops of the HMM dispatched to the widest instruction set available at runtime.
+ *
+ * The kernels operate on the per-unique-haplotype probability rows used by
+ * `hidden_markov_model`. `condition` returns the sum of the conditioned row so
+ * that the reduction needed by the following `transpose` is fused into the
+ * same pass over memory.
+ *
+ * Vector kernels are compiled with per-function target attributes, so a single
+ * binary runs on any CPU of the architecture. The implementation is selected
+ * once by CPU detection and can be forced with the `MINIMAC4_SIMD` environment
+ * variable (scalar, avx2, avx512 or neon).
+ *
+ * @note The transpose update is computed in double precision in every kernel and
+ * is bit-identical to the scalar reference. Vector reductions accumulate in
+ * double precision but in a different order, so their sums may differ from the
+ * scalar reference in the last bits.
+ */
+class hmm_kernels
+{
+public:
+  /**
+   * @brief Table of kernel implementations for one instruction set.
+   */
+  struct table
+  {
+    /** Name of the instruction set (e.g., "scalar", "avx2"). */
+    const char* name;
+
+    /**
+     * @brief Multiplies each probability by `pmatch` if the template allele matches `observed`, or by `prandom` otherwise.
+     * @return Sum of the conditioned `probs`.
+     */
+    double (*condition)(float* probs, float* probs_norecom, const std::int8_t* template_haps, std::size_t n, std::int8_t observed, float pmatch, float prandom);
+
+    /** @return Sum of `n` probabilities. */
+    double (*sum)(const float* probs, std::size_t n);
+
+    /**
+     * @brief Computes `to = from * complement + cardinalities * scaled_sum` and `to_norecom = from_norecom * complement`.
+     *
+     * `to` may alias `from` and `to_norecom` may alias `from_norecom`.
+     */
+    void (*transpose)(const float* from, float* to, const float* from_norecom, float* to_norecom, const std::size_t* cardinalities, std::size_t n, double complement, double scaled_sum);
+  };
+
+  /** @return Kernels selected for this process. */
+  static const table& active();
+
+  /** @return Scalar reference kernels. */
+  static const table& scalar();
+
+  /** @return All kernels supported by the running CPU, starting with the scalar reference. */
+  static std::vector<const table*> supported();
+
+  /** @return Supported kernels named `name`, or nullptr if the instruction set is unknown or unsupported. */
+  static const table* find(const std::string& name);
+};
+
+#endif // MINIMAC4_HMM_KERNELS_HPP
@@ -1,44 +1,287 @@
 #include "imputation.hpp"
 
-bool imputation::impute_chunk(const savvy::region& impute_region, const prog_args& args, omp::internal::thread_pool2& tpool, dosage_writer& output)
+bool imputation::load_chunk(const prog_args& args, chunk_data& chunk, reference_block_cache& block_cache, std::unique_ptr<genetic_map_file>& map_file, resident_reference_cache* resident_cache)
 {
-    savvy::region extended_region =
+    const savvy::region& impute_region = chunk.impute_region;
+    const savvy::region& extended_region = chunk.extended_region;
+    chunk.extended_region =
         {
         impute_region.chromosome(),
         std::uint64_t(std::max(std::int64_t(1), std::int64_t(impute_region.from()) - args.overlap())),
         impute_region.to() + args.overlap()
         };
 
-    std::cerr << "Imputing " << impute_region.chromosome() << ":" << impute_region.from() << "-" << impute_region.to() << " ..." << std::endl;
-
-    std::cerr << "Loading target haplotypes ..." << std::endl;
-    std::time_t start_time = std::time(nullptr);
-    std::vector<std::string> sample_ids;
-    std::vector<target_variant> target_sites;
-    if (!load_target_haplotypes(args.tar_path(), extended_region, target_sites, sample_ids))
+    std::cerr << "Loading target haplotypes for " << impute_region.chromosome() << ":" << impute_region.from() << "-" << impute_region.to() << " ..." << std::endl;
+    stopwatch timer;
+    if (!load_target_haplotypes(args.tar_path(), extended_region, chunk.target_sites, chunk.sample_ids, !args.stream_targets(), args.sample_shard(), args.sample_shard_count()))
         return std::cerr << "Error: failed loading target haplotypes\n", false;
-    std::cerr << "Loading target haplotypes took " << record_input_time(std::difftime(std::time(nullptr), start_time)) << " seconds" << std::endl;
+    double elapsed = timer.restart();
+    chunk.metrics.seconds[imputation_metrics::target_load] += elapsed;
+    std::cerr << "Loading target haplotypes took " << elapsed << " seconds" << std::endl;
 
-    std::cerr << "Loading reference haplotypes ..." << std::endl;
-    start_time = std::time(nullptr);
-    reduced_haplotypes typed_only_reference_data(16, 512);
-    reduced_haplotypes full_reference_data;
-    std::unique_ptr<genetic_map_file> mf(args.map_path().empty() ? nullptr : new genetic_map_file(args.map_path(), impute_region.chromosome()));
-    if (!load_reference_haplotypes(args.ref_path(), extended_region, impute_region, args.sample_ids(), target_sites, typed_only_reference_data, full_reference_data, mf.get(), args.min_recom(), args.error_param()))
-        return std::cerr << "Error: failed loading reference haplotypes\n", false;
-    std::cerr << "Loading reference haplotypes took " << record_input_time(std::difftime(std::time(nullptr), start_time)) << " seconds" << std::endl;
+    std::cerr << "Loading reference haplotypes for " << impute_region.chromosome() << ":" << impute_region.from() << "-" << impute_region.to() << " ..." << std::endl;
+    timer.restart();
+    if (args.map_path().size() && (!map_file || map_file->chromosome() != impute_region.chromosome()))
+    {
+        map_file.reset(new genetic_map_file(args.map_path(), impute_region.chromosome()));
+        if (!map_file->good())
+            return std::cerr << "Error: could not load genetic map\n", false;
+    }
+    std::uint64_t typed_key = 0;
+    std::string typed_cache_path;
+    bool typed_saved = false;
+    bool typed_cached = false;
+    std::vector<std::size_t> target_order;
+    if (args.typed_cache_dir().size())
+    {
+        typed_key = typed_reference_cache::key(args.ref_path(), args.map_path(), extended_region, args.sample_ids(), args.min_recom(), args.error_param(), chunk.target_sites);
+        typed_cache_path = typed_reference_cache::path(args.typed_cache_dir(), typed_key);
+        typed_saved = access(typed_cache_path.c_str(), R_OK) == 0;
+    }
 
+    // A saved typed-only file is loaded after the full data, so its blocks can be checked against the panel's haplotype count.
+    auto load_typed_cache = [&]()
+    {
+        const reduced_haplotypes& full = chunk.full_reference();
+        std::size_t n_haplotypes = full.blocks().empty() ? 0 : full.blocks().front().expanded_haplotype_size();
+        typed_cached = typed_reference_cache::load(typed_cache_path, typed_key, n_haplotypes, chunk.target_sites, chunk.typed_only_reference_data);
+        if (typed_cached)
+            std::cerr << "Loaded typed-site reference data from " << typed_cache_path << std::endl;
+    };
+
+    const genetic_map_file* chunk_map = args.map_path().empty() ? nullptr : map_file.get();
+    if (resident_cache)
+    {
+        // The full data and allele bit rows are shared by every job, so only the typed-only data is built per target file.
+        chunk.resident = resident_cache->get(args, extended_region, impute_region, chunk_map);
+        if (!chunk.resident)
+            return std::cerr << "Error: failed loading reference haplotypes\n", false;
+        if (typed_saved)
+            load_typed_cache();
+        if (!typed_cached && !load_reference_haplotypes(chunk.resident->blocks, chunk.resident->sliced, extended_region, impute_region, chunk.target_sites, chunk.typed_only_reference_data, nullptr, chunk_map, args.min_recom(), args.error_param(),
+            true, typed_cache_path.empty() ? nullptr : &target_order))
+            return std::cerr << "Error: failed loading reference haplotypes\n", false;
+    }
+    else
+    {
+        reference_index ref_index;
+        reference_cache ref_cache;
+        if (!ref_cache.open(args.ref_path()))
+            ref_index.load(args.ref_path(), impute_region.chromosome());
 
-    std::vector<target_variant> target_only_sites = separate_target_only_variants(target_sites);
+        if (!load_reference_haplotypes(args.ref_path(), extended_region, impute_region, args.sample_ids(), chunk.target_sites, chunk.typed_only_reference_data, chunk.full_reference_data, chunk_map, &ref_index, &block_cache, &ref_cache, args.min_recom(), args.error_param(),
+            !typed_saved, typed_cache_path.empty() || typed_saved ? nullptr : &target_order))
+            return std::cerr << "Error: failed loading reference haplotypes\n", false;
 
-    double impute_time = 0.;
-    double temp_write_time = 0.;
+        if (typed_saved)
+        {
+            load_typed_cache();
+            // Align the target sites again so the ignored file is replaced, keeping the full data and block cache of the first read.
+            reduced_haplotypes realigned_full_data;
+            if (!typed_cached && !load_reference_haplotypes(args.ref_path(), extended_region, impute_region, args.sample_ids(), chunk.target_sites, chunk.typed_only_reference_data, realigned_full_data, chunk_map, &ref_index, nullptr, &ref_cache, args.min_recom(), args.error_param(),
+                true, &target_order))
+                return std::cerr << "Error: failed loading reference haplotypes\n", false;
+        }
+    }
+
+    // The order is left empty when the reference has no records in the region.
+    if (typed_cache_path.size() && !typed_cached && target_order.size() == chunk.target_sites.size()
+        && !typed_reference_cache::save(typed_cache_path, typed_key, target_order, chunk.target_sites, chunk.typed_only_reference_data))
+        std::cerr << "Warning: could not write " << typed_cache_path << std::endl;
+    elapsed = timer.restart();
+    chunk.metrics.seconds[imputation_metrics::reference_load] += elapsed;
+    std::cerr << "Loading reference haplotypes took " << elapsed << " seconds" << std::endl;
+
+    timer.restart();
+    chunk.typed_only_reference_data.build_reverse_maps();
+    if (!resident_cache)
+        chunk.full_reference_data.build_haplotype_bits();
+    chunk.metrics.seconds[imputation_metrics::reverse_maps] += timer.elapsed();
+
+    return true;
+}
+
+bool imputation::impute_chunk(const savvy::region& impute_region, const prog_args& args, omp::internal::thread_pool2& tpool, dosage_writer& output, std::size_t temp_buffer)
+{
+    chunk_data chunk(impute_region);
+    chunk.temp_buffer = temp_buffer;
+    bool loaded = load_chunk(args, chunk, ref_block_cache_, map_file_, resident_cache_);
+    record_input_time(chunk.input_time());
+    return loaded && impute_loaded_chunk(chunk, args, tpool, output);
+}
+
+bool imputation::impute_chunks(const std::vector<savvy::region>& impute_regions, const prog_args& args, omp::internal::thread_pool2& tpool, dosage_writer& output)
+{
+    if (args.parallel_chunks() > 1 && impute_regions.size() > 1)
+        return impute_chunks_parallel(impute_regions, args, tpool, output);
+
+    if (args.prefetch_chunks() == 0)
+    {
+        for (std::size_t i = 0; i < impute_regions.size(); ++i)
+        {
+            if (!impute_chunk(impute_regions[i], args, tpool, output, i < chunk_temp_buffers_.size() ? chunk_temp_buffers_[i] : 0))
+                return false;
+        }
+        return true;
+    }
+
+    // Loads run in the background one after another, each waiting for the previous one, so the
+    // input files are only read by one loader at a time and the reference block cache is passed
+    // from chunk to chunk in order.
+    std::deque<std::unique_ptr<chunk_data>> chunks;
+    std::deque<std::shared_future<bool>> loads;
+    std::size_t next_idx = 0;
+    for (std::size_t i = 0; i < impute_regions.size(); ++i)
+    {
+        for ( ; next_idx < impute_regions.size() && next_idx <= i + args.prefetch_chunks(); ++next_idx)
+        {
+            chunks.emplace_back(new chunk_data(impute_regions[next_idx]));
+            chunk_data* chunk = chunks.back().get();
+            chunk->temp_buffer = next_idx < chunk_temp_buffers_.size() ? chunk_temp_buffers_[next_idx] : 0;
+            std::shared_future<bool> prev_load = loads.empty() ? std::shared_future<bool>() : loads.back();
+            reference_block_cache* block_cache = &ref_block_cache_;
+            std::unique_ptr<genetic_map_file>* map_file = &map_file_;
+            resident_reference_cache* resident_cache = resident_cache_;
+            loads.emplace_back(std::async(std::launch::async, [&args, chunk, block_cache, map_file, resident_cache, prev_load]()
+            {
+                if (prev_load.valid() && !prev_load.get())
+                    return false;
+                return load_chunk(args, *chunk, *block_cache, *map_file, resident_cache);
+            }).share());
+        }
+
+        bool loaded = loads.front().get();
+        loads.pop_front();
+        std::unique_ptr<chunk_data> chunk = std::move(chunks.front());
+        chunks.pop_front();
+
+        record_input_time(chunk->input_time());
+        if (!loaded || !impute_loaded_chunk(*chunk, args, tpool, output))
+            return false;
+    }
+
+    return true;
+}
+
+std::size_t imputation::chunk_pool_threads(const prog_args& args, std::size_t n_chunks)
+{
+    std::size_t threads = std::max(1, int(args.threads()));
+    if (args.parallel_chunks() > 1 && n_chunks > 1)
+        return std::max(std::size_t(1), threads / std::min(args.parallel_chunks(), n_chunks));
+    return threads;
+}
+
+bool imputation::impute_chunks_parallel(const std::vector<savvy::region>& impute_regions, const prog_args& args, omp::internal::thread_pool2& tpool, dosage_writer& output)
+{
+    std::size_t n_slots = std::min(args.parallel_chunks(), impute_regions.size());
+    std::size_t slot_threads = chunk_pool_threads(args, impute_regions.size());
+    std::cerr << "Imputing " << n_slots << " chunks at a time with " << slot_threads << " threads each" << std::endl;
+
+    std::vector<std::unique_ptr<omp::internal::thread_pool2>> owned_pools;
+    std::vector<omp::internal::thread_pool2*> pools;
+    std::vector<hmm_workspace> slot_workspaces(n_slots);
+    for (std::size_t s = 0; s < n_slots; ++s)
+    {
+        if (s == 0 && tpool.thread_count() == slot_threads)
+        {
+            pools.push_back(&tpool);
+            continue;
+        }
+        owned_pools.emplace_back(new omp::internal::thread_pool2(slot_threads));
+        pools.push_back(owned_pools.back().get());
+    }
 
-    std::list<savvy::reader> temp_files;
-    std::list<savvy::reader> temp_emp_files;
+    // Chunk j runs in slot j % n_slots. Chunks in flight form a reorder buffer that is
+    // written from the front, so a slot is reused only after its previous chunk is written.
+    std::deque<std::unique_ptr<chunk_data>> chunks;
+    std::deque<std::future<bool>> runs;
+    std::shared_future<bool> prev_load;
+    std::size_t next_idx = 0;
+    for (std::size_t i = 0; i < impute_regions.size(); ++i)
+    {
+        for ( ; next_idx < impute_regions.size() && next_idx < i + n_slots; ++next_idx)
+        {
+            chunks.emplace_back(new chunk_data(impute_regions[next_idx]));
+            chunk_data* chunk = chunks.back().get();
+            chunk->temp_buffer = next_idx < chunk_temp_buffers_.size() ? chunk_temp_buffers_[next_idx] : 0;
+            reference_block_cache* block_cache = &ref_block_cache_;
+            std::unique_ptr<genetic_map_file>* map_file = &map_file_;
+            resident_reference_cache* resident_cache = resident_cache_;
+            std::shared_future<bool> load = std::async(std::launch::async, [&args, chunk, block_cache, map_file, resident_cache, prev_load]() -> bool
+            {
+                if (prev_load.valid() && !prev_load.get())
+                    return false;
+                return load_chunk(args, *chunk, *block_cache, *map_file, resident_cache);
+            }).share();
+            prev_load = load;
+
+            omp::internal::thread_pool2* slot_pool = pools[next_idx % n_slots];
+            hmm_workspace* workspace = &slot_workspaces[next_idx % n_slots];
+            runs.emplace_back(std::async(std::launch::async, [&args, chunk, load, slot_pool, workspace]()
+            {
+                return load.get() && run_chunk_hmm(*chunk, args, *slot_pool, *workspace);
+            }));
+        }
+
+        bool imputed = runs.front().get();
+        runs.pop_front();
+        std::unique_ptr<chunk_data> chunk = std::move(chunks.front());
+        chunks.pop_front();
+
+        record_input_time(chunk->input_time());
+        if (!imputed || !write_chunk_output(*chunk, slot_workspaces[i % n_slots].hmm_results, slot_threads, output))
+            return false;
+    }
+
+    return true;
+}
+
+bool imputation::impute_loaded_chunk(chunk_data& chunk, const prog_args& args, omp::internal::thread_pool2& tpool, dosage_writer& output)
+{
+    return run_chunk_hmm(chunk, args, tpool, workspace_) && write_chunk_output(chunk, workspace_.hmm_results, std::max(1, int(args.threads())), output);
+}
+
+void hmm_workspace::prepare(const prog_args& args, std::size_t n_threads)
+{
+    if (hmms.size() != n_threads)
+    {
+        hmms.clear();
+        // The models have const members, so they are emplaced rather than assigned.
+        hmms.reserve(n_threads);
+        for (std::size_t t = 0; t < n_threads; ++t)
+            hmms.emplace_back(args.prob_threshold(), args.prob_threshold_s1(), args.diff_threshold(), 1e-5f, args.decay(), args.forward_checkpoints(), args.forward_precision(), args.leave_one_out(), args.max_templates());
+    }
+
+    for (auto it = hmms.begin(); it != hmms.end(); ++it)
+        it->reset_counters();
+}
+
+bool imputation::run_chunk_hmm(chunk_data& chunk, const prog_args& args, omp::internal::thread_pool2& tpool, hmm_workspace& workspace)
+{
+    const savvy::region& impute_region = chunk.impute_region;
+    std::vector<std::string>& sample_ids = chunk.sample_ids;
+    std::vector<target_variant>& target_sites = chunk.target_sites;
+    reduced_haplotypes& typed_only_reference_data = chunk.typed_only_reference_data;
+    const reduced_haplotypes& full_reference_data = chunk.full_reference();
+    imputation_metrics::chunk_record& metrics = chunk.metrics;
+    stopwatch timer;
+
+    std::cerr << "Imputing " << impute_region.chromosome() << ":" << impute_region.from() << "-" << impute_region.to() << " ..." << std::endl;
+
+    std::vector<target_variant>& target_only_sites = chunk.target_only_sites;
+    target_only_sites = separate_target_only_variants(target_sites);
+
+    double& impute_time = chunk.impute_time;
+    double& temp_write_time = chunk.temp_write_time;
+
+    std::list<savvy::reader>& temp_files = chunk.temp_files;
+    std::list<savvy::reader>& temp_emp_files = chunk.temp_emp_files;
     //    std::list<std::string> temp_files;
     //    std::list<std::string> temp_emp_files;
-    full_dosages_results hmm_results;
+    workspace.hmm_results.set_layout(args.tile_dosages() ? full_dosages_results::layout::haplotype_tiled : full_dosages_results::layout::variant_major);
+    workspace.hmm_results.clear();
+    workspace.hmm_results_back.set_layout(args.tile_dosages() ? full_dosages_results::layout::haplotype_tiled : full_dosages_results::layout::variant_major);
+    workspace.hmm_results_back.clear();
 
     if (full_reference_data.variant_size() == 0)
     {
@@ -55,6 +298,7 @@ bool imputation::impute_chunk(const savvy::region& impute_region, const prog_arg
             std::cerr << "Warning: skipping chunk " << impute_region.chromosome() << ":" << impute_region.from() << "-" << impute_region.to() << std::endl;
         if (args.fail_min_ratio())
             return false;
+        chunk.skipped = true;
         return true; // skip
         }
 
@@ -80,50 +324,86 @@ bool imputation::impute_chunk(const savvy::region& impute_region, const prog_arg
     //        return std::cerr << "Error: parsing map file failed\n", false;
     //      std::cerr << "Loading switch probabilities took " << record_input_time(std::difftime(std::time(nullptr), start_time)) << " seconds" << std::endl;
 
-        auto reverse_maps = generate_reverse_maps(typed_only_reference_data);
-
-        std::cerr << "Running HMM with " << args.threads() << " threads ..." << std::endl;
-        start_time = std::time(nullptr);
-        std::vector<hidden_markov_model> hmms(tpool.thread_count(), {args.prob_threshold(), args.prob_threshold_s1(), args.diff_threshold(), 1e-5f, args.decay()});
-
-        std::size_t ploidy = target_sites[0].gt.size() / sample_ids.size();
-        std::size_t haplotype_buffer_size = args.temp_buffer() * ploidy;
-        assert(ploidy && target_sites[0].gt.size() % sample_ids.size() == 0);
-
-        hmm_results.resize(full_reference_data.variant_size(), target_sites.size(), std::min(haplotype_buffer_size, target_sites[0].gt.size()));
+        std::cerr << "Running HMM with " << tpool.thread_count() << " threads ..." << std::endl;
+        // Forward and backward seconds are accumulated per thread and summed after the parallel loops.
+        std::vector<double> forward_seconds(tpool.thread_count()), backward_seconds(tpool.thread_count());
+        workspace.prepare(args, tpool.thread_count());
+        std::vector<hidden_markov_model>& hmms = workspace.hmms;
+
+        // With --stream-targets, only the sites were loaded. Genotypes are read one sample group at a time,
+        // so gt holds the haplotypes of the current group and is indexed relative to its first haplotype.
+        std::size_t temp_buffer = chunk.temp_buffer ? chunk.temp_buffer : args.temp_buffer();
+        std::size_t n_group_samples = sample_ids.size();
+        if (args.stream_targets())
+        {
+            n_group_samples = std::min(temp_buffer, sample_ids.size());
+            timer.restart();
+            if (!load_target_genotypes(args.tar_path(), chunk.extended_region, {sample_ids.begin(), sample_ids.begin() + n_group_samples}, target_sites, target_only_sites))
+                return std::cerr << "Error: failed loading target genotypes\n", false;
+            metrics.seconds[imputation_metrics::target_load] += timer.elapsed();
+        }
 
-        for (std::size_t i = 0; i < target_sites[0].gt.size(); i += haplotype_buffer_size)
+        std::size_t ploidy = target_sites[0].gt.size() / n_group_samples;
+        std::size_t haplotype_buffer_size = temp_buffer * ploidy;
+        std::size_t n_haplotypes = ploidy * sample_ids.size();
+        assert(ploidy && target_sites[0].gt.size() % n_group_samples == 0);
+
+        // Without --no-er2, typed sites also get a leave-one-out dosage row, which only ER2 and --empirical-output use.
+        std::size_t n_loo_rows = args.leave_one_out() ? target_sites.size() : 0;
+        std::uint64_t loo_bytes = std::uint64_t(target_sites.size()) * std::min(haplotype_buffer_size, n_haplotypes) * sizeof(float) * (n_haplotypes > haplotype_buffer_size ? 2 : 1);
+        (args.leave_one_out() ? metrics.loo_dosage_bytes : metrics.skipped_loo_bytes) = loo_bytes;
+        workspace.hmm_results.resize(full_reference_data.variant_size(), n_loo_rows, std::min(haplotype_buffer_size, n_haplotypes));
+
+        // Temp files are written on a background thread while the next group runs through the HMM,
+        // so consecutive groups alternate between the two dosage buffers of the workspace.
+        std::future<bool> pending_write;
+        for (std::size_t i = 0; i < n_haplotypes; i += haplotype_buffer_size)
         {
-        std::size_t group_size = std::min(target_sites[0].gt.size() - i, haplotype_buffer_size);
-        if (group_size < haplotype_buffer_size)
+        std::size_t group_size = std::min(n_haplotypes - i, haplotype_buffer_size);
+        std::size_t gt_offset = args.stream_targets() ? i : 0;
+        full_dosages_results& hmm_results = (i / haplotype_buffer_size) % 2 ? workspace.hmm_results_back : workspace.hmm_results;
+        if (args.stream_targets() && i > 0)
         {
-            for (std::size_t j = 0; j < hmm_results.dosages_.size(); ++j)
-            hmm_results.dosages_[j].resize(group_size);
-            for (std::size_t j = 0; j < hmm_results.loo_dosages_.size(); ++j)
-            hmm_results.loo_dosages_[j].resize(group_size);
+            timer.restart();
+            if (!load_target_genotypes(args.tar_path(), chunk.extended_region, {sample_ids.begin() + i / ploidy, sample_ids.begin() + (i + group_size) / ploidy}, target_sites, target_only_sites))
+                return std::cerr << "Error: failed loading target genotypes\n", false;
+            if (target_sites[0].gt.size() != group_size)
+                return std::cerr << "Error: maximum ploidy differs between sample groups, which is not supported with --stream-targets\n", false;
+            metrics.seconds[imputation_metrics::target_load] += timer.elapsed();
         }
 
-        if (i > 0)
+        if (group_size < haplotype_buffer_size || i == haplotype_buffer_size)
+            hmm_results.resize(full_reference_data.variant_size(), n_loo_rows, group_size);
+        else if (i > 0)
             hmm_results.fill_eov();
 
-        start_time = std::time(nullptr);
+        timer.restart();
+        // With --tile-dosages, each iteration imputes one whole tile of haplotypes. Groups start
+        // at column 0, so tiles are aligned and threads never write to the same cache line.
+        std::size_t hap_step = args.tile_dosages() ? full_dosages_results::tile_width : 1;
+        std::size_t n_steps = (group_size + hap_step - 1) / hap_step;
         omp::parallel_for_exp(
-            omp::static_schedule(), omp::sequence_iterator(i), omp::sequence_iterator(i + group_size), [&](int& i, const omp::iteration_context& ctx)
+            omp::static_schedule(), omp::sequence_iterator(0), omp::sequence_iterator(n_steps), [&](int& step, const omp::iteration_context& ctx)
+            {
+            std::size_t step_end = std::min(i + group_size, i + (step + 1) * hap_step);
+            for (std::size_t h = i + step * hap_step; h < step_end; ++h)
             {
-            if (savvy::typed_value::is_end_of_vector(target_sites[0].gt[i]))
-                return; // Sample has fewer haplotypes
-            hmms[ctx.thread_index].traverse_forward(typed_only_reference_data.blocks(), target_sites, i);
-            hmms[ctx.thread_index].traverse_backward(typed_only_reference_data.blocks(), target_sites, i, i % haplotype_buffer_size, reverse_maps, hmm_results, full_reference_data);
+                if (savvy::typed_value::is_end_of_vector(target_sites[0].gt[h - gt_offset]))
+                    continue; // Sample has fewer haplotypes
+                stopwatch hmm_timer;
+                hmms[ctx.thread_index].traverse_forward(typed_only_reference_data.blocks(), target_sites, h - gt_offset);
+                forward_seconds[ctx.thread_index] += hmm_timer.restart();
+                hmms[ctx.thread_index].traverse_backward(typed_only_reference_data.blocks(), target_sites, h - gt_offset, h % haplotype_buffer_size, hmm_results, full_reference_data);
+                backward_seconds[ctx.thread_index] += hmm_timer.elapsed();
+            }
             },
             tpool);
-        impute_time += std::difftime(std::time(nullptr), start_time);
-
-        start_time = std::time(nullptr);
+        impute_time += timer.restart();
 
         int tmp_fd = -1;
         int tmp_emp_fd = -1;
 
-        if (target_sites[0].gt.size() > haplotype_buffer_size)
+        if (n_haplotypes > haplotype_buffer_size)
         {
             std::string out_emp_path;
             std::string out_path = args.temp_prefix() + std::to_string(i / haplotype_buffer_size) + "_XXXXXX";
@@ -139,14 +419,14 @@ bool imputation::impute_chunk(const savvy::region& impute_region, const prog_arg
                 return std::cerr << "Error: could not open temp file (" << out_emp_path << ")" << std::endl, false;
             }
 
-            dosage_writer temp_output(out_path, out_emp_path,
+            std::shared_ptr<dosage_writer> temp_output(new dosage_writer(out_path, out_emp_path,
             "", // sites path
             savvy::file::format::sav,
             std::min<std::uint8_t>(3, args.out_compression()),
             {sample_ids.begin() + (i / ploidy), sample_ids.begin() + (i + group_size) / ploidy},
             {"HDS"},
             impute_region.chromosome(),
-            -1.f, true);
+            -1.f, true));
 
             temp_files.emplace_back(out_path);
             ::close(tmp_fd);
@@ -161,27 +441,88 @@ bool imputation::impute_chunk(const savvy::region& impute_region, const prog_arg
             assert(tmp_emp_fd > 0);
             }
 
-            if (!temp_output.write_dosages(hmm_results, target_sites, target_only_sites, {i, i + group_size}, full_reference_data, impute_region))
+            // The previous group was written from the buffer that the next group will fill.
+            timer.restart();
+            if (pending_write.valid() && !pending_write.get())
             return std::cerr << "Error: failed writing output\n", false;
-            temp_write_time += std::difftime(std::time(nullptr), start_time);
+            metrics.seconds[imputation_metrics::temp_write_wait] += timer.elapsed();
 
-            std::cerr << "Completed " << (i + group_size) / ploidy << " of " << sample_ids.size() << " samples" << std::endl;
+            // With --stream-targets, the genotypes of the next group replace these before the write is done.
+            std::shared_ptr<std::vector<target_variant>> sites_copy, target_only_copy;
+            if (args.stream_targets())
+            {
+            sites_copy.reset(new std::vector<target_variant>(target_sites));
+            target_only_copy.reset(new std::vector<target_variant>(target_only_sites));
+            }
+            const std::vector<target_variant>* write_sites = sites_copy ? sites_copy.get() : &target_sites;
+            const std::vector<target_variant>* write_target_only = target_only_copy ? target_only_copy.get() : &target_only_sites;
+            const full_dosages_results* write_results = &hmm_results;
+            std::pair<std::size_t, std::size_t> observed_range(i - gt_offset, i - gt_offset + group_size);
+            // The pool runs the next group while this one is written, so the write gets one thread unless it is the last group.
+            std::size_t n_completed = (i + group_size) / ploidy, n_samples = sample_ids.size(), n_threads = i + group_size < n_haplotypes ? 1 : tpool.thread_count();
+            pending_write = std::async(std::launch::async, [=, &full_reference_data, &impute_region, &temp_write_time]()
+            {
+            stopwatch write_timer;
+            if (!temp_output->write_dosages(*write_results, *write_sites, *write_target_only, observed_range, full_reference_data, impute_region, n_threads))
+                return false;
+            temp_write_time += write_timer.elapsed();
+            std::cerr << "Completed " << n_completed << " of " << n_samples << " samples" << std::endl;
+            return true;
+            });
+            ++metrics.temp_files;
         }
         }
 
-        std::cerr << "Running HMM took " << record_impute_time(impute_time) << " seconds" << std::endl;
+        timer.restart();
+        if (pending_write.valid() && !pending_write.get())
+            return std::cerr << "Error: failed writing output\n", false;
+        metrics.seconds[imputation_metrics::temp_write_wait] += timer.elapsed();
+
+        std::cerr << "Running HMM took " << impute_time << " seconds" << std::endl;
+
+        metrics.seconds[imputation_metrics::forward] += std::accumulate(forward_seconds.begin(), forward_seconds.end(), 0.);
+        metrics.seconds[imputation_metrics::backward] += std::accumulate(backward_seconds.begin(), backward_seconds.end(), 0.);
+        metrics.seconds[imputation_metrics::temp_write] += temp_write_time;
+        metrics.target_haplotypes = n_haplotypes;
+        metrics.typed_variants = typed_only_reference_data.variant_size();
+        metrics.reference_variants = full_reference_data.variant_size();
+        for (auto it = hmms.begin(); it != hmms.end(); ++it)
+            metrics.hmm += it->counters();
+    }
+
+    return true;
+}
+
+bool imputation::write_chunk_output(chunk_data& chunk, const full_dosages_results& hmm_results, std::size_t threads, dosage_writer& output)
+{
+    const savvy::region& impute_region = chunk.impute_region;
+    std::vector<target_variant>& target_sites = chunk.target_sites;
+    std::vector<target_variant>& target_only_sites = chunk.target_only_sites;
+    const reduced_haplotypes& full_reference_data = chunk.full_reference();
+    std::list<savvy::reader>& temp_files = chunk.temp_files;
+    std::list<savvy::reader>& temp_emp_files = chunk.temp_emp_files;
+    imputation_metrics::chunk_record& metrics = chunk.metrics;
+    stopwatch timer;
+
+    record_impute_time(chunk.impute_time);
+    if (chunk.skipped)
+    {
+        metrics_.add_chunk(metrics);
+        return true;
     }
 
     if (temp_files.size())
     {
-        std::cerr << "Writing temp files took " << record_output_time(temp_write_time) << " seconds" << std::endl;
+        std::cerr << "Writing temp files took " << record_output_time(chunk.temp_write_time) << " seconds" << std::endl;
 
         std::cerr << "Merging temp files ... " << std::endl;
-        start_time = std::time(nullptr);
+        timer.restart();
         //dosage_writer output(args.out_path(), args.emp_out_path(), args.sites_out_path(), args.out_format(), args.out_compression(), sample_ids, args.fmt_fields(), target_sites.front().chrom, false);
-        if (!output.merge_temp_files(temp_files, temp_emp_files))
+        if (!output.merge_temp_files(temp_files, temp_emp_files, threads))
         return std::cerr << "Error: failed merging temp files\n", false;
-        std::cerr << "Merging temp files took " << record_output_time(std::difftime(std::time(nullptr), start_time)) << " seconds" << std::endl;
+        double elapsed = timer.elapsed();
+        metrics.seconds[imputation_metrics::merge] += elapsed;
+        std::cerr << "Merging temp files took " << record_output_time(elapsed) << " seconds" << std::endl;
     }
     else
     {
@@ -194,13 +535,17 @@ bool imputation::impute_chunk(const savvy::region& impute_region, const prog_arg
         if (n_tar_haps)
         {
         std::cerr << "Writing output ... " << std::endl;
-        start_time = std::time(nullptr);
-        if (!output.write_dosages(hmm_results, target_sites, target_only_sites, {0, n_tar_haps}, full_reference_data, impute_region))
+        timer.restart();
+        if (!output.write_dosages(hmm_results, target_sites, target_only_sites, {0, n_tar_haps}, full_reference_data, impute_region, threads))
             return std::cerr << "Error: failed writing output\n", false;
-        std::cerr << "Writing output took " << record_output_time(std::difftime(std::time(nullptr), start_time)) << " seconds" << std::endl;
+        double elapsed = timer.elapsed();
+        metrics.seconds[imputation_metrics::output_write] += elapsed;
+        std::cerr << "Writing output took " << record_output_time(elapsed) << " seconds" << std::endl;
         }
     }
 
+    metrics_.add_chunk(metrics);
+
     std::cerr << std::endl;
 
     return true;
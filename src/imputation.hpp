@@ -12,11 +12,83 @@
 #include "hidden_markov_model.hpp"
 #include "recombination.hpp"
 #include "dosage_writer.hpp"
+#include "metrics.hpp"
+#include "typed_reference_cache.hpp"
+#include "resident_reference_cache.hpp"
 
 #include <savvy/reader.hpp>
 #include <savvy/writer.hpp>
 #include <omp.hpp>
 
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+
+/**
+ * @brief Inputs of one chunk, loaded by `imputation::load_chunk`, and the HMM outputs that are pending until it is written.
+ *
+ * Keeping the loaded inputs separate from the imputation step lets the next
+ * chunk be loaded on a background thread while the current one is imputed.
+ * Keeping the HMM outputs with the chunk lets several chunks be imputed at
+ * once while their output is still written in order.
+ */
+struct chunk_data
+{
+    savvy::region impute_region;                    ///< Region to impute.
+    savvy::region extended_region;                  ///< Impute region plus the overlap on each side.
+    std::vector<std::string> sample_ids;            ///< Target sample IDs.
+    std::vector<target_variant> target_sites;       ///< Target haplotypes of the extended region (one sample group at a time with --stream-targets).
+    reduced_haplotypes typed_only_reference_data;   ///< Reference haplotypes at typed sites.
+    reduced_haplotypes full_reference_data;         ///< Reference haplotypes of the impute region, unless taken from the resident cache.
+    std::shared_ptr<const resident_reference_cache::chunk_entry> resident; ///< Resident cache entry of the chunk with --serve (null otherwise).
+    imputation_metrics::chunk_record metrics;       ///< Load timers, completed by the imputation step.
+    std::vector<target_variant> target_only_sites;  ///< Variants exclusive to the target file, set by the HMM step.
+    std::list<savvy::reader> temp_files;            ///< Temp files of the sample groups, merged when the chunk is written.
+    std::list<savvy::reader> temp_emp_files;        ///< Empirical dosage temp files of the sample groups.
+    double impute_time = 0.;                        ///< Wall seconds of the HMM step.
+    double temp_write_time = 0.;                    ///< Wall seconds spent writing temp files.
+    std::size_t temp_buffer = 0;                    ///< Samples per HMM group planned by --max-memory (0 uses --temp-buffer).
+    bool skipped = false;                           ///< Set if the chunk was skipped because of --min-ratio.
+
+    chunk_data(const savvy::region& reg) :
+        impute_region(reg),
+        extended_region(reg),
+        typed_only_reference_data(16, 512)
+    {
+        metrics.chrom = reg.chromosome();
+        metrics.from = reg.from();
+        metrics.to = reg.to();
+    }
+
+    /** @return Reference haplotypes of the impute region, shared with the resident cache if it holds the chunk. */
+    const reduced_haplotypes& full_reference() const { return resident ? resident->full_reference_data : full_reference_data; }
+
+    /** @return Seconds spent loading. */
+    double input_time() const { return metrics.seconds[imputation_metrics::target_load] + metrics.seconds[imputation_metrics::reference_load]; }
+};
+
+/**
+ * @brief HMMs and dosage matrices reused by every chunk imputed with one thread pool.
+ *
+ * Each model keeps its forward, backward and scratch rows between haplotypes
+ * and chunks, so after the first few haplotypes the HMM loops run without
+ * allocating. Rows are first written by the pool thread that owns the model,
+ * so under first-touch page placement they are local to that thread's node.
+ */
+struct hmm_workspace
+{
+    std::vector<hidden_markov_model> hmms; ///< One model per pool thread.
+    full_dosages_results hmm_results;      ///< Only reallocated when a chunk is larger than all previous ones.
+    full_dosages_results hmm_results_back; ///< Filled by every other sample group while the previous one is written to a temp file.
+
+    /**
+     * @brief Creates the models on first use and zeroes their counters.
+     * @param n_threads Number of threads of the pool using this workspace.
+     */
+    void prepare(const prog_args& args, std::size_t n_threads);
+};
+
 /**
  * @class imputation
  * @brief Class responsible for managing genotype imputation statistics and timing.
@@ -35,17 +107,47 @@ class imputation
         /**
      * @brief Accumulated total time spent loading input (in seconds).
      */
-    long total_input_time_ = 0;
+    double total_input_time_ = 0.;
 
     /**
      * @brief Accumulated total time spent writing output (in seconds).
      */
-    long total_output_time_ = 0;
+    double total_output_time_ = 0.;
 
     /**
      * @brief Accumulated total time spent on imputation (in seconds).
      */
-    long total_impute_time_ = 0;
+    double total_impute_time_ = 0.;
+
+    /**
+     * @brief Reference blocks shared between the overlaps of consecutive chunks.
+     */
+    reference_block_cache ref_block_cache_;
+
+    /**
+     * @brief Genetic map of the chromosome being imputed, kept between chunks.
+     */
+    std::unique_ptr<genetic_map_file> map_file_;
+
+    /**
+     * @brief Stage timers and counters of the imputed chunks.
+     */
+    imputation_metrics metrics_;
+
+    /**
+     * @brief Models and dosage matrices reused by every chunk imputed sequentially.
+     */
+    hmm_workspace workspace_;
+
+    /**
+     * @brief Samples per HMM group of each chunk passed to `impute_chunks()`, if planned by --max-memory.
+     */
+    std::vector<std::size_t> chunk_temp_buffers_;
+
+    /**
+     * @brief Reference chunks kept between jobs by --serve (null otherwise).
+     */
+    resident_reference_cache* resident_cache_ = nullptr;
     private:
         /**
          * @brief Record elapsed input time and update cumulative total.
@@ -72,19 +174,42 @@ class imputation
          * @brief Get the total accumulated input time.
          * @return Total input time in seconds.
          */
-        long total_input_time() const  { return total_input_time_; }
+        long total_input_time() const  { return long(total_input_time_); }
 
         /**
          * @brief Get the total accumulated output time.
          * @return Total output time in seconds.
          */
-        long total_output_time() const  { return total_output_time_; }
+        long total_output_time() const  { return long(total_output_time_); }
 
         /**
          * @brief Get the total accumulated imputation time.
          * @return Total imputation time in seconds.
          */
-        long total_impute_time() const  { return total_impute_time_; }
+        long total_impute_time() const  { return long(total_impute_time_); }
+
+        /**
+         * @brief Get the stage timers and counters of the imputed chunks.
+         * @return Metrics with one record per imputed chunk.
+         */
+        const imputation_metrics& metrics() const { return metrics_; }
+
+        /**
+         * @brief Set the number of samples per HMM group of each chunk.
+         *
+         * Element i applies to region i of the next call to `impute_chunks()`.
+         * Chunks without an element, or with 0, use `args.temp_buffer()`.
+         */
+        void set_chunk_temp_buffers(std::vector<std::size_t> temp_buffers) { chunk_temp_buffers_ = std::move(temp_buffers); }
+
+        /**
+         * @brief Set the cache from which chunks take their reference data (`--serve`).
+         *
+         * Only the typed-only data is then built by each chunk, from the cached
+         * blocks, and the reference file is read only for chunks missing from
+         * the cache. Pass null to read the reference for every chunk.
+         */
+        void set_resident_cache(resident_reference_cache* cache) { resident_cache_ = cache; }
 
         /**
          * @brief Perform genotype imputation for a given genomic region.
@@ -108,6 +233,7 @@ class imputation
          * @param args           Program arguments controlling paths, thresholds, buffers, and options.
          * @param tpool          Thread pool for parallel HMM traversal.
          * @param output         Dosage writer for writing final imputation results.
+         * @param temp_buffer    Samples per HMM group (0 uses `args.temp_buffer()`).
          *
          * @return True if the imputation completed successfully (even if the chunk was skipped),
          *         false if an error occurred (e.g., file loading/writing failed).
@@ -119,5 +245,98 @@ class imputation
          *  - Target-only variants can be optionally included in the output (`--all-typed-sites`).
          *  - Temporary files are created and merged automatically when processing in buffered groups.
          */
-        bool impute_chunk(const savvy::region& impute_region, const prog_args& args, omp::internal::thread_pool2& tpool, dosage_writer& output);
+        bool impute_chunk(const savvy::region& impute_region, const prog_args& args, omp::internal::thread_pool2& tpool, dosage_writer& output, std::size_t temp_buffer = 0);
+
+        /**
+         * @brief Impute a sequence of chunks, loading up to `args.prefetch_chunks()` of them ahead.
+         *
+         * Loading of the upcoming chunks runs on a background thread while the
+         * HMM and output of the current chunk run on @p tpool, so the pool is not
+         * idle while inputs are read. Chunks are still imputed and written in order.
+         * With a prefetch count of 0, this is the same as calling `impute_chunk()`
+         * for each region.
+         *
+         * @param impute_regions Regions to impute, in output order.
+         * @param args           Program arguments.
+         * @param tpool          Thread pool for parallel HMM traversal.
+         * @param output         Dosage writer for writing final imputation results.
+         *
+         * @return False if loading or imputing any chunk failed.
+         *
+         * @note At most `args.prefetch_chunks() + 1` chunks are held in memory at once.
+         * @note With `args.parallel_chunks()` greater than 1, chunks are imputed
+         *       concurrently by `impute_chunks_parallel()` instead and
+         *       `args.prefetch_chunks()` is not used.
+         */
+        bool impute_chunks(const std::vector<savvy::region>& impute_regions, const prog_args& args, omp::internal::thread_pool2& tpool, dosage_writer& output);
+
+        /**
+         * @brief Number of threads of the pool to pass to `impute_chunks()`.
+         *
+         * With `args.parallel_chunks()` greater than 1 and more than one chunk, this is
+         * the share of `args.threads()` of each concurrent chunk, so the pool is reused
+         * as the pool of the first slot. Otherwise it is `args.threads()`.
+         *
+         * @param args     Program arguments.
+         * @param n_chunks Number of regions that will be passed to `impute_chunks()`.
+         */
+        static std::size_t chunk_pool_threads(const prog_args& args, std::size_t n_chunks);
+
+    private:
+        /**
+         * @brief Load target and reference haplotypes of a chunk.
+         *
+         * Does not modify the timing totals, so it may run on another thread
+         * than the one imputing.
+         *
+         * @param args        Program arguments.
+         * @param chunk       Chunk whose `impute_region` is set. Filled with the loaded inputs.
+         * @param block_cache Reference blocks kept from the previously loaded chunk. Calls
+         *                    sharing a cache must not run concurrently.
+         * @param map_file    Genetic map of the previously loaded chunk. Replaced when the
+         *                    chromosome changes, so each chromosome of `--map` is read once.
+         * @param resident_cache Optional cache of reference chunks kept between jobs, used
+         *                    instead of @p block_cache. Calls sharing it must not run concurrently.
+         * @return False if loading failed.
+         */
+        static bool load_chunk(const prog_args& args, chunk_data& chunk, reference_block_cache& block_cache, std::unique_ptr<genetic_map_file>& map_file, resident_reference_cache* resident_cache);
+
+        /**
+         * @brief Run the HMM on a loaded chunk and write its dosages.
+         * @return False if an error occurred.
+         */
+        bool impute_loaded_chunk(chunk_data& chunk, const prog_args& args, omp::internal::thread_pool2& tpool, dosage_writer& output);
+
+        /**
+         * @brief Run the HMM on a loaded chunk.
+         *
+         * Dosages are left in the results of @p workspace, or in the temp files of the chunk when
+         * the samples do not fit in one `--temp-buffer` group. Does not modify the
+         * timing totals or metrics, so chunks using different pools and workspaces may
+         * run concurrently.
+         *
+         * @return False if an error occurred.
+         */
+        static bool run_chunk_hmm(chunk_data& chunk, const prog_args& args, omp::internal::thread_pool2& tpool, hmm_workspace& workspace);
+
+        /**
+         * @brief Write the dosages of a chunk imputed by `run_chunk_hmm()` and record its timers and metrics.
+         * @param threads Number of threads used to build output records.
+         * @return False if an error occurred.
+         */
+        bool write_chunk_output(chunk_data& chunk, const full_dosages_results& hmm_results, std::size_t threads, dosage_writer& output);
+
+        /**
+         * @brief Impute chunks `args.parallel_chunks()` at a time.
+         *
+         * The thread budget is split evenly between the concurrent chunks, each
+         * with its own thread pool and dosage matrices. @p tpool is used by the
+         * first slot if it has `chunk_pool_threads()` threads. Loads run one after
+         * another on background threads, as with prefetching. Chunks whose HMM
+         * finishes early wait until the chunks before them are written, so the
+         * output is still in region order.
+         *
+         * @return False if loading or imputing any chunk failed.
+         */
+        bool impute_chunks_parallel(const std::vector<savvy::region>& impute_regions, const prog_args& args, omp::internal::thread_pool2& tpool, dosage_writer& output);
 };
\ No newline at end of file
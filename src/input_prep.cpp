@@ -2,6 +2,10 @@
 #include "recombination.hpp"
 
 #include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <future>
+#include <memory>
 #include <sys/stat.h>
 
 bool stat_tar_panel(const std::string& tar_file_path, std::vector<std::string>& sample_ids)
@@ -17,6 +21,28 @@ bool stat_tar_panel(const std::string& tar_file_path, std::vector<std::string>&
 
 bool stat_ref_panel(const std::string& ref_file_path, std::string& chrom, std::uint64_t& end_pos)
 {
+  reference_index ref_index;
+  if (ref_index.load(ref_file_path))
+  {
+    if (chrom.empty())
+    {
+      std::vector<std::string> chromosomes = ref_index.chromosomes();
+      if (chromosomes.size() > 1)
+        return std::cerr << "Error: reference file contains multiple chromosomes so --region is required\n", false;
+      if (chromosomes.size() == 1)
+        chrom = chromosomes.front();
+    }
+
+    std::uint64_t chrom_end = 0;
+    if (ref_index.chromosome_end(chrom, chrom_end))
+    {
+      end_pos = std::min(end_pos, chrom_end);
+      return true;
+    }
+
+    return std::cerr << "Error: reference file does not contain chromosome " << chrom << "\n", false;
+  }
+
   std::string separate_s1r_path = ref_file_path + ".s1r";
   struct stat st;
   std::vector<savvy::s1r::index_statistics> s1r_stats = savvy::s1r::stat_index(stat(separate_s1r_path.c_str(), &st) == 0 ? separate_s1r_path : ref_file_path);
@@ -114,13 +140,73 @@ std::int64_t check_ploidies(const std::vector<std::uint8_t>& ploidies, const std
   return -1;
 }
 
-bool load_target_haplotypes(const std::string& file_path, const savvy::genomic_region& reg, std::vector<target_variant>& target_sites, std::vector<std::string>& sample_ids)
+namespace
+{
+  bool update_target_ploidies(std::vector<std::uint8_t>& ploidies, const std::vector<std::int8_t>& gt_vec, const std::vector<std::string>& sample_ids, const savvy::variant& var)
+  {
+    std::int64_t ploidy_res = -1;
+    if (ploidies[0] == 0)
+      init_ploidies(ploidies, gt_vec);
+    else
+      ploidy_res = check_ploidies(ploidies, gt_vec);
+
+    if (ploidy_res >= 0)
+    {
+      std::cerr << "Error: Sample " << sample_ids[ploidy_res] << " changes ploidy at " << var.chrom() << ":" << var.pos() << "\n";
+      if (var.chrom() == "X" || var.chrom() == "chrX")
+        std::cerr << "Notice: PAR and non-PAR regions on chromosome X should be imputed separately\n";
+      return false;
+    }
+    return true;
+  }
+
+  void assign_allele_genotypes(packed_genotypes& dest, const std::vector<std::int8_t>& gt_vec, std::size_t allele_idx, std::size_t n_alts, std::vector<std::int8_t>& allele_geno)
+  {
+    if (n_alts == 1)
+    {
+      dest.assign(gt_vec.data(), gt_vec.size());
+    }
+    else
+    {
+      allele_geno.resize(gt_vec.size());
+      for (std::size_t j = 0; j < gt_vec.size(); ++j)
+        allele_geno[j] = std::int8_t(gt_vec[j] == allele_idx);
+      dest.assign(allele_geno.data(), allele_geno.size());
+    }
+  }
+
+  bool target_site_less(const target_variant* a, const target_variant* b)
+  {
+    if (a->pos != b->pos)
+      return a->pos < b->pos;
+    if (a->ref != b->ref)
+      return a->ref < b->ref;
+    return a->alt < b->alt;
+  }
+}
+
+std::vector<std::string> sample_shard_ids(const std::vector<std::string>& sample_ids, std::size_t shard, std::size_t n_shards)
+{
+  assert(shard < n_shards);
+  std::size_t beg = sample_ids.size() * shard / n_shards;
+  std::size_t end = sample_ids.size() * (shard + 1) / n_shards;
+  return std::vector<std::string>(sample_ids.begin() + beg, sample_ids.begin() + end);
+}
+
+bool load_target_haplotypes(const std::string& file_path, const savvy::genomic_region& reg, std::vector<target_variant>& target_sites, std::vector<std::string>& sample_ids, bool load_genotypes, std::size_t sample_shard, std::size_t n_sample_shards)
 {
   savvy::reader input(file_path);
   if (!input)
     return std::cerr << "Error: cannot open target file\n", false;
 
   sample_ids = input.samples();
+  if (n_sample_shards > 1)
+    sample_ids = sample_shard_ids(sample_ids, sample_shard, n_sample_shards);
+
+  if (!load_genotypes)
+    input.subset_samples({});
+  else if (n_sample_shards > 1 && input.subset_samples({sample_ids.begin(), sample_ids.end()}) != sample_ids)
+    return std::cerr << "Error: target samples could not be subset (sample IDs must be unique)\n", false;
   input.reset_bounds(reg);
   if (!input)
     return std::cerr << "Error: cannot query region (" << reg.chromosome() << ":" << reg.from() << "-" << reg.to() << ") from target file. Target file must be indexed.\n", false;
@@ -128,78 +214,116 @@ bool load_target_haplotypes(const std::string& file_path, const savvy::genomic_r
   const auto nan = std::numeric_limits<float>::quiet_NaN();
   std::vector<std::uint8_t> ploidies(sample_ids.size());
   savvy::variant var;
-  std::vector<std::int8_t> tmp_geno;
+  std::vector<std::int8_t> tmp_geno, allele_geno;
   while (input >> var)
   {
-    var.get_format("GT", tmp_geno);
-
-    std::int64_t ploidy_res = -1;
-    if (ploidies[0] == 0)
-      init_ploidies(ploidies, tmp_geno);
-    else
-      ploidy_res = check_ploidies(ploidies, tmp_geno);
-
-    if (ploidy_res >= 0)
+    if (load_genotypes)
     {
-      std::cerr << "Error: Sample " << sample_ids[ploidy_res] << " changes ploidy at " << var.chrom() << ":" << var.pos() << "\n";
-      if (var.chrom() == "X" || var.chrom() == "chrX")
-        std::cerr << "Notice: PAR and non-PAR regions on chromosome X should be imputed separately\n";
-      return false;
+      var.get_format("GT", tmp_geno);
+      if (!update_target_ploidies(ploidies, tmp_geno, sample_ids, var))
+        return false;
     }
 
     for (std::size_t i = 0; i < var.alts().size(); ++i)
     {
-      std::size_t allele_idx = i + 1;
       target_sites.push_back({var.chromosome(), var.position(), var.id(), var.ref(), var.alts()[i], true, false, nan, nan, nan, {}});
-      if (var.alts().size() == 1)
-        tmp_geno.swap(target_sites.back().gt);
-      else
-      {
-        target_sites.back().gt.resize(tmp_geno.size());
-        std::int8_t* dest_ptr = target_sites.back().gt.data();
-        for (std::size_t j = 0; j < tmp_geno.size(); ++j)
-          dest_ptr[j] = std::int8_t(tmp_geno[j] == allele_idx);
-      }
+      if (load_genotypes)
+        assign_allele_genotypes(target_sites.back().gt, tmp_geno, i + 1, var.alts().size(), allele_geno);
     }
   }
 
   return !input.bad();
 }
 
-bool load_reference_haplotypes(const std::string& file_path,
-  const savvy::genomic_region& extended_reg,
-  const savvy::genomic_region& impute_reg,
-  const std::unordered_set<std::string>& subset_ids,
-  std::vector<target_variant>& target_sites,
-  reduced_haplotypes& typed_only_reference_data,
-  reduced_haplotypes& full_reference_data,
-  genetic_map_file* map_file,
-  float min_recom,
-  float default_match_error)
+bool load_target_genotypes(const std::string& file_path, const savvy::genomic_region& reg, const std::vector<std::string>& group_sample_ids, std::vector<target_variant>& target_sites, std::vector<target_variant>& target_only_sites)
 {
   savvy::reader input(file_path);
+  if (!input)
+    return std::cerr << "Error: cannot open target file\n", false;
 
-  if (input)
+  if (input.subset_samples({group_sample_ids.begin(), group_sample_ids.end()}) != group_sample_ids)
+    return std::cerr << "Error: target samples could not be subset (sample IDs must be unique)\n", false;
+  input.reset_bounds(reg);
+  if (!input)
+    return std::cerr << "Error: cannot query region (" << reg.chromosome() << ":" << reg.from() << "-" << reg.to() << ") from target file. Target file must be indexed.\n", false;
+
+  std::vector<target_variant*> sites;
+  sites.reserve(target_sites.size() + target_only_sites.size());
+  for (auto it = target_sites.begin(); it != target_sites.end(); ++it)
+    sites.push_back(&*it);
+  for (auto it = target_only_sites.begin(); it != target_only_sites.end(); ++it)
+    sites.push_back(&*it);
+  for (auto it = sites.begin(); it != sites.end(); ++it)
+    (*it)->gt = packed_genotypes();
+  std::sort(sites.begin(), sites.end(), target_site_less);
+
+  std::vector<std::uint8_t> ploidies(group_sample_ids.size());
+  savvy::variant var;
+  target_variant key;
+  std::vector<std::int8_t> tmp_geno, allele_geno;
+  std::size_t n_filled = 0;
+  while (input >> var)
   {
-    if (!input.reset_bounds(extended_reg, savvy::bounding_point::any))
-      return std::cerr << "Error: reference file must be indexed MVCF\n", false;
+    var.get_format("GT", tmp_geno);
+    if (!update_target_ploidies(ploidies, tmp_geno, group_sample_ids, var))
+      return false;
 
-    bool is_m3vcf_v3 = false;
-    for (auto it = input.headers().begin(); !is_m3vcf_v3 && it != input.headers().end(); ++it)
+    key.pos = var.position();
+    key.ref = var.ref();
+    for (std::size_t i = 0; i < var.alts().size(); ++i)
     {
-      if (it->first == "subfileformat" && (it->second == "M3VCFv3.0" || it->second == "MVCFv3.0"))
-        is_m3vcf_v3 = true;
+      // Sites dropped by reference alignment are absent, and duplicate records fill duplicate sites in turn.
+      key.alt = var.alts()[i];
+      auto it = std::lower_bound(sites.begin(), sites.end(), &key, target_site_less);
+      for ( ; it != sites.end() && !target_site_less(&key, *it) && !(*it)->gt.empty(); ++it) {}
+      if (it != sites.end() && !target_site_less(&key, *it))
+      {
+        assign_allele_genotypes((*it)->gt, tmp_geno, i + 1, var.alts().size(), allele_geno);
+        ++n_filled;
+      }
     }
+  }
 
-    if (!is_m3vcf_v3)
-      return std::cerr << "Error: reference file must be an MVCF\n", false;
+  if (input.bad())
+    return std::cerr << "Error: failed reading target file\n", false;
 
-    if (subset_ids.size() && input.subset_samples(subset_ids).empty())
-      return std::cerr << "Error: no reference samples overlap subset IDs\n", false;
+  if (n_filled != sites.size())
+    return std::cerr << "Error: target file changed while imputing (" << sites.size() - n_filled << " sites not found)\n", false;
 
-    savvy::variant var;
-    if (!input.read(var))
-      return std::cerr << "Notice: no variant records in reference query region (" << extended_reg.chromosome() << ":" << extended_reg.from() << "-" << extended_reg.to() << ")\n", input.bad() ? false : true;
+  return true;
+}
+
+namespace
+{
+  /**
+   * Aligns the reference blocks returned by `next_block` with the target sites and
+   * appends them to the typed-only and full reference data. Without
+   * `align_target_sites`, only the full reference data is built, and with a null
+   * `full_reference_data`, only the typed-only data.
+   *
+   * @return Last value returned by `next_block` (negative on error).
+   */
+  template <typename NextBlockFn>
+  int append_reference_blocks(NextBlockFn next_block,
+    bool sliced,
+    reference_block_cache* block_cache,
+    const savvy::genomic_region& extended_reg,
+    const savvy::genomic_region& impute_reg,
+    std::vector<target_variant>& target_sites,
+    reduced_haplotypes& typed_only_reference_data,
+    reduced_haplotypes* full_reference_data,
+    const genetic_map_file* map_file,
+    float min_recom,
+    float default_match_error,
+    bool align_target_sites,
+    std::vector<std::size_t>* target_order)
+  {
+    if (target_order)
+    {
+      target_order->resize(target_sites.size());
+      for (std::size_t i = 0; i < target_order->size(); ++i)
+        (*target_order)[i] = i;
+    }
 
     double no_recom_prob = 1.;
     double prev_cm = 0.;
@@ -208,16 +332,30 @@ bool load_reference_haplotypes(const std::string& file_path,
     unique_haplotype_block block;
     auto tar_it = target_sites.begin();
     auto recom_it = tar_it;
+
     int res;
-    while ((res = block.deserialize(input, var)) > 0)
+    while ((res = next_block(block)) > 0)
     {
       block.remove_eov();
+      if (block_cache && block.end_position() >= block_cache->min_end_pos)
+        block_cache->blocks.push_back(block);
+
+      if (sliced)
+      {
+        // Record slices return whole blocks, so drop the variants that a region query would have skipped.
+        block.remove_non_overlapping(extended_reg.from(), extended_reg.to());
+        if (block.variants().empty())
+          continue;
+      }
+
       if (block.variants().empty() || block.variants().front().pos > extended_reg.to())
         break;
 
-      //block.fill_cm_from_recom(start_cm); // TODO: REMOVE
+      // The positions of a block are interpolated in one batch rather than looked up per variant.
+      if (map_file && align_target_sites)
+        block.fill_cm(*map_file);
 
-      for (auto ref_it = block.variants().begin(); ref_it != block.variants().end(); ++ref_it)
+      for (auto ref_it = block.variants().begin(); align_target_sites && ref_it != block.variants().end(); ++ref_it)
       {
         while (tar_it != target_sites.end() && tar_it->pos < ref_it->pos)
           ++tar_it;
@@ -245,7 +383,11 @@ bool load_reference_haplotypes(const std::string& file_path,
             it->in_ref = true;
 
             if (it != tar_it)
+            {
+              if (target_order)
+                std::swap((*target_order)[it - target_sites.begin()], (*target_order)[tar_it - target_sites.begin()]);
               std::swap(*it, *tar_it);
+            }
 
             no_recom_prob = 1.;
             recom_it = tar_it;
@@ -258,26 +400,145 @@ bool load_reference_haplotypes(const std::string& file_path,
 
         if (map_file)
         {
-          double cm = map_file->interpolate_centimorgan(ref_it->pos);
-          switch_prob = recombination::cm_to_switch_prob(cm - prev_cm);
-          prev_cm = cm;
+          switch_prob = recombination::cm_to_switch_prob(ref_it->cm - prev_cm);
+          prev_cm = ref_it->cm;
         }
 
         if (prev_ref_pos > 0 && ref_it->pos != prev_ref_pos)
           no_recom_prob *= 1. - std::max<double>(switch_prob, min_recom);
-        
+      
         prev_ref_pos = ref_it->pos;
       }
 
+      if (!full_reference_data)
+        continue;
+
       block.trim(impute_reg.from(), impute_reg.to());
       if (!block.variants().empty())
-        full_reference_data.append_block(block);
+        full_reference_data->append_block(block);
     }
 
-    assert(recom_it != target_sites.end());
-    if (recom_it != target_sites.end())
+    assert(!align_target_sites || recom_it != target_sites.end());
+    if (align_target_sites && recom_it != target_sites.end())
       recom_it->recom = 0.f;
 
+    return res;
+  }
+}
+
+bool load_reference_haplotypes(const std::string& file_path,
+  const savvy::genomic_region& extended_reg,
+  const savvy::genomic_region& impute_reg,
+  const std::unordered_set<std::string>& subset_ids,
+  std::vector<target_variant>& target_sites,
+  reduced_haplotypes& typed_only_reference_data,
+  reduced_haplotypes& full_reference_data,
+  const genetic_map_file* map_file,
+  const reference_index* ref_index,
+  reference_block_cache* block_cache,
+  const reference_cache* ref_cache,
+  float min_recom,
+  float default_match_error,
+  bool align_target_sites,
+  std::vector<std::size_t>* target_order)
+{
+  if (ref_cache && ref_cache->is_open() && subset_ids.empty())
+  {
+    if (block_cache)
+      block_cache->clear();
+
+    std::size_t beg_block = 0, end_block = 0;
+    if (!ref_cache->query(extended_reg.chromosome(), extended_reg.from(), extended_reg.to(), beg_block, end_block))
+      return std::cerr << "Notice: no variant records in reference query region (" << extended_reg.chromosome() << ":" << extended_reg.from() << "-" << extended_reg.to() << ")\n", true;
+
+    auto next_block = [&](unique_haplotype_block& block) -> int
+    {
+      if (beg_block == end_block)
+        return 0;
+      return ref_cache->load_block(beg_block++, block) ? 1 : -1;
+    };
+
+    // Cached blocks are whole blocks, so they are trimmed like record slices.
+    return append_reference_blocks(next_block, true, nullptr, extended_reg, impute_reg, target_sites,
+      typed_only_reference_data, &full_reference_data, map_file, min_recom, default_match_error, align_target_sites, target_order) >= 0;
+  }
+
+  savvy::reader input(file_path);
+
+  if (input)
+  {
+    std::uint64_t beg_record = 0, end_record = 0;
+    bool sliced = ref_index && !ref_index->empty();
+    bool read_file = true;
+    std::deque<unique_haplotype_block> cached_blocks;
+    if (sliced)
+    {
+      if (!ref_index->query(extended_reg.chromosome(), extended_reg.from(), extended_reg.to(), beg_record, end_record))
+        return std::cerr << "Notice: no variant records in reference query region (" << extended_reg.chromosome() << ":" << extended_reg.from() << "-" << extended_reg.to() << ")\n", true;
+
+      if (block_cache && block_cache->chrom == extended_reg.chromosome() && block_cache->min_end_pos <= extended_reg.from())
+      {
+        // Overlapping blocks that precede the cached end_record are already in memory.
+        cached_blocks.swap(block_cache->blocks);
+        beg_record = std::max(beg_record, block_cache->end_record);
+      }
+
+      read_file = beg_record < end_record;
+      if (read_file && !input.reset_bounds(savvy::slice_bounds(beg_record, end_record)))
+        return std::cerr << "Error: reference file must be indexed MVCF\n", false;
+    }
+    else if (!input.reset_bounds(extended_reg, savvy::bounding_point::any))
+      return std::cerr << "Error: reference file must be indexed MVCF\n", false;
+
+    if (block_cache)
+      block_cache->clear();
+    if (!sliced)
+      block_cache = nullptr;
+
+    if (block_cache)
+    {
+      // Keep what the next chunk needs, assuming it uses the same overlap.
+      std::uint64_t right_overlap = extended_reg.to() - impute_reg.to();
+      block_cache->chrom = extended_reg.chromosome();
+      block_cache->min_end_pos = impute_reg.to() + 1 > right_overlap ? impute_reg.to() + 1 - right_overlap : 1;
+      block_cache->end_record = beg_record;
+    }
+
+    bool is_m3vcf_v3 = false;
+    for (auto it = input.headers().begin(); !is_m3vcf_v3 && it != input.headers().end(); ++it)
+    {
+      if (it->first == "subfileformat" && (it->second == "M3VCFv3.0" || it->second == "MVCFv3.0"))
+        is_m3vcf_v3 = true;
+    }
+
+    if (!is_m3vcf_v3)
+      return std::cerr << "Error: reference file must be an MVCF\n", false;
+
+    if (subset_ids.size() && input.subset_samples(subset_ids).empty())
+      return std::cerr << "Error: no reference samples overlap subset IDs\n", false;
+
+    savvy::variant var;
+    bool has_records = read_file && input.read(var);
+    if (!has_records && cached_blocks.empty())
+      return std::cerr << "Notice: no variant records in reference query region (" << extended_reg.chromosome() << ":" << extended_reg.from() << "-" << extended_reg.to() << ")\n", input.bad() ? false : true;
+
+    // Blocks kept from the previous chunk come first, followed by the blocks read from the file.
+    auto cache_it = cached_blocks.begin();
+    auto next_block = [&](unique_haplotype_block& block) -> int
+    {
+      if (cache_it != cached_blocks.end())
+        return block = std::move(*(cache_it++)), 1;
+      if (!has_records)
+        return 0;
+      int ret = block.deserialize(input, var);
+      if (ret > 0 && block_cache)
+        block_cache->end_record += ret;
+      return ret;
+    };
+
+    int res = append_reference_blocks(next_block, sliced, block_cache, extended_reg, impute_reg, target_sites,
+      typed_only_reference_data, &full_reference_data, map_file, min_recom, default_match_error, align_target_sites, target_order);
+
     if (res < 0)
       return false;
 
@@ -288,6 +549,108 @@ bool load_reference_haplotypes(const std::string& file_path,
   return false;
 }
 
+bool read_reference_blocks(const std::string& file_path,
+  const savvy::genomic_region& extended_reg,
+  const std::unordered_set<std::string>& subset_ids,
+  const reference_index* ref_index,
+  const reference_cache* ref_cache,
+  std::deque<unique_haplotype_block>& blocks,
+  bool& sliced)
+{
+  blocks.clear();
+  sliced = true;
+  if (ref_cache && ref_cache->is_open() && subset_ids.empty())
+  {
+    std::size_t beg_block = 0, end_block = 0;
+    if (!ref_cache->query(extended_reg.chromosome(), extended_reg.from(), extended_reg.to(), beg_block, end_block))
+      return std::cerr << "Notice: no variant records in reference query region (" << extended_reg.chromosome() << ":" << extended_reg.from() << "-" << extended_reg.to() << ")\n", true;
+
+    for ( ; beg_block < end_block; ++beg_block)
+    {
+      blocks.emplace_back();
+      if (!ref_cache->load_block(beg_block, blocks.back()))
+        return false;
+      blocks.back().remove_eov();
+    }
+    return true;
+  }
+
+  savvy::reader input(file_path);
+  if (!input)
+    return std::cerr << "Error: failed to open MVCF file" << std::endl, false;
+
+  sliced = ref_index && !ref_index->empty();
+  if (sliced)
+  {
+    std::uint64_t beg_record = 0, end_record = 0;
+    if (!ref_index->query(extended_reg.chromosome(), extended_reg.from(), extended_reg.to(), beg_record, end_record))
+      return std::cerr << "Notice: no variant records in reference query region (" << extended_reg.chromosome() << ":" << extended_reg.from() << "-" << extended_reg.to() << ")\n", true;
+    if (!input.reset_bounds(savvy::slice_bounds(beg_record, end_record)))
+      return std::cerr << "Error: reference file must be indexed MVCF\n", false;
+  }
+  else if (!input.reset_bounds(extended_reg, savvy::bounding_point::any))
+    return std::cerr << "Error: reference file must be indexed MVCF\n", false;
+
+  bool is_m3vcf_v3 = false;
+  for (auto it = input.headers().begin(); !is_m3vcf_v3 && it != input.headers().end(); ++it)
+  {
+    if (it->first == "subfileformat" && (it->second == "M3VCFv3.0" || it->second == "MVCFv3.0"))
+      is_m3vcf_v3 = true;
+  }
+
+  if (!is_m3vcf_v3)
+    return std::cerr << "Error: reference file must be an MVCF\n", false;
+
+  if (subset_ids.size() && input.subset_samples(subset_ids).empty())
+    return std::cerr << "Error: no reference samples overlap subset IDs\n", false;
+
+  savvy::variant var;
+  if (!input.read(var))
+    return std::cerr << "Notice: no variant records in reference query region (" << extended_reg.chromosome() << ":" << extended_reg.from() << "-" << extended_reg.to() << ")\n", input.bad() ? false : true;
+
+  unique_haplotype_block block;
+  int res;
+  while ((res = block.deserialize(input, var)) > 0)
+  {
+    block.remove_eov();
+    // A region query may return a block starting past the region, which ends the load as in load_reference_haplotypes().
+    if (!sliced && (block.variants().empty() || block.variants().front().pos > extended_reg.to()))
+      break;
+    blocks.emplace_back(std::move(block));
+  }
+
+  return res >= 0 && !input.bad();
+}
+
+bool load_reference_haplotypes(const std::deque<unique_haplotype_block>& blocks,
+  bool sliced,
+  const savvy::genomic_region& extended_reg,
+  const savvy::genomic_region& impute_reg,
+  std::vector<target_variant>& target_sites,
+  reduced_haplotypes& typed_only_reference_data,
+  reduced_haplotypes* full_reference_data,
+  const genetic_map_file* map_file,
+  float min_recom,
+  float default_match_error,
+  bool align_target_sites,
+  std::vector<std::size_t>* target_order)
+{
+  if (blocks.empty())
+    return true;
+
+  auto it = blocks.begin();
+  auto next_block = [&](unique_haplotype_block& block) -> int
+  {
+    if (it == blocks.end())
+      return 0;
+    block = *(it++);
+    return 1;
+  };
+
+  return append_reference_blocks(next_block, sliced, nullptr, extended_reg, impute_reg, target_sites,
+    typed_only_reference_data, full_reference_data, map_file, min_recom, default_match_error, align_target_sites, target_order) >= 0;
+}
+
 // Old approach to setting recombination probs.
 // saving this to compare with new appraoch.
 bool load_reference_haplotypes_old_recom_approach(const std::string& file_path,
@@ -297,7 +660,7 @@ bool load_reference_haplotypes_old_recom_approach(const std::string& file_path,
   std::vector<target_variant>& target_sites,
   reduced_haplotypes& typed_only_reference_data,
   reduced_haplotypes& full_reference_data,
-  genetic_map_file* map_file)
+  const genetic_map_file* map_file)
 {
   savvy::reader input(file_path);
 
@@ -552,31 +915,90 @@ bool load_variant_hmm_params(std::vector<target_variant>& tar_variants, reduced_
   return true;
 }
 
-std::vector<std::vector<std::vector<std::size_t>>> generate_reverse_maps(const reduced_haplotypes& typed_only_reference_data)
+namespace
 {
-  std::vector<std::vector<std::vector<std::size_t>>> reverse_maps;
-
-  reverse_maps.reserve(typed_only_reference_data.blocks().size());
-  for (auto it = typed_only_reference_data.blocks().begin(); it != typed_only_reference_data.blocks().end(); ++it)
+  /**
+   * Splits the blocks of an m3vcf stream out of large reads, so that the text
+   * of each block can be parsed independently. Only the header line of a
+   * block is inspected (for `VARIANTS`), and the following lines are skipped
+   * with `memchr` over the buffer.
+   */
+  class m3vcf_block_reader
   {
-    reverse_maps.emplace_back();
-    auto& map = reverse_maps.back();
-    for (std::size_t i = 0; i < it->cardinalities().size(); ++i)
+  private:
+    std::istream& is_;
+    std::vector<char> buf_;
+    std::size_t beg_ = 0;
+    std::size_t end_ = 0;
+    bool eof_ = false;
+
+    // Moves the unread bytes to the front and appends the next read. Returns the shift of offsets.
+    std::size_t fill()
     {
-      map.emplace_back();
-      map.back().reserve(it->cardinalities()[i]);
+      std::size_t shift = beg_;
+      std::memmove(buf_.data(), buf_.data() + beg_, end_ - beg_);
+      end_ -= beg_;
+      beg_ = 0;
+      if (end_ == buf_.size())
+        buf_.resize(buf_.size() * 2);
+
+      is_.read(buf_.data() + end_, buf_.size() - end_);
+      std::size_t n = is_.gcount();
+      end_ += n;
+      eof_ = n == 0;
+      return shift;
     }
-
-    for (std::size_t i = 0; i < it->unique_map().size(); ++i)
-    { assert(it->unique_map()[i] < map.size());
-      map[it->unique_map()[i]].push_back(i);
+  public:
+    m3vcf_block_reader(std::istream& is, std::size_t buffer_size = std::size_t(16) << 20) :
+      is_(is),
+      buf_(buffer_size)
+    {
     }
-  }
 
-  return reverse_maps;
+    /**
+     * Reads the header line and variant lines of the next block into @p text, without the last newline.
+     * @return 1 if a block was read, 0 at the end of the stream, -1 if the stream ends within a block.
+     */
+    int read(std::string& text)
+    {
+      std::size_t scan = beg_;
+      std::size_t lines_left = 1;
+      bool header = true;
+      while (lines_left)
+      {
+        const char* nl = static_cast<const char*>(std::memchr(buf_.data() + scan, '\n', end_ - scan));
+        std::size_t line_end = nl ? nl - buf_.data() : end_;
+        if (!nl)
+        {
+          if (!eof_)
+          {
+            scan -= fill();
+            continue;
+          }
+
+          if (scan == end_) // no partial last line
+            return header && scan == beg_ ? 0 : -1;
+        }
+
+        if (header)
+        {
+          lines_left += unique_haplotype_block::m3vcf_variant_count(buf_.data() + scan, buf_.data() + line_end);
+          header = false;
+        }
+
+        --lines_left;
+        scan = nl ? line_end + 1 : line_end;
+      }
+
+      std::size_t text_end = scan > beg_ && buf_[scan - 1] == '\n' ? scan - 1 : scan;
+      text.assign(buf_.data() + beg_, buf_.data() + text_end);
+      beg_ = scan;
+      return 1;
+    }
+  };
 }
 
-bool convert_old_m3vcf(const std::string& input_path, const std::string& output_path, const std::string& map_file_path)
+bool convert_old_m3vcf(const std::string& input_path, const std::string& output_path, const std::string& map_file_path, std::size_t threads)
 {
   std::vector<std::pair<std::string, std::string>> headers;
   std::vector<std::string> ids;
@@ -667,8 +1089,15 @@ bool convert_old_m3vcf(const std::string& input_path, const std::string& output_
   ids.emplace_back(line.substr(last_pos, tab_pos - last_pos));
   std::size_t n_samples = ids.size();
 
+  std::size_t n_haplotypes = m3vcf_version == 1 ? n_samples : 2 * n_samples;
+  m3vcf_block_reader reader(input_file);
+  std::string block_text;
   unique_haplotype_block block;
-  block.deserialize(input_file, m3vcf_version, m3vcf_version == 1 ? n_samples : 2 * n_samples);
+  int res = reader.read(block_text);
+  if (res < 0)
+    return std::cerr << "Error: truncated m3vcf v" << int(m3vcf_version) << " file\n", false;
+  if (res > 0 && !block.deserialize(block_text, m3vcf_version, n_haplotypes))
+    return false;
   if (!contig_header_present && block.variants().size())
     headers.emplace_back("contig","<ID=" + block.variants()[0].chrom + ">");
 
@@ -677,9 +1106,6 @@ bool convert_old_m3vcf(const std::string& input_path, const std::string& output_
     last_3 = output_path.substr(output_path.size() - 3);
   savvy::writer output_file(output_path, last_3 == "bcf" ? savvy::file::format::bcf : savvy::file::format::sav, headers, ids, 6);
 
-
-  std::size_t block_cnt = 0;
-
   std::unique_ptr<genetic_map_file> map_file;
   if (!map_file_path.empty() && !block.variants().empty())
   {
@@ -688,28 +1114,151 @@ bool convert_old_m3vcf(const std::string& input_path, const std::string& output_
       return std::cerr << "Error: could not open map file\n", false;
   }
 
-  std::vector<std::int8_t> tmp_geno;
-  do
+  // Blocks are split off the decompressed stream on this thread, parsed by up to `threads` tasks
+  // and written in file order. With one thread, deferred tasks parse each block when it is written.
+  typedef std::unique_ptr<unique_haplotype_block> parsed_block;
+  auto parse_block = [m3vcf_version, n_haplotypes](std::shared_ptr<std::string> text)
   {
-    if (block.variants().empty())
-      break;
+    parsed_block ret(new unique_haplotype_block());
+    if (!ret->deserialize(*text, m3vcf_version, n_haplotypes))
+      ret.reset();
+    return ret;
+  };
 
+  std::launch policy = threads > 1 ? std::launch::async : std::launch::deferred;
+  std::deque<std::future<parsed_block>> pending;
+  bool more = res > 0;
+  while (!block.variants().empty())
+  {
     if (map_file)
       block.fill_cm(*map_file);
 
     if (!block.serialize(output_file))
       return false;
-    ++block_cnt;
-  } while (block.deserialize(input_file, m3vcf_version, m3vcf_version == 1 ? n_samples : 2 * n_samples));
+
+    for ( ; more && pending.size() < std::max<std::size_t>(1, threads); )
+    {
+      if ((res = reader.read(block_text)) < 0)
+        return std::cerr << "Error: truncated m3vcf v" << int(m3vcf_version) << " file\n", false;
+      more = res > 0;
+      if (more)
+        pending.emplace_back(std::async(policy, parse_block, std::make_shared<std::string>(std::move(block_text))));
+    }
+
+    if (pending.empty())
+      break;
+
+    parsed_block next = pending.front().get();
+    pending.pop_front();
+    if (!next)
+      return false;
+    block = std::move(*next);
+  }
 
   return !input_file.bad() && output_file.good();
 }
 
+/**
+ * @brief Splits a stream of variants into unique haplotype blocks.
+ *
+ * Applies the block boundary heuristic of `compress_reference_panel`. A block
+ * is flushed once it has at least `min_block_size` variants and either its
+ * compression ratio increased over the last `slope_unit` variants or it
+ * reached `max_block_size`. Blocks also end at chromosome boundaries.
+ */
+class reference_block_builder
+{
+private:
+  std::size_t min_block_size_;
+  std::size_t max_block_size_;
+  std::size_t slope_unit_;
+  unique_haplotype_block block_;
+  std::string prev_chrom_;
+  double prev_cr_ = 2.;
+  double cr_sum_ = 0.;
+  double cr_min_ = 2.;
+  double cr_max_ = 0.;
+  std::size_t block_cnt_ = 0;
+
+  static double comp_ratio(const unique_haplotype_block& b)
+  {
+    return double(b.expanded_haplotype_size() + b.unique_haplotype_size() * b.variant_size()) / double(b.expanded_haplotype_size() * b.variant_size());
+  }
+
+  void flush(std::deque<unique_haplotype_block>& out)
+  {
+    out.emplace_back(std::move(block_));
+    block_.clear();
+    ++block_cnt_;
+  }
+
+  void record_cr(double cr)
+  {
+    if (cr < cr_min_) cr_min_ = cr;
+    if (cr > cr_max_) cr_max_ = cr;
+    cr_sum_ += cr;
+  }
+public:
+  reference_block_builder(std::size_t min_block_size, std::size_t max_block_size, std::size_t slope_unit) :
+    min_block_size_(min_block_size),
+    max_block_size_(max_block_size),
+    slope_unit_(slope_unit)
+  {
+  }
+
+  /** @return Sum of compression ratios of the blocks flushed by the heuristic or by `finish()`. */
+  double cr_sum() const { return cr_sum_; }
+  double cr_min() const { return cr_min_; }
+  double cr_max() const { return cr_max_; }
+  std::size_t block_count() const { return block_cnt_; }
+
+  /**
+   * @brief Adds a variant, appending any completed block to @p out.
+   * @return False if the variant could not be compressed.
+   */
+  bool add(const reference_site_info& site, const std::vector<std::int8_t>& gts, std::deque<unique_haplotype_block>& out)
+  {
+    if (site.chrom != prev_chrom_ && block_.variant_size())
+      flush(out);
+    prev_chrom_ = site.chrom;
+
+    if (!block_.compress_variant(site, gts))
+      return false;
+
+    std::size_t cnt = block_.variant_size();
+    double new_cr = comp_ratio(block_);
+    if (cnt >= min_block_size_ && ((cnt % slope_unit_ == 0 && new_cr > prev_cr_) || cnt >= max_block_size_))
+    {
+      flush(out);
+      record_cr(new_cr);
+      prev_cr_ = 2.;
+    }
+    else if (cnt % slope_unit_ == 0)
+    {
+      prev_cr_ = new_cr;
+    }
+
+    return true;
+  }
+
+  /** @brief Flushes the last, possibly short, block. */
+  void finish(std::deque<unique_haplotype_block>& out)
+  {
+    if (block_.variant_size())
+    {
+      record_cr(comp_ratio(block_));
+      flush(out);
+    }
+  }
+};
+
 bool compress_reference_panel(const std::string& input_path, const std::string& output_path,
   std::size_t min_block_size,
   std::size_t max_block_size,
   std::size_t slope_unit,
-  const std::string& map_file_path)
+  const std::string& map_file_path,
+  std::size_t threads,
+  std::size_t segment_size)
 {
   savvy::reader input_file(input_path);
   if (!input_file)
@@ -753,7 +1302,7 @@ bool compress_reference_panel(const std::string& input_path, const std::string&
   std::string last_3;
   if (output_path.size() >= 3)
     last_3 = output_path.substr(output_path.size() - 3);
-  savvy::writer output_file(output_path, last_3 == "bcf" ? savvy::file::format::bcf : savvy::file::format::sav, headers, input_file.samples(), 6);
+  std::unique_ptr<savvy::writer> output_file(new savvy::writer(output_path, last_3 == "bcf" ? savvy::file::format::bcf : savvy::file::format::sav, headers, input_file.samples(), 6));
 
   //if (!input_file.read(var))
   //  return input_file.bad() ? std::cerr << "Error: read failure on first record\n", false : true;
@@ -765,9 +1314,9 @@ bool compress_reference_panel(const std::string& input_path, const std::string&
   //  headers.emplace_back("contig", "<ID=" + var.chrom() + ">");
 
   float flt_nan = std::numeric_limits<float>::quiet_NaN();
-  unique_haplotype_block block;
-  //block.compress_variant(reference_site_info(var.chrom(), var.pos(), var.id(), var.ref(), var.alts().size() ? var.alts()[0] : "", flt_nan, flt_nan, std::numeric_limits<double>::quiet_NaN()), gts);
-  std::size_t variant_cnt = 0;
+  double cr_sum = 0.;
+  double cr_min = 2.;
+  double cr_max = 0.;
   std::size_t block_cnt = 0;
 
   //std::string last_3;
@@ -775,88 +1324,160 @@ bool compress_reference_panel(const std::string& input_path, const std::string&
   //  last_3 = output_path.substr(output_path.size() - 3);
   //savvy::writer output_file(output_path, last_3 == "bcf" ? savvy::file::format::bcf : savvy::file::format::sav, headers, input_file.samples(), 6);
 
-  auto comp_ratio = [](const unique_haplotype_block& b)
-  {
-    return double(b.expanded_haplotype_size() + b.unique_haplotype_size() * b.variant_size()) / double(b.expanded_haplotype_size() * b.variant_size());
-  };
-
   //const std::size_t min_block_size = 400; //10;
   //const std::size_t max_block_size = 400; //0xFFFF; // max s1r block size minus 1 partition record
-  std::string prev_chrom;
   //std::size_t slope_unit = 10;
-  double cr_sum = 0.;
-  double cr_min = 2.;
-  double cr_max = 0.;
-  double prev_cr = 2.;
-  while (input_file >> var)
+  reference_index ref_index;
+  std::unique_ptr<genetic_map_file> map_file;
+  double prev_cm = 0.;
+  auto write_blocks = [&](std::deque<unique_haplotype_block>& blocks)
   {
-    if (var.chrom() != prev_chrom && block.variant_size())
+    for ( ; !blocks.empty(); blocks.pop_front())
     {
-      if (!block.serialize(output_file))
+      unique_haplotype_block& block = blocks.front();
+      if (!map_file_path.empty())
+      {
+        // Blocks are written in file order, so the previous cM carries over between blocks of a chromosome.
+        if (!map_file || map_file->chromosome() != block.variants().front().chrom)
+        {
+          map_file.reset(new genetic_map_file(map_file_path, block.variants().front().chrom));
+          if (!map_file->good())
+            return std::cerr << "Error: could not open map file\n", false;
+          prev_cm = 0.;
+        }
+        block.fill_recom(*map_file, prev_cm);
+      }
+
+      if (!block.serialize(*output_file))
         return std::cerr << "Error: serializing block failed\n", false;
-      block.clear();
-      ++block_cnt;
+      ref_index.push_back(block.variants().front().chrom, block.variants().front().pos, block.end_position(), block.variant_size(), block.unique_haplotype_size());
     }
+    return true;
+  };
 
+  auto add_stats = [&](const reference_block_builder& builder)
+  {
+    cr_sum += builder.cr_sum();
+    cr_min = std::min(cr_min, builder.cr_min());
+    cr_max = std::max(cr_max, builder.cr_max());
+    block_cnt += builder.block_count();
+  };
 
-    if (!var.get_format("GT", gts))
-      return std::cerr << "Error: could not read GT from variant record\n", false;
+  std::deque<unique_haplotype_block> blocks;
+  if (threads <= 1 && segment_size == 0)
+  {
+    reference_block_builder builder(min_block_size, max_block_size, slope_unit);
+    while (input_file >> var)
+    {
+      if (!var.get_format("GT", gts))
+        return std::cerr << "Error: could not read GT from variant record\n", false;
 
-    bool ret = block.compress_variant(
-      reference_site_info(var.chrom(), var.pos(), var.id(), var.ref(), var.alts().size() ? var.alts()[0] : "", flt_nan, flt_nan, std::numeric_limits<double>::quiet_NaN()),
-      gts);
+      if (!builder.add(reference_site_info(var.chrom(), var.pos(), var.id(), var.ref(), var.alts().size() ? var.alts()[0] : "", flt_nan, flt_nan, std::numeric_limits<double>::quiet_NaN()), gts, blocks))
+        return std::cerr << "Error: compressing variant failed\n", false;
 
-    if (!ret)
-      return std::cerr << "Error: compressing variant failed\n", false;
+      if (!write_blocks(blocks))
+        return false;
+    }
 
-    ++variant_cnt;
+    builder.finish(blocks);
+    if (!write_blocks(blocks))
+      return false;
+    add_stats(builder);
+  }
+  else
+  {
+    // Segments of consecutive variants are compressed independently, so a block always ends at a
+    // segment boundary. Segments end at chromosome boundaries, where a block ends anyway, and are
+    // otherwise sized to keep the genotypes buffered per segment around 256 MiB unless segment_size is given.
+    struct segment_result
+    {
+      std::deque<unique_haplotype_block> blocks;
+      std::unique_ptr<reference_block_builder> builder;
+      bool good = true;
+    };
 
-    bool flush_block = false;
-    std::size_t cnt = block.variant_size();
-    double new_cr = comp_ratio(block);
-    if (cnt >= min_block_size)
+    typedef std::vector<std::pair<reference_site_info, std::vector<std::int8_t>>> segment_type;
+    auto compress_segment = [min_block_size, max_block_size, slope_unit](std::shared_ptr<segment_type> segment)
     {
-      if ((cnt % slope_unit == 0 && new_cr > prev_cr) || cnt >= max_block_size)
-        flush_block = true;
-    }
-   
-    if (flush_block)
+      segment_result res;
+      res.builder.reset(new reference_block_builder(min_block_size, max_block_size, slope_unit));
+      for (auto it = segment->begin(); res.good && it != segment->end(); ++it)
+        res.good = res.builder->add(it->first, it->second, res.blocks);
+      res.builder->finish(res.blocks);
+      return res;
+    };
+
+    std::deque<std::future<segment_result>> pending;
+    auto write_front = [&]()
     {
-      if (!block.serialize(output_file))
-        return std::cerr << "Error: serializing block failed\n", false;
-      block.clear();
-      ++block_cnt;
-      if (new_cr < cr_min) cr_min = new_cr;
-      if (new_cr > cr_max) cr_max = new_cr;
-      cr_sum += new_cr;
-      prev_cr=2.;
-    }
-    else if (cnt % slope_unit == 0)
+      segment_result res = pending.front().get();
+      pending.pop_front();
+      if (!res.good)
+        return std::cerr << "Error: compressing variant failed\n", false;
+      add_stats(*res.builder);
+      return write_blocks(res.blocks);
+    };
+
+    threads = std::max<std::size_t>(1, threads);
+    std::shared_ptr<segment_type> segment;
+    bool has_var = bool(input_file >> var);
+    while (has_var)
     {
-      prev_cr = new_cr;
-    }
+      if (!var.get_format("GT", gts))
+        return std::cerr << "Error: could not read GT from variant record\n", false;
 
-    prev_chrom = var.chrom();
-  }
+      if (!segment)
+      {
+        segment = std::make_shared<segment_type>();
+        if (!segment_size)
+          segment_size = std::max<std::size_t>(min_block_size, (std::size_t(256) << 20) / std::max<std::size_t>(1, gts.size()));
+        segment->reserve(segment_size);
+      }
 
-  // CM INFO field would need to be a double in order to have enough precision
-  // if (map_file)
-  //  block.fill_cm(*map_file);
+      segment->emplace_back(reference_site_info(var.chrom(), var.pos(), var.id(), var.ref(), var.alts().size() ? var.alts()[0] : "", flt_nan, flt_nan, std::numeric_limits<double>::quiet_NaN()), gts);
 
-  if (block.variants().size())
-  {
-    double cr = comp_ratio(block);
-    if (cr < cr_min) cr_min = cr;
-    if (cr > cr_max) cr_max = cr;
-    cr_sum += comp_ratio(block);
-    if (!block.serialize(output_file))
-      return std::cerr << "Error: serializing final block failed\n", false;
-    ++block_cnt;
+      std::string chrom = var.chrom();
+      has_var = bool(input_file >> var);
+      if (!has_var || segment->size() >= segment_size || var.chrom() != chrom)
+      {
+        if (pending.size() >= threads && !write_front())
+          return false;
+        pending.emplace_back(std::async(std::launch::async, compress_segment, std::move(segment)));
+        segment.reset();
+      }
+    }
+
+    while (!pending.empty())
+    {
+      if (!write_front())
+        return false;
+    }
   }
 
   std::cerr << "Mean Compression Ratio: " << cr_sum / block_cnt << std::endl;
   std::cerr << "Min Compression Ratio: " << cr_min << std::endl;
   std::cerr << "Max Compression Ratio: " << cr_max << std::endl;
 
-  return !input_file.bad() && output_file.good();
+  if (input_file.bad() || !output_file->good())
+    return false;
+  output_file.reset(); // the index stores the size and modification time of the closed file
+
+  if (output_path.compare(0, 5, "/dev/") != 0 && !ref_index.save(output_path))
+    return false;
+
+  return true;
+}
+
+bool index_reference_panel(const std::string& ref_file_path)
+{
+  reference_index ref_index;
+  if (!ref_index.build(ref_file_path))
+    return false;
+
+  return ref_index.save(ref_file_path);
+}
+
+bool cache_reference_panel(const std::string& ref_file_path)
+{
+  return reference_cache::build(ref_file_path, reference_cache::default_path(ref_file_path));
 }
@@ -2,9 +2,13 @@
 #define MINIMAC4_INPUT_PREP_HPP
 
 #include "unique_haplotype.hpp"
+#include "reference_cache.hpp"
+#include "reference_index.hpp"
 
 #include <savvy/reader.hpp>
 
+#include <deque>
+
 /**
  * @brief Extract sample IDs from a target panel file.
  *
@@ -25,6 +29,20 @@
  */
 bool stat_tar_panel(const std::string& tar_file_path, std::vector<std::string>& sample_ids);
 
+/**
+ * @brief Selects the target samples of one `--sample-shard`.
+ *
+ * Samples are split into `n_shards` contiguous blocks in file order, so
+ * pasting the shard outputs in shard order restores the sample order of the
+ * target file. Shard sizes differ by at most one sample.
+ *
+ * @param sample_ids All target sample IDs, in file order.
+ * @param shard      Zero-based shard index.
+ * @param n_shards   Number of shards.
+ * @return Sample IDs of the shard.
+ */
+std::vector<std::string> sample_shard_ids(const std::vector<std::string>& sample_ids, std::size_t shard, std::size_t n_shards);
+
 /**
  * @brief Inspect a reference panel file to determine chromosome and end position.
  *
@@ -43,6 +61,7 @@ bool stat_tar_panel(const std::string& tar_file_path, std::vector<std::string>&
  *         index missing, or inconsistent contig name).
  *
  * @note
+ * - If a current `.m4i` block index exists, it takes priority over all other indexes.
  * - If `.s1r` index statistics are available, they take priority.
  * - If multiple contigs are present and `chrom` is empty, the function fails 
  *   and suggests using `--region`.
@@ -121,6 +140,8 @@ bool stat_ref_panel(const std::string& ref_file_path, std::string& chrom, std::u
  *                     each representing one ALT allele at a site.  
  *                     For multi-allelic sites, one entry per ALT allele is created.
  * @param sample_ids   Output vector of sample IDs extracted from the target file header.
+ * @param load_genotypes If false, only the sites are loaded and `target_variant::gt` is left
+ *                     empty. Genotypes are then read per sample group with `load_target_genotypes()`.
  *
  * @return True if the haplotypes were successfully loaded and ploidy checks passed,  
  *         false otherwise. On failure, descriptive error messages are printed to `stderr`.
@@ -142,6 +163,7 @@ bool stat_ref_panel(const std::string& ref_file_path, std::string& chrom, std::u
  * - If the function encounters ploidy changes, the run is aborted to avoid downstream 
  *   phasing/imputation errors.
  * - End users should split chromosome X into **PAR** and **non-PAR** regions before imputation.
+ * - With `n_sample_shards` > 1, only the samples returned by `sample_shard_ids()` are read.
  *
  * @warning
  * Error messages are printed directly to `stderr`.  
@@ -150,7 +172,50 @@ bool stat_ref_panel(const std::string& ref_file_path, std::string& chrom, std::u
  * - Region query errors (file not indexed or invalid `reg`).  
  * - Ploidy inconsistency across samples.  
  */
-bool load_target_haplotypes(const std::string& file_path, const savvy::genomic_region& reg, std::vector<target_variant>& target_sites, std::vector<std::string>& sample_ids);
+bool load_target_haplotypes(const std::string& file_path, const savvy::genomic_region& reg, std::vector<target_variant>& target_sites, std::vector<std::string>& sample_ids, bool load_genotypes = true, std::size_t sample_shard = 0, std::size_t n_sample_shards = 1);
+
+/**
+ * @brief Reloads the genotypes of a group of target samples into sites loaded without genotypes.
+ *
+ * Re-reads `reg` from the target file with savvy's sample subsetting and
+ * replaces `target_variant::gt` of every site in `target_sites` and
+ * `target_only_sites` with the haplotypes of `group_sample_ids`. Sites are
+ * matched to records by position and alleles, so the order of the vectors may
+ * differ from the file after the sites were aligned with the reference.
+ *
+ * @param group_sample_ids Consecutive samples of the target file, in file order.
+ *
+ * @return False if the file cannot be read, a sample changes ploidy, or a site
+ *         is missing from the file.
+ */
+bool load_target_genotypes(const std::string& file_path, const savvy::genomic_region& reg, const std::vector<std::string>& group_sample_ids, std::vector<target_variant>& target_sites, std::vector<target_variant>& target_only_sites);
+
+/**
+ * @brief Reference blocks kept from the trailing overlap of the previous chunk.
+ *
+ * `load_reference_haplotypes` fills the cache with the blocks that reach into
+ * the next chunk's extended region and, on the next call, processes them
+ * before reading only the records that follow them. This avoids decoding the
+ * overlap between consecutive chunks twice. The cache is only used together
+ * with a `reference_index`, since record ordinals are needed to resume reading
+ * exactly after the cached blocks.
+ */
+struct reference_block_cache
+{
+  std::string chrom;                           ///< Chromosome of the cached blocks.
+  std::uint64_t min_end_pos = 0;               ///< Blocks ending at or after this position are cached.
+  std::uint64_t end_record = 0;                ///< One past the last record read from the file.
+  std::deque<unique_haplotype_block> blocks;   ///< Cached blocks, as read from the file after `remove_eov()`.
+
+  /** @brief Empties the cache. */
+  void clear()
+  {
+    chrom.clear();
+    min_end_pos = 0;
+    end_record = 0;
+    blocks.clear();
+  }
+};
 
 /**
  * @brief Load and process reference haplotypes from an MVCF file.
@@ -172,8 +237,21 @@ bool load_target_haplotypes(const std::string& file_path, const savvy::genomic_r
  * @param full_reference_data Output container for full reference haplotype data across the impute region.
  * @param map_file Optional genetic map file for interpolation of centimorgan positions. 
  *                 If provided, recombination probabilities are computed from map distances.
+ * @param ref_index Optional block index of the reference file. If provided and non-empty,
+ *                  the reader seeks directly to the records of the overlapping blocks.
+ * @param block_cache Optional cache of blocks shared between consecutive chunks. Used
+ *                    only with @p ref_index and when the chunks are loaded in increasing
+ *                    order; otherwise it is reset.
+ * @param ref_cache Optional mapped `.m4c` cache of the reference file. If open and
+ *                  @p subset_ids is empty, blocks are read from the cache instead of
+ *                  decoding the file, and @p ref_index and @p block_cache are not used.
  * @param min_recom Minimum recombination probability to enforce between adjacent variants.
  * @param default_match_error Default genotype matching error rate used when missing in the reference file.
+ * @param align_target_sites If false, @p target_sites and @p typed_only_reference_data are left
+ *                   unchanged and only @p full_reference_data is loaded, e.g. when the
+ *                   typed-only data was restored from a `typed_reference_cache`.
+ * @param target_order Optional output set to the index in the original order of each
+ *                   target site after alignment, as needed by `typed_reference_cache::save()`.
  *
  * @return true if the haplotypes were successfully loaded and processed, 
  *         false if an error occurred (e.g., file not found, wrong format, no overlapping samples).
@@ -194,9 +272,60 @@ bool load_reference_haplotypes(const std::string& file_path,
   std::vector<target_variant>& target_sites,
   reduced_haplotypes& typed_only_reference_data,
   reduced_haplotypes& full_reference_data,
-  genetic_map_file* map_file,
+  const genetic_map_file* map_file,
+  const reference_index* ref_index,
+  reference_block_cache* block_cache,
+  const reference_cache* ref_cache,
+  float min_recom,
+  float default_match_error,
+  bool align_target_sites = true,
+  std::vector<std::size_t>* target_order = nullptr);
+
+/**
+ * @brief Reads the decoded reference blocks overlapping a region, without aligning them to target sites.
+ *
+ * The blocks are what `load_reference_haplotypes()` reads for @p extended_reg,
+ * before they are trimmed, so they can be kept in memory and replayed by the
+ * overload taking blocks for any number of target files (`--serve`).
+ *
+ * @param file_path    Path to the MVCF reference file.
+ * @param extended_reg Region to read.
+ * @param subset_ids   Reference samples to keep (all if empty).
+ * @param ref_index    Optional block index of the reference file.
+ * @param ref_cache    Optional mapped `.m4c` cache, used as in `load_reference_haplotypes()`.
+ * @param blocks       Set to the blocks, with end-of-vector values removed from their unique maps.
+ * @param sliced       Set to true if the blocks are whole index slices, which must be trimmed to @p extended_reg when replayed.
+ * @return False if the file could not be read. A region without records is not an error.
+ */
+bool read_reference_blocks(const std::string& file_path,
+  const savvy::genomic_region& extended_reg,
+  const std::unordered_set<std::string>& subset_ids,
+  const reference_index* ref_index,
+  const reference_cache* ref_cache,
+  std::deque<unique_haplotype_block>& blocks,
+  bool& sliced);
+
+/**
+ * @brief Builds the reference data of a chunk from blocks read by `read_reference_blocks()`.
+ *
+ * Same as the overload reading the file, except that the blocks are copied
+ * from @p blocks. With a null @p full_reference_data, only the target sites
+ * and the typed-only data are built, e.g. when the full data is kept in memory.
+ *
+ * @return False if the blocks could not be aligned.
+ */
+bool load_reference_haplotypes(const std::deque<unique_haplotype_block>& blocks,
+  bool sliced,
+  const savvy::genomic_region& extended_reg,
+  const savvy::genomic_region& impute_reg,
+  std::vector<target_variant>& target_sites,
+  reduced_haplotypes& typed_only_reference_data,
+  reduced_haplotypes* full_reference_data,
+  const genetic_map_file* map_file,
   float min_recom,
-  float default_match_error);
+  float default_match_error,
+  bool align_target_sites = true,
+  std::vector<std::size_t>* target_order = nullptr);
 
 /**
  * @brief Loads reference haplotypes using an older recombination-based approach.
@@ -245,7 +374,7 @@ bool load_reference_haplotypes_old_recom_approach(const std::string& file_path,
   std::vector<target_variant>& target_sites,
   reduced_haplotypes& typed_only_reference_data,
   reduced_haplotypes& full_reference_data,
-  genetic_map_file* map_file);
+  const genetic_map_file* map_file);
 
 /**
  * @brief Separates target-only variants from those found in the reference panel.
@@ -311,39 +440,6 @@ std::vector<target_variant> separate_target_only_variants(std::vector<target_var
  */
 bool load_variant_hmm_params(std::vector<target_variant>& tar_variants, reduced_haplotypes& typed_only_reference_data, float default_error_param, float recom_min, const std::string& map_file_path);
 
-/**
- * @brief Generates reverse mapping tables for reduced haplotype blocks.
- *
- * This function constructs a three-level nested vector structure
- * (`reverse_maps`) that provides, for each block and each allele state
- * in that block, the list of haplotype indices that map to it.
- *
- * The mapping is inverted from the `unique_map()` representation in each
- * block of the `typed_only_reference_data`.
- *
- * Structure of the returned vector:
- * - `reverse_maps[block_idx][allele_idx]` → list of haplotype indices
- *   that correspond to this allele in the given block.
- *
- * Example:
- * ```
- * reverse_maps[b][a] = { h0, h1, h7 }
- * ```
- * means in block `b`, allele `a` corresponds to haplotypes 0, 1, and 7.
- *
- * @param[in] typed_only_reference_data Reference haplotype data partitioned
- *                                      into blocks, each containing allele
- *                                      cardinalities and a unique haplotype map.
- *
- * @return A nested vector structure containing reverse maps for each block.
- *
- * @complexity O(N), where N = total number of haplotype entries across all blocks.
- *
- * @note Each block in `typed_only_reference_data` must have consistent
- *       `cardinalities()` and `unique_map()` values.
- */
-std::vector<std::vector<std::vector<std::size_t>>> generate_reverse_maps(const reduced_haplotypes& typed_only_reference_data);
-
 /**
  * @brief Converts an old M3VCF file (v1/v2) to a newer VCF-like format (MVCFv3.0).
  *
@@ -364,6 +460,8 @@ std::vector<std::vector<std::vector<std::size_t>>> generate_reverse_maps(const r
  * @param[in] input_path Path to the old M3VCF file (gzipped).
  * @param[in] output_path Path to the output file (can be `.bcf` or `.sav`).
  * @param[in] map_file_path Optional path to a genetic map file for cM annotation.
+ * @param[in] threads Number of threads parsing blocks. Blocks are split off the input on the
+ *                    calling thread, parsed concurrently and written in file order.
  *
  * @return True if the conversion completed successfully, false otherwise.
  *
@@ -380,7 +478,7 @@ std::vector<std::vector<std::vector<std::size_t>>> generate_reverse_maps(const r
  * - Time: O(B × V), where B = number of blocks, V = number of variants per block.
  * - Memory: O(N), proportional to the size of haplotype data buffered during conversion.
  */
-bool convert_old_m3vcf(const std::string& input_path, const std::string& output_path, const std::string& map_file_path = "");
+bool convert_old_m3vcf(const std::string& input_path, const std::string& output_path, const std::string& map_file_path = "", std::size_t threads = 1);
 
 /**
  * @brief Compress a haplotype reference panel into blocks and write to an output file.
@@ -395,11 +493,25 @@ bool convert_old_m3vcf(const std::string& input_path, const std::string& output_
  * @param min_block_size   Minimum number of variants required in a block before flushing.
  * @param max_block_size   Maximum number of variants allowed in a block before forcing flush.
  * @param slope_unit       Interval of variants used to check compression ratio slope.
- * @param map_file_path    Path to a genetic map file (currently unused, reserved for CM filling).
+ * @param map_file_path    Path to a genetic map file. If non-empty, the RECOM field of each variant is set
+ *                         from it, so that imputation does not need `--map`.
+ * @param threads          Number of threads used to build blocks. With more than one thread,
+ *                         the input is split into segments that are compressed concurrently
+ *                         and written in order.
+ * @param segment_size     Number of variants per segment (0 sizes segments to about 256 MiB of
+ *                         genotypes). A nonzero value also splits a single-threaded run into
+ *                         segments, so that small panels can exercise segment boundaries.
  *
  * @return true if compression and writing completed successfully, false otherwise.
  *
  * @note
+ *  - With multiple threads, a block always ends at a segment boundary, so blocks next to
+ *    a boundary may differ from a single-threaded run. Segments end at chromosome
+ *    boundaries and otherwise hold about 256 MiB of genotypes each. Inputs smaller than one
+ *    segment per chromosome produce the same output as a single-threaded run. A given
+ *    `segment_size` produces the same output with any number of threads.
+ *  - Unless the output is a device (e.g., `/dev/stdout`), a block index is written
+ *    to `<output_path>.m4i` (see `reference_index`).
  *  - Input file must contain fully phased genotypes (phasing header must not be "none" or "partial").
  *  - INFO and FORMAT fields required for compressed blocks are automatically added to headers.
  *  - Compression ratio is defined as:
@@ -415,7 +527,29 @@ bool compress_reference_panel(const std::string& input_path, const std::string&
   std::size_t min_block_size = 10,
   std::size_t max_block_size = 0xFFFF, // max s1r block size minus 1 partition record
   std::size_t slope_unit = 10, 
-  const std::string& map_file_path = "");
+  const std::string& map_file_path = "",
+  std::size_t threads = 1,
+  std::size_t segment_size = 0);
+
+/**
+ * @brief Writes the `.m4i` block index of an existing MVCF reference file.
+ *
+ * @param ref_file_path Path to the MVCF reference file.
+ * @return true if the index was built and written, false otherwise.
+ *
+ * @see reference_index
+ */
+bool index_reference_panel(const std::string& ref_file_path);
+
+/**
+ * @brief Writes the `.m4c` memory-mappable cache of an existing MVCF reference file.
+ *
+ * @param ref_file_path Path to the MVCF reference file.
+ * @return true if the cache was built and written, false otherwise.
+ *
+ * @see reference_cache
+ */
+bool cache_reference_panel(const std::string& ref_file_path);
 
 
 #endif // MINIMAC4_INPUT_PREP_HPP
@@ -1,5 +1,7 @@
 
+#include "chunk_planner.hpp"
 #include "imputation.hpp"
+#include "reference_server.hpp"
 
 int main(int argc, char** argv)
 {
@@ -27,10 +29,25 @@ int main(int argc, char** argv)
   std::cerr << "minimac v" << VERSION << "\n\n";
 
   if (args.update_m3vcf())
-    return convert_old_m3vcf(args.ref_path(), args.out_path(), args.map_path()) ? EXIT_SUCCESS : EXIT_FAILURE;
+    return convert_old_m3vcf(args.ref_path(), args.out_path(), args.map_path(), std::max(1, int(args.threads()))) ? EXIT_SUCCESS : EXIT_FAILURE;
 
   if (args.compress_reference())
-    return compress_reference_panel(args.ref_path(), args.out_path(), args.min_block_size(), args.max_block_size(), args.slope_unit(), args.map_path()) ? EXIT_SUCCESS : EXIT_FAILURE;
+    return compress_reference_panel(args.ref_path(), args.out_path(), args.min_block_size(), args.max_block_size(), args.slope_unit(), args.map_path(), std::max(1, int(args.threads()))) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  if (args.index_reference())
+    return index_reference_panel(args.ref_path()) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  if (args.cache_reference())
+    return cache_reference_panel(args.ref_path()) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  if (args.index_map())
+    return genetic_map_file::save_binary(args.map_path()) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  if (args.merge_shards())
+    return merge_sample_shards(args.shard_paths(), args.emp_shard_paths(), args.out_path(), args.emp_out_path(), args.sites_out_path(), args.out_format(), args.out_compression(), args.fmt_fields(), args.min_r2(), std::max(1, int(args.threads()))) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  if (args.serve_path().size())
+    return reference_server(args).run() ? EXIT_SUCCESS : EXIT_FAILURE;
 
   std::uint64_t end_pos = args.region().to();
   std::string chrom = args.region().chromosome();
@@ -41,35 +58,63 @@ int main(int argc, char** argv)
   if (!stat_tar_panel(args.tar_path(), sample_ids))
     return std::cerr << "Error: could not stat target file\n", EXIT_FAILURE;
 
+  // A sample shard is written like a temp file, with HDS and the per-site sums merged by --merge-shards.
+  bool is_shard = args.sample_sharded();
+  if (is_shard)
+  {
+    sample_ids = sample_shard_ids(sample_ids, args.sample_shard(), args.sample_shard_count());
+    if (sample_ids.empty())
+      return std::cerr << "Error: --sample-shard selects no target samples\n", EXIT_FAILURE;
+    if (!args.sites_out_path().empty())
+      std::cerr << "Warning: --sites is ignored with --sample-shard and should be passed to --merge-shards\n";
+  }
+
   dosage_writer output(args.out_path(),
     args.emp_out_path(),
-    args.sites_out_path(),
+    is_shard ? "" : args.sites_out_path(),
     args.out_format(),
     args.out_compression(),
     sample_ids,
-    args.fmt_fields(),
+    is_shard ? std::vector<std::string>{"HDS"} : args.fmt_fields(),
     chrom,
-    args.min_r2(), false);
+    is_shard ? -1.f : args.min_r2(), is_shard);
 
-  omp::internal::thread_pool2 tpool(args.threads());
   imputation imputer;
-  for (std::uint64_t chunk_start_pos = std::max(std::uint64_t(1), args.region().from()); chunk_start_pos <= end_pos; chunk_start_pos += args.chunk_size())
+  std::vector<savvy::region> impute_regions;
+  if (args.max_memory())
+  {
+    chunk_planner planner;
+    std::vector<std::size_t> temp_buffers;
+    std::uint64_t start_pos = std::max(std::uint64_t(1), args.region().from());
+    if (!planner.init(args, chrom, start_pos, end_pos, sample_ids.size()))
+      return std::cerr << "Error: could not plan chunks for --max-memory\n", EXIT_FAILURE;
+    if (!planner.plan(chrom, start_pos, end_pos, args.max_memory(), impute_regions, temp_buffers))
+      return std::cerr << "Error: --max-memory is too small for the reference and target panels\n", EXIT_FAILURE;
+
+    std::size_t min_temp_buffer = temp_buffers.empty() ? args.temp_buffer() : *std::min_element(temp_buffers.begin(), temp_buffers.end());
+    std::cerr << "Planned " << impute_regions.size() << " chunks for --max-memory (smallest sample group: " << min_temp_buffer << ")" << std::endl;
+    imputer.set_chunk_temp_buffers(std::move(temp_buffers));
+  }
+  else
   {
-    std::uint64_t chunk_end_pos = std::min(end_pos, chunk_start_pos + args.chunk_size() - 1ul);
-    savvy::region impute_region =
-      {
-        chrom,
-        chunk_start_pos,
-        chunk_end_pos
-      };
-
-    if (!imputer.impute_chunk(impute_region, args, tpool, output))
-      return EXIT_FAILURE;
+    for (std::uint64_t chunk_start_pos = std::max(std::uint64_t(1), args.region().from()); chunk_start_pos <= end_pos; chunk_start_pos += args.chunk_size())
+    {
+      std::uint64_t chunk_end_pos = std::min(end_pos, chunk_start_pos + args.chunk_size() - 1ul);
+      impute_regions.emplace_back(chrom, chunk_start_pos, chunk_end_pos);
+    }
   }
 
+  omp::internal::thread_pool2 tpool(imputation::chunk_pool_threads(args, impute_regions.size()));
+  if (!imputer.impute_chunks(impute_regions, args, tpool, output))
+    return EXIT_FAILURE;
+
+  if (!args.metrics_out_path().empty() && !imputer.metrics().write(args.metrics_out_path()))
+    return EXIT_FAILURE;
+
   auto total_time = long(std::difftime(std::time(nullptr), start_time));
 
-  output.print_mean_er2(std::cerr);
+  if (!is_shard && args.leave_one_out())
+    output.print_mean_er2(std::cerr);
   std::cerr << std::endl;
   std::fprintf(stderr, "Total time for parsing input: %ld seconds\n", imputer.total_input_time());
   std::fprintf(stderr, "Total time for HMM: %ld seconds\n", imputer.total_impute_time());
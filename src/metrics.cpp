@@ -0,0 +1,173 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+imputation_metrics::imputation_metrics()
+{
+  read_process_io(last_rchar_, last_wchar_);
+}
+
+const char* imputation_metrics::stage_name(stage s)
+{
+  switch (s)
+  {
+  case target_load: return "target_load";
+  case reference_load: return "reference_load";
+  case reverse_maps: return "reverse_maps";
+  case forward: return "forward";
+  case backward: return "backward";
+  case temp_write: return "temp_write";
+  case temp_write_wait: return "temp_write_wait";
+  case merge: return "merge";
+  case output_write: return "output_write";
+  default: return "";
+  }
+}
+
+bool imputation_metrics::read_process_io(std::uint64_t& rchar, std::uint64_t& wchar)
+{
+  std::ifstream ifs("/proc/self/io");
+  std::string key;
+  std::uint64_t value;
+  bool found_r = false, found_w = false;
+  while (ifs >> key >> value)
+  {
+    if (key == "rchar:")
+      rchar = value, found_r = true;
+    else if (key == "wchar:")
+      wchar = value, found_w = true;
+  }
+  return found_r && found_w;
+}
+
+void imputation_metrics::add_chunk(chunk_record rec)
+{
+  std::uint64_t rchar = 0, wchar = 0;
+  if (read_process_io(rchar, wchar))
+  {
+    rec.bytes_read = rchar - last_rchar_;
+    rec.bytes_written = wchar - last_wchar_;
+    last_rchar_ = rchar;
+    last_wchar_ = wchar;
+  }
+  chunks_.emplace_back(std::move(rec));
+}
+
+imputation_metrics::chunk_record imputation_metrics::total() const
+{
+  chunk_record ret;
+  ret.chrom = "total";
+  for (auto it = chunks_.begin(); it != chunks_.end(); ++it)
+  {
+    for (std::size_t s = 0; s < stage_count; ++s)
+      ret.seconds[s] += it->seconds[s];
+    ret.target_haplotypes = std::max(ret.target_haplotypes, it->target_haplotypes);
+    ret.typed_variants += it->typed_variants;
+    ret.reference_variants += it->reference_variants;
+    ret.temp_files += it->temp_files;
+    ret.loo_dosage_bytes = std::max(ret.loo_dosage_bytes, it->loo_dosage_bytes);
+    ret.skipped_loo_bytes = std::max(ret.skipped_loo_bytes, it->skipped_loo_bytes);
+    ret.bytes_read += it->bytes_read;
+    ret.bytes_written += it->bytes_written;
+    ret.hmm += it->hmm;
+  }
+  return ret;
+}
+
+namespace
+{
+  typedef std::vector<std::pair<const char*, std::uint64_t>> counter_list;
+
+  counter_list chunk_counters(const imputation_metrics::chunk_record& rec)
+  {
+    return {
+      {"target_haplotypes", rec.target_haplotypes},
+      {"typed_variants", rec.typed_variants},
+      {"reference_variants", rec.reference_variants},
+      {"temp_files", rec.temp_files},
+      {"loo_dosage_bytes", rec.loo_dosage_bytes},
+      {"skipped_loo_bytes", rec.skipped_loo_bytes},
+      {"bytes_read", rec.bytes_read},
+      {"bytes_written", rec.bytes_written},
+      {"precision_jumps", rec.hmm.precision_jumps},
+      {"typed_sites", rec.hmm.typed_sites},
+      {"loo_sites", rec.hmm.loo_sites},
+      {"s3_states", rec.hmm.s3_states},
+      {"s1_updates", rec.hmm.s1_updates},
+      {"s1_states", rec.hmm.s1_states},
+      {"s1_capped_states", rec.hmm.s1_capped_states},
+      {"s2_updates", rec.hmm.s2_updates},
+      {"s2_states", rec.hmm.s2_states},
+      {"workspace_growths", rec.hmm.workspace_growths}};
+  }
+
+  std::string region_string(const imputation_metrics::chunk_record& rec)
+  {
+    if (rec.from == 0 && rec.to == 0)
+      return rec.chrom;
+    return rec.chrom + ":" + std::to_string(rec.from) + "-" + std::to_string(rec.to);
+  }
+
+  void write_json_record(std::ostream& os, const imputation_metrics::chunk_record& rec)
+  {
+    os << "{\"region\": \"" << region_string(rec) << "\", \"seconds\": {";
+    for (std::size_t s = 0; s < imputation_metrics::stage_count; ++s)
+      os << (s ? ", " : "") << "\"" << imputation_metrics::stage_name(imputation_metrics::stage(s)) << "\": " << rec.seconds[s];
+    os << "}, \"counters\": {";
+    counter_list counters = chunk_counters(rec);
+    for (std::size_t i = 0; i < counters.size(); ++i)
+      os << (i ? ", " : "") << "\"" << counters[i].first << "\": " << counters[i].second;
+    os << "}}";
+  }
+
+  void write_tsv_record(std::ostream& os, const imputation_metrics::chunk_record& rec)
+  {
+    os << region_string(rec);
+    for (std::size_t s = 0; s < imputation_metrics::stage_count; ++s)
+      os << "\t" << rec.seconds[s];
+    counter_list counters = chunk_counters(rec);
+    for (std::size_t i = 0; i < counters.size(); ++i)
+      os << "\t" << counters[i].second;
+    os << "\n";
+  }
+}
+
+bool imputation_metrics::write(const std::string& path) const
+{
+  std::ofstream ofs(path);
+  if (!ofs)
+    return std::cerr << "Error: could not open " << path << " for writing\n", false;
+
+  chunk_record tot = total();
+  bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+  if (json)
+  {
+    ofs << "{\"chunks\": [";
+    for (auto it = chunks_.begin(); it != chunks_.end(); ++it)
+    {
+      ofs << (it == chunks_.begin() ? "\n  " : ",\n  ");
+      write_json_record(ofs, *it);
+    }
+    ofs << "\n],\n\"total\": ";
+    write_json_record(ofs, tot);
+    ofs << "}\n";
+  }
+  else
+  {
+    ofs << "#REGION";
+    for (std::size_t s = 0; s < stage_count; ++s)
+      ofs << "\t" << stage_name(stage(s)) << "_seconds";
+    counter_list counters = chunk_counters(tot);
+    for (std::size_t i = 0; i < counters.size(); ++i)
+      ofs << "\t" << counters[i].first;
+    ofs << "\n";
+
+    for (auto it = chunks_.begin(); it != chunks_.end(); ++it)
+      write_tsv_record(ofs, *it);
+    write_tsv_record(ofs, tot);
+  }
+
+  return ofs.good();
+}
@@ -0,0 +1,113 @@
+#ifndef MINIMAC4_METRICS_HPP
+#define MINIMAC4_METRICS_HPP
+
+#include "hidden_markov_model.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Monotonic stopwatch based on `std::chrono::steady_clock`.
+ */
+class stopwatch
+{
+private:
+  std::chrono::steady_clock::time_point start_;
+public:
+  stopwatch() : start_(std::chrono::steady_clock::now()) {}
+
+  /** @return Seconds since construction or the last `restart()`. */
+  double elapsed() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count(); }
+
+  /** @return Seconds since construction or the last `restart()`, then restarts. */
+  double restart()
+  {
+    auto now = std::chrono::steady_clock::now();
+    double ret = std::chrono::duration<double>(now - start_).count();
+    start_ = now;
+    return ret;
+  }
+};
+
+/**
+ * @brief Per-chunk stage timers and work counters of an imputation run.
+ *
+ * One record is added per imputed chunk. The report written by `write()` is
+ * JSON when the path ends in `.json` and tab-delimited text otherwise, with
+ * one row per chunk followed by a `total` row.
+ *
+ * Forward and backward times are summed over the HMM threads, so they are
+ * thread-seconds rather than wall time. Temp files are written while the next
+ * sample group runs through the HMM, so `temp_write` is mostly hidden and
+ * `temp_write_wait` is the part the HMM waited for. Bytes read and written are taken from
+ * the `rchar`/`wchar` fields of `/proc/self/io` between the completion of
+ * consecutive chunks. They are process-wide (including prefetched loads of
+ * later chunks) and zero where `/proc/self/io` is unavailable. The `total` row
+ * reports the largest leave-one-out matrix sizes of any chunk, since they are
+ * held by one chunk at a time.
+ */
+class imputation_metrics
+{
+public:
+  enum stage
+  {
+    target_load = 0,
+    reference_load,
+    reverse_maps,
+    forward,
+    backward,
+    temp_write,
+    temp_write_wait,
+    merge,
+    output_write,
+    stage_count
+  };
+
+  /** @brief Timers and counters of one chunk. */
+  struct chunk_record
+  {
+    std::string chrom;
+    std::uint64_t from = 0;
+    std::uint64_t to = 0;
+    std::array<double, stage_count> seconds; ///< Seconds per stage.
+    std::uint64_t target_haplotypes = 0;
+    std::uint64_t typed_variants = 0;        ///< Typed sites in the extended region.
+    std::uint64_t reference_variants = 0;    ///< Reference variants in the impute region.
+    std::uint64_t temp_files = 0;
+    std::uint64_t loo_dosage_bytes = 0;      ///< Bytes of the leave-one-out dosage matrices.
+    std::uint64_t skipped_loo_bytes = 0;     ///< Bytes of leave-one-out dosages not allocated because of `--no-er2`.
+    std::uint64_t bytes_read = 0;
+    std::uint64_t bytes_written = 0;
+    hmm_counters hmm;
+
+    chunk_record() { seconds.fill(0.); }
+  };
+private:
+  std::vector<chunk_record> chunks_;
+  std::uint64_t last_rchar_ = 0;
+  std::uint64_t last_wchar_ = 0;
+public:
+  imputation_metrics();
+
+  /** @return Report name of a stage. */
+  static const char* stage_name(stage s);
+
+  /** @brief Appends a completed chunk and fills its I/O counters. */
+  void add_chunk(chunk_record rec);
+
+  /** @return Records of the completed chunks. */
+  const std::vector<chunk_record>& chunks() const { return chunks_; }
+
+  /** @return Sum of all chunk records. */
+  chunk_record total() const;
+
+  /** @brief Writes the report to `path` (JSON if it ends in `.json`, TSV otherwise). */
+  bool write(const std::string& path) const;
+private:
+  static bool read_process_io(std::uint64_t& rchar, std::uint64_t& wchar);
+};
+
+#endif // MINIMAC4_METRICS_HPP
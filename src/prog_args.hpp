@@ -2,16 +2,19 @@
 #define MINIMAC4_PROG_ARGS_HPP
 
 #include "getopt_wrapper.hpp"
+#include "reduced_precision.hpp"
 
 #include <savvy/reader.hpp>
 
 #include <string>
 #include <vector>
 #include <unordered_set>
+#include <cctype>
 #include <cstdint>
 #include <cstdlib>
 #include <fstream>
 #include <iterator>
+#include <limits>
 
 /**
  * @brief Stores and manages program arguments for Minimac4.
@@ -30,10 +33,15 @@ private:
   std::string prefix_;                 ///< Deprecated: old prefix option.
   std::string emp_out_path_;           ///< Path for empirical R2 output.
   std::string sites_out_path_;         ///< Path for sites-only output.
+  std::string metrics_out_path_;       ///< Path for per-chunk timing and counter report.
+  std::string typed_cache_dir_;        ///< Directory of saved typed-only reference data (empty if disabled).
+  std::string serve_path_;             ///< Socket, job file or "-" (stdin) read by --serve (empty if disabled).
   savvy::file::format out_format_ = savvy::file::format::sav; ///< Output file format.
   std::uint8_t out_compression_ = 6;   ///< Compression level for output file.
   std::vector<std::string> fmt_fields_ = {"HDS"}; ///< FORMAT fields to include in output.
   std::unordered_set<std::string> sample_ids_; ///< Subset of sample IDs to process.
+  std::vector<std::string> shard_paths_;        ///< Sample shard outputs pasted by --merge-shards.
+  std::vector<std::string> emp_shard_paths_;    ///< Empirical sample shard outputs pasted by --merge-shards.
   savvy::genomic_region reg_ = {""};   ///< Genomic region to restrict processing.
   std::size_t temp_buffer_ = 200;      ///< Buffer size for temporary storage.
   std::size_t min_block_size_ = 10;    ///< Minimum block size for imputation.
@@ -42,6 +50,15 @@ private:
   std::int64_t chunk_size_ = 20000000; ///< Size of chunks to process (bp).
   std::int64_t overlap_ = 3000000;     ///< Overlap between chunks (bp).
   std::int16_t threads_ = 1;           ///< Number of computation threads.
+  std::size_t forward_checkpoints_ = 0;///< Interval of stored forward rows (0 stores all rows).
+  hmm_precision hmm_precision_ = hmm_precision::fp32; ///< Storage precision of forward probabilities.
+  std::size_t prefetch_chunks_ = 0;    ///< Number of chunks loaded ahead of the chunk being imputed.
+  std::size_t parallel_chunks_ = 1;    ///< Number of chunks imputed concurrently.
+  std::size_t max_templates_ = 0;      ///< Cap on the S1 templates used to interpolate untyped sites (0 is unbounded).
+  std::uint64_t max_memory_ = 0;       ///< Memory budget in bytes used to plan chunks (0 uses fixed chunks).
+  std::uint64_t serve_cache_bytes_ = std::uint64_t(4) << 30; ///< Cap of the reference chunks kept resident by --serve.
+  std::size_t sample_shard_ = 0;       ///< Zero-based index of the target sample shard to impute.
+  std::size_t sample_shard_count_ = 1; ///< Number of target sample shards (1 imputes all samples).
   float decay_ = 0.f;                  ///< Decay parameter for HMM.
   float min_r2_ = -1.f;                ///< Minimum imputation R2 threshold.
   float min_ratio_ = 1e-4f;            ///< Minimum ratio for haplotype pruning.
@@ -53,6 +70,14 @@ private:
   bool all_typed_sites_ = false;       ///< Process all typed sites if true.
   bool update_m3vcf_ = false;          ///< Update M3VCF reference if true.
   bool compress_reference_ = false;    ///< Compress reference panel if true.
+  bool index_reference_ = false;       ///< Write block index of reference panel if true.
+  bool cache_reference_ = false;       ///< Write memory-mappable cache of reference panel if true.
+  bool index_map_ = false;             ///< Write binary form of genetic map if true.
+  bool merge_shards_ = false;          ///< Paste sample shard outputs into the final output if true.
+  bool sample_sharded_ = false;        ///< Write a --sample-shard output for merging if true.
+  bool tile_dosages_ = false;          ///< Store HMM dosages in haplotype tiles instead of variant rows if true.
+  bool stream_targets_ = false;        ///< Read target genotypes one --temp-buffer sample group at a time if true.
+  bool no_er2_ = false;                ///< Skip leave-one-out dosages and ER2 of typed sites if true.
   bool pass_only_ = false;             ///< Keep only PASS variants if true.
   bool meta_ = false;                  ///< Deprecated: meta option.
   bool fail_min_ratio_ = true;         ///< Whether to fail if min ratio not met.
@@ -84,6 +109,18 @@ public:
   /** @return Sites-only output path. */
   const std::string& sites_out_path() const { return sites_out_path_; }
 
+  /** @return Per-chunk metrics report path (empty if disabled). */
+  const std::string& metrics_out_path() const { return metrics_out_path_; }
+
+  /** @return Directory of saved typed-only reference data (empty if disabled). */
+  const std::string& typed_cache_dir() const { return typed_cache_dir_; }
+
+  /** @return Socket, job file or "-" from which `--serve` reads imputation jobs (empty if disabled). */
+  const std::string& serve_path() const { return serve_path_; }
+
+  /** @return Cap in bytes of the reference chunks kept in memory by `--serve`. */
+  std::uint64_t serve_cache_bytes() const { return serve_cache_bytes_; }
+
   /** @return Prefix for temporary files. */
   const std::string& temp_prefix() const { return temp_prefix_; }
 
@@ -111,6 +148,27 @@ public:
   /** @return Number of threads to use. */
   std::int16_t threads() const { return threads_; }
 
+  /** @return Interval between stored forward rows (0 stores every row; SIZE_MAX stores block boundaries only). */
+  std::size_t forward_checkpoints() const { return forward_checkpoints_; }
+
+  /** @return Storage precision of the HMM forward probabilities. */
+  hmm_precision forward_precision() const { return hmm_precision_; }
+
+  /** @return Number of chunks loaded in the background ahead of the chunk being imputed. */
+  std::size_t prefetch_chunks() const { return prefetch_chunks_; }
+
+  /** @return Number of chunks imputed concurrently, sharing the thread budget. */
+  std::size_t parallel_chunks() const { return parallel_chunks_; }
+
+  /** @return Memory budget in bytes from which chunk lengths and sample groups are planned (0 if disabled). */
+  std::uint64_t max_memory() const { return max_memory_; }
+
+  /** @return True if HMM dosages are stored in tiles of haplotypes. */
+  bool tile_dosages() const { return tile_dosages_; }
+
+  /** @return true if target genotypes are read one `--temp-buffer` sample group at a time. */
+  bool stream_targets() const { return stream_targets_; }
+
   /** @return Temporary buffer size. */
   std::size_t temp_buffer() const { return temp_buffer_ ; }
 
@@ -138,6 +196,9 @@ public:
   /** @return Probability threshold for S1 records. */
   float prob_threshold_s1() const { return prob_threshold_s1_; }
 
+  /** @return Cap on the S1 templates used to interpolate untyped sites (0 is unbounded). */
+  std::size_t max_templates() const { return max_templates_; }
+
   /** @return Likelihood difference threshold. */
   float diff_threshold() const { return diff_threshold_; }
 
@@ -156,9 +217,53 @@ public:
   /** @return true if reference panel should be compressed. */
   bool compress_reference() const { return compress_reference_; }
 
+  /** @return true if the block index of the reference panel should be written. */
+  bool index_reference() const { return index_reference_; }
+
+  /** @return true if the memory-mappable cache of the reference panel should be written. */
+  bool cache_reference() const { return cache_reference_; }
+
+  /** @return true if the binary form of the genetic map should be written. */
+  bool index_map() const { return index_map_; }
+
+  /** @return true if sample shard outputs should be merged. */
+  bool merge_shards() const { return merge_shards_; }
+
+  /** @return Sample shard outputs to merge, in sample order. */
+  const std::vector<std::string>& shard_paths() const { return shard_paths_; }
+
+  /** @return Empirical sample shard outputs to merge, in sample order (empty if not given). */
+  const std::vector<std::string>& emp_shard_paths() const { return emp_shard_paths_; }
+
+  /** @return Zero-based index of the target sample shard imputed by this run. */
+  std::size_t sample_shard() const { return sample_shard_; }
+
+  /** @return Number of target sample shards (1 if --sample-shard is not set). */
+  std::size_t sample_shard_count() const { return sample_shard_count_; }
+
+  /** @return true if --sample-shard was given, even as 1/1, so the output holds the statistics merged by --merge-shards. */
+  bool sample_sharded() const { return sample_sharded_; }
+
   /** @return true if only PASS variants are kept. */
   bool pass_only() const { return pass_only_; }
 
+  /** @return false if `--no-er2` is set, in which case typed sites are imputed without leave-one-out dosages. */
+  bool leave_one_out() const { return !no_er2_; }
+
+  /**
+   * @brief Sets the target file, output file and FORMAT fields of a `--serve` job.
+   * @param fmt_fields Comma-separated FORMAT fields (empty keeps those of the server).
+   * @return False if a FORMAT field is invalid.
+   */
+  bool set_serve_job(const std::string& tar_path, const std::string& out_path, const std::string& fmt_fields)
+  {
+    tar_path_ = tar_path;
+    out_path_ = out_path;
+    if (fmt_fields.size())
+      return parse_fmt_fields(fmt_fields.c_str());
+    return true;
+  }
+
   /** @return true if failing on min ratio violation is enabled. */
   bool fail_min_ratio() const { return fail_min_ratio_; }
 
@@ -173,6 +278,11 @@ public:
    *   minimac4 [opts ...] <reference.msav> <target.{sav,bcf,vcf.gz}>
    *   minimac4 [opts ...] --update-m3vcf <reference.m3vcf.gz>
    *   minimac4 [opts ...] --compress-reference <reference.{sav,bcf,vcf.gz}>
+   *   minimac4 [opts ...] --index-reference <reference.msav>
+   *   minimac4 [opts ...] --cache-reference <reference.msav>
+   *   minimac4 [opts ...] --index-map <genetic_map.txt>
+   *   minimac4 [opts ...] --merge-shards <shard1.sav> [<shard2.sav> ...]
+   *   minimac4 [opts ...] --serve <socket|jobs.txt|-> <reference.msav>
    * @endcode
    *
    * Supported options include:
@@ -184,6 +294,7 @@ public:
    *   - `--output-format, -O <fmt>` : Output format (bcf, sav, vcf.gz, …; default: sav).
    *   - `--sites, -s <path>` : Output path for sites-only file.
    *   - `--empirical-output, -e <path>` : Path for empirical dosages.
+   *   - `--no-er2` : Skip leave-one-out dosages of typed sites, so no ER2 is written.
    * - Reference/Target control:
    *   - `--all-typed-sites, -a` : Include sites that exist only in target VCF.
    *   - `--map, -m <file>` : Genetic map file.
@@ -194,6 +305,15 @@ public:
    *   - `--temp-buffer, -b <int>` : Number of samples to buffer before writing (default: 200).
    *   - `--chunk, -c <bp>` : Maximum chunk length in base pairs (default: 20,000,000).
    *   - `--overlap, -w <bp>` : Size of flanking overlap (default: 3,000,000).
+   *   - `--forward-checkpoints <int|block>` : Store forward probabilities only at block boundaries and every N-th typed site (default: 0, store all).
+   *   - `--hmm-precision <fp32|bf16|fp16>` : Storage precision of forward probabilities (default: fp32).
+   *   - `--parallel-chunks <int>` : Number of chunks imputed concurrently, splitting --threads between them (default: 1).
+   *   - `--max-memory <size>` : Memory budget (e.g. 16G) from which chunk boundaries and sample groups are planned.
+   *   - `--sample-shard <i/N>` : Impute only the i-th of N contiguous target sample shards, writing partial statistics.
+   *   - `--merge-shards` : Paste the outputs of `--sample-shard` runs and compute final R2/ER2.
+   *   - `--empirical-shards <list>` : Comma-separated empirical outputs of the shards, merged into `--empirical-output`.
+   *   - `--serve <path>` : Keep reference chunks resident and impute jobs read from a Unix socket, job file or stdin.
+   *   - `--serve-cache <size>` : Cap of the reference chunks kept resident by `--serve` (default: 4G).
    * - HMM/Imputation parameters:
    *   - `--match-error <float>` : Match error probability (default: 0.01).
    *   - `--min-r2 <float>` : Minimum estimated r² for output variants.
@@ -203,10 +323,13 @@ public:
    *   - `--prob-threshold <float>` : Probability threshold for template selection.
    *   - `--prob-threshold-s1 <float>` : Probability threshold in original state space.
    *   - `--diff-threshold <float>` : Probability diff threshold for template selection.
+   *   - `--max-templates <int>` : Keep only the most probable N templates after the thresholds (default: 0, unbounded).
    *   - `--decay <float>` : Dosage decay in flanking regions (default: 0, disabled).
    * - Reference compression / conversion:
    *   - `--update-m3vcf` : Convert M3VCF to MVCF.
    *   - `--compress-reference` : Compress VCF/BCF/SAV into MVCF.
+   *   - `--cache-reference` : Write memory-mappable <reference>.m4c cache of an MVCF.
+   *   - `--index-map` : Write memory-mappable <map>.m4g copy of a genetic map.
    *   - `--min-block-size <int>` : Minimum haplotype block size (default: 10).
    *   - `--max-block-size <int>` : Maximum haplotype block size (default: 65535).
    *   - `--slope-unit <int>` : Slope parameter for compression heuristic (default: 10).
@@ -221,7 +344,11 @@ public:
     getopt_wrapper(
       "Usage: minimac4 [opts ...] <reference.msav> <target.{sav,bcf,vcf.gz}>\n"
       "       minimac4 [opts ...] --update-m3vcf <reference.m3vcf.gz>\n"
-      "       minimac4 [opts ...] --compress-reference <reference.{sav,bcf,vcf.gz}>",
+      "       minimac4 [opts ...] --compress-reference <reference.{sav,bcf,vcf.gz}>\n"
+      "       minimac4 [opts ...] --index-reference <reference.msav>\n"
+      "       minimac4 [opts ...] --cache-reference <reference.msav>\n"
+      "       minimac4 [opts ...] --index-map <genetic_map.txt>\n"
+      "       minimac4 [opts ...] --merge-shards <shard1.sav> [<shard2.sav> ...]",
       {
         {"all-typed-sites", no_argument, 0, 'a', "Include in the output sites that exist only in target VCF"},
         {"temp-buffer", required_argument, 0, 'b', "Number of samples to impute before writing to temporary files (default: 200)"},
@@ -247,11 +374,30 @@ public:
         {"prob-threshold", required_argument, 0, '\x02', "Probability threshold used for template selection"},
         {"prob-threshold-s1", required_argument, 0, '\x02', "Probability threshold used for template selection in original state space"},
         {"diff-threshold", required_argument, 0, '\x02', "Probability diff threshold used in template selection"},
+        {"max-templates", required_argument, 0, '\x02', "Keeps only the N most probable templates passing the thresholds when interpolating untyped sites (default: 0, unbounded)"},
         {"sample-ids", required_argument, 0, '\x02', "Comma-separated list of sample IDs to subset from reference panel"},
         {"sample-ids-file", required_argument, 0, '\x02', "Text file containing sample IDs to subset from reference panel (one ID per line)"},
         {"temp-prefix", required_argument, 0, '\x02', "Prefix path for temporary output files (default: ${TMPDIR}/m4_)"},
+        {"forward-checkpoints", required_argument, 0, '\x02', "Stores forward probabilities only at block boundaries and every N-th typed site, recomputing the rest during the backward pass (\"block\" for block boundaries only; default: 0, store all)"},
+        {"hmm-precision", required_argument, 0, '\x02', "Storage precision of forward probabilities (fp32, bf16, or fp16; 16-bit modes halve forward memory at a small cost in accuracy; default: fp32)"},
+        {"prefetch-chunks", required_argument, 0, '\x02', "Number of chunks loaded on a background thread while the current chunk is imputed (default: 0)"},
+        {"parallel-chunks", required_argument, 0, '\x02', "Number of chunks imputed concurrently, each with an equal share of --threads; useful for small target cohorts (default: 1)"},
+        {"max-memory", required_argument, 0, '\x02', "Memory budget (bytes, or with a K, M, G or T suffix) from which chunk boundaries and the --temp-buffer of each chunk are planned; --chunk and --temp-buffer become upper bounds (requires <reference>.m4i)"},
+        {"sample-shard", required_argument, 0, '\x02', "Imputes only shard i of N (1-based, e.g. 3/10) of the target samples, split into contiguous blocks, and writes per-site sufficient statistics so shards can be combined with --merge-shards"},
+        {"merge-shards", no_argument, 0, '\x01', "Pastes the outputs of --sample-shard runs (given as positional arguments, in shard order) into the final output, computing R2 and ER2 over all samples"},
+        {"empirical-shards", required_argument, 0, '\x02', "Comma-separated empirical outputs of the --sample-shard runs, in shard order, merged into --empirical-output by --merge-shards"},
+        {"serve", required_argument, 0, '\x02', "Keeps the reference chunks of --region in memory and imputes jobs read from a Unix socket created at this path (or from an existing job file or FIFO, or stdin if \"-\"), one \"<target> <output> [<format>]\" line per job, until a \"shutdown\" line"},
+        {"serve-cache", required_argument, 0, '\x02', "Memory cap (bytes, or with a K, M, G or T suffix) of the reference chunks kept by --serve, evicting the least recently used (default: 4G)"},
+        {"tile-dosages", no_argument, 0, '\x01', "Stores HMM dosages in tiles of 16 haplotypes so threads do not share cache lines (default: one row per variant)"},
+        {"typed-cache-dir", required_argument, 0, '\x02', "Directory where the typed-site reference data of each chunk is saved and reused by later runs with the same reference and target site list"},
+        {"stream-targets", no_argument, 0, '\x01', "Reads target genotypes one --temp-buffer sample group at a time, so target memory does not grow with the number of samples (re-reads the target file once per group)"},
+        {"no-er2", no_argument, 0, '\x01', "Skips the leave-one-out dosages of typed sites, which are only used for ER2 and --empirical-output, so typed sites are written without ER2 (cannot be combined with --empirical-output)"},
+        {"metrics-out", required_argument, 0, '\x02', "Output path for per-chunk stage timings and HMM counters (JSON if path ends in .json, otherwise TSV)"},
         {"update-m3vcf", no_argument, 0, '\x01', "Converts M3VCF to MVCF (default output: /dev/stdout)"},
         {"compress-reference", no_argument, 0, '\x01', "Compresses VCF to MVCF (default output: /dev/stdout)"},
+        {"index-reference", no_argument, 0, '\x01', "Writes block index of MVCF reference to <reference>.m4i (done automatically by --compress-reference)"},
+        {"cache-reference", no_argument, 0, '\x01', "Writes memory-mappable binary copy of MVCF reference to <reference>.m4c, which is then used automatically when imputing without --sample-ids"},
+        {"index-map", no_argument, 0, '\x01', "Writes memory-mappable binary copy of genetic map to <map>.m4g, which is then used automatically by --map"},
         {"min-block-size", required_argument, 0, '\x02', "Minimium block size for unique haplotype compression (default: 10)"},
         {"max-block-size", required_argument, 0, '\x02', "Maximum block size for unique haplotype compression (default: 65535)"},
         {"slope-unit", required_argument, 0, '\x02', "Parameter for unique haplotype compression heuristic (default: 10)"},
@@ -298,6 +444,10 @@ public:
    *   minimac4 [options] <reference.msav> <target.{sav,bcf,vcf.gz}>
    *   minimac4 [options] --update-m3vcf <reference.m3vcf.gz>
    *   minimac4 [options] --compress-reference <reference.{sav,bcf,vcf.gz}>
+   *   minimac4 [options] --index-reference <reference.msav>
+   *   minimac4 [options] --cache-reference <reference.msav>
+   *   minimac4 [options] --index-map <genetic_map.txt>
+   *   minimac4 [options] --merge-shards <shard1.sav> [<shard2.sav> ...]
    * @endcode
    *
    * Return conditions:
@@ -329,6 +479,7 @@ public:
   {
     int long_index = 0;
     int opt;
+    optind = 0; // Restarts getopt, so that arguments can be parsed more than once per process (tests).
     while ((opt = getopt_long(argc, argv, short_opt_string_.c_str(), long_options_.data(), &long_index)) != -1)
     {
       char copt = char(opt & 0xFF);
@@ -350,16 +501,9 @@ public:
         help_ = true;
         return true;
       case 'f':
-        {
-          fmt_fields_ = split_string_to_vector(optarg ? optarg : "", ',');
-          std::unordered_set<std::string> allowed = {"GT", "GP", "DS", "HDS", "SD"};
-          for (auto it = fmt_fields_.begin(); it != fmt_fields_.end(); ++it)
-          {
-            if (allowed.find(*it) == allowed.end())
-              return std::cerr << "Error: Invalid --format option (" << *it << ")\n", false;
-          }
-          break;
-        }
+        if (!parse_fmt_fields(optarg ? optarg : ""))
+          return false;
+        break;
       case 'm':
         map_path_ = optarg ? optarg : "";
         break;
@@ -433,6 +577,41 @@ public:
           compress_reference_ = true;
           break;
         }
+        else if (std::string(long_options_[long_index].name) == "index-reference")
+        {
+          index_reference_ = true;
+          break;
+        }
+        else if (std::string(long_options_[long_index].name) == "cache-reference")
+        {
+          cache_reference_ = true;
+          break;
+        }
+        else if (std::string(long_options_[long_index].name) == "index-map")
+        {
+          index_map_ = true;
+          break;
+        }
+        else if (std::string(long_options_[long_index].name) == "tile-dosages")
+        {
+          tile_dosages_ = true;
+          break;
+        }
+        else if (std::string(long_options_[long_index].name) == "merge-shards")
+        {
+          merge_shards_ = true;
+          break;
+        }
+        else if (std::string(long_options_[long_index].name) == "stream-targets")
+        {
+          stream_targets_ = true;
+          break;
+        }
+        else if (std::string(long_options_[long_index].name) == "no-er2")
+        {
+          no_er2_ = true;
+          break;
+        }
         else if (std::string(long_options_[long_index].name) == "allTypedSites")
         {
           std::cerr << "Warning: --allTypedSites is deprecated in favor of --all-typed-sites\n";
@@ -510,11 +689,101 @@ public:
             prob_threshold_s1_ = std::min(1., std::atof(optarg ? optarg : ""));
             break;
           }
+          else if (long_opt_str == "max-templates")
+          {
+            max_templates_ = std::size_t(std::max(0ll, std::atoll(optarg ? optarg : "")));
+            break;
+          }
           else if (long_opt_str == "temp-prefix")
           {
             temp_prefix_ = optarg ? optarg : "";
             break;
           }
+          else if (long_opt_str == "typed-cache-dir")
+          {
+            typed_cache_dir_ = optarg ? optarg : "";
+            break;
+          }
+          else if (long_opt_str == "forward-checkpoints")
+          {
+            std::string val = optarg ? optarg : "";
+            if (val == "block")
+              forward_checkpoints_ = std::numeric_limits<std::size_t>::max();
+            else
+              forward_checkpoints_ = std::size_t(std::max(0ll, std::atoll(val.c_str())));
+            break;
+          }
+          else if (long_opt_str == "hmm-precision")
+          {
+            std::string val = optarg ? optarg : "";
+            if (!parse_hmm_precision(val, hmm_precision_))
+            {
+              std::cerr << "Invalid --hmm-precision: " << val << std::endl;
+              return false;
+            }
+            break;
+          }
+          else if (long_opt_str == "prefetch-chunks")
+          {
+            prefetch_chunks_ = std::size_t(std::max(0ll, std::atoll(optarg ? optarg : "")));
+            break;
+          }
+          else if (long_opt_str == "parallel-chunks")
+          {
+            parallel_chunks_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+            break;
+          }
+          else if (long_opt_str == "max-memory")
+          {
+            std::string val = optarg ? optarg : "";
+            if (!parse_byte_size(val, max_memory_) || max_memory_ == 0)
+            {
+              std::cerr << "Invalid --max-memory: " << val << std::endl;
+              return false;
+            }
+            break;
+          }
+          else if (long_opt_str == "serve")
+          {
+            serve_path_ = optarg ? optarg : "";
+            break;
+          }
+          else if (long_opt_str == "serve-cache")
+          {
+            std::string val = optarg ? optarg : "";
+            if (!parse_byte_size(val, serve_cache_bytes_))
+            {
+              std::cerr << "Invalid --serve-cache: " << val << std::endl;
+              return false;
+            }
+            break;
+          }
+          else if (long_opt_str == "sample-shard")
+          {
+            std::string val = optarg ? optarg : "";
+            std::size_t slash = val.find('/');
+            long long shard = std::atoll(val.substr(0, slash).c_str());
+            long long n_shards = slash == std::string::npos ? 0 : std::atoll(val.substr(slash + 1).c_str());
+            if (shard < 1 || n_shards < 1 || shard > n_shards)
+            {
+              std::cerr << "Invalid --sample-shard: " << val << std::endl;
+              return false;
+            }
+            sample_shard_ = std::size_t(shard - 1);
+            sample_shard_count_ = std::size_t(n_shards);
+            sample_sharded_ = true;
+            break;
+          }
+          else if (long_opt_str == "empirical-shards")
+          {
+            emp_shard_paths_ = split_string_to_vector(optarg ? optarg : "", ',');
+            break;
+          }
+          else if (long_opt_str == "metrics-out")
+          {
+            metrics_out_path_ = optarg ? optarg : "";
+            break;
+          }
           else if (long_opt_str == "diff-threshold")
           {
             diff_threshold_ = std::max(0., std::atof(optarg ? optarg : ""));
@@ -630,12 +899,34 @@ public:
 
     int remaining_arg_count = argc - optind;
 
-    if (remaining_arg_count == 2)
+    if (merge_shards_)
+    {
+      if (remaining_arg_count < 1)
+      {
+        std::cerr << "Too few arguments\n";
+        return false;
+      }
+      shard_paths_.assign(argv + optind, argv + argc);
+      if (!emp_shard_paths_.empty() && emp_shard_paths_.size() != shard_paths_.size())
+      {
+        std::cerr << "Error: --empirical-shards must list one file per shard\n";
+        return false;
+      }
+    }
+    else if (remaining_arg_count == 2)
     {
       ref_path_ = argv[optind];
       tar_path_ = argv[optind + 1];
     }
-    else if ((update_m3vcf_ || compress_reference_) && remaining_arg_count == 1)
+    else if ((update_m3vcf_ || compress_reference_ || index_reference_ || cache_reference_) && remaining_arg_count == 1)
+    {
+      ref_path_ = argv[optind];
+    }
+    else if (index_map_ && remaining_arg_count == 1)
+    {
+      map_path_ = argv[optind];
+    }
+    else if (serve_path_.size() && remaining_arg_count == 1)
     {
       ref_path_ = argv[optind];
     }
@@ -653,6 +944,18 @@ public:
       return false;
     }
 
+    if (serve_path_.size() && (merge_shards_ || sample_sharded_ || max_memory_))
+    {
+      std::cerr << "Error: --serve cannot be combined with --merge-shards, --sample-shard or --max-memory\n";
+      return false;
+    }
+
+    if (merge_shards_ && sample_sharded_)
+    {
+      std::cerr << "Error: --merge-shards cannot be combined with --sample-shard\n";
+      return false;
+    }
+
     if (!prefix_.empty())
     {
       std::string suffix = "sav";
@@ -671,6 +974,18 @@ public:
         emp_out_path_ = prefix_ + ".empiricalDose." + suffix;
     }
 
+    if (serve_path_.size() && (!emp_out_path_.empty() || !sites_out_path_.empty()))
+    {
+      std::cerr << "Error: --serve cannot be combined with --empirical-output or --sites, which would be shared by all jobs\n";
+      return false;
+    }
+
+    if (no_er2_ && !emp_out_path_.empty())
+    {
+      std::cerr << "Error: --no-er2 cannot be combined with --empirical-output\n";
+      return false;
+    }
+
     if (temp_prefix_.empty())
     {
       char* tmpdir = std::getenv("TMPDIR");
@@ -752,6 +1067,65 @@ private:
     }
   }
 
+  /**
+   * @brief Sets the FORMAT fields from a comma-separated list (`--format`).
+   * @return False if a field is not one of GT, GP, DS, HDS or SD.
+   */
+  bool parse_fmt_fields(const char* in)
+  {
+    fmt_fields_ = split_string_to_vector(in, ',');
+    std::unordered_set<std::string> allowed = {"GT", "GP", "DS", "HDS", "SD"};
+    for (auto it = fmt_fields_.begin(); it != fmt_fields_.end(); ++it)
+    {
+      if (allowed.find(*it) == allowed.end())
+        return std::cerr << "Error: Invalid --format option (" << *it << ")\n", false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Parse a byte count with an optional binary suffix.
+   *
+   * Accepts a decimal number optionally followed by `K`, `M`, `G` or `T`
+   * (case-insensitive, with an optional trailing `B`), e.g. `"512M"` or
+   * `"1.5G"`.
+   *
+   * @param s     Input string.
+   * @param bytes Set to the parsed number of bytes.
+   * @return False if the string is not a valid size.
+   */
+  static bool parse_byte_size(const std::string& s, std::uint64_t& bytes)
+  {
+    char* end = nullptr;
+    double val = std::strtod(s.c_str(), &end);
+    if (end == s.c_str() || val < 0.)
+      return false;
+
+    std::string suffix(end);
+    if (!suffix.empty() && std::toupper(suffix.back()) == 'B')
+      suffix.pop_back();
+
+    double scale = 1.;
+    if (suffix.size() == 1)
+    {
+      switch (std::toupper(suffix[0]))
+      {
+      case 'K': scale = 1024.; break;
+      case 'M': scale = 1024. * 1024.; break;
+      case 'G': scale = 1024. * 1024. * 1024.; break;
+      case 'T': scale = 1024. * 1024. * 1024. * 1024.; break;
+      default: return false;
+      }
+    }
+    else if (!suffix.empty())
+    {
+      return false;
+    }
+
+    bytes = std::uint64_t(val * scale);
+    return true;
+  }
+
   /**
    * @brief Split a C-style string into tokens based on a delimiter.
    *
@@ -3,6 +3,16 @@
 #include <cassert>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 
@@ -116,84 +126,287 @@ bool recombination::read_entry(std::istream& ifs, map_file_line& entry, bool new
   return true;
 }
 
+namespace
+{
+  const char map_magic[8] = {'M', '4', 'G', 'v', '1', '.', '0', '\0'};
+
+  std::uint64_t align8(std::uint64_t offset) { return (offset + 7) & ~std::uint64_t(7); }
+}
+
 genetic_map_file::genetic_map_file(const std::string& map_file_path, const std::string& chrom) :
-  ifs_(map_file_path),
   target_chrom_(chrom),
-  good_(true),
-  new_format_(false)
+  good_(true)
 {
-  while (ifs_.peek() == '#') // skip header line
+  if (open_binary(map_file_path))
+    return;
+
+  std::vector<record> records;
+  if (!parse_text(map_file_path, chrom, records))
   {
-    std::string line;
-    std::getline(ifs_, line);
-    if (std::count(line.begin(), line.end(), '\t') != 2)
-    {
-      std::cerr << "Error: invalid genetic map file" << std::endl;
-      good_ = false;
-      return;
-    }
-    new_format_ = true;
+    std::cerr << "Error: invalid genetic map file" << std::endl;
+    good_ = false;
+    return;
   }
 
-  do
+  if (records.empty())
   {
-    if (!read_record(prev_rec_))
+    std::cerr << "Error: target chromosome not found in genetic map file" << std::endl;
+    good_ = false;
+    return;
+  }
+
+  if (records.size() == 1)
+  {
+    std::cerr << "Error: only one record in map file matches target chromosome" << std::endl;
+    good_ = false;
+    return;
+  }
+
+  owned_positions_.reserve(records.size());
+  owned_cms_.reserve(records.size());
+  for (auto it = records.begin(); it != records.end(); ++it)
+  {
+    if (!owned_positions_.empty() && it->pos < owned_positions_.back())
     {
-      std::cerr << "Error: target chromosome not found in genetic map file" << std::endl;
+      std::cerr << "Error: genetic map file is not sorted by position" << std::endl;
       good_ = false;
       return;
     }
-  } while (prev_rec_.chrom != target_chrom_);
+    owned_positions_.push_back(it->pos);
+    owned_cms_.push_back(it->map_value);
+  }
+
+  positions_ = owned_positions_.data();
+  cms_ = owned_cms_.data();
+  size_ = owned_positions_.size();
+}
 
-  if (!read_record(cur_rec_) || cur_rec_.chrom != target_chrom_)
+genetic_map_file::~genetic_map_file()
+{
+  if (mapping_)
+    munmap(const_cast<char*>(mapping_), mapping_size_);
+}
+
+bool genetic_map_file::open_binary(const std::string& map_file_path)
+{
+  std::string bin_path = default_path(map_file_path);
+  struct stat bin_st, map_st;
+  if (stat(bin_path.c_str(), &bin_st) != 0)
+    return false;
+
+  if (stat(map_file_path.c_str(), &map_st) == 0 && bin_st.st_mtime < map_st.st_mtime)
+    return std::cerr << "Warning: ignoring " << bin_path << " since it is older than the map file\n", false;
+
+  if (std::size_t(bin_st.st_size) < sizeof(file_header))
+    return std::cerr << "Warning: ignoring " << bin_path << " since it is not a valid M4G file\n", false;
+
+  int fd = ::open(bin_path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return std::cerr << "Warning: could not open " << bin_path << "\n", false;
+
+  void* addr = mmap(nullptr, bin_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED)
+    return std::cerr << "Warning: could not map " << bin_path << "\n", false;
+
+  const char* data = static_cast<const char*>(addr);
+  std::size_t size = bin_st.st_size;
+  const file_header* header = reinterpret_cast<const file_header*>(data);
+  const chrom_entry* entries = reinterpret_cast<const chrom_entry*>(data + sizeof(file_header));
+  bool valid = std::memcmp(header->magic, map_magic, sizeof(map_magic)) == 0
+    && header->file_size == size
+    && sizeof(file_header) + header->n_chroms * sizeof(chrom_entry) <= size;
+
+  const chrom_entry* found = nullptr;
+  for (std::uint64_t i = 0; valid && i < header->n_chroms; ++i)
   {
-    std::cerr << "Error: only one record in map file matches target chromosome" << std::endl;
-    good_ = false;
+    const chrom_entry& e = entries[i];
+    valid = e.name_offset + e.name_size <= size && e.data_offset % 8 == 0 && e.n_records >= 2
+      && e.data_offset + e.n_records * (sizeof(std::uint64_t) + sizeof(double)) <= size;
+    if (valid && std::string(data + e.name_offset, e.name_size) == target_chrom_)
+      found = &e;
   }
+
+  if (!valid)
+  {
+    munmap(addr, size);
+    return std::cerr << "Warning: ignoring " << bin_path << " since it is not a valid M4G file\n", false;
+  }
+
+  if (!found)
+  {
+    munmap(addr, size);
+    return false; // The text file reports the missing chromosome.
+  }
+
+  mapping_ = data;
+  mapping_size_ = size;
+  positions_ = reinterpret_cast<const std::uint64_t*>(data + found->data_offset);
+  cms_ = reinterpret_cast<const double*>(positions_ + found->n_records);
+  size_ = found->n_records;
+  return true;
 }
 
-double genetic_map_file::interpolate_centimorgan(std::size_t variant_pos)
+bool genetic_map_file::parse_text(const std::string& map_file_path, const std::string& chrom, std::vector<record>& records)
 {
-  if (good_)
+  records.clear();
+  shrinkwrap::istream ifs(map_file_path);
+  if (!ifs)
+    return false;
+
+  bool new_format = false;
+  while (ifs.peek() == '#') // skip header line
   {
-    if (variant_pos < prev_rec_.pos)
-    {
-      auto basepair_cm = prev_rec_.map_value / double(prev_rec_.pos);
-      return double(double(variant_pos) * basepair_cm);
-    }
+    std::string line;
+    std::getline(ifs, line);
+    if (std::count(line.begin(), line.end(), '\t') != 2)
+      return false;
+    new_format = true;
+  }
 
-    record temp_rec;
-    while (variant_pos >= cur_rec_.pos && read_record(temp_rec) && temp_rec.chrom == target_chrom_)
-    {
-      prev_rec_ = cur_rec_;
-      cur_rec_ = temp_rec;
-    }
+  // Records of a chromosome are expected to be contiguous, so only the first run of each is kept.
+  std::unordered_set<std::string> finished;
+  record rec;
+  std::string discard;
+  while (true)
+  {
+    if (new_format)
+      ifs >> rec.chrom >> rec.pos >> rec.map_value;
+    else
+      ifs >> rec.chrom >> discard >> rec.map_value >> rec.pos;
 
-    assert(cur_rec_.pos != prev_rec_.pos); //TODO: handle gracefully
-    assert(cur_rec_.pos - prev_rec_.pos < cur_rec_.pos); //TODO: handle gracefully
-    auto basepair_cm = (cur_rec_.map_value - prev_rec_.map_value) / double(cur_rec_.pos - prev_rec_.pos);
+    if (!ifs || rec.chrom.empty())
+      break;
 
-    if (variant_pos < cur_rec_.pos)
+    if (!records.empty() && records.back().chrom != rec.chrom)
     {
-      assert(variant_pos - prev_rec_.pos < variant_pos); //TODO: handle gracefully
-      return double(prev_rec_.map_value + double(variant_pos - prev_rec_.pos) * basepair_cm);
+      finished.insert(records.back().chrom);
+      if (!chrom.empty())
+        break;
     }
 
-    return double(cur_rec_.map_value + double(variant_pos - cur_rec_.pos) * basepair_cm); // Should we assume that basepair_cm is zero?
+    if ((chrom.empty() || rec.chrom == chrom) && finished.find(rec.chrom) == finished.end())
+      records.push_back(rec);
   }
 
-  return std::numeric_limits<double>::quiet_NaN();;
+  return true;
 }
 
-bool genetic_map_file::read_record(record& entry)
+bool genetic_map_file::save_binary(const std::string& map_file_path)
 {
-  std::string discard;
-  if (new_format_)
-    ifs_ >> entry.chrom >> entry.pos >> entry.map_value;
-  else
-    ifs_ >> entry.chrom >> discard >> entry.map_value >> entry.pos;
+  std::vector<record> records;
+  if (!parse_text(map_file_path, "", records))
+    return std::cerr << "Error: invalid genetic map file\n", false;
 
-  if (!ifs_ || entry.chrom.empty())
-    return false;
+  // Runs of records per chromosome, as [begin, end) into records.
+  std::vector<std::pair<std::size_t, std::size_t>> runs;
+  for (std::size_t i = 0; i < records.size(); ++i)
+  {
+    if (runs.empty() || records[i].chrom != records[runs.back().first].chrom)
+      runs.emplace_back(i, i);
+    else if (records[i].pos < records[i - 1].pos)
+      return std::cerr << "Error: genetic map file is not sorted by position\n", false;
+    ++runs.back().second;
+  }
+
+  std::vector<chrom_entry> entries;
+  std::uint64_t offset = sizeof(file_header) + runs.size() * sizeof(chrom_entry);
+  for (auto it = runs.begin(); it != runs.end(); ++it)
+  {
+    chrom_entry e;
+    e.name_offset = offset;
+    e.name_size = records[it->first].chrom.size();
+    e.n_records = it->second - it->first;
+    offset += e.name_size;
+    entries.push_back(e);
+  }
+  for (auto it = entries.begin(); it != entries.end(); ++it)
+  {
+    offset = align8(offset);
+    it->data_offset = offset;
+    offset += it->n_records * (sizeof(std::uint64_t) + sizeof(double));
+  }
+
+  std::string bin_path = default_path(map_file_path);
+  std::ofstream ofs(bin_path, std::ios::binary);
+  if (!ofs)
+    return std::cerr << "Error: could not open " << bin_path << " for writing\n", false;
+
+  file_header header;
+  std::memcpy(header.magic, map_magic, sizeof(map_magic));
+  header.file_size = offset;
+  header.n_chroms = entries.size();
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  ofs.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(chrom_entry));
+  for (auto it = runs.begin(); it != runs.end(); ++it)
+    ofs.write(records[it->first].chrom.data(), records[it->first].chrom.size());
+
+  static const char zeros[8] = {};
+  for (std::size_t c = 0; c < runs.size(); ++c)
+  {
+    ofs.write(zeros, entries[c].data_offset - std::uint64_t(ofs.tellp()));
+    for (std::size_t i = runs[c].first; i < runs[c].second; ++i)
+    {
+      std::uint64_t pos = records[i].pos;
+      ofs.write(reinterpret_cast<const char*>(&pos), sizeof(pos));
+    }
+    for (std::size_t i = runs[c].first; i < runs[c].second; ++i)
+      ofs.write(reinterpret_cast<const char*>(&records[i].map_value), sizeof(double));
+  }
+
+  if (!ofs.good())
+    return std::cerr << "Error: failed writing " << bin_path << "\n", false;
+
+  std::cerr << "Wrote " << runs.size() << " chromosomes to " << bin_path << std::endl;
   return true;
-}
\ No newline at end of file
+}
+
+double genetic_map_file::interpolate_centimorgan(std::size_t variant_pos) const
+{
+  std::uint64_t pos = variant_pos;
+  double cm;
+  interpolate_centimorgans(&pos, 1, &cm);
+  return cm;
+}
+
+void genetic_map_file::interpolate_centimorgans(const std::uint64_t* positions, std::size_t n, double* cms) const
+{
+  if (!good_)
+  {
+    std::fill(cms, cms + n, std::numeric_limits<double>::quiet_NaN());
+    return;
+  }
+
+  std::size_t v = 0;
+  double first_rate = cms_[0] / double(positions_[0]);
+  for ( ; v < n && positions[v] < positions_[0]; ++v)
+    cms[v] = double(positions[v]) * first_rate;
+
+  if (v == n)
+    return;
+
+  // Index of the first record after positions[v].
+  std::size_t r = std::upper_bound(positions_, positions_ + size_, positions[v]) - positions_;
+  while (v < n)
+  {
+    assert(r > 0);
+    std::size_t base = r < size_ ? r - 1 : size_ - 1;
+    double rate = interval_rate(r < size_ ? r - 1 : size_ - 2);
+    std::uint64_t base_pos = positions_[base];
+    double base_cm = cms_[base];
+
+    // Beyond the last record, the rate of the last two records is extrapolated.
+    std::size_t end = r < size_ ? v : n;
+    while (end < n && positions[end] < positions_[r])
+      ++end;
+
+    for ( ; v < end; ++v)
+    {
+      assert(positions[v] >= base_pos);
+      cms[v] = base_cm + double(positions[v] - base_pos) * rate;
+    }
+
+    while (v < n && r < size_ && positions_[r] <= positions[v])
+      ++r;
+  }
+}
@@ -8,6 +8,7 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <cstddef>
 #include <algorithm>
 #include <cmath>
 
@@ -203,9 +204,18 @@ private:
  * - **New format**: Three columns — `chrom pos cM`
  * - **Legacy format**: Four columns — `chrom <discard> cM pos`
  *
- * Only entries corresponding to the specified target chromosome are processed.
+ * Only entries corresponding to the specified target chromosome are kept.
+ * They are held as sorted position and cM arrays, so positions may be
+ * interpolated in any order and from several threads.
  *
- * @see record, read_record(), interpolate_centimorgan()
+ * If `<map>.m4g` (written by `save_binary()`, see `--index-map`) exists and is
+ * not older than the map, the arrays of the chromosome are memory-mapped from
+ * it instead of parsing the text file. Its layout (native byte order) is a
+ * header with an 8-byte magic, the file size and the number of chromosomes,
+ * a table of `chrom_entry`, the chromosome names, then the 8-byte aligned
+ * position (uint64) and cM (double) arrays of each chromosome.
+ *
+ * @see interpolate_centimorgan(), interpolate_centimorgans()
  */
 class genetic_map_file
 {
@@ -221,27 +231,43 @@ public:
     std::size_t pos = 0; ///< Basepair position on the chromosome.
     double map_value = 0.; ///< Genetic distance (in centimorgans).
   };
+
+  /** @brief Header of a `.m4g` file. */
+  struct file_header
+  {
+    char magic[8];            ///< "M4Gv1.0" followed by a null byte.
+    std::uint64_t file_size;  ///< Size of the whole file, to detect truncation.
+    std::uint64_t n_chroms;   ///< Number of `chrom_entry` records after the header.
+  };
+
+  /** @brief Location of the records of one chromosome in a `.m4g` file. */
+  struct chrom_entry
+  {
+    std::uint64_t name_offset;  ///< Offset of the chromosome name.
+    std::uint64_t name_size;    ///< Length of the chromosome name.
+    std::uint64_t data_offset;  ///< Offset of the position array, followed by the cM array.
+    std::uint64_t n_records;    ///< Number of map records.
+  };
 private:
-  shrinkwrap::istream ifs_;  ///< Input stream for the genetic map file.
-  std::string target_chrom_; ///< Chromosome of interest.
-  record prev_rec_;          ///< Previously read record for interpolation.
-  record cur_rec_;           ///< Current record used for interpolation.
-  bool good_;                ///< Status flag: true if file is valid and usable.
-  bool new_format_;          ///< True if file follows the new three-column format.
+  std::string target_chrom_;       ///< Chromosome of interest.
+  std::vector<std::uint64_t> owned_positions_; ///< Positions parsed from the text file.
+  std::vector<double> owned_cms_;  ///< Map values parsed from the text file.
+  const std::uint64_t* positions_ = nullptr; ///< Sorted record positions.
+  const double* cms_ = nullptr;    ///< Map value (cM) of each record.
+  std::size_t size_ = 0;           ///< Number of records.
+  const char* mapping_ = nullptr;  ///< Mapped `.m4g` file, if used.
+  std::size_t mapping_size_ = 0;   ///< Size of the mapping.
+  bool good_;                      ///< Status flag: true if file is valid and usable.
 public:
   /**
-   * @brief Constructs a genetic_map_file object for reading recombination map data.
-   *
-   * This constructor opens a genetic map file and prepares it for iterating over
-   * recombination map records associated with a specific chromosome.
+   * @brief Loads the records of one chromosome of a genetic map.
    *
    * The constructor:
-   * - Opens the map file stream.
-   * - Detects whether the file is in "new format" (three-column format with tab separators)
-   *   or the older PLINK-style format.
-   * - Skips header lines (those beginning with `#`).
-   * - Searches for the first record matching the requested chromosome.
-   * - Reads and buffers the first two records (`prev_rec_` and `cur_rec_`) for iteration.
+   * - Maps `<map>.m4g` if it is present, current and lists the chromosome.
+   * - Otherwise, detects whether the text file is in "new format" (three-column
+   *   format with tab separators) or the older PLINK-style format, skips header
+   *   lines (those beginning with `#`) and reads the records of the requested
+   *   chromosome.
    *
    * @param map_file_path Path to the genetic map file.
    * @param chrom Chromosome identifier to extract records for.
@@ -263,6 +289,19 @@ public:
    */
   genetic_map_file(const std::string& map_file_path, const std::string& chrom);
 
+  genetic_map_file(const genetic_map_file&) = delete;
+  genetic_map_file& operator=(const genetic_map_file&) = delete;
+
+  ~genetic_map_file();
+
+  /** @return Default path of the binary form of a map file. */
+  static std::string default_path(const std::string& map_file_path) { return map_file_path + ".m4g"; }
+
+  /**
+   * @brief Parses every chromosome of a text map and writes `<map>.m4g`.
+   * @return False if the map could not be read or the file could not be written.
+   */
+  static bool save_binary(const std::string& map_file_path);
 
   /**
    * @brief Check whether the genetic map file was loaded successfully.
@@ -294,57 +333,64 @@ public:
    */
   operator bool() const { return good_; }
 
+  /** @return Chromosome of the loaded records. */
+  const std::string& chromosome() const { return target_chrom_; }
+
   /**
    * @brief Interpolate the genetic map position (in centimorgans) for a variant.
    *
    * Given a genomic coordinate (basepair position), this method estimates
    * the corresponding centimorgan (cM) value using linear interpolation
-   * between records in the genetic map file. The interpolation relies on
-   * two adjacent map records (`prev_rec_` and `cur_rec_`).
+   * between the two map records around it, found by binary search.
    *
    * - If the position is before the first record, interpolation assumes
    *   a proportional relationship between basepairs and cM using the
    *   first record as reference.
    * - If the position falls between two known records, interpolation is
    *   performed linearly between their map values.
-   * - If the position extends beyond the current block, additional records
-   *   are read until the correct interval is found or until the chromosome
-   *   ends.
+   * - If the position is at or after the last record, the rate of the last
+   *   two records is extrapolated.
    *
    * @param variant_pos The genomic coordinate (basepair position) of the variant.
    * @return The interpolated centimorgan (cM) value. If the object is invalid
    *         (`good_ == false`), returns NaN.
    *
-   * @note Assertions ensure that consecutive map records have different
-   *       positions. These cases should ideally be handled more gracefully.
-   *
    * @warning Extrapolation beyond the last record assumes constant recombination
    *          rate (`basepair_cm`). Interpret with caution.
    *
    * @see good()
    */
-  double interpolate_centimorgan(std::size_t variant_pos);
-private:
+  double interpolate_centimorgan(std::size_t variant_pos) const;
 
   /**
-   * @brief Read the next record from the genetic map file.
-   *
-   * This method extracts a single record from the input stream `ifs_` into
-   * the provided `entry`. The parsing format depends on whether the map file
-   * is in the "new format" (three-column: `chrom pos cM`) or the legacy format
-   * (four-column: `chrom <discard> cM pos`).
-   *
-   * @param[out] entry A reference to a record object that will be populated
-   *                   with chromosome, position, and map value.
+   * @brief Interpolates the cM values of sorted positions.
    *
-   * @return `true` if a record was successfully read and is valid,
-   *         `false` if the stream is exhausted, corrupted, or the
-   *         chromosome field is empty.
+   * Gives the same values as `interpolate_centimorgan()`, but finds the map
+   * interval of the first position only and then advances through the
+   * records, so that the positions of one interval are interpolated by a
+   * single affine loop.
    *
-   * @note The `discard` column in legacy format is read but ignored.
-   * @see interpolate_centimorgan(), good()
+   * @param positions Positions in increasing order.
+   * @param n Number of positions.
+   * @param[out] cms Interpolated values, or NaN if the object is invalid.
    */
-  bool read_record(record& rec);
+  void interpolate_centimorgans(const std::uint64_t* positions, std::size_t n, double* cms) const;
+private:
+  /** @brief Maps `<map>.m4g` and points the arrays at the chromosome. @return False if the file is missing, stale, malformed or lacks the chromosome. */
+  bool open_binary(const std::string& map_file_path);
+
+  /**
+   * @brief Reads the records of one chromosome (or all, if `chrom` is empty) from a text map.
+   * @param[out] records Records in file order.
+   * @return False if the header is invalid.
+   */
+  static bool parse_text(const std::string& map_file_path, const std::string& chrom, std::vector<record>& records);
+
+  /** @return Rate (cM per basepair) between records `i` and `i + 1`. */
+  double interval_rate(std::size_t i) const
+  {
+    return positions_[i + 1] == positions_[i] ? 0. : (cms_[i + 1] - cms_[i]) / double(positions_[i + 1] - positions_[i]);
+  }
 };
 
 #endif // MINIMAC4_RECOMBINATION_HPP
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include "reduced_precision.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace
+{
+  std::uint32_t float_bits(float f)
+  {
+    std::uint32_t b;
+    std::memcpy(&b, &f, sizeof(b));
+    return b;
+  }
+
+  float bits_float(std::uint32_t b)
+  {
+    float f;
+    std::memcpy(&f, &b, sizeof(f));
+    return f;
+  }
+
+  // Inputs are finite and non-negative, so only rounding of the magnitude is handled.
+  std::uint16_t float_to_bf16(float f)
+  {
+    std::uint32_t b = float_bits(f);
+    b += 0x7FFFu + ((b >> 16) & 1u);
+    return std::uint16_t(b >> 16);
+  }
+
+  float bf16_to_float(std::uint16_t h)
+  {
+    return bits_float(std::uint32_t(h) << 16);
+  }
+
+  std::uint16_t float_to_fp16(float f)
+  {
+    std::uint32_t b = float_bits(f);
+    std::uint32_t e = b >> 23;
+    if (e < 102)
+      return 0; // Below half the smallest subnormal
+    if (e > 142)
+      return 0x7C00; // Infinity
+
+    std::uint32_t mant = b & 0x7FFFFFu;
+    std::uint32_t shift = 13;
+    std::uint32_t h;
+    if (e < 113)
+    {
+      // Subnormal half: the implicit bit becomes explicit.
+      mant |= 0x800000u;
+      shift = 126 - e;
+      h = mant >> shift;
+    }
+    else
+    {
+      h = ((e - 112) << 10) | (mant >> shift);
+    }
+
+    std::uint32_t rem = mant & ((1u << shift) - 1u);
+    std::uint32_t half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (h & 1u)))
+      ++h; // A carry out of the mantissa increments the exponent.
+    return std::uint16_t(h);
+  }
+
+  float fp16_to_float(std::uint16_t h)
+  {
+    std::uint32_t e = (h >> 10) & 0x1Fu;
+    std::uint32_t mant = h & 0x3FFu;
+    if (e == 0)
+      return float(mant) * (1.f / 16777216.f); // 2^-24
+    if (e == 0x1F)
+      return bits_float(0x7F800000u | (mant << 13));
+    return bits_float(((e + 112) << 23) | (mant << 13));
+  }
+}
+
+bool parse_hmm_precision(const std::string& name, hmm_precision& precision)
+{
+  if (name == "fp32")
+    precision = hmm_precision::fp32;
+  else if (name == "bf16")
+    precision = hmm_precision::bf16;
+  else if (name == "fp16")
+    precision = hmm_precision::fp16;
+  else
+    return false;
+  return true;
+}
+
+const char* hmm_precision_name(hmm_precision precision)
+{
+  switch (precision)
+  {
+  case hmm_precision::bf16: return "bf16";
+  case hmm_precision::fp16: return "fp16";
+  default: return "fp32";
+  }
+}
+
+void packed_prob_row::pack(const std::vector<float>& probs, const std::vector<float>& probs_norecom, hmm_precision precision)
+{
+  assert(probs.size() == probs_norecom.size());
+  assert(precision != hmm_precision::fp32);
+
+  float max_prob = probs.empty() ? 0.f : *std::max_element(probs.begin(), probs.end());
+  scale_ = max_prob > 0.f ? max_prob : 1.f;
+  float inv_scale = 1.f / scale_;
+
+  probs_.resize(probs.size());
+  probs_norecom_.resize(probs.size());
+  if (precision == hmm_precision::bf16)
+  {
+    for (std::size_t i = 0; i < probs.size(); ++i)
+    {
+      probs_[i] = float_to_bf16(probs[i] * inv_scale);
+      probs_norecom_[i] = float_to_bf16(probs_norecom[i] * inv_scale);
+    }
+  }
+  else
+  {
+    for (std::size_t i = 0; i < probs.size(); ++i)
+    {
+      probs_[i] = float_to_fp16(probs[i] * inv_scale);
+      probs_norecom_[i] = float_to_fp16(probs_norecom[i] * inv_scale);
+    }
+  }
+}
+
+void packed_prob_row::unpack(std::vector<float>& probs, std::vector<float>& probs_norecom, hmm_precision precision) const
+{
+  assert(precision != hmm_precision::fp32);
+
+  probs.resize(probs_.size());
+  probs_norecom.resize(probs_.size());
+  if (precision == hmm_precision::bf16)
+  {
+    for (std::size_t i = 0; i < probs.size(); ++i)
+    {
+      probs[i] = bf16_to_float(probs_[i]) * scale_;
+      probs_norecom[i] = bf16_to_float(probs_norecom_[i]) * scale_;
+    }
+  }
+  else
+  {
+    for (std::size_t i = 0; i < probs.size(); ++i)
+    {
+      probs[i] = fp16_to_float(probs_[i]) * scale_;
+      probs_norecom[i] = fp16_to_float(probs_norecom_[i]) * scale_;
+    }
+  }
+}
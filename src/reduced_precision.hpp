@@ -0,0 +1,56 @@
+#ifndef MINIMAC4_REDUCED_PRECISION_HPP
+#define MINIMAC4_REDUCED_PRECISION_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Storage precision of the forward probability matrices.
+ */
+enum class hmm_precision
+{
+  fp32, ///< Single precision (default).
+  bf16, ///< bfloat16: 8-bit exponent and 7-bit mantissa.
+  fp16  ///< IEEE half precision: 5-bit exponent and 10-bit mantissa.
+};
+
+/**
+ * @brief Parses a precision name ("fp32", "bf16" or "fp16").
+ * @return false if `name` is not a known precision.
+ */
+bool parse_hmm_precision(const std::string& name, hmm_precision& precision);
+
+/** @return Name of a precision. */
+const char* hmm_precision_name(hmm_precision precision);
+
+/**
+ * @brief A forward row and its no-recombination row stored as 16-bit values.
+ *
+ * Both rows are divided by one scale factor, the maximum of the probability
+ * row, before rounding to nearest even. Since the no-recombination row never
+ * exceeds the probability row, the shared scale keeps that ordering after
+ * rounding. Values too small for the format relative to the row maximum are
+ * flushed to zero.
+ */
+class packed_prob_row
+{
+private:
+  std::vector<std::uint16_t> probs_;
+  std::vector<std::uint16_t> probs_norecom_;
+  float scale_ = 1.f;
+public:
+  /** @brief Rounds `probs` and `probs_norecom` to 16 bits. */
+  void pack(const std::vector<float>& probs, const std::vector<float>& probs_norecom, hmm_precision precision);
+
+  /** @brief Widens the stored rows back to single precision. */
+  void unpack(std::vector<float>& probs, std::vector<float>& probs_norecom, hmm_precision precision) const;
+
+  /** @return Number of values in each row. */
+  std::size_t size() const { return probs_.size(); }
+
+  /** @return Number of values allocated for both rows. */
+  std::size_t capacity() const { return probs_.capacity() + probs_norecom_.capacity(); }
+};
+
+#endif // MINIMAC4_REDUCED_PRECISION_HPP
@@ -0,0 +1,356 @@
+#include "reference_cache.hpp"
+
+#include <savvy/reader.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+  const char cache_magic[8] = {'M', '4', 'C', 'v', '1', '.', '1', '\0'};
+
+  std::uint64_t align8(std::uint64_t offset) { return (offset + 7) & ~std::uint64_t(7); }
+
+  std::uint64_t row_bytes(const reference_cache::block_entry& e) { return e.packed ? (e.n_reps + 7) / 8 : e.n_reps; }
+
+  std::uint64_t variants_offset(const reference_cache::block_entry& e) { return align8(sizeof(std::uint32_t) * (e.n_expanded + e.n_reps)); }
+
+  std::uint64_t block_bytes(const reference_cache::block_entry& e)
+  {
+    return variants_offset(e) + e.n_variants * (sizeof(reference_cache::variant_entry) + row_bytes(e));
+  }
+
+  class string_table
+  {
+  private:
+    std::unordered_map<std::string, std::uint32_t> ids_;
+    std::vector<const std::string*> strings_;
+  public:
+    std::uint32_t intern(const std::string& s)
+    {
+      auto res = ids_.emplace(s, std::uint32_t(strings_.size()));
+      if (res.second)
+        strings_.push_back(&res.first->first);
+      return res.first->second;
+    }
+
+    std::size_t size() const { return strings_.size(); }
+
+    void write(std::ostream& os) const
+    {
+      std::uint64_t off = 0;
+      os.write(reinterpret_cast<const char*>(&off), sizeof(off));
+      for (auto it = strings_.begin(); it != strings_.end(); ++it)
+      {
+        off += (*it)->size();
+        os.write(reinterpret_cast<const char*>(&off), sizeof(off));
+      }
+      for (auto it = strings_.begin(); it != strings_.end(); ++it)
+        os.write((*it)->data(), (*it)->size());
+    }
+  };
+
+  void pad_to(std::ostream& os, std::uint64_t offset)
+  {
+    static const char zeros[8] = {};
+    std::uint64_t pos = std::uint64_t(os.tellp());
+    if (offset > pos)
+      os.write(zeros, offset - pos);
+  }
+}
+
+bool reference_cache::open(const std::string& ref_file_path)
+{
+  close();
+
+  std::string cache_path = default_path(ref_file_path);
+  struct stat cache_st, ref_st;
+  if (stat(cache_path.c_str(), &cache_st) != 0)
+    return false;
+
+  if (std::size_t(cache_st.st_size) < sizeof(file_header))
+    return std::cerr << "Warning: ignoring " << cache_path << " since it is not a valid M4C file\n", false;
+
+  int fd = ::open(cache_path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return std::cerr << "Warning: could not open " << cache_path << "\n", false;
+
+  void* addr = mmap(nullptr, cache_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED)
+    return std::cerr << "Warning: could not map " << cache_path << "\n", false;
+
+  data_ = static_cast<const char*>(addr);
+  size_ = cache_st.st_size;
+  header_ = reinterpret_cast<const file_header*>(data_);
+
+  bool valid = std::memcmp(header_->magic, cache_magic, sizeof(cache_magic)) == 0
+    && header_->file_size == size_
+    && header_->string_table_offset % 8 == 0
+    && header_->block_table_offset % 8 == 0
+    && header_->string_table_offset + (header_->n_strings + 1) * sizeof(std::uint64_t) <= size_
+    && header_->block_table_offset + header_->n_blocks * sizeof(block_entry) <= size_;
+  if (valid)
+  {
+    string_offsets_ = reinterpret_cast<const std::uint64_t*>(data_ + header_->string_table_offset);
+    string_data_ = reinterpret_cast<const char*>(string_offsets_ + header_->n_strings + 1);
+    blocks_ = reinterpret_cast<const block_entry*>(data_ + header_->block_table_offset);
+    valid = string_data_ + string_offsets_[header_->n_strings] <= data_ + size_;
+    for (std::size_t i = 0; valid && i < header_->n_blocks; ++i)
+      valid = valid_string(blocks_[i].chrom);
+  }
+
+  if (!valid)
+  {
+    close();
+    return std::cerr << "Warning: ignoring " << cache_path << " since it is not a valid M4C file (run --cache-reference to rebuild it)\n", false;
+  }
+
+  // The cache describes the reference file it was built from, so it is only used with a panel of the same size and modification time.
+  if (stat(ref_file_path.c_str(), &ref_st) != 0 || header_->ref_size != std::int64_t(ref_st.st_size) || header_->ref_mtime != std::int64_t(ref_st.st_mtime))
+  {
+    close();
+    return std::cerr << "Warning: ignoring " << cache_path << " since it does not match the size and modification time of the reference file\n", false;
+  }
+
+  return true;
+}
+
+void reference_cache::close()
+{
+  if (data_)
+    munmap(const_cast<char*>(data_), size_);
+  data_ = nullptr;
+  size_ = 0;
+  header_ = nullptr;
+  blocks_ = nullptr;
+  string_offsets_ = nullptr;
+  string_data_ = nullptr;
+}
+
+bool reference_cache::query(const std::string& chrom, std::uint64_t from, std::uint64_t to, std::size_t& beg_block, std::size_t& end_block) const
+{
+  bool found = false;
+  for (std::size_t i = 0; i < size(); ++i)
+  {
+    const block_entry& e = blocks_[i];
+    if (e.end < from || string_at(e.chrom) != chrom)
+      continue;
+    if (e.beg > to)
+      break;
+
+    if (!found)
+      beg_block = i;
+    end_block = i + 1;
+    found = true;
+  }
+  return found;
+}
+
+bool reference_cache::load_block(std::size_t block_idx, unique_haplotype_block& block) const
+{
+  block.clear();
+
+  if (block_idx >= size())
+    return std::cerr << "Error: block " << block_idx << " is not in the reference cache\n", false;
+
+  const block_entry& e = blocks_[block_idx];
+  if (e.data_offset % 8 != 0 || e.data_offset + block_bytes(e) > size_)
+    return std::cerr << "Error: block " << block_idx << " of reference cache is out of bounds\n", false;
+
+  const std::uint32_t* uniq_map = reinterpret_cast<const std::uint32_t*>(data_ + e.data_offset);
+  block.unique_map_.resize(e.n_expanded);
+  for (std::size_t i = 0; i < e.n_expanded; ++i)
+  {
+    if (uniq_map[i] == std::numeric_limits<std::uint32_t>::max())
+    {
+      block.unique_map_[i] = savvy::typed_value::end_of_vector_value<std::int64_t>();
+    }
+    else if (uniq_map[i] < e.n_reps)
+    {
+      block.unique_map_[i] = std::int64_t(uniq_map[i]);
+    }
+    else
+    {
+      block.clear();
+      return std::cerr << "Error: unique map of block " << block_idx << " of reference cache is out of bounds\n", false;
+    }
+  }
+
+  const std::uint32_t* cardinalities = uniq_map + e.n_expanded;
+  block.cardinalities_.assign(cardinalities, cardinalities + e.n_reps);
+
+  const variant_entry* sites = reinterpret_cast<const variant_entry*>(data_ + e.data_offset + variants_offset(e));
+  const std::uint8_t* rows = reinterpret_cast<const std::uint8_t*>(sites + e.n_variants);
+  std::uint64_t n_row_bytes = row_bytes(e);
+  std::string chrom = string_at(e.chrom);
+
+  block.variants_.resize(e.n_variants);
+  for (std::size_t v = 0; v < e.n_variants; ++v)
+  {
+    reference_variant& var = block.variants_[v];
+    const variant_entry& site = sites[v];
+    if (!valid_string(site.id) || !valid_string(site.ref) || !valid_string(site.alt))
+    {
+      block.clear();
+      return std::cerr << "Error: variant " << v << " of block " << block_idx << " of reference cache refers to a string out of bounds\n", false;
+    }
+    var.chrom = chrom;
+    var.pos = site.pos;
+    var.id = string_at(site.id);
+    var.ref = string_at(site.ref);
+    var.alt = string_at(site.alt);
+    var.err = site.err;
+    var.recom = site.recom;
+    var.cm = site.cm;
+
+    const std::uint8_t* row = rows + v * n_row_bytes;
+    var.gt.resize(e.n_reps);
+    if (e.packed)
+    {
+      for (std::size_t j = 0; j < e.n_reps; ++j)
+        var.gt[j] = (row[j / 8] >> (j % 8)) & 1;
+    }
+    else
+    {
+      std::memcpy(var.gt.data(), row, e.n_reps);
+    }
+    var.ac = std::inner_product(var.gt.begin(), var.gt.end(), block.cardinalities_.begin(), 0ull);
+  }
+
+  return true;
+}
+
+bool reference_cache::build(const std::string& ref_file_path, const std::string& cache_path)
+{
+  struct stat ref_st;
+  if (stat(ref_file_path.c_str(), &ref_st) != 0)
+    return std::cerr << "Error: could not stat " << ref_file_path << "\n", false;
+
+  savvy::reader input(ref_file_path);
+  if (!input)
+    return std::cerr << "Error: could not open reference file\n", false;
+
+  bool is_m3vcf_v3 = false;
+  for (auto it = input.headers().begin(); !is_m3vcf_v3 && it != input.headers().end(); ++it)
+  {
+    if (it->first == "subfileformat" && (it->second == "M3VCFv3.0" || it->second == "MVCFv3.0"))
+      is_m3vcf_v3 = true;
+  }
+
+  if (!is_m3vcf_v3)
+    return std::cerr << "Error: reference file must be an MVCF\n", false;
+
+  std::ofstream ofs(cache_path, std::ios::binary);
+  if (!ofs)
+    return std::cerr << "Error: could not open " << cache_path << " for writing\n", false;
+
+  file_header header = {};
+  std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+  header.ref_size = std::int64_t(ref_st.st_size);
+  header.ref_mtime = std::int64_t(ref_st.st_mtime);
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  string_table strings;
+  std::vector<block_entry> entries;
+  std::vector<std::uint32_t> u32_buf;
+  std::vector<variant_entry> sites;
+  std::vector<std::uint8_t> row;
+
+  savvy::variant var;
+  unique_haplotype_block block;
+  int ret = 0;
+  if (input.read(var))
+  {
+    while ((ret = block.deserialize(input, var)) > 0)
+    {
+      block_entry e = {};
+      e.chrom = strings.intern(block.variants().front().chrom);
+      e.packed = 1;
+      e.beg = block.variants().front().pos;
+      e.end = block.end_position();
+      e.n_variants = block.variant_size();
+      e.n_reps = block.cardinalities().size();
+      e.n_expanded = block.expanded_haplotype_size();
+      e.data_offset = align8(std::uint64_t(ofs.tellp()));
+      for (auto it = block.variants().begin(); e.packed && it != block.variants().end(); ++it)
+      {
+        for (auto jt = it->gt.begin(); jt != it->gt.end(); ++jt)
+        {
+          if (*jt != 0 && *jt != 1)
+          {
+            e.packed = 0;
+            break;
+          }
+        }
+      }
+
+      pad_to(ofs, e.data_offset);
+      u32_buf.resize(e.n_expanded + e.n_reps);
+      for (std::size_t i = 0; i < e.n_expanded; ++i)
+        u32_buf[i] = block.unique_map()[i] < 0 ? std::numeric_limits<std::uint32_t>::max() : std::uint32_t(block.unique_map()[i]);
+      for (std::size_t i = 0; i < e.n_reps; ++i)
+        u32_buf[e.n_expanded + i] = std::uint32_t(block.cardinalities()[i]);
+      ofs.write(reinterpret_cast<const char*>(u32_buf.data()), u32_buf.size() * sizeof(std::uint32_t));
+      pad_to(ofs, e.data_offset + variants_offset(e));
+
+      sites.resize(e.n_variants);
+      for (std::size_t v = 0; v < e.n_variants; ++v)
+      {
+        const reference_variant& ref_var = block.variants()[v];
+        sites[v].pos = ref_var.pos;
+        sites[v].id = strings.intern(ref_var.id);
+        sites[v].ref = strings.intern(ref_var.ref);
+        sites[v].alt = strings.intern(ref_var.alt);
+        sites[v].err = ref_var.err;
+        sites[v].recom = ref_var.recom;
+        sites[v].cm = ref_var.cm;
+      }
+      ofs.write(reinterpret_cast<const char*>(sites.data()), sites.size() * sizeof(variant_entry));
+
+      for (auto it = block.variants().begin(); it != block.variants().end(); ++it)
+      {
+        if (e.packed)
+        {
+          row.assign(row_bytes(e), 0);
+          for (std::size_t j = 0; j < e.n_reps; ++j)
+            row[j / 8] |= std::uint8_t(it->gt[j]) << (j % 8);
+          ofs.write(reinterpret_cast<const char*>(row.data()), row.size());
+        }
+        else
+        {
+          ofs.write(reinterpret_cast<const char*>(it->gt.data()), it->gt.size());
+        }
+      }
+
+      entries.push_back(e);
+    }
+  }
+
+  if (ret < 0 || input.bad())
+    return std::cerr << "Error: failed reading reference file\n", false;
+
+  header.n_blocks = entries.size();
+  header.n_strings = strings.size();
+  header.string_table_offset = align8(std::uint64_t(ofs.tellp()));
+  pad_to(ofs, header.string_table_offset);
+  strings.write(ofs);
+
+  header.block_table_offset = align8(std::uint64_t(ofs.tellp()));
+  pad_to(ofs, header.block_table_offset);
+  ofs.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(block_entry));
+  header.file_size = std::uint64_t(ofs.tellp());
+
+  ofs.seekp(0);
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  return ofs.good();
+}
@@ -0,0 +1,140 @@
+#ifndef MINIMAC4_REFERENCE_CACHE_HPP
+#define MINIMAC4_REFERENCE_CACHE_HPP
+
+#include "unique_haplotype.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Memory-mapped binary copy of an MVCF reference panel (`<ref>.m4c`).
+ *
+ * The cache stores every block of the panel as fixed-width arrays, so a block
+ * is loaded with a few copies out of the mapping instead of decompressing and
+ * parsing its records. Since the file is mapped read-only and shared, several
+ * jobs imputing against the same panel on one node share its pages in the
+ * page cache.
+ *
+ * Layout (native byte order, all sections 8-byte aligned):
+ * - `file_header`
+ * - Block data, for each block: `n_expanded` uint32 unique map entries
+ *   (UINT32_MAX for end-of-vector), `n_reps` uint32 cardinalities,
+ *   `n_variants` `variant_entry`s and `n_variants` allele rows. Rows are
+ *   bit-packed (one bit per unique haplotype) when the block has only 0/1
+ *   alleles, and one int8 per unique haplotype otherwise.
+ * - String table: `n_strings + 1` uint64 offsets followed by the characters.
+ *   Chromosomes, IDs and alleles are stored as indices into this table.
+ * - Block table: `n_blocks` `block_entry`s in file order.
+ *
+ * The cache holds all samples of the panel, so it is not used with
+ * `--sample-ids`.
+ */
+class reference_cache
+{
+public:
+  /** @brief Fixed-size file header. */
+  struct file_header
+  {
+    char magic[8];                     ///< "M4Cv1.1" followed by a null byte.
+    std::int64_t ref_size;             ///< Size of the reference file the cache was built from.
+    std::int64_t ref_mtime;            ///< Modification time of the reference file the cache was built from.
+    std::uint64_t n_blocks;
+    std::uint64_t n_strings;
+    std::uint64_t string_table_offset;
+    std::uint64_t block_table_offset;
+    std::uint64_t file_size;           ///< Total size, used to detect truncated files.
+  };
+
+  /** @brief Fixed-size description of one block. */
+  struct block_entry
+  {
+    std::uint32_t chrom;      ///< String index of the chromosome.
+    std::uint32_t packed;     ///< 1 if allele rows are bit-packed.
+    std::uint64_t beg;        ///< Position of the first variant.
+    std::uint64_t end;        ///< Last base covered by any variant of the block.
+    std::uint64_t n_variants;
+    std::uint64_t n_reps;
+    std::uint64_t n_expanded;
+    std::uint64_t data_offset;
+  };
+
+  /** @brief Fixed-size site record. */
+  struct variant_entry
+  {
+    std::uint32_t pos;
+    std::uint32_t id;  ///< String index.
+    std::uint32_t ref; ///< String index.
+    std::uint32_t alt; ///< String index.
+    float err;
+    float recom;
+    double cm;
+  };
+private:
+  const char* data_ = nullptr;
+  std::size_t size_ = 0;
+  const file_header* header_ = nullptr;
+  const block_entry* blocks_ = nullptr;
+  const std::uint64_t* string_offsets_ = nullptr;
+  const char* string_data_ = nullptr;
+public:
+  reference_cache() {}
+  reference_cache(const reference_cache&) = delete;
+  reference_cache& operator=(const reference_cache&) = delete;
+  ~reference_cache() { close(); }
+
+  /** @return Default sidecar path of a reference file. */
+  static std::string default_path(const std::string& ref_file_path) { return ref_file_path + ".m4c"; }
+
+  /**
+   * @brief Maps the cache of a reference file.
+   *
+   * The cache is rejected with a warning when the size or modification time
+   * of the reference file differ from those stored in its header, or when it
+   * is not a valid M4C file.
+   *
+   * @return False if the cache is missing, stale or malformed.
+   */
+  bool open(const std::string& ref_file_path);
+
+  /** @brief Unmaps the cache. */
+  void close();
+
+  /** @return True if a cache is mapped. */
+  bool is_open() const { return data_ != nullptr; }
+
+  /** @return Number of blocks. */
+  std::size_t size() const { return header_ ? header_->n_blocks : 0; }
+
+  /**
+   * @brief Finds the blocks overlapping `[from, to]`.
+   * @param beg_block Set to the first overlapping block.
+   * @param end_block Set to one past the last overlapping block.
+   * @return False if no block overlaps the query.
+   */
+  bool query(const std::string& chrom, std::uint64_t from, std::uint64_t to, std::size_t& beg_block, std::size_t& end_block) const;
+
+  /**
+   * @brief Loads block `block_idx` into `block`.
+   * @return False if the block data or its string indices are out of bounds.
+   */
+  bool load_block(std::size_t block_idx, unique_haplotype_block& block) const;
+
+  /**
+   * @brief Writes the cache of an MVCF reference file.
+   * @param ref_file_path Path to the MVCF reference file.
+   * @param cache_path Output path.
+   * @return False if the reference could not be read or the cache could not be written.
+   */
+  static bool build(const std::string& ref_file_path, const std::string& cache_path);
+private:
+  /** @return True if `idx` refers to a string inside the string table. */
+  bool valid_string(std::uint32_t idx) const
+  {
+    return idx < header_->n_strings && string_offsets_[idx] <= string_offsets_[idx + 1] && string_offsets_[idx + 1] <= string_offsets_[header_->n_strings];
+  }
+
+  std::string string_at(std::uint32_t idx) const { return std::string(string_data_ + string_offsets_[idx], string_data_ + string_offsets_[idx + 1]); }
+};
+
+#endif // MINIMAC4_REFERENCE_CACHE_HPP
@@ -0,0 +1,190 @@
+#include "reference_index.hpp"
+
+#include <savvy/reader.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+
+bool reference_index::load(const std::string& ref_file_path, const std::string& chrom)
+{
+  blocks_.clear();
+  record_count_ = 0;
+
+  std::string index_path = default_path(ref_file_path);
+  std::ifstream ifs(index_path);
+  if (!ifs)
+    return false;
+
+  std::string line;
+  if (!std::getline(ifs, line) || line != "##fileformat=M4Iv1.1")
+    return std::cerr << "Warning: ignoring " << index_path << " since it is not a valid M4I file (run --index-reference to rebuild it)\n", false;
+
+  // The index describes the reference file it was written for, so it is only used with a panel of the same size and modification time.
+  long long ref_size = -1, ref_mtime = -1, n_blocks = -1;
+  while (std::getline(ifs, line) && line.compare(0, 2, "##") == 0)
+  {
+    std::size_t eq = line.find('=');
+    std::string key = line.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+    long long val = eq == std::string::npos ? -1 : std::atoll(line.c_str() + eq + 1);
+    if (key == "reference_size") ref_size = val;
+    else if (key == "reference_mtime") ref_mtime = val;
+    else if (key == "blocks") n_blocks = val;
+  }
+
+  struct stat ref_st;
+  if (stat(ref_file_path.c_str(), &ref_st) != 0 || ref_size != (long long)ref_st.st_size || ref_mtime != (long long)ref_st.st_mtime)
+    return std::cerr << "Warning: ignoring " << index_path << " since it does not match the size and modification time of the reference file\n", false;
+
+  std::size_t n_entries = 0;
+  do
+  {
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    block_entry entry;
+    std::istringstream iss(line);
+    if (!(iss >> entry.chrom >> entry.beg >> entry.end >> entry.record >> entry.variants >> entry.reps) || entry.record != record_count_)
+    {
+      blocks_.clear();
+      return std::cerr << "Warning: ignoring " << index_path << " since it is not a valid M4I file\n", false;
+    }
+
+    ++n_entries;
+    record_count_ = entry.record + 1 + entry.variants;
+    if (chrom.empty() || entry.chrom == chrom)
+      blocks_.emplace_back(std::move(entry));
+  } while (std::getline(ifs, line));
+
+  if (ifs.bad() || n_blocks < 0 || std::size_t(n_blocks) != n_entries)
+  {
+    blocks_.clear();
+    return std::cerr << "Warning: ignoring " << index_path << " since its block count does not match its entries\n", false;
+  }
+
+  return true;
+}
+
+bool reference_index::build(const std::string& ref_file_path)
+{
+  blocks_.clear();
+  record_count_ = 0;
+
+  savvy::reader input(ref_file_path);
+  if (!input)
+    return std::cerr << "Error: could not open reference file\n", false;
+
+  bool is_m3vcf_v3 = false;
+  for (auto it = input.headers().begin(); !is_m3vcf_v3 && it != input.headers().end(); ++it)
+  {
+    if (it->first == "subfileformat" && (it->second == "M3VCFv3.0" || it->second == "MVCFv3.0"))
+      is_m3vcf_v3 = true;
+  }
+
+  if (!is_m3vcf_v3)
+    return std::cerr << "Error: reference file must be an MVCF\n", false;
+
+  savvy::variant var;
+  std::uint64_t n_records = 0;
+  while (input >> var)
+  {
+    if (!var.alts().empty() && var.alts()[0] == "<BLOCK>")
+    {
+      if (n_records != record_count_)
+        return std::cerr << "Error: VARIANTS of block preceding " << var.chrom() << ":" << var.pos() << " does not match the number of variant records\n", false;
+
+      std::int64_t end_pos = var.pos(), n_variants = 0, n_reps = 0;
+      var.get_info("END", end_pos);
+      var.get_info("VARIANTS", n_variants);
+      var.get_info("REPS", n_reps);
+      push_back(var.chrom(), var.pos(), end_pos, n_variants, n_reps);
+    }
+    ++n_records;
+  }
+
+  if (n_records != record_count_)
+    return std::cerr << "Error: VARIANTS of last block does not match the number of variant records\n", false;
+
+  return !input.bad();
+}
+
+bool reference_index::save(const std::string& ref_file_path) const
+{
+  std::string index_path = default_path(ref_file_path);
+  struct stat ref_st;
+  if (stat(ref_file_path.c_str(), &ref_st) != 0)
+    return std::cerr << "Error: could not stat " << ref_file_path << "\n", false;
+
+  std::ofstream ofs(index_path);
+  if (!ofs)
+    return std::cerr << "Error: could not open " << index_path << " for writing\n", false;
+
+  ofs << "##fileformat=M4Iv1.1\n";
+  ofs << "##reference_size=" << (long long)ref_st.st_size << "\n";
+  ofs << "##reference_mtime=" << (long long)ref_st.st_mtime << "\n";
+  ofs << "##blocks=" << blocks_.size() << "\n";
+  ofs << "#CHROM\tBEG\tEND\tRECORD\tVARIANTS\tREPS\n";
+  for (auto it = blocks_.begin(); it != blocks_.end(); ++it)
+    ofs << it->chrom << "\t" << it->beg << "\t" << it->end << "\t" << it->record << "\t" << it->variants << "\t" << it->reps << "\n";
+
+  return ofs.good();
+}
+
+void reference_index::push_back(const std::string& chrom, std::uint64_t beg, std::uint64_t end, std::uint64_t variants, std::uint64_t reps)
+{
+  blocks_.emplace_back();
+  block_entry& entry = blocks_.back();
+  entry.chrom = chrom;
+  entry.beg = beg;
+  entry.end = end;
+  entry.record = record_count_;
+  entry.variants = variants;
+  entry.reps = reps;
+  record_count_ += 1 + variants;
+}
+
+std::vector<std::string> reference_index::chromosomes() const
+{
+  std::vector<std::string> ret;
+  for (auto it = blocks_.begin(); it != blocks_.end(); ++it)
+  {
+    if (ret.empty() || ret.back() != it->chrom)
+      ret.push_back(it->chrom);
+  }
+  return ret;
+}
+
+bool reference_index::chromosome_end(const std::string& chrom, std::uint64_t& end_pos) const
+{
+  bool found = false;
+  for (auto it = blocks_.begin(); it != blocks_.end(); ++it)
+  {
+    if (it->chrom == chrom)
+    {
+      end_pos = found ? std::max(end_pos, it->end) : it->end;
+      found = true;
+    }
+  }
+  return found;
+}
+
+bool reference_index::query(const std::string& chrom, std::uint64_t from, std::uint64_t to, std::uint64_t& beg_record, std::uint64_t& end_record) const
+{
+  bool found = false;
+  for (auto it = blocks_.begin(); it != blocks_.end(); ++it)
+  {
+    if (it->chrom != chrom || it->end < from)
+      continue;
+    if (it->beg > to)
+      break;
+
+    if (!found)
+      beg_record = it->record;
+    end_record = it->record + 1 + it->variants;
+    found = true;
+  }
+  return found;
+}
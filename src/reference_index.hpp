@@ -0,0 +1,115 @@
+#ifndef MINIMAC4_REFERENCE_INDEX_HPP
+#define MINIMAC4_REFERENCE_INDEX_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Sidecar block index of an MVCF reference panel (`<ref>.m4i`).
+ *
+ * The index lists every unique haplotype block of the panel in file order
+ * with its position span, record ordinal, variant count and number of
+ * unique haplotypes. Chunk loading uses it to seek directly to the first
+ * overlapping block and `stat_ref_panel` uses it to get chromosome bounds
+ * without decoding the panel.
+ *
+ * The file is tab-delimited text:
+ * @code
+ * ##fileformat=M4Iv1.1
+ * ##reference_size=<bytes>
+ * ##reference_mtime=<seconds>
+ * ##blocks=<count>
+ * #CHROM  BEG  END  RECORD  VARIANTS  REPS
+ * @endcode
+ * where `reference_size` and `reference_mtime` are those of the reference
+ * file when the index was written, `blocks` is the number of entries, and `RECORD` is the zero-based ordinal of the `<BLOCK>` header record
+ * in the MVCF file. Record ordinals are used instead of byte offsets since
+ * they can be passed to `savvy::slice_bounds` and resolved through the
+ * S1R index of the panel.
+ */
+class reference_index
+{
+public:
+  /** @brief Index entry for one block. */
+  struct block_entry
+  {
+    std::string chrom;          ///< Chromosome of the block.
+    std::uint64_t beg = 0;      ///< Position of the first variant.
+    std::uint64_t end = 0;      ///< Last base covered by any variant of the block.
+    std::uint64_t record = 0;   ///< Ordinal of the block header record.
+    std::uint64_t variants = 0; ///< Number of variant records following the header.
+    std::uint64_t reps = 0;     ///< Number of unique haplotypes.
+  };
+private:
+  std::vector<block_entry> blocks_;
+  std::uint64_t record_count_ = 0;
+public:
+  /** @return Default sidecar path of a reference file. */
+  static std::string default_path(const std::string& ref_file_path) { return ref_file_path + ".m4i"; }
+
+  /**
+   * @brief Loads the sidecar index of a reference file.
+   *
+   * The index is rejected with a warning when the size or modification time
+   * of the reference file differ from those stored in it, since it may no
+   * longer describe the blocks on disk. It is also rejected when its entries
+   * do not add up to the stored block count or to consecutive records.
+   *
+   * @param ref_file_path Path to the MVCF reference file.
+   * @param chrom If non-empty, only blocks of this chromosome are kept.
+   * @return False if the index is missing, stale or malformed.
+   */
+  bool load(const std::string& ref_file_path, const std::string& chrom = "");
+
+  /**
+   * @brief Builds the index by scanning an MVCF reference file.
+   * @return False if the file could not be read or is not an MVCF.
+   */
+  bool build(const std::string& ref_file_path);
+
+  /**
+   * @brief Writes the index to the default sidecar path of a reference file.
+   *
+   * The size and modification time of the reference file are stored with the
+   * index, so it must be called after the reference file is closed.
+   */
+  bool save(const std::string& ref_file_path) const;
+
+  /**
+   * @brief Appends the next block of the file.
+   *
+   * Record ordinals are assigned from the running record count, so blocks
+   * must be appended in file order.
+   */
+  void push_back(const std::string& chrom, std::uint64_t beg, std::uint64_t end, std::uint64_t variants, std::uint64_t reps);
+
+  /** @return Blocks in file order. */
+  const std::vector<block_entry>& blocks() const { return blocks_; }
+
+  /** @return True if the index has no blocks. */
+  bool empty() const { return blocks_.empty(); }
+
+  /** @return Distinct chromosomes in file order. */
+  std::vector<std::string> chromosomes() const;
+
+  /**
+   * @brief Gets the last covered position of a chromosome.
+   * @return False if the chromosome is not in the index.
+   */
+  bool chromosome_end(const std::string& chrom, std::uint64_t& end_pos) const;
+
+  /**
+   * @brief Finds the records of all blocks overlapping `[from, to]`.
+   *
+   * @param chrom Chromosome.
+   * @param from First position of the query.
+   * @param to Last position of the query.
+   * @param beg_record Set to the header record of the first overlapping block.
+   * @param end_record Set to one past the last record of the last overlapping block.
+   * @return False if no block overlaps the query.
+   */
+  bool query(const std::string& chrom, std::uint64_t from, std::uint64_t to, std::uint64_t& beg_record, std::uint64_t& end_record) const;
+};
+
+#endif // MINIMAC4_REFERENCE_INDEX_HPP
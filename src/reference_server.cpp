@@ -0,0 +1,194 @@
+#include "reference_server.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+reference_server::reference_server(const prog_args& args) :
+  args_(args),
+  cache_(args.serve_cache_bytes())
+{
+  imputer_.set_resident_cache(&cache_);
+}
+
+bool reference_server::run()
+{
+  std::uint64_t end_pos = args_.region().to();
+  chrom_ = args_.region().chromosome();
+  if (!stat_ref_panel(args_.ref_path(), chrom_, end_pos))
+    return std::cerr << "Error: could not stat reference file\n", false;
+
+  impute_regions_.clear();
+  for (std::uint64_t chunk_start_pos = std::max(std::uint64_t(1), args_.region().from()); chunk_start_pos <= end_pos; chunk_start_pos += args_.chunk_size())
+  {
+    std::uint64_t chunk_end_pos = std::min(end_pos, chunk_start_pos + args_.chunk_size() - 1ul);
+    impute_regions_.emplace_back(chrom_, chunk_start_pos, chunk_end_pos);
+  }
+  tpool_.reset(new omp::internal::thread_pool2(imputation::chunk_pool_threads(args_, impute_regions_.size())));
+
+  const std::string& path = args_.serve_path();
+  if (path == "-")
+    return serve_stream(std::cin);
+
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+  {
+    std::ifstream ifs(path);
+    if (!ifs)
+      return std::cerr << "Error: could not open " << path << std::endl, false;
+    return serve_stream(ifs);
+  }
+
+  if (stat(path.c_str(), &st) == 0 && S_ISFIFO(st.st_mode))
+  {
+    // Each writer that closes the FIFO ends the stream, so it is reopened (blocking until the next writer) until shut down.
+    while (!shutdown_)
+    {
+      std::ifstream ifs(path);
+      if (!ifs)
+        return std::cerr << "Error: could not open " << path << std::endl, false;
+      serve_stream(ifs);
+    }
+    return true;
+  }
+
+  return serve_socket(path);
+}
+
+bool reference_server::serve_stream(std::istream& is)
+{
+  bool ret = true;
+  std::string line, reply;
+  while (!shutdown_ && std::getline(is, line))
+  {
+    if (!run_job(line, reply))
+      ret = false;
+    if (reply.size())
+      std::cerr << reply << std::endl;
+  }
+  return ret;
+}
+
+bool reference_server::serve_socket(const std::string& path)
+{
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    return std::cerr << "Error: --serve socket path is too long\n", false;
+  std::strcpy(addr.sun_path, path.c_str());
+
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    ::unlink(path.c_str()); // Left over by a previous server.
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return std::cerr << "Error: could not create socket (" << std::strerror(errno) << ")\n", false;
+  if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 16) != 0)
+  {
+    std::cerr << "Error: could not listen on " << path << " (" << std::strerror(errno) << ")\n";
+    ::close(fd);
+    return false;
+  }
+
+  std::cerr << "Serving imputation jobs on " << path << std::endl;
+  while (!shutdown_)
+  {
+    int conn = ::accept(fd, nullptr, nullptr);
+    if (conn < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "Error: could not accept connection (" << std::strerror(errno) << ")\n";
+      break;
+    }
+
+    std::string buf, reply;
+    char chunk[4096];
+    ssize_t n;
+    while (!shutdown_ && (n = ::read(conn, chunk, sizeof(chunk))) > 0)
+    {
+      buf.append(chunk, n);
+      std::size_t line_beg = 0, line_end;
+      while (!shutdown_ && (line_end = buf.find('\n', line_beg)) != std::string::npos)
+      {
+        run_job(buf.substr(line_beg, line_end - line_beg), reply);
+        line_beg = line_end + 1;
+        if (reply.size())
+        {
+          reply += '\n';
+          ::send(conn, reply.data(), reply.size(), MSG_NOSIGNAL);
+        }
+      }
+      buf.erase(0, line_beg);
+    }
+    ::close(conn);
+  }
+
+  ::close(fd);
+  ::unlink(path.c_str());
+  return shutdown_;
+}
+
+bool reference_server::run_job(const std::string& line, std::string& reply)
+{
+  reply.clear();
+  std::istringstream ss(line);
+  std::string tar_path, out_path, fmt_fields;
+  if (!(ss >> tar_path) || tar_path[0] == '#')
+    return true;
+
+  if (tar_path == "shutdown")
+  {
+    shutdown_ = true;
+    reply = "OK shutdown";
+    return true;
+  }
+
+  if (!(ss >> out_path))
+    return reply = "ERROR " + tar_path, std::cerr << "Error: --serve job has no output path (" << line << ")\n", false;
+  ss >> fmt_fields;
+
+  reply = "ERROR " + out_path;
+  prog_args job_args(args_);
+  if (!job_args.set_serve_job(tar_path, out_path, fmt_fields))
+    return false;
+
+  std::vector<std::string> sample_ids;
+  if (!stat_tar_panel(job_args.tar_path(), sample_ids))
+    return std::cerr << "Error: could not stat target file\n", false;
+
+  std::cerr << "Imputing " << tar_path << " into " << out_path << " ..." << std::endl;
+  stopwatch timer;
+  {
+    dosage_writer output(job_args.out_path(),
+      "", // empirical path
+      "", // sites path
+      job_args.out_format(),
+      job_args.out_compression(),
+      sample_ids,
+      job_args.fmt_fields(),
+      chrom_,
+      job_args.min_r2(), false);
+
+    if (!imputer_.impute_chunks(impute_regions_, job_args, *tpool_, output))
+      return false;
+
+    if (job_args.leave_one_out())
+      output.print_mean_er2(std::cerr);
+  }
+
+  if (!job_args.metrics_out_path().empty() && !imputer_.metrics().write(job_args.metrics_out_path()))
+    return false;
+
+  std::cerr << "Imputing " << tar_path << " took " << timer.elapsed() << " seconds (resident chunks: " << cache_.size() << ", " << cache_.bytes() / (1024 * 1024)
+    << " MiB, " << cache_.hits() << " hits, " << cache_.misses() << " misses, " << cache_.evictions() << " evictions)" << std::endl;
+  reply = "OK " + out_path;
+  return true;
+}
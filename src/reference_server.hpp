@@ -0,0 +1,65 @@
+#ifndef MINIMAC4_REFERENCE_SERVER_HPP
+#define MINIMAC4_REFERENCE_SERVER_HPP
+
+#include "imputation.hpp"
+#include "resident_reference_cache.hpp"
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Imputes a stream of target files against one reference panel (`--serve`).
+ *
+ * The reference is stat'ed, the chunks of `--region` are laid out and the
+ * thread pool and HMM workspaces are created once. The reference data of each
+ * chunk is kept in a `resident_reference_cache`, so a job only reads its
+ * target file and builds the typed-only data of its target sites.
+ *
+ * A job is one line `<target> <output> [<format>]`, with whitespace-separated
+ * fields and `<format>` a comma-separated `--format` list. Every other option
+ * is taken from the server's command line. Jobs run one after another, each
+ * using all threads. Jobs are read from:
+ *  - stdin, if the path is `-`;
+ *  - an existing regular file, which is read once;
+ *  - an existing FIFO, which is reopened whenever its writers close it;
+ *  - otherwise a Unix socket created at the path, which accepts one
+ *    connection at a time and replies `OK <output>` or `ERROR <output>` per job.
+ *
+ * A `shutdown` line stops the server. Empty lines and lines starting with `#`
+ * are ignored. `--metrics-out` is rewritten after each job, with the chunks
+ * of all jobs so far.
+ */
+class reference_server
+{
+private:
+  const prog_args& args_;
+  std::unique_ptr<omp::internal::thread_pool2> tpool_;
+  imputation imputer_;
+  resident_reference_cache cache_;
+  std::vector<savvy::region> impute_regions_;
+  std::string chrom_;
+  bool shutdown_ = false;
+public:
+  explicit reference_server(const prog_args& args);
+
+  /**
+   * @brief Serves jobs until a `shutdown` line, or the end of a job file or stdin.
+   * @return False if the server could not start, or if a job read from a file or stdin failed.
+   */
+  bool run();
+
+  /**
+   * @brief Runs one job line.
+   * @param line  Job line.
+   * @param reply Set to the reply sent to a socket client (empty for ignored lines).
+   * @return False if the job failed.
+   */
+  bool run_job(const std::string& line, std::string& reply);
+private:
+  bool serve_stream(std::istream& is);
+  bool serve_socket(const std::string& path);
+};
+
+#endif // MINIMAC4_REFERENCE_SERVER_HPP
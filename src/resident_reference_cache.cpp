@@ -0,0 +1,67 @@
+#include "resident_reference_cache.hpp"
+#include "input_prep.hpp"
+
+std::uint64_t resident_reference_cache::estimate_bytes(const std::deque<unique_haplotype_block>& blocks)
+{
+  std::uint64_t ret = 0;
+  for (auto it = blocks.begin(); it != blocks.end(); ++it)
+  {
+    ret += it->unique_map().size() * sizeof(std::int64_t) + it->cardinalities().size() * sizeof(std::size_t);
+    for (auto jt = it->variants().begin(); jt != it->variants().end(); ++jt)
+      ret += sizeof(reference_variant) + jt->gt.size() + jt->id.size() + jt->ref.size() + jt->alt.size();
+    if (!it->haplotype_bits().empty())
+      ret += it->variants().size() * ((it->cardinalities().size() + 63) / 64) * sizeof(std::uint64_t);
+  }
+  return ret;
+}
+
+std::shared_ptr<const resident_reference_cache::chunk_entry> resident_reference_cache::get(const prog_args& args, const savvy::region& extended_reg, const savvy::region& impute_reg, const genetic_map_file* map_file)
+{
+  std::string key = extended_reg.chromosome() + ":" + std::to_string(extended_reg.from()) + "-" + std::to_string(extended_reg.to())
+    + ":" + std::to_string(impute_reg.from()) + "-" + std::to_string(impute_reg.to());
+
+  auto found = entries_.find(key);
+  if (found != entries_.end())
+  {
+    lru_.splice(lru_.begin(), lru_, found->second);
+    ++hits_;
+    return found->second->second;
+  }
+
+  ++misses_;
+  std::shared_ptr<chunk_entry> entry(new chunk_entry());
+  reference_index ref_index;
+  reference_cache ref_cache;
+  if (!ref_cache.open(args.ref_path()))
+    ref_index.load(args.ref_path(), impute_reg.chromosome());
+  if (!read_reference_blocks(args.ref_path(), extended_reg, args.sample_ids(), &ref_index, &ref_cache, entry->blocks, entry->sliced))
+    return nullptr;
+
+  // The full data is built without target sites, which skips the cM interpolation done while aligning them.
+  if (map_file)
+  {
+    for (auto it = entry->blocks.begin(); it != entry->blocks.end(); ++it)
+      it->fill_cm(*map_file);
+  }
+
+  std::vector<target_variant> no_sites;
+  reduced_haplotypes no_typed;
+  if (!load_reference_haplotypes(entry->blocks, entry->sliced, extended_reg, impute_reg, no_sites, no_typed, &entry->full_reference_data, map_file, args.min_recom(), args.error_param(), false))
+    return nullptr;
+  entry->full_reference_data.build_haplotype_bits();
+  entry->bytes = estimate_bytes(entry->blocks) + estimate_bytes(entry->full_reference_data.blocks());
+
+  lru_.emplace_front(key, entry);
+  entries_[key] = lru_.begin();
+  bytes_ += entry->bytes;
+
+  while (bytes_ > max_bytes_ && lru_.size() > 1)
+  {
+    bytes_ -= lru_.back().second->bytes;
+    entries_.erase(lru_.back().first);
+    lru_.pop_back();
+    ++evictions_;
+  }
+
+  return entry;
+}
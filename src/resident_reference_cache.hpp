@@ -0,0 +1,84 @@
+#ifndef MINIMAC4_RESIDENT_REFERENCE_CACHE_HPP
+#define MINIMAC4_RESIDENT_REFERENCE_CACHE_HPP
+
+#include "prog_args.hpp"
+#include "recombination.hpp"
+#include "unique_haplotype.hpp"
+
+#include <savvy/reader.hpp>
+
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief Decoded reference chunks kept in memory between imputation jobs (`--serve`).
+ *
+ * The reference data of a chunk that does not depend on the target file is
+ * kept per chunk region: the decoded blocks of the extended region, from which
+ * the typed-only data of each target site list is built, and the full reference
+ * data of the impute region with its allele bit rows. Later jobs imputing the
+ * same region skip reading and decoding the reference.
+ *
+ * Entries are evicted least recently used first once their estimated size
+ * exceeds the cap, keeping the most recent entry even if it alone exceeds it.
+ * Entries are shared, so one evicted while a chunk still uses it is freed when
+ * that chunk is done. Calls must not run concurrently.
+ */
+class resident_reference_cache
+{
+public:
+  /** @brief Reference data of one chunk region. */
+  struct chunk_entry
+  {
+    std::deque<unique_haplotype_block> blocks; ///< Blocks overlapping the extended region, with cM filled from --map.
+    bool sliced = false;                       ///< Blocks are whole index slices, see `read_reference_blocks()`.
+    reduced_haplotypes full_reference_data;    ///< Reference haplotypes of the impute region.
+    std::uint64_t bytes = 0;                   ///< Estimated memory footprint.
+  };
+private:
+  typedef std::list<std::pair<std::string, std::shared_ptr<const chunk_entry>>> lru_list;
+  lru_list lru_;
+  std::unordered_map<std::string, lru_list::iterator> entries_;
+  std::uint64_t max_bytes_;
+  std::uint64_t bytes_ = 0;
+  std::uint64_t hits_ = 0;
+  std::uint64_t misses_ = 0;
+  std::uint64_t evictions_ = 0;
+public:
+  /** @param max_bytes Cap on the summed size of the entries. */
+  explicit resident_reference_cache(std::uint64_t max_bytes) : max_bytes_(max_bytes) {}
+
+  /**
+   * @brief Gets the entry of a chunk, reading it from the reference on a miss.
+   *
+   * @param args         Program arguments (reference path, `--sample-ids`, `--min-recom` and `--match-error`).
+   * @param extended_reg Impute region plus the overlap.
+   * @param impute_reg   Region to impute.
+   * @param map_file     Genetic map of the chromosome, or null without `--map`.
+   * @return The entry, or null if the reference could not be read.
+   */
+  std::shared_ptr<const chunk_entry> get(const prog_args& args, const savvy::region& extended_reg, const savvy::region& impute_reg, const genetic_map_file* map_file);
+
+  /** @return Number of resident chunks. */
+  std::size_t size() const { return lru_.size(); }
+
+  /** @return Estimated bytes of the resident chunks. */
+  std::uint64_t bytes() const { return bytes_; }
+
+  /** @return Number of `get()` calls served from memory. */
+  std::uint64_t hits() const { return hits_; }
+
+  /** @return Number of `get()` calls that read the reference. */
+  std::uint64_t misses() const { return misses_; }
+
+  /** @return Number of entries evicted under the cap. */
+  std::uint64_t evictions() const { return evictions_; }
+private:
+  static std::uint64_t estimate_bytes(const std::deque<unique_haplotype_block>& blocks);
+};
+
+#endif // MINIMAC4_RESIDENT_REFERENCE_CACHE_HPP
@@ -0,0 +1,288 @@
+#include "typed_reference_cache.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+  const char typed_cache_magic[8] = {'M', '4', 'T', 'v', '1', '.', '0', '\0'};
+
+  // 64-bit FNV-1a, so keys are the same across builds and platforms.
+  class key_hasher
+  {
+  private:
+    std::uint64_t h_ = 14695981039346656037ull;
+  public:
+    void add(const void* data, std::size_t n)
+    {
+      const unsigned char* p = static_cast<const unsigned char*>(data);
+      for (std::size_t i = 0; i < n; ++i)
+      {
+        h_ ^= p[i];
+        h_ *= 1099511628211ull;
+      }
+    }
+
+    template <typename T>
+    void add(const T& v) { add(&v, sizeof(v)); }
+
+    void add(const std::string& s)
+    {
+      add(std::uint64_t(s.size()));
+      add(s.data(), s.size());
+    }
+
+    void add_file_stat(const std::string& file_path)
+    {
+      add(file_path);
+      struct stat st;
+      if (!file_path.empty() && stat(file_path.c_str(), &st) == 0)
+      {
+        add(std::int64_t(st.st_size));
+        add(std::int64_t(st.st_mtime));
+      }
+    }
+
+    std::uint64_t value() const { return h_; }
+  };
+
+  template <typename T>
+  void write_pod(std::ostream& os, const T& v) { os.write(reinterpret_cast<const char*>(&v), sizeof(v)); }
+
+  template <typename T>
+  bool read_pod(std::istream& is, T& v) { return (bool)is.read(reinterpret_cast<char*>(&v), sizeof(v)); }
+
+  void write_string(std::ostream& os, const std::string& s)
+  {
+    write_pod(os, std::uint32_t(s.size()));
+    os.write(s.data(), s.size());
+  }
+
+  bool read_string(std::istream& is, std::string& s)
+  {
+    std::uint32_t sz = 0;
+    if (!read_pod(is, sz))
+      return false;
+    s.resize(sz);
+    return sz == 0 || (bool)is.read(&s[0], sz);
+  }
+
+  struct site_entry
+  {
+    std::uint64_t order;
+    float af;
+    float err;
+    float recom;
+    std::uint8_t in_ref;
+  };
+}
+
+std::uint64_t typed_reference_cache::key(const std::string& ref_path,
+  const std::string& map_path,
+  const savvy::genomic_region& extended_reg,
+  const std::unordered_set<std::string>& subset_ids,
+  float min_recom,
+  float default_match_error,
+  const std::vector<target_variant>& target_sites)
+{
+  key_hasher h;
+  h.add(typed_cache_magic, sizeof(typed_cache_magic));
+  h.add_file_stat(ref_path);
+  h.add_file_stat(map_path);
+  h.add(extended_reg.chromosome());
+  h.add(std::uint64_t(extended_reg.from()));
+  h.add(std::uint64_t(extended_reg.to()));
+
+  std::vector<std::string> sorted_ids(subset_ids.begin(), subset_ids.end());
+  std::sort(sorted_ids.begin(), sorted_ids.end());
+  h.add(std::uint64_t(sorted_ids.size()));
+  for (auto it = sorted_ids.begin(); it != sorted_ids.end(); ++it)
+    h.add(*it);
+
+  h.add(min_recom);
+  h.add(default_match_error);
+
+  h.add(std::uint64_t(target_sites.size()));
+  for (auto it = target_sites.begin(); it != target_sites.end(); ++it)
+  {
+    h.add(it->pos);
+    h.add(it->ref);
+    h.add(it->alt);
+  }
+
+  return h.value();
+}
+
+std::string typed_reference_cache::path(const std::string& dir, std::uint64_t key)
+{
+  std::ostringstream ss;
+  ss << dir;
+  if (!dir.empty() && dir.back() != '/')
+    ss << '/';
+  ss << std::hex << std::setw(16) << std::setfill('0') << key << ".m4t";
+  return ss.str();
+}
+
+bool typed_reference_cache::load(const std::string& file_path, std::uint64_t key, std::size_t n_haplotypes, std::vector<target_variant>& target_sites, reduced_haplotypes& typed_only_reference_data)
+{
+  std::ifstream ifs(file_path, std::ios::binary);
+  if (!ifs)
+    return false;
+
+  char magic[8];
+  std::uint64_t file_key = 0, n_sites = 0, n_blocks = 0;
+  if (!ifs.read(magic, sizeof(magic)) || std::memcmp(magic, typed_cache_magic, sizeof(magic)) != 0
+    || !read_pod(ifs, file_key) || !read_pod(ifs, n_sites) || !read_pod(ifs, n_blocks))
+    return std::cerr << "Warning: ignoring " << file_path << " since it is not a valid M4T file\n", false;
+
+  if (file_key != key || n_sites != target_sites.size())
+    return std::cerr << "Warning: ignoring " << file_path << " since its key does not match\n", false;
+
+  std::vector<site_entry> sites(n_sites);
+  std::vector<char> used(n_sites, 0);
+  for (auto it = sites.begin(); it != sites.end(); ++it)
+  {
+    if (!read_pod(ifs, it->order) || !read_pod(ifs, it->af) || !read_pod(ifs, it->err) || !read_pod(ifs, it->recom) || !read_pod(ifs, it->in_ref)
+      || it->order >= n_sites || used[it->order])
+      return std::cerr << "Warning: ignoring " << file_path << " since it is not a valid M4T file\n", false;
+    used[it->order] = 1;
+  }
+
+  reduced_haplotypes loaded(typed_only_reference_data.min_block_size_, typed_only_reference_data.max_block_size_);
+  for (std::size_t b = 0; b < n_blocks; ++b)
+  {
+    std::uint64_t n_variants = 0, n_reps = 0, n_expanded = 0;
+    if (!read_pod(ifs, n_variants) || !read_pod(ifs, n_reps) || !read_pod(ifs, n_expanded))
+      return std::cerr << "Warning: ignoring truncated " << file_path << "\n", false;
+    if (n_expanded != n_haplotypes)
+      return std::cerr << "Warning: ignoring " << file_path << " since it does not match the reference panel\n", false;
+
+    unique_haplotype_block block;
+    block.unique_map_.resize(n_expanded);
+    block.cardinalities_.resize(n_reps);
+    ifs.read(reinterpret_cast<char*>(block.unique_map_.data()), n_expanded * sizeof(block.unique_map_[0]));
+    for (auto it = block.unique_map_.begin(); ifs && it != block.unique_map_.end(); ++it)
+    {
+      if (*it != savvy::typed_value::end_of_vector_value<std::int64_t>() && (*it < 0 || std::uint64_t(*it) >= n_reps))
+        return std::cerr << "Warning: ignoring " << file_path << " since it is not a valid M4T file\n", false;
+    }
+    for (auto it = block.cardinalities_.begin(); it != block.cardinalities_.end(); ++it)
+    {
+      std::uint64_t c = 0;
+      read_pod(ifs, c);
+      *it = c;
+    }
+
+    block.variants_.resize(n_variants);
+    for (auto it = block.variants_.begin(); it != block.variants_.end(); ++it)
+    {
+      std::uint64_t ac = 0;
+      read_string(ifs, it->chrom);
+      read_pod(ifs, it->pos);
+      read_string(ifs, it->id);
+      read_string(ifs, it->ref);
+      read_string(ifs, it->alt);
+      read_pod(ifs, it->err);
+      read_pod(ifs, it->recom);
+      read_pod(ifs, it->cm);
+      read_pod(ifs, ac);
+      it->ac = ac;
+      it->gt.resize(n_reps);
+      ifs.read(reinterpret_cast<char*>(it->gt.data()), n_reps);
+    }
+
+    if (!ifs)
+      return std::cerr << "Warning: ignoring truncated " << file_path << "\n", false;
+
+    loaded.block_offsets_.push_back(loaded.variant_count_);
+    loaded.variant_count_ += block.variant_size();
+    loaded.blocks_.emplace_back(std::move(block));
+  }
+
+  std::vector<target_variant> aligned(n_sites);
+  for (std::size_t i = 0; i < n_sites; ++i)
+  {
+    aligned[i] = std::move(target_sites[sites[i].order]);
+    aligned[i].af = sites[i].af;
+    aligned[i].err = sites[i].err;
+    aligned[i].recom = sites[i].recom;
+    aligned[i].in_ref = sites[i].in_ref != 0;
+  }
+
+  target_sites = std::move(aligned);
+  typed_only_reference_data = std::move(loaded);
+  return true;
+}
+
+bool typed_reference_cache::save(const std::string& file_path, std::uint64_t key, const std::vector<std::size_t>& target_order, const std::vector<target_variant>& target_sites, const reduced_haplotypes& typed_only_reference_data)
+{
+  assert(target_order.size() == target_sites.size());
+  std::string tmp_path = file_path + ".tmp" + std::to_string(getpid());
+  {
+    std::ofstream ofs(tmp_path, std::ios::binary);
+    if (!ofs)
+      return false;
+
+    ofs.write(typed_cache_magic, sizeof(typed_cache_magic));
+    write_pod(ofs, key);
+    write_pod(ofs, std::uint64_t(target_sites.size()));
+    write_pod(ofs, std::uint64_t(typed_only_reference_data.blocks().size()));
+
+    for (std::size_t i = 0; i < target_sites.size(); ++i)
+    {
+      write_pod(ofs, std::uint64_t(target_order[i]));
+      write_pod(ofs, target_sites[i].af);
+      write_pod(ofs, target_sites[i].err);
+      write_pod(ofs, target_sites[i].recom);
+      write_pod(ofs, std::uint8_t(target_sites[i].in_ref));
+    }
+
+    for (auto it = typed_only_reference_data.blocks().begin(); it != typed_only_reference_data.blocks().end(); ++it)
+    {
+      write_pod(ofs, std::uint64_t(it->variant_size()));
+      write_pod(ofs, std::uint64_t(it->unique_haplotype_size()));
+      write_pod(ofs, std::uint64_t(it->expanded_haplotype_size()));
+      ofs.write(reinterpret_cast<const char*>(it->unique_map_.data()), it->unique_map_.size() * sizeof(it->unique_map_[0]));
+      for (auto jt = it->cardinalities_.begin(); jt != it->cardinalities_.end(); ++jt)
+        write_pod(ofs, std::uint64_t(*jt));
+
+      for (auto jt = it->variants_.begin(); jt != it->variants_.end(); ++jt)
+      {
+        write_string(ofs, jt->chrom);
+        write_pod(ofs, jt->pos);
+        write_string(ofs, jt->id);
+        write_string(ofs, jt->ref);
+        write_string(ofs, jt->alt);
+        write_pod(ofs, jt->err);
+        write_pod(ofs, jt->recom);
+        write_pod(ofs, jt->cm);
+        write_pod(ofs, std::uint64_t(jt->ac));
+        ofs.write(reinterpret_cast<const char*>(jt->gt.data()), jt->gt.size());
+      }
+    }
+
+    if (!ofs.good())
+    {
+      ofs.close();
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+  }
+
+  if (std::rename(tmp_path.c_str(), file_path.c_str()) != 0)
+  {
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+
+  return true;
+}
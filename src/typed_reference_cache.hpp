@@ -0,0 +1,80 @@
+#ifndef MINIMAC4_TYPED_REFERENCE_CACHE_HPP
+#define MINIMAC4_TYPED_REFERENCE_CACHE_HPP
+
+#include "unique_haplotype.hpp"
+#include "variant.hpp"
+
+#include <savvy/reader.hpp>
+
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * @brief Saved typed-only reference data of one chunk (`<dir>/<key>.m4t`).
+ *
+ * Imputing several target batches from one genotyping array against one panel
+ * aligns the same target sites with the same reference blocks for every batch.
+ * This cache stores the result of that alignment: the typed-only reduced
+ * haplotypes, the order of the target sites after alignment, and the HMM
+ * parameters (allele frequency, error and recombination) of each site. On a
+ * later run with the same key, the alignment is replaced by reading the file,
+ * and only the full reference data of the impute region is loaded from the
+ * panel.
+ *
+ * The key hashes the reference path, size and modification time, the genetic
+ * map, the extended region, the reference sample subset, the HMM parameters
+ * and every target site (position and alleles), so a cache is never applied
+ * to a different site list or a modified panel. Reverse maps are rebuilt
+ * after loading, since they are cheap compared with re-blocking.
+ *
+ * Layout (native byte order): an 8-byte magic, the key, the number of sites
+ * and blocks, one record per target site, then each block with its unique map,
+ * cardinalities and variants. Strings are stored with a uint32 length prefix.
+ */
+class typed_reference_cache
+{
+public:
+  /**
+   * @return Key of the typed-only data of a chunk.
+   * @param target_sites Target sites in file order, before reference alignment.
+   */
+  static std::uint64_t key(const std::string& ref_path,
+    const std::string& map_path,
+    const savvy::genomic_region& extended_reg,
+    const std::unordered_set<std::string>& subset_ids,
+    float min_recom,
+    float default_match_error,
+    const std::vector<target_variant>& target_sites);
+
+  /** @return Path of the cache file of @p key in @p dir. */
+  static std::string path(const std::string& dir, std::uint64_t key);
+
+  /**
+   * @brief Loads a cache file written by `save()`.
+   *
+   * On success, `target_sites` is reordered and annotated as reference
+   * alignment would have left it, and `typed_only_reference_data` holds the
+   * saved blocks.
+   *
+   * @param n_haplotypes Number of reference haplotypes of the chunk, which every block must expand to.
+   * @param target_sites Target sites in file order, as used to compute @p key.
+   * @return False if the file is missing, has another key, does not match
+   *         @p n_haplotypes or is malformed. The outputs are unchanged on failure.
+   */
+  static bool load(const std::string& file_path, std::uint64_t key, std::size_t n_haplotypes, std::vector<target_variant>& target_sites, reduced_haplotypes& typed_only_reference_data);
+
+  /**
+   * @brief Writes the typed-only data of a chunk.
+   *
+   * The file is written to a temporary path and renamed, so concurrent runs
+   * sharing a cache directory never read a partial file.
+   *
+   * @param target_order Index in file order of each aligned target site.
+   * @return False if the file could not be written.
+   */
+  static bool save(const std::string& file_path, std::uint64_t key, const std::vector<std::size_t>& target_order, const std::vector<target_variant>& target_sites, const reduced_haplotypes& typed_only_reference_data);
+};
+
+#endif // MINIMAC4_TYPED_REFERENCE_CACHE_HPP
@@ -53,6 +53,14 @@ bool unique_haplotype_block::compress_variant(const reference_site_info& site_in
     std::size_t original_hap_cnt = variants_[0].gt.size();
     variants_.back().gt.resize(original_hap_cnt, std::int8_t(-1));
 
+    // Columns split off in this variant. Since original columns are distinct, a haplotype that no
+    // longer matches its column can only match a column split off from the same column with the
+    // same allele, so each original column keeps a short list of its splits (usually one).
+    const std::size_t npos = std::numeric_limits<std::size_t>::max();
+    std::vector<std::size_t> first_split(original_hap_cnt, npos);
+    std::vector<std::size_t> next_split;
+    const std::size_t k_end = variants_.size() - 1;
+
     for (std::size_t i = 0; i < alleles.size(); ++i)
     {
       if (savvy::typed_value::is_end_of_vector(alleles[i]))
@@ -74,31 +82,20 @@ bool unique_haplotype_block::compress_variant(const reference_site_info& site_in
         {
           // this haplotype no longer matches its column
           --cardinalities_[original_hap_idx];
-          std::size_t j = original_hap_cnt;
-          std::size_t j_end = variants_[0].gt.size();
-          const std::size_t k_end = variants_.size() - 1;
-
-          for ( ; j < j_end; ++j)
-          {
-            // check if this haplotype matches any newly created column
-            std::size_t k = 0;
-            for ( ; k < k_end; ++k)
-            {
-              if (variants_[k].gt[j] != variants_[k].gt[original_hap_idx])
-                break;
-            }
-
-            if (k == k_end && variants_[k].gt[j] == alleles[i])
-              break;
-          }
+          std::size_t j = first_split[original_hap_idx];
+          while (j != npos && variants_[k_end].gt[j] != alleles[i])
+            j = next_split[j - original_hap_cnt];
 
-          if (j == j_end)
+          if (j == npos)
           {
-            // does not match a newly created column, so insert new column
+            // does not match a column split off from the same column, so insert new column
+            j = variants_[0].gt.size();
             for (std::size_t k = 0; k < k_end; ++k)
               variants_[k].gt.push_back(variants_[k].gt[original_hap_idx]);
             variants_[k_end].gt.push_back(alleles[i]);
             cardinalities_.push_back(0);
+            next_split.push_back(first_split[original_hap_idx]);
+            first_split[original_hap_idx] = j;
           }
 
           unique_map_[i] = j;
@@ -120,11 +117,50 @@ bool unique_haplotype_block::compress_variant(const reference_site_info& site_in
   return true;
 }
 
+void csr_reverse_map::assign(const std::vector<std::int64_t>& unique_map, const std::vector<std::size_t>& cardinalities)
+{
+  // Row sizes are counted from the unique map itself, so the map stays valid even if a caller left the
+  // cardinalities out of date.
+  offsets_.assign(cardinalities.size() + 1, 0);
+  for (std::size_t i = 0; i < unique_map.size(); ++i)
+  {
+    assert(std::size_t(unique_map[i]) < cardinalities.size());
+    ++offsets_[unique_map[i] + 1];
+  }
+  for (std::size_t i = 0; i < cardinalities.size(); ++i)
+    offsets_[i + 1] += offsets_[i];
+
+  indices_.resize(offsets_.back());
+  std::vector<std::uint32_t> next(offsets_.begin(), offsets_.end() - 1);
+  for (std::size_t i = 0; i < unique_map.size(); ++i)
+    indices_[next[unique_map[i]]++] = std::uint32_t(i);
+}
+
+void haplotype_bit_matrix::assign(const std::vector<reference_variant>& variants, std::size_t n_haplotypes)
+{
+  words_per_row_ = (variants.size() + 63) / 64;
+  words_.assign(words_per_row_ * n_haplotypes, 0);
+  for (std::size_t v = 0; v < variants.size(); ++v)
+  {
+    const std::vector<std::int8_t>& gt = variants[v].gt;
+    assert(gt.size() == n_haplotypes);
+    std::uint64_t bit = std::uint64_t(1) << (v % 64);
+    std::uint64_t* col = words_.data() + v / 64;
+    for (std::size_t i = 0; i < n_haplotypes; ++i)
+    {
+      if (gt[i])
+        col[i * words_per_row_] |= bit;
+    }
+  }
+}
+
 void unique_haplotype_block::clear()
 {
   variants_.clear();
   unique_map_.clear();
   cardinalities_.clear();
+  reverse_map_.clear();
+  haplotype_bits_.clear();
 }
 
 void unique_haplotype_block::trim(std::size_t min_pos, std::size_t max_pos)
@@ -154,15 +190,53 @@ void unique_haplotype_block::trim(std::size_t min_pos, std::size_t max_pos)
   }
 }
 
+void unique_haplotype_block::remove_non_overlapping(std::size_t min_pos, std::size_t max_pos)
+{
+  variants_.erase(std::remove_if(variants_.begin(), variants_.end(), [min_pos, max_pos](const reference_variant& v)
+  {
+    return v.pos > max_pos || v.pos + std::max(v.ref.size(), v.alt.size()) - 1 < min_pos;
+  }), variants_.end());
+}
+
+std::uint32_t unique_haplotype_block::end_position() const
+{
+  if (variants_.empty())
+    return 0;
+
+  std::uint32_t end_pos = variants_.front().pos;
+  for (auto it = variants_.begin(); it != variants_.end(); ++it)
+    end_pos = std::max(end_pos, std::uint32_t(it->pos + std::max(it->ref.size(), it->alt.size()) - 1));
+  return end_pos;
+}
+
 void unique_haplotype_block::pop_variant()
 {
   variants_.pop_back();
 }
 
-void unique_haplotype_block::fill_cm(genetic_map_file& map_file)
+void unique_haplotype_block::fill_cm(const genetic_map_file& map_file)
 {
-  for (auto it = variants_.begin(); it != variants_.end(); ++it)
-    it->cm = map_file.interpolate_centimorgan(it->pos);
+  std::vector<std::uint64_t> positions(variants_.size());
+  std::vector<double> cms(variants_.size());
+  for (std::size_t i = 0; i < variants_.size(); ++i)
+    positions[i] = variants_[i].pos;
+  map_file.interpolate_centimorgans(positions.data(), positions.size(), cms.data());
+  for (std::size_t i = 0; i < variants_.size(); ++i)
+    variants_[i].cm = cms[i];
+}
+
+void unique_haplotype_block::fill_recom(const genetic_map_file& map_file, double& prev_cm)
+{
+  std::vector<std::uint64_t> positions(variants_.size());
+  std::vector<double> cms(variants_.size());
+  for (std::size_t i = 0; i < variants_.size(); ++i)
+    positions[i] = variants_[i].pos;
+  map_file.interpolate_centimorgans(positions.data(), positions.size(), cms.data());
+  for (std::size_t i = 0; i < variants_.size(); ++i)
+  {
+    variants_[i].recom = recombination::cm_to_switch_prob(cms[i] - prev_cm);
+    prev_cm = cms[i];
+  }
 }
 
 void unique_haplotype_block::fill_cm_from_recom(double& start_cm)
@@ -187,11 +261,7 @@ bool unique_haplotype_block::serialize(savvy::writer& output_file)
       variants_.front().pos,
       variants_.front().ref, {"<BLOCK>"}, variants_.front().id);
 
-    std::int32_t end_pos = variants_.front().pos;
-    for (auto it = variants_.begin(); it != variants_.end(); ++it)
-      end_pos = std::max(end_pos, std::int32_t(it->pos + std::max(it->ref.size(), it->alt.size()) - 1));
-
-    var.set_info("END", end_pos);
+    var.set_info("END", std::int32_t(end_position()));
     var.set_info("VARIANTS", std::int32_t(variants_.size()));
     var.set_info("REPS", std::int32_t(cardinalities_.size()));
 
@@ -297,180 +367,210 @@ void unique_haplotype_block::remove_eov()
     unique_map_.resize(unique_map_.size() - eov_cnt);
 }
 
+namespace
+{
+  // End of the field starting at s, which is the next delim or e.
+  inline const char* field_end(const char* s, const char* e, char delim)
+  {
+    const char* d = static_cast<const char*>(std::memchr(s, delim, e - s));
+    return d ? d : e;
+  }
+
+  inline bool starts_with(const char* s, const char* e, const char* prefix, std::size_t n)
+  {
+    return std::size_t(e - s) >= n && std::memcmp(s, prefix, n) == 0;
+  }
+
+  // Start of INFO (the eighth column) of an m3vcf line, with its end in info_end.
+  const char* info_column(const char* line, const char* line_end, const char*& info_end)
+  {
+    const char* s = line;
+    for (int col = 0; col < 7; ++col)
+    {
+      s = field_end(s, line_end, '\t');
+      if (s == line_end)
+        return info_end = line_end;
+      ++s;
+    }
+    info_end = field_end(s, line_end, '\t');
+    return s;
+  }
+}
+
+std::size_t unique_haplotype_block::m3vcf_variant_count(const char* line, const char* line_end)
+{
+  const char* info_end = nullptr;
+  for (const char* f = info_column(line, line_end, info_end); f < info_end; )
+  {
+    const char* f_end = field_end(f, info_end, ';');
+    if (starts_with(f, f_end, "VARIANTS=", 9))
+      return std::strtoull(f + 9, nullptr, 10);
+    f = f_end + 1;
+  }
+  return 0;
+}
+
 bool unique_haplotype_block::deserialize(std::istream& is, int m3vcf_version, std::size_t n_haplotypes)
 {
   clear();
   if (is.peek() == EOF)
     return is.get(), false;
 
-
-  unique_map_.reserve(n_haplotypes);
-
-  auto split_string_to_vector = [](const char* in, char delim)
+  std::string text, line;
+  std::getline(is, text);
+  std::size_t n_variants = m3vcf_variant_count(text.data(), text.data() + text.size());
+  for (std::size_t i = 0; i < n_variants; ++i)
   {
-    std::vector<std::string> ret;
-    const char* d = nullptr;
-    std::string token;
-    const char* s = in;
-    const char*const e = in + std::strlen(in);
-    while ((d = std::find(s, e,  delim)) != e)
+    if (!std::getline(is, line))
     {
-      ret.emplace_back(std::string(s, d));
-      s = d ? d + 1 : d;
+      is.setstate(is.rdstate() | std::ios::badbit);
+      std::cerr << "Error: truncated m3vcf v" << m3vcf_version << " file\n";
+      return false;
     }
-    ret.emplace_back(std::string(s,d));
-    return ret;
+    text += '\n';
+    text += line;
+  }
+
+  if (deserialize(text, m3vcf_version, n_haplotypes) && is.good())
+    return true;
+  is.setstate(is.rdstate() | std::ios::badbit);
+  return false;
+}
+
+bool unique_haplotype_block::deserialize(const std::string& text, int m3vcf_version, std::size_t n_haplotypes)
+{
+  clear();
+  auto fail = [this, m3vcf_version](const char* problem)
+  {
+    clear();
+    std::cerr << "Error: " << problem << " m3vcf v" << m3vcf_version << " file\n";
+    return false;
   };
 
-  std::string line;
-  std::getline(is, line);
+  // The text is null-terminated, so number conversions stop at its end.
+  const char* beg = text.c_str();
+  const char* end = beg + text.size();
+  const char* line_end = field_end(beg, end, '\n');
 
   std::size_t n_variants = 0;
   std::size_t n_reps = 0;
-  std::size_t col_idx = 0;
-  std::size_t last_tab_pos = 0;
-  std::size_t tab_pos = 0;
-  while ((tab_pos = line.find('\t', tab_pos)) != std::string::npos)
+  unique_map_.reserve(n_haplotypes);
+  for (std::size_t col_idx = 0; ; ++col_idx)
   {
+    const char* col_end = field_end(beg, line_end, '\t');
     if (col_idx == 7) //INFO
     {
-      std::vector<std::string> info_fields = split_string_to_vector(line.substr(last_tab_pos, tab_pos - last_tab_pos).c_str(), ';');
-      for (auto it = info_fields.begin(); it != info_fields.end(); ++it)
+      for (const char* f = beg; f < col_end; )
       {
-        if (it->compare(0, 9, "VARIANTS=") == 0)
-          n_variants = std::atoll(it->c_str() + 9);
-        else if (it->compare(0, 5, "REPS=") == 0)
-          n_reps = std::atoll(it->c_str() + 5);
+        const char* f_end = field_end(f, col_end, ';');
+        if (starts_with(f, f_end, "VARIANTS=", 9))
+          n_variants = std::strtoull(f + 9, nullptr, 10);
+        else if (starts_with(f, f_end, "REPS=", 5))
+          n_reps = std::strtoull(f + 5, nullptr, 10);
+        f = f_end + 1;
       }
     }
     else if (col_idx >= 9)
     {
       char* p = nullptr;
-      unique_map_.push_back(std::strtoll(line.c_str() + last_tab_pos, &p, 10));
+      unique_map_.push_back(std::strtoll(beg, &p, 10));
       if (m3vcf_version == 2)
       {
         if (*p != '|')
-        {
-          clear();
-          std::cerr << "Error: invalid m3vcf v" << m3vcf_version << " file\n";
-          return false;
-        }
+          return fail("invalid");
         unique_map_.push_back(std::strtoll(++p, &p, 10));
       }
     }
 
-    last_tab_pos = ++tab_pos;
-    ++col_idx;
-  }
-
-  {
-    char* p = nullptr;
-    unique_map_.push_back(std::strtoll(line.c_str() + last_tab_pos, &p, 10));
-    if (m3vcf_version == 2)
-    {
-      if (*p != '|')
-      {
-        clear();
-        is.setstate(is.rdstate() | std::ios::badbit);
-        std::cerr << "Error: invalid m3vcf v" << m3vcf_version << " file\n";
-        return false;
-      }
-      unique_map_.push_back(std::strtoll(++p, &p, 10));
-    }
+    if (col_end == line_end)
+      break;
+    beg = col_end + 1;
   }
 
   if (unique_map_.size() != n_haplotypes)
-  {
-    clear();
-    is.setstate(is.rdstate() | std::ios::badbit);
-    std::cerr << "Error: invalid m3vcf v" << m3vcf_version << " file\n";
-    return false;
-  }
+    return fail("invalid");
 
   cardinalities_.resize(n_reps);
   for (auto it = unique_map_.begin(); it != unique_map_.end(); ++it)
+  {
+    if (*it < 0 || std::size_t(*it) >= n_reps)
+      return fail("invalid");
     ++cardinalities_[*it];
+  }
 
+  const char* s = line_end == end ? end : line_end + 1;
   variants_.resize(n_variants);
   for (std::size_t i = 0; i < variants_.size(); ++i)
   {
-    if (!std::getline(is, line))
-    {
-      clear();
-      is.setstate(is.rdstate() | std::ios::badbit);
-      std::cerr << "Error: truncated m3vcf v" << m3vcf_version << " file\n";
-      return false;
-    }
+    if (s >= end)
+      return fail("truncated");
 
-    std::vector<std::string> cols = split_string_to_vector(line.c_str(), '\t');
-    if (cols.size() != 9)
+    const char* le = field_end(s, end, '\n');
+    const char* cols[10];
+    std::size_t n_cols = 0;
+    for (const char* c = s; n_cols < 10; )
     {
-      clear();
-      is.setstate(is.rdstate() | std::ios::badbit);
-      std::cerr << "Error: invalid m3vcf v" << m3vcf_version << " file\n";
-      return false;
+      cols[n_cols++] = c;
+      const char* d = field_end(c, le, '\t');
+      if (d == le)
+        break;
+      c = d + 1;
     }
 
-    variants_[i].chrom = cols[0];
-    variants_[i].pos = std::atoll(cols[1].c_str());
-    variants_[i].id = cols[2];
-    variants_[i].ref = cols[3];
-    variants_[i].alt = cols[4];
+    if (n_cols != 9)
+      return fail("invalid");
+    auto col_end = [&](std::size_t k) { return k + 1 < n_cols ? cols[k + 1] - 1 : le; };
+
+    reference_variant& var = variants_[i];
+    var.chrom.assign(cols[0], col_end(0));
+    var.pos = std::strtoull(cols[1], nullptr, 10);
+    var.id.assign(cols[2], col_end(2));
+    var.ref.assign(cols[3], col_end(3));
+    var.alt.assign(cols[4], col_end(4));
 
-    std::vector<std::string> info_fields = split_string_to_vector(cols[7].c_str(), ';');
-    for (auto it = info_fields.begin(); it != info_fields.end(); ++it)
+    for (const char* f = cols[7]; f < col_end(7); )
     {
-      if (it->compare(0, 4, "ERR=") == 0 || it->compare(0, 4, "Err=") == 0)
-        variants_[i].err = std::atof(it->c_str() + 4);
-      else if (it->compare(0, 6, "RECOM=") == 0 || it->compare(0, 6, "Recom=") == 0)
-        variants_[i].recom = std::atof(it->c_str() + 6);
+      const char* f_end = field_end(f, col_end(7), ';');
+      if (starts_with(f, f_end, "ERR=", 4) || starts_with(f, f_end, "Err=", 4))
+        var.err = std::atof(f + 4);
+      else if (starts_with(f, f_end, "RECOM=", 6) || starts_with(f, f_end, "Recom=", 6))
+        var.recom = std::atof(f + 6);
+      f = f_end + 1;
     }
 
+    const char* g = cols[8];
+    const char* g_end = col_end(8);
     if (m3vcf_version == 2)
     {
-      variants_[i].gt.resize(n_reps);
-      const char* p = cols[8].data();
-      char* p_end;
+      var.gt.assign(n_reps, 0);
+      char* p_end = nullptr;
       std::size_t prev_offset = 0;
       do
       {
-        std::size_t offset = std::strtoll(p, &p_end, 10);
-        if (offset >= n_reps)
-        {
-          clear();
-          is.setstate(is.rdstate() | std::ios::badbit);
-          std::cerr << "Error: invalid m3vcf v" << m3vcf_version << " file\n";
-          return false;
-        }
-        std::size_t uniq_idx = prev_offset + offset;
-        variants_[i].gt[uniq_idx] = 1;
-        variants_[i].ac += cardinalities_[uniq_idx];
+        std::size_t uniq_idx = prev_offset + std::strtoull(g, &p_end, 10);
+        if (uniq_idx >= n_reps)
+          return fail("invalid");
+        var.gt[uniq_idx] = 1;
+        var.ac += cardinalities_[uniq_idx];
         prev_offset = uniq_idx;
-        p = p_end + 1;
-      } while (*p_end);
+        g = p_end + 1;
+      } while (p_end < g_end);
     }
     else
     {
-      variants_[i].gt.reserve(n_reps);
-      for (auto c = cols[8].begin(); c != cols[8].end(); ++c)
-        variants_[i].gt.emplace_back((*c) - '0');
-
-      variants_[i].ac = std::inner_product(variants_[i].gt.begin(), variants_[i].gt.end(), cardinalities_.begin(), 0ull);
+      if (std::size_t(g_end - g) != n_reps)
+        return fail("invalid");
 
-      if (variants_[i].gt.size() != n_reps)
-      {
-        clear();
-        is.setstate(is.rdstate() | std::ios::badbit);
-        std::cerr << "Error: invalid m3vcf v" << m3vcf_version << " file\n";
-        return false;
-      }
+      var.gt.resize(n_reps);
+      for (std::size_t j = 0; j < n_reps; ++j)
+        var.gt[j] = g[j] - '0';
+      var.ac = std::inner_product(var.gt.begin(), var.gt.end(), cardinalities_.begin(), 0ull);
     }
+
+    s = le + 1;
   }
 
-  if (is.good())
-    return true;
-  is.setstate(is.rdstate() | std::ios::badbit);
-  return false;
+  return true;
 }
 
 reduced_haplotypes::reduced_haplotypes(std::size_t min_block_size, std::size_t max_block_size)
@@ -537,12 +637,24 @@ void reduced_haplotypes::append_block(const unique_haplotype_block& block)
   assert(blocks_.size() == block_offsets_.size());
 }
 
-void reduced_haplotypes::fill_cm(genetic_map_file& map_file)
+void reduced_haplotypes::fill_cm(const genetic_map_file& map_file)
 {
   for (auto it = blocks_.begin(); it != blocks_.end(); ++it)
     it->fill_cm(map_file);
 }
 
+void reduced_haplotypes::build_reverse_maps()
+{
+  for (auto it = blocks_.begin(); it != blocks_.end(); ++it)
+    it->build_reverse_map();
+}
+
+void reduced_haplotypes::build_haplotype_bits()
+{
+  for (auto it = blocks_.begin(); it != blocks_.end(); ++it)
+    it->build_haplotype_bits();
+}
+
 float reduced_haplotypes::compression_ratio() const
 {
   float num = 0.f, denom = 0.f;
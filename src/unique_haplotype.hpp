@@ -14,6 +14,86 @@
 #include <limits>
 #include <cassert>
 
+/**
+ * @class csr_reverse_map
+ * @brief Expanded haplotypes of each unique haplotype of a block in compressed sparse row form.
+ *
+ * The expanded haplotypes of unique haplotype `u` are
+ * `indices_[offsets_[u] .. offsets_[u + 1])`, in increasing order. All rows
+ * share two flat 32-bit arrays, so building the map allocates twice per block
+ * and iterating a row is a linear scan.
+ */
+class csr_reverse_map
+{
+public:
+  /** @brief Expanded haplotype indices of one unique haplotype. */
+  class row_view
+  {
+  private:
+    const std::uint32_t* beg_;
+    const std::uint32_t* end_;
+  public:
+    row_view(const std::uint32_t* beg, const std::uint32_t* end) : beg_(beg), end_(end) {}
+    const std::uint32_t* begin() const { return beg_; }
+    const std::uint32_t* end() const { return end_; }
+    std::size_t size() const { return end_ - beg_; }
+    std::uint32_t operator[](std::size_t i) const { return beg_[i]; }
+  };
+private:
+  std::vector<std::uint32_t> offsets_;
+  std::vector<std::uint32_t> indices_;
+public:
+  /**
+   * @brief Inverts a unique map.
+   *
+   * @param unique_map Unique haplotype of each expanded haplotype.
+   * @param cardinalities Cardinalities of the unique haplotypes. Only their count is used.
+   */
+  void assign(const std::vector<std::int64_t>& unique_map, const std::vector<std::size_t>& cardinalities);
+
+  /** @brief Removes all rows. */
+  void clear() { offsets_.clear(); indices_.clear(); }
+
+  /** @return Number of unique haplotypes. */
+  std::size_t size() const { return offsets_.empty() ? 0 : offsets_.size() - 1; }
+
+  /** @return Expanded haplotypes of unique haplotype `i`. */
+  row_view operator[](std::size_t i) const { return row_view(indices_.data() + offsets_[i], indices_.data() + offsets_[i + 1]); }
+};
+
+/**
+ * @class haplotype_bit_matrix
+ * @brief Alleles of a block stored as one bit row per unique haplotype.
+ *
+ * Bit `v` of row `u` is set when unique haplotype `u` carries the alternate
+ * allele at variant `v` of the block. Rows are padded to whole 64-bit words,
+ * so the alternate alleles of a run of variants are found by scanning the
+ * words that cover it instead of reading one `gt` byte per variant.
+ */
+class haplotype_bit_matrix
+{
+private:
+  std::vector<std::uint64_t> words_;
+  std::size_t words_per_row_ = 0;
+public:
+  /**
+   * @brief Transposes the alleles of a block.
+   *
+   * @param variants Variants of the block.
+   * @param n_haplotypes Number of unique haplotypes.
+   */
+  void assign(const std::vector<reference_variant>& variants, std::size_t n_haplotypes);
+
+  /** @brief Removes all rows. */
+  void clear() { words_.clear(); words_per_row_ = 0; }
+
+  /** @return True if no rows are stored. */
+  bool empty() const { return words_.empty(); }
+
+  /** @return Words of unique haplotype `i`. */
+  const std::uint64_t* row(std::size_t i) const { return words_.data() + i * words_per_row_; }
+};
+
 /**
  * @class unique_haplotype_block
  * @brief Represents a block of unique haplotypes and their variants.
@@ -49,6 +129,20 @@ private:
    * haplotype genotypes.
    */
   std::vector<reference_variant> variants_;
+
+  /**
+   * @brief Expanded haplotypes of each unique haplotype, built by `build_reverse_map()`.
+   */
+  csr_reverse_map reverse_map_;
+
+  /**
+   * @brief Alleles of each unique haplotype, built by `build_haplotype_bits()`.
+   */
+  haplotype_bit_matrix haplotype_bits_;
+
+  /** The reference caches fill blocks directly from their stored arrays. */
+  friend class reference_cache;
+  friend class typed_reference_cache;
 public:
   /**
    * @brief Compress and map haplotype alleles for a new variant into the block.
@@ -154,6 +248,34 @@ public:
    */
   const std::vector<std::size_t>& cardinalities() const { return cardinalities_; }
 
+  /**
+   * @brief Builds the reverse map from the current unique map.
+   *
+   * Must be called again after any operation that changes the unique map
+   * (e.g., `compress_variant()` or `remove_eov()`).
+   */
+  void build_reverse_map() { reverse_map_.assign(unique_map_, cardinalities_); }
+
+  /**
+   * @brief Get the expanded haplotypes of each unique haplotype.
+   * @return Reverse map built by the last call to `build_reverse_map()`.
+   */
+  const csr_reverse_map& reverse_map() const { assert(reverse_map_.size() == cardinalities_.size()); return reverse_map_; }
+
+  /**
+   * @brief Builds the bit rows from the current variants.
+   *
+   * Like the reverse map, must be rebuilt after the variants or the unique
+   * map change.
+   */
+  void build_haplotype_bits() { haplotype_bits_.assign(variants_, cardinalities_.size()); }
+
+  /**
+   * @brief Get the alleles of each unique haplotype as bit rows.
+   * @return Rows built by the last call to `build_haplotype_bits()`, or an empty matrix.
+   */
+  const haplotype_bit_matrix& haplotype_bits() const { return haplotype_bits_; }
+
   /**
    * @brief Clears all data stored in the haplotype block.
    *
@@ -190,6 +312,25 @@ public:
    */
   void trim(std::size_t min_pos, std::size_t max_pos);
 
+  /**
+   * @brief Removes variants that do not overlap a genomic range.
+   *
+   * A variant overlaps `[min_pos, max_pos]` if any base spanned by its
+   * longest allele is inside the range. This matches the record filtering
+   * of `savvy::bounding_point::any` and is used when a block was read by
+   * record slice instead of by region.
+   *
+   * @param min_pos The minimum genomic position (inclusive).
+   * @param max_pos The maximum genomic position (inclusive).
+   */
+  void remove_non_overlapping(std::size_t min_pos, std::size_t max_pos);
+
+  /**
+   * @brief Get the last base spanned by any variant of the block.
+   * @return End position, or 0 if the block is empty.
+   */
+  std::uint32_t end_position() const;
+
   /**
    * @brief Removes the last variant from the haplotype block.
    *
@@ -204,13 +345,27 @@ public:
   /**
    * @brief Fills the centimorgan (cM) values for all variants in the haplotype block.
    *
-   * This function iterates over all variants in the `variants_` vector and
-   * sets each variant's `cm` field by interpolating its genetic position
-   * using the provided `genetic_map_file`.
+   * The positions of all variants in the `variants_` vector are interpolated
+   * in one batch with `genetic_map_file::interpolate_centimorgans()` and
+   * stored in each variant's `cm` field.
    *
    * @param map_file Reference to a `genetic_map_file` object used for interpolation.
    */
-  void fill_cm(genetic_map_file& map_file);
+  void fill_cm(const genetic_map_file& map_file);
+
+  /**
+   * @brief Sets the recombination probability of each variant from a genetic map.
+   *
+   * The `recom` field of a variant is set to the switch probability between
+   * the previous variant and itself, which is what chunk loading derives from
+   * `--map`. Storing it in the RECOM field of a compressed reference lets
+   * imputation run without the map. The cM values are not kept, since the
+   * float CM field is too coarse for the small distances between variants.
+   *
+   * @param map_file Genetic map of the chromosome of the block.
+   * @param prev_cm cM of the variant before the block, updated to the last variant.
+   */
+  void fill_recom(const genetic_map_file& map_file, double& prev_cm);
 
   /**
    * @brief Fills missing centimorgan (cM) values for variants using recombination probabilities.
@@ -272,6 +427,29 @@ public:
    */
   bool deserialize(std::istream& is, int m3vcf_version, std::size_t n_haplotypes);
 
+  /**
+   * @brief Parses the text of one m3vcf block.
+   *
+   * Same as the stream overload, but the header line and the variant lines of
+   * the block are already in @p text (separated by newlines), so blocks split
+   * off a large read can be parsed concurrently. Fields are located with
+   * `memchr` and numbers converted in place, without splitting lines into
+   * strings.
+   *
+   * @param text          Header line and `VARIANTS` variant lines of a block.
+   * @param m3vcf_version Format version of the m3vcf file (1 or 2).
+   * @param n_haplotypes  Total number of haplotypes expected in this block.
+   * @return `true` if parsing was successful. On failure, the block is cleared and an
+   *         error message is written to `std::cerr`.
+   */
+  bool deserialize(const std::string& text, int m3vcf_version, std::size_t n_haplotypes);
+
+  /**
+   * @brief Reads the `VARIANTS` entry of an m3vcf block header line.
+   * @return Number of variant lines following the header, or 0 if the entry is missing.
+   */
+  static std::size_t m3vcf_variant_count(const char* line, const char* line_end);
+
   /**
    * @brief Deserializes a unique haplotype block from a SAVVY input file and variant.
    *
@@ -344,6 +522,9 @@ private:
   std::size_t min_block_size_ = 1;
   std::size_t max_block_size_ = std::numeric_limits<std::size_t>::max();
   bool flush_block_ = true;
+
+  /** The typed-site cache restores blocks exactly as compressed, without the merging done by `append_block()`. */
+  friend class typed_reference_cache;
 public:
 
   /**
@@ -429,6 +610,7 @@ public:
     std::size_t global_idx() const { return parent_->block_offsets_[block_idx_] + variant_idx_; }
     const std::vector<std::int64_t>& unique_map() const { return parent_->blocks_[block_idx_].unique_map(); }
     const std::vector<std::size_t>& cardinalities() const { return parent_->blocks_[block_idx_].cardinalities(); }
+    const unique_haplotype_block& block() const { return parent_->blocks_[block_idx_]; }
   };
 
   iterator begin() const { return iterator(*this, 0, 0); }
@@ -477,7 +659,23 @@ public:
    *
    * @param map_file The genetic map file used to interpolate centimorgan values.
    */
-  void fill_cm(genetic_map_file& map_file);
+  void fill_cm(const genetic_map_file& map_file);
+
+  /**
+   * @brief Builds the reverse map of every block.
+   *
+   * Called once after loading, so the HMM reads the reverse maps directly
+   * from the blocks.
+   */
+  void build_reverse_maps();
+
+  /**
+   * @brief Builds the allele bit rows of every block.
+   *
+   * Called once after loading the full reference data, so the HMM can
+   * interpolate runs of untyped sites from packed alleles.
+   */
+  void build_haplotype_bits();
 
   /**
    * @brief Calculates the overall compression ratio of all haplotype blocks.
@@ -6,6 +6,74 @@
 #include <cstdint>
 #include <limits>
 
+/**
+ * @class packed_genotypes
+ * @brief Haplotype alleles of one target site packed into 2 bits each.
+ *
+ * Each haplotype is stored as one of four codes: reference (0), alternate (1),
+ * missing or end-of-vector. Four consecutive haplotypes share a byte, so a
+ * group of haplotypes processed together reads contiguous memory. Decoded
+ * values use the `savvy::typed_value` int8 sentinels for missing and
+ * end-of-vector, so callers see the same values as an unpacked GT vector.
+ */
+class packed_genotypes
+{
+public:
+  static constexpr std::int8_t missing_value = std::numeric_limits<std::int8_t>::min();           ///< savvy int8 missing value
+  static constexpr std::int8_t end_of_vector_value = std::numeric_limits<std::int8_t>::min() + 1; ///< savvy int8 end-of-vector value
+private:
+  std::vector<std::uint8_t> data_;
+  std::size_t size_ = 0;
+
+  static std::uint8_t encode(std::int8_t allele)
+  {
+    return allele == 0 ? 0 : (allele == 1 ? 1 : (allele == end_of_vector_value ? 3 : 2));
+  }
+
+  static std::int8_t decode(std::uint8_t code)
+  {
+    return code < 2 ? std::int8_t(code) : (code == 2 ? std::int8_t(missing_value) : std::int8_t(end_of_vector_value));
+  }
+public:
+  packed_genotypes() {}
+
+  /** @brief Packs a vector of alleles. Values other than 0, 1 and end-of-vector are stored as missing. */
+  packed_genotypes(const std::vector<std::int8_t>& alleles) { assign(alleles.data(), alleles.size()); }
+
+  /** @brief Replaces the contents with @p n packed alleles. */
+  void assign(const std::int8_t* alleles, std::size_t n)
+  {
+    size_ = n;
+    data_.assign((n + 3) / 4, 0);
+    for (std::size_t i = 0; i < n; ++i)
+      data_[i >> 2] |= std::uint8_t(encode(alleles[i]) << ((i & 3) << 1));
+  }
+
+  /** @return Number of haplotypes. */
+  std::size_t size() const { return size_; }
+
+  /** @return True if there are no haplotypes. */
+  bool empty() const { return size_ == 0; }
+
+  /** @return Allele of haplotype @p i. */
+  std::int8_t operator[](std::size_t i) const { return decode((data_[i >> 2] >> ((i & 3) << 1)) & 3); }
+
+  /** @brief Decodes haplotypes `[beg, end)` into @p out. */
+  void unpack(std::size_t beg, std::size_t end, std::int8_t* out) const
+  {
+    for (std::size_t i = beg; i < end; ++i)
+      *(out++) = (*this)[i];
+  }
+
+  /** @return Decoded alleles of haplotypes `[beg, end)`. */
+  std::vector<std::int8_t> unpack(std::size_t beg, std::size_t end) const
+  {
+    std::vector<std::int8_t> ret(end - beg);
+    unpack(beg, end, ret.data());
+    return ret;
+  }
+};
+
 /**
  * @struct target_variant
  * @brief Represents a variant in the target dataset.
@@ -26,7 +94,7 @@ struct target_variant
   float af;               ///< Allele frequency
   float err;              ///< Error rate
   float recom;            ///< Recombination rate
-  std::vector<std::int8_t> gt; ///< Genotype data for each sample
+  packed_genotypes gt;    ///< Genotype data for each haplotype, 2 bits per allele
 };
 
 /**
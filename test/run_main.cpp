@@ -1,4 +1,10 @@
 #include "run_main.hpp"
+#include <fstream>
+#include <sstream>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
 
 // Helper function to run the main imputation pipeline
 int run_imputation_test(std::vector<std::string> compress_args)
@@ -23,10 +29,25 @@ int run_imputation_test(std::vector<std::string> compress_args)
     std::cerr << "minimac v" << VERSION << "\n\n";
 
     if (args.update_m3vcf())
-        return convert_old_m3vcf(args.ref_path(), args.out_path(), args.map_path()) ? EXIT_SUCCESS : EXIT_FAILURE;
+        return convert_old_m3vcf(args.ref_path(), args.out_path(), args.map_path(), std::max(1, int(args.threads()))) ? EXIT_SUCCESS : EXIT_FAILURE;
 
     if (args.compress_reference())
-        return compress_reference_panel(args.ref_path(), args.out_path(), args.min_block_size(), args.max_block_size(), args.slope_unit(), args.map_path()) ? EXIT_SUCCESS : EXIT_FAILURE;
+        return compress_reference_panel(args.ref_path(), args.out_path(), args.min_block_size(), args.max_block_size(), args.slope_unit(), args.map_path(), std::max(1, int(args.threads()))) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (args.index_reference())
+        return index_reference_panel(args.ref_path()) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (args.cache_reference())
+        return cache_reference_panel(args.ref_path()) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (args.index_map())
+        return genetic_map_file::save_binary(args.map_path()) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (args.merge_shards())
+        return merge_sample_shards(args.shard_paths(), args.emp_shard_paths(), args.out_path(), args.emp_out_path(), args.sites_out_path(), args.out_format(), args.out_compression(), args.fmt_fields(), args.min_r2(), std::max(1, int(args.threads()))) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (args.serve_path().size())
+        return reference_server(args).run() ? EXIT_SUCCESS : EXIT_FAILURE;
 
     std::uint64_t end_pos = args.region().to();
     std::string chrom = args.region().chromosome();
@@ -37,35 +58,60 @@ int run_imputation_test(std::vector<std::string> compress_args)
     if (!stat_tar_panel(args.tar_path(), sample_ids))
         return std::cerr << "Error: could not stat target file\n", EXIT_FAILURE;
 
+    // A sample shard is written like a temp file, with HDS and the per-site sums merged by --merge-shards.
+    bool is_shard = args.sample_sharded();
+    if (is_shard)
+    {
+        sample_ids = sample_shard_ids(sample_ids, args.sample_shard(), args.sample_shard_count());
+        if (sample_ids.empty())
+            return std::cerr << "Error: --sample-shard selects no target samples\n", EXIT_FAILURE;
+        if (!args.sites_out_path().empty())
+            std::cerr << "Warning: --sites is ignored with --sample-shard and should be passed to --merge-shards\n";
+    }
+
     dosage_writer output(args.out_path(),
         args.emp_out_path(),
-        args.sites_out_path(),
+        is_shard ? "" : args.sites_out_path(),
         args.out_format(),
         args.out_compression(),
         sample_ids,
-        args.fmt_fields(),
+        is_shard ? std::vector<std::string>{"HDS"} : args.fmt_fields(),
         chrom,
-        args.min_r2(), false);
+        is_shard ? -1.f : args.min_r2(), is_shard);
 
-    omp::internal::thread_pool2 tpool(args.threads());
     imputation imputer;
-    for (std::uint64_t chunk_start_pos = std::max(std::uint64_t(1), args.region().from()); chunk_start_pos <= end_pos; chunk_start_pos += args.chunk_size())
+    std::vector<savvy::region> impute_regions;
+    if (args.max_memory())
     {
-        std::uint64_t chunk_end_pos = std::min(end_pos, chunk_start_pos + args.chunk_size() - 1ul);
-        savvy::region impute_region =
+        chunk_planner planner;
+        std::vector<std::size_t> temp_buffers;
+        std::uint64_t start_pos = std::max(std::uint64_t(1), args.region().from());
+        if (!planner.init(args, chrom, start_pos, end_pos, sample_ids.size()))
+            return std::cerr << "Error: could not plan chunks for --max-memory\n", EXIT_FAILURE;
+        if (!planner.plan(chrom, start_pos, end_pos, args.max_memory(), impute_regions, temp_buffers))
+            return std::cerr << "Error: --max-memory is too small for the reference and target panels\n", EXIT_FAILURE;
+        imputer.set_chunk_temp_buffers(std::move(temp_buffers));
+    }
+    else
+    {
+        for (std::uint64_t chunk_start_pos = std::max(std::uint64_t(1), args.region().from()); chunk_start_pos <= end_pos; chunk_start_pos += args.chunk_size())
         {
-            chrom,
-            chunk_start_pos,
-            chunk_end_pos
-        };
+            std::uint64_t chunk_end_pos = std::min(end_pos, chunk_start_pos + args.chunk_size() - 1ul);
+            impute_regions.emplace_back(chrom, chunk_start_pos, chunk_end_pos);
+        }
+    }
 
-        if (!imputer.impute_chunk(impute_region, args, tpool, output))
+    omp::internal::thread_pool2 tpool(imputation::chunk_pool_threads(args, impute_regions.size()));
+    if (!imputer.impute_chunks(impute_regions, args, tpool, output))
+        return EXIT_FAILURE;
+
+    if (!args.metrics_out_path().empty() && !imputer.metrics().write(args.metrics_out_path()))
         return EXIT_FAILURE;
-    }
 
     auto total_time = long(std::difftime(std::time(nullptr), start_time));
 
-    output.print_mean_er2(std::cerr);
+    if (!is_shard && args.leave_one_out())
+        output.print_mean_er2(std::cerr);
     std::cerr << std::endl;
     std::fprintf(stderr, "Total time for parsing input: %ld seconds\n", imputer.total_input_time());
     std::fprintf(stderr, "Total time for HMM: %ld seconds\n", imputer.total_impute_time());
@@ -73,4 +119,150 @@ int run_imputation_test(std::vector<std::string> compress_args)
     std::fprintf(stderr, "Total wall time (h:mm:ss): %ld:%02ld:%02ld\n", total_time / 3600, (total_time % 3600) / 60, total_time % 60);
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+// Helper function to build the arguments of a run on the test panels
+std::vector<std::string> impute_test_args(const std::string& out_path, const std::vector<std::string>& extra_args)
+{
+    std::vector<std::string> argv{
+        "minimac4",
+        std::string(TEST_DATA) + "/ref_panel.msav",
+        std::string(TEST_DATA) + "/tar_panel.vcf.gz",
+        "-o", out_path
+    };
+    argv.insert(argv.end(), extra_args.begin(), extra_args.end());
+    return argv;
+}
+// Helper function to build the arguments of a chunked run on the test region
+std::vector<std::string> chunked_impute_test_args(const std::string& out_path, const std::string& chunk_size, const std::vector<std::string>& extra_args)
+{
+    std::vector<std::string> argv = impute_test_args(out_path, {
+        "--region", "chr20:10000000-10010000",
+        "--chunk", chunk_size,
+        "--overlap", "1000",
+        "--min-ratio-behavior", "skip"
+    });
+    argv.insert(argv.end(), extra_args.begin(), extra_args.end());
+    return argv;
+}
+// Helper function to build the arguments compressing the test reference panel
+std::vector<std::string> compress_test_args(const std::string& out_path, const std::vector<std::string>& extra_args)
+{
+    std::vector<std::string> argv{
+        "minimac4",
+        "--compress-reference", std::string(TEST_DATA) + "/ref_panel.vcf.gz",
+        "-o", out_path
+    };
+    argv.insert(argv.end(), extra_args.begin(), extra_args.end());
+    return argv;
+}
+// Helper function to parse command line arguments as minimac4 would
+bool parse_test_args(std::vector<std::string> argv, prog_args& args)
+{
+    std::vector<char*> cstrings;
+    cstrings.reserve(argv.size() + 1);
+    for (auto& s : argv)
+        cstrings.push_back(&s[0]);
+    cstrings.push_back(nullptr);
+    return args.parse(static_cast<int>(argv.size()), cstrings.data());
+}
+// Helper function to compare the dosages of two imputed files
+double max_dosage_difference(const std::string& file_path_a, const std::string& file_path_b)
+{
+    return max_format_difference(file_path_a, file_path_b, "HDS");
+}
+// Helper function to compare a float FORMAT field of two imputed files
+double max_format_difference(const std::string& file_path_a, const std::string& file_path_b, const std::string& key)
+{
+    savvy::reader rdr_a(file_path_a);
+    savvy::reader rdr_b(file_path_b);
+    if (!rdr_a || !rdr_b)
+        return -1.;
+
+    double max_diff = 0.;
+    savvy::variant var_a, var_b;
+    std::vector<float> vec_a, vec_b;
+    while (rdr_a.read(var_a))
+    {
+        if (!rdr_b.read(var_b) || var_a.pos() != var_b.pos() || var_a.ref() != var_b.ref() || var_a.alts() != var_b.alts())
+            return -1.;
+
+        var_a.get_format(key, vec_a);
+        var_b.get_format(key, vec_b);
+        if (vec_a.size() != vec_b.size())
+            return -1.;
+
+        for (std::size_t i = 0; i < vec_a.size(); ++i)
+            max_diff = std::max(max_diff, double(std::abs(vec_a[i] - vec_b[i])));
+    }
+
+    if (rdr_b.read(var_b))
+        return -1.;
+
+    return max_diff;
+}
+// Helper function to compare a float INFO field of two imputed files
+double max_info_difference(const std::string& file_path_a, const std::string& file_path_b, const std::string& key)
+{
+    savvy::reader rdr_a(file_path_a);
+    savvy::reader rdr_b(file_path_b);
+    if (!rdr_a || !rdr_b)
+        return -1.;
+
+    double max_diff = 0.;
+    savvy::variant var_a, var_b;
+    while (rdr_a.read(var_a))
+    {
+        if (!rdr_b.read(var_b) || var_a.pos() != var_b.pos() || var_a.ref() != var_b.ref() || var_a.alts() != var_b.alts())
+            return -1.;
+
+        float val_a = 0.f, val_b = 0.f;
+        if (var_a.get_info(key, val_a) != var_b.get_info(key, val_b))
+            return -1.;
+
+        max_diff = std::max(max_diff, double(std::abs(val_a - val_b)));
+    }
+
+    if (rdr_b.read(var_b))
+        return -1.;
+
+    return max_diff;
+}
+
+// Helper function to count the records of a file that have an INFO field
+long info_count(const std::string& file_path, const std::string& key)
+{
+    savvy::reader rdr(file_path);
+    if (!rdr)
+        return -1;
+
+    long cnt = 0;
+    savvy::variant var;
+    while (rdr.read(var))
+    {
+        auto it = std::find_if(var.info_fields().begin(), var.info_fields().end(), [&key](const std::pair<std::string, savvy::typed_value>& f) { return f.first == key; });
+        cnt += it != var.info_fields().end();
+    }
+    return rdr.bad() ? -1 : cnt;
+}
+
+// Helper function to read a column of the total row of a TSV --metrics-out report
+double metrics_total(const std::string& tsv_path, const std::string& column)
+{
+    std::ifstream tsv(tsv_path);
+    std::string header, line, last;
+    if (!std::getline(tsv, header))
+        return -1.;
+    while (std::getline(tsv, line))
+        last = line;
+    if (last.substr(0, 6) != "total\t")
+        return -1.;
+
+    std::istringstream header_fields(header), total_fields(last);
+    std::string name, value;
+    while (std::getline(header_fields, name, '\t') && std::getline(total_fields, value, '\t'))
+    {
+        if (name == column)
+            return std::atof(value.c_str());
+    }
+    return -1.;
+}
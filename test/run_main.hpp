@@ -1,6 +1,35 @@
 #pragma once
+#include "chunk_planner.hpp"
 #include "imputation.hpp"
+#include "reference_server.hpp"
 #include "run_main.hpp"
 #include <cstring>
 
-int run_imputation_test(std::vector<std::string> compress_args);
\ No newline at end of file
+int run_imputation_test(std::vector<std::string> compress_args);
+
+// Returns the arguments imputing the test target panel against the test reference panel into out_path, followed by extra_args
+std::vector<std::string> impute_test_args(const std::string& out_path, const std::vector<std::string>& extra_args = {});
+
+// Same as impute_test_args, restricted to chr20:10000000-10010000 in chunks of chunk_size bases with 1000 base overlaps, skipping chunks with too few typed sites
+std::vector<std::string> chunked_impute_test_args(const std::string& out_path, const std::string& chunk_size, const std::vector<std::string>& extra_args = {});
+
+// Returns the arguments compressing the test reference VCF into out_path, followed by extra_args
+std::vector<std::string> compress_test_args(const std::string& out_path, const std::vector<std::string>& extra_args = {});
+
+// Parses command line arguments into args, e.g. to call library functions directly
+bool parse_test_args(std::vector<std::string> argv, prog_args& args);
+
+// Returns the largest absolute HDS difference between two imputed files, or -1 if their records do not line up
+double max_dosage_difference(const std::string& file_path_a, const std::string& file_path_b);
+
+// Returns the largest absolute difference of a float FORMAT field (e.g. LDS) between two imputed files, or -1 if their records do not line up
+double max_format_difference(const std::string& file_path_a, const std::string& file_path_b, const std::string& key);
+
+// Returns the largest absolute difference of a float INFO field (e.g. R2) between two imputed files, or -1 if their records do not line up
+double max_info_difference(const std::string& file_path_a, const std::string& file_path_b, const std::string& key);
+
+// Returns the number of records that have an INFO field (e.g. ER2 or TYPED), or -1 if the file cannot be read
+long info_count(const std::string& file_path, const std::string& key);
+
+// Returns a column of the total row of a TSV --metrics-out report (e.g. s1_states or forward_seconds), or -1 if it is missing
+double metrics_total(const std::string& tsv_path, const std::string& column);
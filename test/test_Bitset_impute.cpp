@@ -0,0 +1,34 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Bitset_run, impute)
+{
+    // Read the decoded blocks of the test panel
+    std::deque<unique_haplotype_block> blocks;
+    bool sliced = false;
+    ASSERT_TRUE(read_reference_blocks(std::string(TEST_DATA) + "/ref_panel.msav", savvy::genomic_region("chr20"), {}, nullptr, nullptr, blocks, sliced));
+    ASSERT_FALSE(blocks.empty());
+
+    // Bit v of row u must be set exactly when unique haplotype u carries the alternate allele at variant v
+    for (auto it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        EXPECT_TRUE(it->haplotype_bits().empty());
+        it->build_haplotype_bits();
+        ASSERT_FALSE(it->haplotype_bits().empty());
+        for (std::size_t u = 0; u < it->unique_haplotype_size(); ++u)
+        {
+            const std::uint64_t* row = it->haplotype_bits().row(u);
+            for (std::size_t v = 0; v < it->variant_size(); ++v)
+                EXPECT_EQ((row[v / 64] >> (v % 64)) & 1, std::uint64_t(it->variants()[v].gt[u] != 0));
+
+            // The padding of the last word stays clear, so scans may cover whole words
+            for (std::size_t v = it->variant_size(); v % 64; ++v)
+                EXPECT_EQ((row[v / 64] >> (v % 64)) & 1, 0u);
+        }
+    }
+}
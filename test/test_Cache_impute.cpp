@@ -0,0 +1,55 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <sys/stat.h>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Cache_run, impute)
+{
+    // Compress to a file so that the cache can be written next to it
+    ASSERT_EQ(run_imputation_test(compress_test_args("cached_ref_panel.msav")), EXIT_SUCCESS);
+
+    // Run minimac4 decoding the MVCF
+    std::vector<std::string> impute_args = chunked_impute_test_args("cache_none.sav", "2500");
+    impute_args[1] = "cached_ref_panel.msav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Write the cache
+    std::vector<std::string> cache_args{
+        "minimac4",
+        "--cache-reference", "cached_ref_panel.msav"
+    };
+    ASSERT_EQ(run_imputation_test(cache_args), EXIT_SUCCESS);
+
+    struct stat st;
+    ASSERT_EQ(stat("cached_ref_panel.msav.m4c", &st), 0);
+
+    // Run minimac4 loading blocks from the mapped cache
+    impute_args[4] = "cache_mapped.sav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    EXPECT_EQ(max_dosage_difference("cache_none.sav", "cache_mapped.sav"), 0.);
+
+    reference_cache cache;
+    EXPECT_TRUE(cache.open("cached_ref_panel.msav"));
+    cache.close();
+
+    // A cache whose stored panel size no longer matches is ignored, even when it is newer than the panel
+    {
+        std::fstream fs("cached_ref_panel.msav.m4c", std::ios::in | std::ios::out | std::ios::binary);
+        std::int64_t wrong_size = 1;
+        fs.seekp(offsetof(reference_cache::file_header, ref_size));
+        fs.write(reinterpret_cast<const char*>(&wrong_size), sizeof(wrong_size));
+    }
+    EXPECT_FALSE(cache.open("cached_ref_panel.msav"));
+
+    // Imputation falls back to decoding the MVCF
+    impute_args[4] = "cache_stale.sav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+    EXPECT_EQ(max_dosage_difference("cache_none.sav", "cache_stale.sav"), 0.);
+}
@@ -0,0 +1,32 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Checkpoint_run, impute)
+{
+    std::vector<std::string> impute_args = impute_test_args("checkpoint_all_rows.sav", {"--temp-buffer", "2"});
+
+    // Run minimac4 storing every forward row
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 storing only block boundaries
+    impute_args[4] = "checkpoint_block.sav";
+    impute_args.insert(impute_args.end(), {"--forward-checkpoints", "block"});
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 storing every third row
+    impute_args[4] = "checkpoint_3.sav";
+    impute_args.back() = "3";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Recomputed rows must produce identical dosages, including the leave-one-out dosages behind ER2
+    ASSERT_GT(info_count("checkpoint_all_rows.sav", "ER2"), 0);
+    EXPECT_EQ(max_dosage_difference("checkpoint_all_rows.sav", "checkpoint_block.sav"), 0.);
+    EXPECT_EQ(max_dosage_difference("checkpoint_all_rows.sav", "checkpoint_3.sav"), 0.);
+    EXPECT_EQ(max_info_difference("checkpoint_all_rows.sav", "checkpoint_block.sav", "ER2"), 0.);
+    EXPECT_EQ(max_info_difference("checkpoint_all_rows.sav", "checkpoint_3.sav", "ER2"), 0.);
+}
@@ -0,0 +1,67 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Index_run, impute)
+{
+    // Compress to a file so that the block index is written next to it
+    ASSERT_EQ(run_imputation_test(compress_test_args("indexed_ref_panel.msav")), EXIT_SUCCESS);
+
+    struct stat st;
+    ASSERT_EQ(stat("indexed_ref_panel.msav.m4i", &st), 0);
+
+    // Run minimac4 seeking through the block index
+    std::vector<std::string> impute_args = impute_test_args("index_seek.sav");
+    impute_args[1] = "indexed_ref_panel.msav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 with small chunks so that reference blocks are shared between overlaps
+    std::vector<std::string> chunk_args = chunked_impute_test_args("index_seek_chunks.sav", "2500");
+    chunk_args[1] = "indexed_ref_panel.msav";
+    ASSERT_EQ(run_imputation_test(chunk_args), EXIT_SUCCESS);
+
+    // Run minimac4 with region queries only
+    std::remove("indexed_ref_panel.msav.m4i");
+    impute_args[4] = "index_region.sav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    chunk_args[4] = "index_region_chunks.sav";
+    ASSERT_EQ(run_imputation_test(chunk_args), EXIT_SUCCESS);
+
+    EXPECT_EQ(max_dosage_difference("index_seek.sav", "index_region.sav"), 0.);
+    EXPECT_EQ(max_dosage_difference("index_seek_chunks.sav", "index_region_chunks.sav"), 0.);
+
+    // Rebuild the index from the existing panel
+    std::vector<std::string> index_args{
+        "minimac4",
+        "--index-reference", "indexed_ref_panel.msav"
+    };
+    ASSERT_EQ(run_imputation_test(index_args), EXIT_SUCCESS);
+    EXPECT_EQ(stat("indexed_ref_panel.msav.m4i", &st), 0);
+
+    reference_index idx;
+    EXPECT_TRUE(idx.load("indexed_ref_panel.msav"));
+
+    // An index whose stored panel size no longer matches is ignored, even when it is newer than the panel
+    std::string index_text;
+    {
+        std::ifstream ifs("indexed_ref_panel.msav.m4i");
+        index_text.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    }
+    std::size_t size_pos = index_text.find("##reference_size=");
+    ASSERT_NE(size_pos, std::string::npos);
+    std::ofstream("indexed_ref_panel.msav.m4i") << index_text.substr(0, size_pos) << "##reference_size=1\n" << index_text.substr(index_text.find('\n', size_pos) + 1);
+    EXPECT_FALSE(idx.load("indexed_ref_panel.msav"));
+
+    // So is an index that lost entries
+    std::string truncated = index_text.substr(0, index_text.rfind('\n', index_text.size() - 2) + 1);
+    std::ofstream("indexed_ref_panel.msav.m4i") << truncated;
+    EXPECT_FALSE(idx.load("indexed_ref_panel.msav"));
+}
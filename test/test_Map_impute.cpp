@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+#include <fstream>
+#include <sys/stat.h>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Map_run, impute)
+{
+    // Write a genetic map spanning the test region, with a rate that changes every 10 kb
+    {
+        std::ofstream map_file("test_map.txt");
+        map_file << "#chrom\tpos\tcM\n";
+        double cm = 0.;
+        for (std::size_t pos = 9900000; pos <= 10100000; pos += 500)
+        {
+            map_file << "chr20\t" << pos << "\t" << cm << "\n";
+            cm += ((pos / 10000) % 3 + 1) * 0.0004;
+        }
+    }
+
+    // Compress the reference both without and with the map
+    ASSERT_EQ(run_imputation_test(compress_test_args("map_ref_panel.msav")), EXIT_SUCCESS);
+    ASSERT_EQ(run_imputation_test(compress_test_args("map_recom_ref_panel.msav", {"--map", "test_map.txt"})), EXIT_SUCCESS);
+
+    // Run minimac4 parsing the text map
+    std::vector<std::string> impute_args = chunked_impute_test_args("map_text.sav", "2500", {"--map", "test_map.txt"});
+    impute_args[1] = "map_ref_panel.msav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Write the binary map
+    std::vector<std::string> index_args{
+        "minimac4",
+        "--index-map", "test_map.txt"
+    };
+    ASSERT_EQ(run_imputation_test(index_args), EXIT_SUCCESS);
+
+    struct stat st;
+    ASSERT_EQ(stat("test_map.txt.m4g", &st), 0);
+
+    // Run minimac4 mapping the binary map
+    impute_args[4] = "map_binary.sav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    EXPECT_EQ(max_dosage_difference("map_text.sav", "map_binary.sav"), 0.);
+
+    // Run minimac4 without the map, using the RECOM values stored at compression
+    impute_args[1] = "map_recom_ref_panel.msav";
+    impute_args[4] = "map_stored.sav";
+    impute_args.resize(impute_args.size() - 2);
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // RECOM is stored as a float, so dosages may differ by a rounding step. A negative difference means the records do not line up.
+    double diff = max_dosage_difference("map_text.sav", "map_stored.sav");
+    EXPECT_GE(diff, 0.);
+    EXPECT_LE(diff, 0.01);
+}
@@ -0,0 +1,33 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(MaxTemplates_run, impute)
+{
+    std::vector<std::string> impute_args = chunked_impute_test_args("thresholds.sav", "5000");
+
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 with a cap larger than the panel, which keeps every template passing the thresholds
+    impute_args[4] = "max_templates_unbounded.sav";
+    impute_args.insert(impute_args.end(), {"--metrics-out", "max_templates_unbounded.tsv", "--max-templates", "1000000"});
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    EXPECT_EQ(max_dosage_difference("thresholds.sav", "max_templates_unbounded.sav"), 0.);
+    EXPECT_EQ(metrics_total("max_templates_unbounded.tsv", "s1_capped_states"), 0.);
+
+    // Run minimac4 with a cap small enough to drop templates
+    impute_args[4] = "max_templates_2.sav";
+    impute_args[impute_args.size() - 3] = "max_templates_2.tsv";
+    impute_args.back() = "2";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // The cap must have dropped templates, and the dosages must still line up and stay within [0, 1] of each other
+    EXPECT_GT(metrics_total("max_templates_2.tsv", "s1_capped_states"), 0.);
+    double diff = max_dosage_difference("thresholds.sav", "max_templates_2.sav");
+    EXPECT_GE(diff, 0.);
+    EXPECT_LE(diff, 1.);
+}
@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Memory_run, impute)
+{
+    // Create args string with fixed chunks
+    std::vector<std::string> impute_args = impute_test_args("memory_fixed.sav", {"--region", "chr20:10000000-10010000", "--all-typed-sites", "--threads", "2"});
+
+    // Run minimac4 with --chunk and --temp-buffer as given
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // A budget larger than any chunk must plan the same chunks and sample groups
+    impute_args[4] = "memory_large.sav";
+    impute_args.emplace_back("--max-memory");
+    impute_args.emplace_back("64G");
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+    EXPECT_EQ(max_dosage_difference("memory_fixed.sav", "memory_large.sav"), 0.);
+
+    // Plan the region directly to compare budgets
+    prog_args args;
+    ASSERT_TRUE(parse_test_args(impute_args, args));
+    std::vector<std::string> sample_ids;
+    ASSERT_TRUE(stat_tar_panel(args.tar_path(), sample_ids));
+    ASSERT_GT(sample_ids.size(), 2u);
+
+    const std::uint64_t from = 10000000, to = 10010000;
+    chunk_planner planner;
+    ASSERT_TRUE(planner.init(args, "chr20", from, to, sample_ids.size()));
+
+    std::vector<savvy::region> regions;
+    std::vector<std::size_t> temp_buffers;
+    ASSERT_TRUE(planner.plan("chr20", from, to, planner.estimate(from, to, args.temp_buffer()), regions, temp_buffers));
+    ASSERT_EQ(regions.size(), 1u);
+    EXPECT_EQ(temp_buffers[0], args.temp_buffer());
+
+    // A budget that only fits the region with one sample per group must shrink the groups and keep the chunk
+    std::uint64_t tight_bytes = planner.estimate(from, to, 1);
+    ASSERT_LT(tight_bytes, planner.estimate(from, to, args.temp_buffer()));
+    ASSERT_TRUE(planner.plan("chr20", from, to, tight_bytes, regions, temp_buffers));
+    ASSERT_EQ(regions.size(), 1u);
+    EXPECT_LT(temp_buffers[0], args.temp_buffer());
+    EXPECT_GE(temp_buffers[0], 1u);
+
+    // A tight budget still imputes the same dosages
+    impute_args[4] = "memory_tight.sav";
+    impute_args.back() = std::to_string(tight_bytes);
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+    EXPECT_EQ(max_dosage_difference("memory_fixed.sav", "memory_tight.sav"), 0.);
+
+    // A budget smaller than any block with one sample per group is rejected
+    EXPECT_FALSE(planner.plan("chr20", from, to, 1024, regions, temp_buffers));
+    impute_args[4] = "memory_small.sav";
+    impute_args.back() = "1K";
+    EXPECT_EQ(run_imputation_test(impute_args), EXIT_FAILURE);
+}
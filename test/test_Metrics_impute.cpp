@@ -0,0 +1,42 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <fstream>
+#include <string>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Metrics_run, impute)
+{
+    // Create args string with two chunks and a TSV metrics report
+    std::vector<std::string> impute_args = chunked_impute_test_args("metrics.sav", "5000", {"--metrics-out", "metrics.tsv"});
+
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Header, one row per chunk and a total row
+    std::ifstream tsv("metrics.tsv");
+    std::string line;
+    std::size_t n_lines = 0;
+    while (std::getline(tsv, line))
+    {
+        if (n_lines == 0)
+            EXPECT_EQ(line.substr(0, 7), "#REGION");
+        ++n_lines;
+    }
+    EXPECT_EQ(n_lines, 4u);
+    EXPECT_EQ(line.substr(0, 6), "total\t");
+
+    // The total row sums the counters of the imputed chunks
+    EXPECT_GT(metrics_total("metrics.tsv", "target_haplotypes"), 0.);
+    EXPECT_GT(metrics_total("metrics.tsv", "reference_variants"), 0.);
+    EXPECT_GT(metrics_total("metrics.tsv", "s1_states"), 0.);
+
+    // A .json path selects the JSON format
+    impute_args.back() = "metrics.json";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    std::ifstream json("metrics.json");
+    ASSERT_TRUE(std::getline(json, line));
+    EXPECT_EQ(line.substr(0, 11), "{\"chunks\": ");
+}
@@ -0,0 +1,31 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(NoEr2_run, impute)
+{
+    // Create args string, with sample groups small enough to be written to temp files
+    std::vector<std::string> impute_args = chunked_impute_test_args("er2.sav", "5000", {"--temp-buffer", "2", "--metrics-out", "er2.tsv"});
+
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 without leave-one-out dosages
+    impute_args[4] = "no_er2.sav";
+    impute_args.back() = "no_er2.tsv";
+    impute_args.emplace_back("--no-er2");
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    EXPECT_EQ(max_dosage_difference("er2.sav", "no_er2.sav"), 0.);
+    EXPECT_EQ(max_info_difference("er2.sav", "no_er2.sav", "R2"), 0.);
+
+    // ER2 is left out and its leave-one-out dosages are neither allocated nor computed
+    EXPECT_GT(info_count("er2.sav", "ER2"), 0);
+    EXPECT_EQ(info_count("no_er2.sav", "ER2"), 0);
+    EXPECT_GT(metrics_total("er2.tsv", "loo_sites"), 0.);
+    EXPECT_EQ(metrics_total("no_er2.tsv", "loo_sites"), 0.);
+    EXPECT_EQ(metrics_total("no_er2.tsv", "loo_dosage_bytes"), 0.);
+    EXPECT_GT(metrics_total("no_er2.tsv", "skipped_loo_bytes"), 0.);
+}
@@ -0,0 +1,40 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Parallel_run, impute)
+{
+    // Create args string with several small chunks
+    std::vector<std::string> impute_args = chunked_impute_test_args("parallel_1.sav", "2500", {"--threads", "4", "--metrics-out", "parallel_1.tsv"});
+
+    // Run minimac4 imputing one chunk at a time
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 imputing three chunks at a time
+    impute_args[4] = "parallel_3.sav";
+    impute_args.back() = "parallel_3.tsv";
+    impute_args.insert(impute_args.end(), {"--parallel-chunks", "3"});
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 imputing two chunks at a time through temp files
+    impute_args[4] = "parallel_2_temp.sav";
+    impute_args[impute_args.size() - 3] = "parallel_2_temp.tsv";
+    impute_args.back() = "2";
+    impute_args.insert(impute_args.end(), {"--temp-buffer", "2"});
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Chunks must still be written in order with unchanged dosages
+    EXPECT_EQ(max_dosage_difference("parallel_1.sav", "parallel_3.sav"), 0.);
+    EXPECT_EQ(max_dosage_difference("parallel_1.sav", "parallel_2_temp.sav"), 0.);
+
+    // Each chunk is imputed once by one of the slots, so the HMM does the same work
+    ASSERT_GT(metrics_total("parallel_1.tsv", "s1_states"), 0.);
+    EXPECT_EQ(metrics_total("parallel_1.tsv", "reference_variants"), metrics_total("parallel_3.tsv", "reference_variants"));
+    EXPECT_EQ(metrics_total("parallel_1.tsv", "s1_states"), metrics_total("parallel_3.tsv", "s1_states"));
+    EXPECT_EQ(metrics_total("parallel_1.tsv", "s1_states"), metrics_total("parallel_2_temp.tsv", "s1_states"));
+    EXPECT_GT(metrics_total("parallel_2_temp.tsv", "temp_files"), 0.);
+}
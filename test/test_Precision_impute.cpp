@@ -0,0 +1,44 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Precision_run, impute)
+{
+    std::vector<std::string> impute_args = impute_test_args("precision_fp32.sav", {"--temp-buffer", "2"});
+
+    // Run minimac4 with the fp32 baseline
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    for (std::string precision : {"bf16", "fp16"})
+    {
+        std::string out_path = "precision_" + precision + ".sav";
+        std::vector<std::string> args = impute_args;
+        args[4] = out_path;
+        args.insert(args.end(), {"--hmm-precision", precision});
+        ASSERT_EQ(run_imputation_test(args), EXIT_SUCCESS);
+
+        // Report the deviation from the baseline so the modes can be compared
+        double dosage_diff = max_dosage_difference("precision_fp32.sav", out_path);
+        double r2_diff = max_info_difference("precision_fp32.sav", out_path, "R2");
+        std::cerr << precision << ": max HDS difference " << dosage_diff << ", max R2 difference " << r2_diff << std::endl;
+        RecordProperty(precision + "_max_hds_difference", std::to_string(dosage_diff));
+        RecordProperty(precision + "_max_r2_difference", std::to_string(r2_diff));
+
+        EXPECT_GE(dosage_diff, 0.);
+        EXPECT_LT(dosage_diff, 0.05);
+        EXPECT_GE(r2_diff, 0.);
+        EXPECT_LT(r2_diff, 0.05);
+    }
+
+    // 16-bit rows also combine with forward checkpoints
+    impute_args[4] = "precision_bf16_block.sav";
+    impute_args.insert(impute_args.end(), {"--hmm-precision", "bf16", "--forward-checkpoints", "block"});
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+    double block_diff = max_dosage_difference("precision_fp32.sav", "precision_bf16_block.sav");
+    EXPECT_GE(block_diff, 0.);
+    EXPECT_LT(block_diff, 0.05);
+}
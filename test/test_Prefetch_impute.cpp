@@ -0,0 +1,30 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Prefetch_run, impute)
+{
+    // Create args string with several small chunks and a metrics report
+    std::vector<std::string> impute_args = chunked_impute_test_args("prefetch_0.sav", "2500", {"--metrics-out", "prefetch_0.tsv"});
+
+    // Run minimac4 loading each chunk before imputing it
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 loading up to two chunks ahead
+    impute_args[4] = "prefetch_2.sav";
+    impute_args.back() = "prefetch_2.tsv";
+    impute_args.insert(impute_args.end(), {"--prefetch-chunks", "2"});
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Prefetching must not change the output
+    EXPECT_EQ(max_dosage_difference("prefetch_0.sav", "prefetch_2.sav"), 0.);
+
+    // Every chunk is loaded once, with the same sites as without prefetching
+    ASSERT_GT(metrics_total("prefetch_0.tsv", "reference_variants"), 0.);
+    EXPECT_EQ(metrics_total("prefetch_0.tsv", "reference_variants"), metrics_total("prefetch_2.tsv", "reference_variants"));
+    EXPECT_EQ(metrics_total("prefetch_0.tsv", "typed_variants"), metrics_total("prefetch_2.tsv", "typed_variants"));
+}
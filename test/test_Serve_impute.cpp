@@ -0,0 +1,68 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <fstream>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Serve_run, impute)
+{
+    // Run minimac4 once per target file as a reference
+    std::vector<std::string> impute_args = chunked_impute_test_args("serve_expected.sav", "5000");
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Queue three jobs; the later ones reuse the resident reference chunks
+    {
+        std::ofstream jobs("serve_jobs.txt");
+        jobs << std::string(TEST_DATA) << "/tar_panel.vcf.gz serve_1.sav\n";
+        jobs << "# comment lines are ignored\n";
+        jobs << std::string(TEST_DATA) << "/tar_panel.vcf.gz serve_2.sav HDS,GT\n";
+        jobs << std::string(TEST_DATA) << "/tar_panel.vcf.gz serve_3.sav\n";
+    }
+
+    // Serve with a cap small enough that chunks are evicted between jobs
+    for (std::string cache_size : {"4G", "1"})
+    {
+        std::vector<std::string> serve_args{
+            "minimac4",
+            "--serve", "serve_jobs.txt",
+            "--serve-cache", cache_size,
+            std::string(TEST_DATA) + "/ref_panel.msav",
+            "--region", "chr20:10000000-10010000",
+            "--chunk", "5000",
+            "--overlap", "1000",
+            "--min-ratio-behavior", "skip"
+        };
+        ASSERT_EQ(run_imputation_test(serve_args), EXIT_SUCCESS);
+
+        EXPECT_EQ(max_dosage_difference("serve_expected.sav", "serve_1.sav"), 0.);
+        EXPECT_EQ(max_dosage_difference("serve_expected.sav", "serve_2.sav"), 0.);
+        EXPECT_EQ(max_dosage_difference("serve_expected.sav", "serve_3.sav"), 0.);
+    }
+
+    // A chunk is read once and then shared from memory
+    prog_args args;
+    ASSERT_TRUE(parse_test_args(impute_args, args));
+    savvy::region extended_1("chr20", 9999000, 10006000), impute_1("chr20", 10000000, 10005000);
+    savvy::region extended_2("chr20", 10004000, 10011000), impute_2("chr20", 10005001, 10010000);
+    resident_reference_cache cache(std::uint64_t(1) << 32);
+    std::shared_ptr<const resident_reference_cache::chunk_entry> entry = cache.get(args, extended_1, impute_1, nullptr);
+    ASSERT_TRUE(entry != nullptr);
+    EXPECT_GT(entry->full_reference_data.variant_size(), 0u);
+    EXPECT_EQ(cache.get(args, extended_1, impute_1, nullptr), entry);
+    EXPECT_EQ(cache.hits(), 1u);
+    EXPECT_EQ(cache.misses(), 1u);
+
+    // Under a cap smaller than one chunk, each new chunk evicts the previous one, which stays valid while a job holds it
+    resident_reference_cache small_cache(1);
+    entry = small_cache.get(args, extended_1, impute_1, nullptr);
+    ASSERT_TRUE(entry != nullptr);
+    std::size_t n_variants = entry->full_reference_data.variant_size();
+    ASSERT_TRUE(small_cache.get(args, extended_2, impute_2, nullptr) != nullptr);
+    EXPECT_EQ(small_cache.size(), 1u);
+    EXPECT_EQ(small_cache.evictions(), 1u);
+    EXPECT_EQ(entry->full_reference_data.variant_size(), n_variants);
+    EXPECT_NE(small_cache.get(args, extended_1, impute_1, nullptr), entry);
+    EXPECT_EQ(small_cache.misses(), 3u);
+}
@@ -0,0 +1,55 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Shard_run, impute)
+{
+    // Create args string for an unsharded run
+    std::vector<std::string> impute_args = impute_test_args("shard_off.sav", {"-e", "shard_off.emp.sav", "--region", "chr20:10000000-10010000", "--all-typed-sites", "--temp-buffer", "2", "--threads", "2"});
+
+    // Run minimac4 on all samples at once
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 on each half of the samples
+    impute_args.emplace_back("--sample-shard");
+    impute_args.emplace_back("");
+    for (int i = 1; i <= 2; ++i)
+    {
+        impute_args[4] = "shard_" + std::to_string(i) + ".sav";
+        impute_args[6] = "shard_" + std::to_string(i) + ".emp.sav";
+        impute_args.back() = std::to_string(i) + "/2";
+        ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+    }
+
+    // Each shard holds its share of the samples, in file order
+    savvy::reader all_reader("shard_off.sav"), shard_1_reader("shard_1.sav"), shard_2_reader("shard_2.sav");
+    std::vector<std::string> shard_samples = shard_1_reader.samples();
+    shard_samples.insert(shard_samples.end(), shard_2_reader.samples().begin(), shard_2_reader.samples().end());
+    ASSERT_GT(shard_1_reader.samples().size(), 0u);
+    ASSERT_GT(shard_2_reader.samples().size(), 0u);
+    EXPECT_EQ(shard_samples, all_reader.samples());
+
+    // Paste the shards
+    std::vector<std::string> merge_args{
+        "minimac4",
+        "--merge-shards",
+        "shard_1.sav", "shard_2.sav",
+        "--empirical-shards", "shard_1.emp.sav,shard_2.emp.sav",
+        "-o", "shard_on.sav",
+        "-e", "shard_on.emp.sav"
+    };
+    ASSERT_EQ(run_imputation_test(merge_args), EXIT_SUCCESS);
+
+    // Merged dosages must match, and R2/ER2 must agree up to the order of summation
+    EXPECT_EQ(max_dosage_difference("shard_off.sav", "shard_on.sav"), 0.);
+    double r2_diff = max_info_difference("shard_off.sav", "shard_on.sav", "R2");
+    EXPECT_GE(r2_diff, 0.);
+    EXPECT_LT(r2_diff, 1e-4);
+    double er2_diff = max_info_difference("shard_off.sav", "shard_on.sav", "ER2");
+    EXPECT_GE(er2_diff, 0.);
+    EXPECT_LT(er2_diff, 1e-4);
+}
@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Stream_run, impute)
+{
+    // Create args string with small sample groups
+    std::vector<std::string> impute_args = impute_test_args("stream_off.sav", {"--region", "chr20:10000000-10010000", "--all-typed-sites", "--temp-buffer", "2", "--threads", "2"});
+
+    // Run minimac4 with all target genotypes loaded up front
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 reading target genotypes one sample group at a time
+    impute_args[4] = "stream_on.sav";
+    impute_args.emplace_back("--stream-targets");
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Streaming must not change dosages, including those of target-only sites
+    EXPECT_EQ(max_dosage_difference("stream_off.sav", "stream_on.sav"), 0.);
+
+    // With streaming, sites are loaded without genotypes, which are then read one sample group at a time
+    const std::string tar_path = std::string(TEST_DATA) + "/tar_panel.vcf.gz";
+    savvy::genomic_region reg("chr20", 10000000, 10010000);
+    std::vector<target_variant> all_sites, sites, target_only_sites;
+    std::vector<std::string> all_ids, sample_ids;
+    ASSERT_TRUE(load_target_haplotypes(tar_path, reg, all_sites, all_ids));
+    ASSERT_TRUE(load_target_haplotypes(tar_path, reg, sites, sample_ids, false));
+    ASSERT_EQ(sites.size(), all_sites.size());
+    ASSERT_GT(sample_ids.size(), 3u);
+    for (auto it = sites.begin(); it != sites.end(); ++it)
+        EXPECT_EQ(it->gt.size(), 0u);
+
+    // The group holds the haplotypes of the third and fourth samples only
+    ASSERT_TRUE(load_target_genotypes(tar_path, reg, {sample_ids[2], sample_ids[3]}, sites, target_only_sites));
+    std::size_t ploidy = all_sites[0].gt.size() / all_ids.size();
+    for (std::size_t i = 0; i < sites.size(); ++i)
+    {
+        ASSERT_EQ(sites[i].gt.size(), 2 * ploidy);
+        for (std::size_t j = 0; j < 2 * ploidy; ++j)
+            EXPECT_EQ(sites[i].gt[j], all_sites[i].gt[2 * ploidy + j]);
+    }
+}
@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+// Reads a compressed panel and expands its blocks back to one haplotype vector per variant
+static bool expand_panel(const std::string& path, std::vector<std::vector<std::int8_t>>& haplotypes, std::size_t& n_blocks)
+{
+    std::deque<unique_haplotype_block> blocks;
+    bool sliced = false;
+    if (!read_reference_blocks(path, savvy::genomic_region("chr20"), {}, nullptr, nullptr, blocks, sliced))
+        return false;
+
+    n_blocks = blocks.size();
+    haplotypes.clear();
+    for (auto it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        for (auto vt = it->variants().begin(); vt != it->variants().end(); ++vt)
+        {
+            haplotypes.emplace_back();
+            for (auto mt = it->unique_map().begin(); mt != it->unique_map().end(); ++mt)
+                haplotypes.back().push_back(vt->gt[*mt]);
+        }
+    }
+    return true;
+}
+
+TEST(Threaded_run, compress)
+{
+    // Compress the reference panel with one and with four threads
+    ASSERT_EQ(run_imputation_test(compress_test_args("threaded_ref_1.msav")), EXIT_SUCCESS);
+    ASSERT_EQ(run_imputation_test(compress_test_args("threaded_ref_4.msav", {"--threads", "4"})), EXIT_SUCCESS);
+
+    // Impute with both panels
+    std::vector<std::string> impute_args = impute_test_args("threaded_impute_1.sav");
+    impute_args[1] = "threaded_ref_1.msav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    impute_args[1] = "threaded_ref_4.msav";
+    impute_args[4] = "threaded_impute_4.sav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // The test panel fits in one segment, so both panels have the same blocks
+    EXPECT_EQ(max_dosage_difference("threaded_impute_1.sav", "threaded_impute_4.sav"), 0.);
+
+    // Split the panel into segments of 10 variants, compressed with four threads and with one
+    ASSERT_TRUE(compress_reference_panel(std::string(TEST_DATA) + "/ref_panel.vcf.gz", "threaded_ref_seg_4.msav", 10, 0xFFFF, 10, "", 4, 10));
+    ASSERT_TRUE(compress_reference_panel(std::string(TEST_DATA) + "/ref_panel.vcf.gz", "threaded_ref_seg_1.msav", 10, 0xFFFF, 10, "", 1, 10));
+
+    std::vector<std::vector<std::int8_t>> haps_1, haps_seg_4, haps_seg_1;
+    std::size_t n_blocks_1 = 0, n_blocks_seg_4 = 0, n_blocks_seg_1 = 0;
+    ASSERT_TRUE(expand_panel("threaded_ref_1.msav", haps_1, n_blocks_1));
+    ASSERT_TRUE(expand_panel("threaded_ref_seg_4.msav", haps_seg_4, n_blocks_seg_4));
+    ASSERT_TRUE(expand_panel("threaded_ref_seg_1.msav", haps_seg_1, n_blocks_seg_1));
+
+    // Every segment ends a block, so the segmented panel has one block per segment at least
+    EXPECT_GE(n_blocks_seg_4, (haps_1.size() + 9) / 10);
+    EXPECT_GT(n_blocks_seg_4, n_blocks_1);
+
+    // Segment boundaries only move block boundaries, so the haplotypes match the single-threaded panel
+    EXPECT_EQ(haps_seg_4, haps_1);
+
+    // The segments, not the thread count, decide the blocks
+    EXPECT_EQ(n_blocks_seg_4, n_blocks_seg_1);
+    EXPECT_EQ(haps_seg_4, haps_seg_1);
+
+    impute_args[1] = "threaded_ref_seg_4.msav";
+    impute_args[4] = "threaded_impute_seg_4.sav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    impute_args[1] = "threaded_ref_seg_1.msav";
+    impute_args[4] = "threaded_impute_seg_1.sav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    EXPECT_EQ(max_dosage_difference("threaded_impute_seg_1.sav", "threaded_impute_seg_4.sav"), 0.);
+    EXPECT_GE(max_dosage_difference("threaded_impute_1.sav", "threaded_impute_seg_4.sav"), 0.);
+}
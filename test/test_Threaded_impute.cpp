@@ -0,0 +1,31 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Threaded_run, impute)
+{
+    // Create args string with temp files and empirical output
+    std::vector<std::string> impute_args = impute_test_args("threaded_1.sav", {"-e", "threaded_1.emp.sav", "--temp-buffer", "2", "--threads", "1"});
+
+    // Run minimac4 on one thread
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 with record building and temp file decoding split across threads
+    impute_args[4] = "threaded_4.sav";
+    impute_args[6] = "threaded_4.emp.sav";
+    impute_args.back() = "4";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Typed sites carry ER2 and empirical records, so the comparisons below cover them
+    ASSERT_GT(info_count("threaded_1.sav", "ER2"), 0);
+    ASSERT_GT(info_count("threaded_1.emp.sav", "TYPED"), 0);
+
+    // Multithreaded output must match, including the record order, the empirical dosages and ER2
+    EXPECT_EQ(max_dosage_difference("threaded_1.sav", "threaded_4.sav"), 0.);
+    EXPECT_EQ(max_format_difference("threaded_1.emp.sav", "threaded_4.emp.sav", "LDS"), 0.);
+    EXPECT_EQ(max_info_difference("threaded_1.sav", "threaded_4.sav", "ER2"), 0.);
+}
@@ -0,0 +1,29 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+TEST(Tiled_run, impute)
+{
+    // Create args string with several chunks so the dosage matrices are reused
+    std::vector<std::string> impute_args = chunked_impute_test_args("tiled_0.sav", "2500", {"--temp-buffer", "3", "-e", "tiled_0.emp.sav"});
+
+    // Run minimac4 with variant-major dosages
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // Run minimac4 with tiled dosages
+    impute_args[4] = "tiled_1.sav";
+    impute_args.back() = "tiled_1.emp.sav";
+    impute_args.push_back("--tile-dosages");
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // The layout must not change the output, including the empirical dosages and ER2 of typed sites
+    ASSERT_GT(info_count("tiled_0.sav", "ER2"), 0);
+    ASSERT_GT(info_count("tiled_0.emp.sav", "TYPED"), 0);
+    EXPECT_EQ(max_dosage_difference("tiled_0.sav", "tiled_1.sav"), 0.);
+    EXPECT_EQ(max_format_difference("tiled_0.emp.sav", "tiled_1.emp.sav", "LDS"), 0.);
+    EXPECT_EQ(max_info_difference("tiled_0.sav", "tiled_1.sav", "ER2"), 0.);
+}
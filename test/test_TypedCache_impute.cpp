@@ -0,0 +1,85 @@
+#include <gtest/gtest.h>
+#include "run_main.hpp"
+#include <cstdio>
+#include <dirent.h>
+#include <fstream>
+#include <sys/stat.h>
+
+#ifndef TEST_DATA
+#define TEST_DATA
+#endif
+
+// Returns the paths of the .m4t files in dir
+static std::vector<std::string> typed_cache_files(const std::string& dir)
+{
+    std::vector<std::string> paths;
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+        return paths;
+    while (dirent* e = readdir(d))
+    {
+        std::string name = e->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".m4t") == 0)
+            paths.push_back(dir + "/" + name);
+    }
+    closedir(d);
+    return paths;
+}
+
+TEST(TypedCache_run, impute)
+{
+    // Run minimac4 without saving typed-site data
+    std::vector<std::string> impute_args = chunked_impute_test_args("typed_cache_none.sav", "2500");
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // The first run with a cache directory saves the typed-site data of each chunk
+    mkdir("typed_cache", 0755);
+    impute_args[4] = "typed_cache_write.sav";
+    impute_args.insert(impute_args.end(), {"--typed-cache-dir", "typed_cache"});
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    // The second run loads it instead of aligning the target sites again
+    impute_args[4] = "typed_cache_read.sav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+
+    EXPECT_EQ(max_dosage_difference("typed_cache_none.sav", "typed_cache_write.sav"), 0.);
+    EXPECT_EQ(max_dosage_difference("typed_cache_none.sav", "typed_cache_read.sav"), 0.);
+
+    // Raise the error of every saved site (magic, key and two counts, then order, af, err, recom and in_ref per site),
+    // so dosages only change if the saved data is used instead of aligning the sites again
+    std::vector<std::string> cache_files = typed_cache_files("typed_cache");
+    ASSERT_FALSE(cache_files.empty());
+    for (auto it = cache_files.begin(); it != cache_files.end(); ++it)
+    {
+        std::fstream fs(*it, std::ios::in | std::ios::out | std::ios::binary);
+        std::uint64_t n_sites = 0;
+        fs.seekg(16);
+        ASSERT_TRUE(fs.read(reinterpret_cast<char*>(&n_sites), sizeof(n_sites)));
+        const float err = 0.4f;
+        for (std::uint64_t i = 0; i < n_sites; ++i)
+        {
+            fs.seekp(32 + i * 21 + 12);
+            fs.write(reinterpret_cast<const char*>(&err), sizeof(err));
+        }
+        ASSERT_TRUE(fs.good());
+    }
+
+    impute_args[4] = "typed_cache_modified.sav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+    EXPECT_GT(max_dosage_difference("typed_cache_none.sav", "typed_cache_modified.sav"), 0.);
+
+    // Truncated files are ignored and replaced with the data of a new alignment
+    for (auto it = cache_files.begin(); it != cache_files.end(); ++it)
+        ASSERT_EQ(truncate(it->c_str(), 40), 0);
+
+    impute_args[4] = "typed_cache_truncated.sav";
+    ASSERT_EQ(run_imputation_test(impute_args), EXIT_SUCCESS);
+    EXPECT_EQ(max_dosage_difference("typed_cache_none.sav", "typed_cache_truncated.sav"), 0.);
+
+    for (auto it = cache_files.begin(); it != cache_files.end(); ++it)
+    {
+        struct stat st;
+        ASSERT_EQ(stat(it->c_str(), &st), 0);
+        EXPECT_GT(st.st_size, 40);
+    }
+}